@@ -0,0 +1,193 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "cachedFile.h"
+#include "fs.h"
+#include "ioBuffer.h"
+#include "platform.h"
+#include "storeFile.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+class AsyncFile;
+using SharedAsyncFile = std::shared_ptr<AsyncFile>;
+
+/// \brief Pipelined file I/O
+/// \note Reads ahead or writes behind on the I/O threads using a ring of buffers. Buffers are
+/// exchanged with the caller rather than copied.
+class AsyncFile : public std::enable_shared_from_this<AsyncFile>
+{
+public:
+	~AsyncFile ();
+
+	/// \brief Create pipelined file
+	/// \param file_ File to take ownership of
+	/// \param write_ Whether the file is written (otherwise read)
+	/// \param bufferSize_ Size of each ring buffer; must match the caller's buffers
+	static SharedAsyncFile create (fs::File file_, bool write_, std::size_t bufferSize_);
+
+	/// \brief Create pipelined reader of a shared file
+	/// \param file_ Shared file
+	/// \param offset_ Offset to start reading at
+	/// \param end_ Offset to stop reading at
+	/// \param bufferSize_ Size of each ring buffer; must match the caller's buffers
+	static SharedAsyncFile create (SharedCachedFile file_,
+	    std::uint64_t offset_,
+	    std::uint64_t end_,
+	    std::size_t bufferSize_);
+
+	/// \brief Create pipelined writer of a shared file
+	/// \param file_ Shared file
+	/// \param offset_ Offset to start writing at
+	/// \param bufferSize_ Size of each ring buffer; must match the caller's buffers
+	static SharedAsyncFile
+	    create (SharedStoreFile file_, std::uint64_t offset_, std::size_t bufferSize_);
+
+	/// \brief Read data
+	/// \param buffer_ Buffer to exchange; receives the next block of file data
+	/// \returns Number of bytes read, 0 on end of file, or -1 (EWOULDBLOCK if no data is ready)
+	std::make_signed_t<std::size_t> read (IOBuffer &buffer_);
+
+	/// \brief Write data
+	/// \param buffer_ Buffer to exchange; all of its data is queued for writing
+	/// \returns Number of bytes queued, or -1 (EWOULDBLOCK if the ring is full)
+	std::make_signed_t<std::size_t> write (IOBuffer &buffer_);
+
+	/// \brief Flush queued writes
+	/// \returns 0 once everything is written, or -1 (EWOULDBLOCK while writes are pending)
+	int flush ();
+
+	/// \brief Set file size once queued writes are flushed
+	/// \param size_ File size
+	/// \note Trims preallocated space past the written data
+	void truncate (std::uint64_t size_);
+
+	/// \brief Whether the next read/write/flush would not block
+	bool ready ();
+
+	/// \brief Grow the read-ahead
+	/// \param size_ Number of bytes to keep read ahead
+	/// \note The ring never shrinks; it is bounded by MAX_RING_SIZE
+	void readAhead (std::size_t size_);
+
+private:
+	/// \brief Initial ring size
+	constexpr static std::size_t RING_SIZE = 2;
+
+#ifdef __3DS__
+	/// \brief Maximum ring size
+	constexpr static std::size_t MAX_RING_SIZE = 4;
+#else
+	/// \brief Maximum ring size
+	constexpr static std::size_t MAX_RING_SIZE = 16;
+#endif
+
+	/// \brief Parameterized constructor
+	/// \param file_ File to take ownership of
+	/// \param write_ Whether the file is written (otherwise read)
+	/// \param bufferSize_ Size of each ring buffer
+	AsyncFile (fs::File file_, bool write_, std::size_t bufferSize_);
+
+	/// \brief Queue work on the I/O threads if needed
+	/// \note Must be called with m_lock held
+	void schedule ();
+
+	/// \brief Perform queued work (called on an I/O thread)
+	void process ();
+
+	/// \brief Read ahead (called on an I/O thread)
+	void processRead ();
+
+	/// \brief Read the next block of m_cachedFile (called on an I/O thread)
+	/// \param buffer_ Output buffer
+	std::make_signed_t<std::size_t> readCached (IOBuffer &buffer_);
+
+	/// \brief Write behind (called on an I/O thread)
+	void processWrite ();
+
+	/// \brief Write to m_storeFile at the next offset (called on an I/O thread)
+	/// \param buffer_ Input data
+	std::make_signed_t<std::size_t> writeShared (IOBuffer &buffer_);
+
+	/// \brief Mutex
+	platform::Mutex m_lock;
+
+	/// \brief Underlying file
+	/// \note Only accessed on the I/O threads once created
+	fs::File m_file;
+
+	/// \brief Shared file to read instead of m_file
+	SharedCachedFile m_cachedFile;
+
+	/// \brief Shared file to write instead of m_file
+	SharedStoreFile m_storeFile;
+
+	/// \brief Next offset to read from m_cachedFile or write to m_storeFile
+	/// \note Only accessed on the I/O threads once created
+	std::uint64_t m_offset = 0;
+
+	/// \brief Offset to stop reading m_cachedFile at
+	std::uint64_t m_end = 0;
+
+	/// \brief Buffer ring
+	/// \note Slots are heap-allocated so the one being filled stays put when the ring grows
+	std::vector<std::unique_ptr<IOBuffer>> m_ring;
+
+	/// \brief Size of each ring buffer
+	std::size_t const m_bufferSize;
+
+	/// \brief First filled ring slot
+	std::size_t m_head = 0;
+
+	/// \brief Number of filled ring slots
+	std::size_t m_count = 0;
+
+	/// \brief Error from the I/O thread
+	int m_error = 0;
+
+	/// \brief File size to set after flushing
+	std::uint64_t m_size = 0;
+
+	/// \brief Whether the file is written
+	bool const m_write;
+
+	/// \brief Whether work is queued or running on an I/O thread
+	bool m_busy : 1;
+
+	/// \brief Whether the end of file was read
+	bool m_eof : 1;
+
+	/// \brief Whether a flush was requested
+	bool m_flush : 1;
+
+	/// \brief Whether the requested flush is complete
+	bool m_flushed : 1;
+
+	/// \brief Whether to set the file size after flushing
+	bool m_truncate : 1;
+};
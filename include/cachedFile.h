@@ -0,0 +1,131 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "fs.h"
+#include "ioBuffer.h"
+#include "platform.h"
+
+#include <sys/stat.h>
+using stat_t = struct stat;
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+class CachedFile;
+using SharedCachedFile = std::shared_ptr<CachedFile>;
+
+/// \brief Read-only file shared by every transfer of the same path
+/// \note Sessions fetching one file (or several ranges of it) share a single handle and a small
+/// cache of recently read blocks instead of each opening and reading ahead on their own.
+class CachedFile
+{
+public:
+	~CachedFile ();
+
+	/// \brief Open file, sharing the existing handle if the file is unchanged
+	/// \param path_ Resolved path
+	/// \param st_ Current stat of path_
+	/// \param bufferSize_ stdio buffer size for a newly opened file (unused where blocks are read
+	/// with pread)
+	/// \returns nullptr on error
+	static SharedCachedFile
+	    open (std::string const &path_, stat_t const &st_, std::size_t bufferSize_);
+
+	/// \brief Stop sharing the handle for path; transfers already using it are unaffected
+	/// \param path_ Resolved path
+	static void invalidate (std::string_view path_);
+
+	/// \brief Read data (thread-safe)
+	/// \param buffer_ Output buffer
+	/// \param offset_ File offset
+	/// \param size_ Maximum size to read
+	/// \returns Number of bytes read, 0 on end of file, or -1 on error
+	std::make_signed_t<std::size_t>
+	    read (IOBuffer &buffer_, std::uint64_t offset_, std::size_t size_);
+
+	/// \brief Get the shared file descriptor
+	/// \note Only for positional I/O like sendfile, which leaves the file position alone
+	/// \returns -1 if the file has no descriptor
+	int fd () const;
+
+private:
+	/// \brief Cached block
+	struct Block
+	{
+		/// \brief File offset
+		std::uint64_t offset = 0;
+
+		/// \brief Valid size
+		std::size_t size = 0;
+
+		/// \brief Last use
+		std::uint64_t tick = 0;
+
+		/// \brief Block data
+		std::unique_ptr<char[]> data;
+	};
+
+	/// \brief Block size
+	constexpr static std::size_t BLOCK_SIZE = 64 * 1024;
+
+	/// \brief Parameterized constructor
+	/// \param file_ File to take ownership of
+	/// \param st_ stat of file_
+	CachedFile (fs::File file_, stat_t const &st_);
+
+	/// \brief Get cached block containing offset, reading it if needed
+	/// \param offset_ File offset
+	/// \note Must be called with m_lock held
+	/// \returns nullptr on error
+	Block *fetch (std::uint64_t offset_);
+
+	/// \brief Mutex
+	platform::Mutex m_lock;
+
+	/// \brief Underlying file
+	fs::File m_file;
+
+#if !FTPD_HAS_PREAD
+	/// \brief Current position of m_file
+	std::uint64_t m_position = 0;
+#endif
+
+	/// \brief Cached blocks
+	std::vector<Block> m_blocks;
+
+	/// \brief LRU clock
+	std::uint64_t m_tick = 0;
+
+	/// \brief File size when opened
+	std::uint64_t const m_size;
+
+	/// \brief File mtime when opened
+	std::time_t const m_mtime;
+};
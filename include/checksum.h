@@ -0,0 +1,93 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/// \brief File checksums for HASH and XCRC/XMD5/XSHA1/XSHA256
+namespace checksum
+{
+/// \brief Checksum algorithm
+enum class Algorithm
+{
+	CRC32,
+	MD5,
+	SHA1,
+	SHA256,
+};
+
+/// \brief Number of algorithms
+constexpr unsigned ALGORITHMS = 4;
+
+/// \brief Get algorithm name as used by HASH
+/// \param algorithm_ Algorithm
+char const *name (Algorithm algorithm_);
+
+/// \brief Parse algorithm name
+/// \param name_ Algorithm name (case-insensitive)
+/// \param algorithm_ Output algorithm
+/// \returns Whether the name is supported
+bool parse (std::string_view name_, Algorithm &algorithm_);
+
+/// \brief Incremental checksum
+class Hasher
+{
+public:
+	/// \brief Parameterized constructor
+	/// \param algorithm_ Algorithm
+	Hasher (Algorithm algorithm_);
+
+	/// \brief Hash data
+	/// \param data_ Data
+	/// \param size_ Data size
+	void update (void const *data_, std::size_t size_);
+
+	/// \brief Finish hashing
+	/// \returns Lower-case hex digest
+	std::string finish ();
+
+private:
+	/// \brief Hash whole blocks
+	/// \param data_ Blocks
+	/// \param blocks_ Number of blocks
+	void process (unsigned char const *data_, std::size_t blocks_);
+
+	/// \brief Algorithm
+	Algorithm const m_algorithm;
+
+	/// \brief Running state (crc32 uses the first word)
+	std::uint32_t m_state[8];
+
+	/// \brief Partial block
+	unsigned char m_block[64];
+
+	/// \brief Bytes in m_block
+	std::size_t m_blockSize = 0;
+
+	/// \brief Bytes hashed
+	std::uint64_t m_length = 0;
+};
+}
@@ -0,0 +1,155 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+// selected by CMake (FTPD_ZLIB_NG/FTPD_LIBDEFLATE); 3DS and NDS always use stock zlib
+#ifndef FTPD_HAS_ZLIB_NG
+#define FTPD_HAS_ZLIB_NG 0
+#endif
+
+#ifndef FTPD_HAS_LIBDEFLATE
+#define FTPD_HAS_LIBDEFLATE 0
+#endif
+
+#if FTPD_HAS_ZLIB_NG
+#include <zlib-ng.h>
+#else
+#include <zlib.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+
+/// \brief MODE Z compression backend
+/// \note Every backend produces standard zlib streams, so clients can't tell them apart
+namespace codec
+{
+#if FTPD_HAS_ZLIB_NG
+/// \brief Stream state
+using Stream = zng_stream;
+#else
+/// \brief Stream state
+using Stream = z_stream;
+#endif
+
+/// \brief Initial adler32 value
+constexpr std::uint32_t ADLER32_INIT = 1;
+
+/// \brief Backend description
+char const *name ();
+
+/// \brief Initialize zlib-format deflate stream
+/// \param stream_ Stream to initialize
+/// \param level_ Compression level
+int initDeflate (Stream *stream_, int level_);
+
+/// \brief Initialize raw deflate stream (no zlib header or trailer)
+/// \param stream_ Stream to initialize
+/// \param level_ Compression level
+int initRawDeflate (Stream *stream_, int level_);
+
+/// \brief Initialize zlib-format inflate stream
+/// \param stream_ Stream to initialize
+int initInflate (Stream *stream_);
+
+/// \brief Compress
+/// \param stream_ Stream
+/// \param flush_ Flush mode
+int deflate (Stream *stream_, int flush_);
+
+/// \brief Change compression level
+/// \param stream_ Stream
+/// \param level_ Compression level
+int deflateParams (Stream *stream_, int level_);
+
+/// \brief Set preset dictionary
+/// \param stream_ Stream
+/// \param dict_ Dictionary
+/// \param size_ Dictionary size
+int deflateSetDictionary (Stream *stream_, unsigned char const *dict_, std::size_t size_);
+
+/// \brief Upper bound of compressed size
+/// \param stream_ Stream
+/// \param size_ Uncompressed size
+std::size_t deflateBound (Stream *stream_, std::size_t size_);
+
+/// \brief Reset deflate stream for a new transfer
+/// \param stream_ Stream
+int deflateReset (Stream *stream_);
+
+/// \brief Free deflate stream state
+/// \param stream_ Stream
+int deflateEnd (Stream *stream_);
+
+/// \brief Decompress
+/// \param stream_ Stream
+/// \param flush_ Flush mode
+int inflate (Stream *stream_, int flush_);
+
+/// \brief Reset inflate stream for a new transfer
+/// \param stream_ Stream
+int inflateReset (Stream *stream_);
+
+/// \brief Free inflate stream state
+/// \param stream_ Stream
+int inflateEnd (Stream *stream_);
+
+/// \brief Update adler32 checksum
+/// \param adler_ Running checksum
+/// \param data_ Data
+/// \param size_ Data size
+std::uint32_t adler32 (std::uint32_t adler_, void const *data_, std::size_t size_);
+
+/// \brief Combine adler32 checksums
+/// \param adler1_ Checksum of the first part
+/// \param adler2_ Checksum of the second part
+/// \param size2_ Size of the second part
+std::uint32_t adler32Combine (std::uint32_t adler1_, std::uint32_t adler2_, std::uint64_t size2_);
+
+/// \brief Update crc32 checksum
+/// \param crc_ Running checksum (0 to start)
+/// \param data_ Data
+/// \param size_ Data size
+std::uint32_t crc32 (std::uint32_t crc_, void const *data_, std::size_t size_);
+
+#if FTPD_HAS_LIBDEFLATE
+/// \brief Upper bound of wholeDeflate output size
+/// \param size_ Uncompressed size
+std::size_t wholeDeflateBound (std::size_t size_);
+
+/// \brief Compress a complete raw deflate stream in one call
+/// \param level_ Compression level
+/// \param in_ Input data
+/// \param inSize_ Input size
+/// \param out_ Output buffer
+/// \param outSize_ Output buffer size
+/// \returns Compressed size, or 0 on failure
+/// \note Uses libdeflate, which is considerably faster than streaming zlib but can't take a preset
+/// dictionary or leave the stream open
+std::size_t wholeDeflate (int level_,
+    void const *in_,
+    std::size_t inSize_,
+    void *out_,
+    std::size_t outSize_);
+#endif
+}
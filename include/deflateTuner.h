@@ -0,0 +1,121 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "platform.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+class DeflateTuner;
+using UniqueDeflateTuner = std::unique_ptr<DeflateTuner>;
+
+/// \brief Adaptive deflate level controller
+/// \note Samples compression ratio and compressor time against how fast the data socket drains,
+/// then moves the level one step at a time toward whichever side is the bottleneck. Data that
+/// doesn't compress drops to level 0 (stored blocks) and is re-probed periodically.
+class DeflateTuner
+{
+public:
+	~DeflateTuner ();
+
+	/// \brief Create tuner
+	/// \param level_ Initial level
+	/// \param threads_ Number of threads compressing concurrently
+	static UniqueDeflateTuner create (int level_, unsigned threads_);
+
+	/// \brief Whether a file is likely already compressed
+	/// \param path_ File path
+	static bool incompressible (std::string_view path_);
+
+	/// \brief Current level
+	int level () const;
+
+	/// \brief Record compressed data
+	/// \param in_ Uncompressed size
+	/// \param out_ Compressed size
+	/// \param duration_ Compressor time spent
+	void compressed (std::size_t in_,
+	    std::size_t out_,
+	    platform::steady_clock::duration duration_);
+
+	/// \brief Record data sent to the network
+	/// \param size_ Bytes sent
+	/// \param blocked_ Whether the socket would block
+	void sent (std::size_t size_, bool blocked_);
+
+	/// \brief Treat data as incompressible until the next probe
+	void skip ();
+
+	/// \brief Re-evaluate level
+	/// \returns Whether the level changed since the last call
+	bool update ();
+
+private:
+	/// \brief Parameterized constructor
+	/// \param level_ Initial level
+	/// \param threads_ Number of threads compressing concurrently
+	DeflateTuner (int level_, unsigned threads_);
+
+	/// \brief Evaluate sample interval
+	void evaluate ();
+
+	/// \brief Start new sample interval
+	/// \param now_ Current timestamp
+	void reset (platform::steady_clock::time_point now_);
+
+	/// \brief Number of threads compressing concurrently
+	unsigned const m_threads;
+
+	/// \brief Current level
+	int m_level;
+
+	/// \brief Level last reported by update
+	int m_appliedLevel;
+
+	/// \brief Level to probe when leaving level 0
+	int m_probeLevel;
+
+	/// \brief Start of sample interval
+	platform::steady_clock::time_point m_start;
+
+	/// \brief When to probe again after dropping to level 0
+	platform::steady_clock::time_point m_probeTime;
+
+	/// \brief Compressor time in sample interval
+	platform::steady_clock::duration m_busy;
+
+	/// \brief Uncompressed bytes in sample interval
+	std::uint64_t m_in;
+
+	/// \brief Compressed bytes in sample interval
+	std::uint64_t m_out;
+
+	/// \brief Bytes sent in sample interval
+	std::uint64_t m_sent;
+
+	/// \brief Number of blocked socket writes in sample interval
+	unsigned m_blocked;
+};
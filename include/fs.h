@@ -23,6 +23,9 @@
 #pragma once
 
 #include "ioBuffer.h"
+#if defined(__3DS__) || defined(__SWITCH__)
+#include "platform.h"
+#endif
 
 #include <gsl/gsl>
 
@@ -35,6 +38,18 @@
 #include <string_view>
 #include <vector>
 
+#if defined(__NDS__) || defined(__3DS__)
+#define FTPD_HAS_PREAD 0
+#else
+#define FTPD_HAS_PREAD 1
+#endif
+
+#ifdef __linux__
+#define FTPD_HAS_COPY_FILE_RANGE 1
+#else
+#define FTPD_HAS_COPY_FILE_RANGE 0
+#endif
+
 namespace fs
 {
 /// \brief Print size in human-readable format (KiB, MiB, etc)
@@ -65,6 +80,7 @@ public:
 	explicit operator bool () const;
 
 	/// \brief std::FILE* cast operator
+	/// \note nullptr for files opened through the native backend
 	operator std::FILE * () const;
 
 	/// \brief Set buffer size
@@ -84,6 +100,13 @@ public:
 	/// \param origin_ Reference position (\sa std::fseek)
 	std::make_signed_t<std::size_t> seek (std::make_signed_t<std::size_t> pos_, int origin_);
 
+	/// \brief Get file position
+	/// \returns -1 on error
+	std::make_signed_t<std::size_t> tell ();
+
+	/// \brief Flush written data
+	bool flush ();
+
 	/// \brief Read data
 	/// \param buffer_ Output buffer
 	/// \param size_ Size to read
@@ -95,6 +118,16 @@ public:
 	/// \note Can return partial reads
 	std::make_signed_t<std::size_t> read (IOBuffer &buffer_);
 
+#if FTPD_HAS_PREAD
+	/// \brief Read data at a file offset straight from the file descriptor
+	/// \param buffer_ Output buffer
+	/// \param size_ Size to read
+	/// \param offset_ File offset
+	/// \note Bypasses the stdio buffer and leaves the file position alone; can return partial reads
+	std::make_signed_t<std::size_t>
+	    readAt (gsl::not_null<void *> buffer_, std::size_t size_, std::uint64_t offset_);
+#endif
+
 	/// \brief Read line
 	std::string_view readLine ();
 
@@ -121,10 +154,48 @@ public:
 	/// \note Fails on partials writes and errors
 	bool writeAll (gsl::not_null<void const *> buffer_, std::size_t size_);
 
+	/// \brief Write data straight to the file descriptor, bypassing the stdio buffer
+	/// \param buffer_ Input data
+	/// \note Can return partial writes
+	std::make_signed_t<std::size_t> writeDirect (IOBuffer &buffer_);
+
+#if FTPD_HAS_PREAD
+	/// \brief Write data at a file offset straight to the file descriptor
+	/// \param buffer_ Input data
+	/// \param size_ Size to write
+	/// \param offset_ File offset
+	/// \note Bypasses the stdio buffer and leaves the file position alone; can return partial
+	/// writes
+	std::make_signed_t<std::size_t>
+	    writeAt (gsl::not_null<void const *> buffer_, std::size_t size_, std::uint64_t offset_);
+#endif
+
+#if FTPD_HAS_COPY_FILE_RANGE
+	/// \brief Copy data from another file without passing it through user space
+	/// \param that_ Source file; must not have been read through stdio
+	/// \param size_ Maximum size to copy
+	/// \note Advances both files' positions; can return partial copies
+	std::make_signed_t<std::size_t> copyFrom (File &that_, std::size_t size_);
+#endif
+
+	/// \brief Reserve storage so the file can grow to a size without allocating as it goes
+	/// \param size_ Expected file size
+	/// \note Some platforms do this by growing the file; truncate to the written size afterwards
+	bool preallocate (std::uint64_t size_);
+
+	/// \brief Set file size
+	/// \param size_ File size
+	bool truncate (std::uint64_t size_);
+
 private:
 	/// \brief Underlying std::FILE*
 	std::unique_ptr<std::FILE, int (*) (std::FILE *)> m_fp{nullptr, nullptr};
 
+#ifdef __SWITCH__
+	/// \brief Native file used instead of m_fp
+	std::unique_ptr<platform::NxFile> m_native;
+#endif
+
 	/// \brief Buffer
 	std::vector<char> m_buffer;
 
@@ -172,8 +243,29 @@ public:
 	/// \note Returns nullptr on end-of-directory or error; check errno
 	dirent *read ();
 
+#ifdef __3DS__
+	/// \brief Get bulk sdmc reader
+	/// \returns nullptr if the directory is read through devoptab
+	platform::ArchiveDir *archive () const;
+#endif
+
 private:
 	/// \brief Underlying DIR*
 	std::unique_ptr<DIR, int (*) (DIR *)> m_dp{nullptr, nullptr};
+
+#ifdef __3DS__
+	/// \brief Bulk sdmc reader used instead of m_dp
+	std::unique_ptr<platform::ArchiveDir> m_archive;
+#endif
+
+#ifdef __SWITCH__
+	/// \brief Native directory used instead of m_dp
+	std::unique_ptr<platform::NxDir> m_native;
+#endif
+
+#if defined(__3DS__) || defined(__SWITCH__)
+	/// \brief Entry returned by read
+	dirent m_dirent;
+#endif
 };
 }
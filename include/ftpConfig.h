@@ -34,11 +34,15 @@
 
 class FtpConfig;
 using UniqueFtpConfig = std::unique_ptr<FtpConfig>;
+using SharedFtpConfig = std::shared_ptr<FtpConfig const>;
 
 /// \brief FTP config
 class FtpConfig
 {
 public:
+	/// \brief Deflate level which adapts to the link during each transfer
+	constexpr static int DEFLATE_LEVEL_AUTO = -1;
+
 	~FtpConfig ();
 
 	/// \brief Create config
@@ -52,6 +56,10 @@ public:
 	std::scoped_lock<platform::Mutex> lockGuard ();
 #endif
 
+	/// \brief Get immutable snapshot of the settings
+	/// \note The snapshot is read without lockGuard (); setters publish a new one
+	SharedFtpConfig snapshot () const;
+
 	/// \brief Save config
 	/// \param path_ Path to config file
 	bool save (gsl::not_null<gsl::czstring> path_);
@@ -68,9 +76,54 @@ public:
 	/// \brief Get port
 	std::uint16_t port () const;
 
+	/// \brief Get listen backlog
+	unsigned backlog () const;
+
 	/// \brief Get deflate level
+	/// \note May be DEFLATE_LEVEL_AUTO
 	int deflateLevel () const;
 
+	/// \brief Get stat cache TTL in seconds
+	/// \note 0 disables the cache
+	unsigned statCacheTTL () const;
+
+	/// \brief Get total transfer rate limit in KiB/s
+	/// \note 0 is unlimited
+	unsigned rateLimit () const;
+
+	/// \brief Get per-session transfer rate limit in KiB/s
+	/// \note 0 is unlimited
+	unsigned sessionRateLimit () const;
+
+	/// \brief Get data socket buffer size in bytes
+	/// \note 0 keeps the system default
+	unsigned dataBufferSize () const;
+
+	/// \brief Get control socket buffer size in bytes
+	/// \note 0 keeps the system default
+	unsigned controlBufferSize () const;
+
+	/// \brief Get control connection keepalive idle time in seconds
+	/// \note 0 disables keepalive
+	unsigned keepAlive () const;
+
+	/// \brief Get lowest passive data port
+	/// \note 0 lets the system pick ephemeral ports
+	std::uint16_t pasvPortMin () const;
+
+	/// \brief Get highest passive data port
+	/// \note 0 lets the system pick ephemeral ports
+	std::uint16_t pasvPortMax () const;
+
+	/// \brief Whether passive data connections must come from the client's address
+	/// \note Site-to-site (FXP) transfers need this off
+	bool pasvPeerCheck () const;
+
+#ifndef CLASSIC
+	/// \brief Whether to throttle the UI while transfers are active
+	bool lowUI () const;
+#endif
+
 #ifdef __3DS__
 	/// \brief Whether to get mtime
 	/// \note only effective on 3DS
@@ -108,14 +161,89 @@ public:
 	/// \param port_ Listen port
 	bool setPort (std::uint16_t port_);
 
+	/// \brief Set listen backlog
+	/// \param backlog_ Queue size for incoming connections
+	bool setBacklog (std::string_view backlog_);
+
+	/// \brief Set listen backlog
+	/// \param backlog_ Queue size for incoming connections
+	bool setBacklog (unsigned backlog_);
+
 	/// \brief Set deflate level
-	/// \param level_ Deflate level
+	/// \param level_ Deflate level, or "auto"
 	bool setDeflateLevel (std::string_view level_);
 
 	/// \brief Set deflate level
 	/// \param level_ Deflate level
 	bool setDeflateLevel (int level_);
 
+	/// \brief Set stat cache TTL
+	/// \param ttl_ TTL in seconds
+	bool setStatCacheTTL (std::string_view ttl_);
+
+	/// \brief Set stat cache TTL
+	/// \param ttl_ TTL in seconds
+	void setStatCacheTTL (unsigned ttl_);
+
+	/// \brief Set total transfer rate limit
+	/// \param limit_ Limit in KiB/s; 0 is unlimited
+	bool setRateLimit (std::string_view limit_);
+
+	/// \brief Set total transfer rate limit
+	/// \param limit_ Limit in KiB/s; 0 is unlimited
+	void setRateLimit (unsigned limit_);
+
+	/// \brief Set per-session transfer rate limit
+	/// \param limit_ Limit in KiB/s; 0 is unlimited
+	bool setSessionRateLimit (std::string_view limit_);
+
+	/// \brief Set per-session transfer rate limit
+	/// \param limit_ Limit in KiB/s; 0 is unlimited
+	void setSessionRateLimit (unsigned limit_);
+
+	/// \brief Set data socket buffer size
+	/// \param size_ Size in bytes; 0 keeps the system default
+	bool setDataBufferSize (std::string_view size_);
+
+	/// \brief Set data socket buffer size
+	/// \param size_ Size in bytes; 0 keeps the system default
+	void setDataBufferSize (unsigned size_);
+
+	/// \brief Set control socket buffer size
+	/// \param size_ Size in bytes; 0 keeps the system default
+	bool setControlBufferSize (std::string_view size_);
+
+	/// \brief Set control socket buffer size
+	/// \param size_ Size in bytes; 0 keeps the system default
+	void setControlBufferSize (unsigned size_);
+
+	/// \brief Set control connection keepalive
+	/// \param idle_ Idle time in seconds; 0 disables keepalive
+	bool setKeepAlive (std::string_view idle_);
+
+	/// \brief Set control connection keepalive
+	/// \param idle_ Idle time in seconds; 0 disables keepalive
+	void setKeepAlive (unsigned idle_);
+
+	/// \brief Set passive data port range
+	/// \param range_ "<MIN>-<MAX>", or "0" for ephemeral ports
+	bool setPasvPorts (std::string_view range_);
+
+	/// \brief Set passive data port range
+	/// \param min_ Lowest port; 0 for ephemeral ports
+	/// \param max_ Highest port; 0 for ephemeral ports
+	bool setPasvPorts (std::uint16_t min_, std::uint16_t max_);
+
+	/// \brief Set whether passive data connections must come from the client's address
+	/// \param check_ Whether to check the data connection's peer
+	void setPasvPeerCheck (bool check_);
+
+#ifndef CLASSIC
+	/// \brief Set whether to throttle the UI while transfers are active
+	/// \param lowUI_ Whether to throttle the UI
+	void setLowUI (bool lowUI_);
+#endif
+
 #ifdef __3DS__
 	/// \brief Set whether to get mtime
 	/// \param getMTime_ Whether to get mtime
@@ -139,11 +267,30 @@ public:
 private:
 	FtpConfig ();
 
+	/// \brief Copy settings into a snapshot
+	/// \param that_ Config to copy
+	FtpConfig (FtpConfig const &that_);
+
+	FtpConfig (FtpConfig &&that_) = delete;
+
+	FtpConfig &operator= (FtpConfig const &that_) = delete;
+
+	FtpConfig &operator= (FtpConfig &&that_) = delete;
+
+	/// \brief Publish the current settings as a new snapshot
+	void publish ();
+
 #ifndef __NDS__
 	/// \brief Mutex
 	mutable platform::Mutex m_lock;
+
+	/// \brief Snapshot mutex; only held to swap or copy m_snapshot
+	mutable platform::Mutex m_snapshotLock;
 #endif
 
+	/// \brief Latest snapshot
+	SharedFtpConfig m_snapshot;
+
 	/// \brief Username
 	std::string m_user;
 
@@ -156,9 +303,44 @@ private:
 	/// \brief Listen port
 	std::uint16_t m_port;
 
+	/// \brief Listen backlog
+	unsigned m_backlog;
+
 	/// \brief Deflate level
 	int m_deflateLevel;
 
+	/// \brief Stat cache TTL in seconds
+	unsigned m_statCacheTTL;
+
+	/// \brief Total transfer rate limit in KiB/s
+	unsigned m_rateLimit = 0;
+
+	/// \brief Per-session transfer rate limit in KiB/s
+	unsigned m_sessionRateLimit = 0;
+
+	/// \brief Data socket buffer size in bytes
+	unsigned m_dataBufferSize;
+
+	/// \brief Control socket buffer size in bytes
+	unsigned m_controlBufferSize;
+
+	/// \brief Control connection keepalive idle time in seconds
+	unsigned m_keepAlive;
+
+	/// \brief Lowest passive data port
+	std::uint16_t m_pasvPortMin;
+
+	/// \brief Highest passive data port
+	std::uint16_t m_pasvPortMax;
+
+	/// \brief Whether passive data connections must come from the client's address
+	bool m_pasvPeerCheck = false;
+
+#ifndef CLASSIC
+	/// \brief Whether to throttle the UI while transfers are active
+	bool m_lowUI = false;
+#endif
+
 #ifdef __3DS__
 	/// \brief Whether to get mtime
 	bool m_getMTime = true;
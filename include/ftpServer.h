@@ -24,7 +24,9 @@
 
 #include "ftpConfig.h"
 #include "ftpSession.h"
+#include "pasvPool.h"
 #include "platform.h"
+#include "poller.h"
 #include "socket.h"
 
 #ifndef CLASSIC
@@ -50,18 +52,33 @@ public:
 	/// \brief Draw server and all of its sessions
 	void draw ();
 
+#ifndef CLASSIC
+	/// \brief Get time to idle after presenting a frame
+	/// \note Non-zero while transfers are active in low-UI mode
+	std::chrono::milliseconds frameIdle () const;
+#endif
+
 	/// \brief Whether server wants to quit
 	bool quit ();
 
 	/// \brief Create server
 	static UniqueFtpServer create ();
 
+	/// \brief Create server
+	/// \param config_ FTP config
+	static UniqueFtpServer create (UniqueFtpConfig config_);
+
 	/// \brief Get free space
 	static std::string getFreeSpace ();
 
-	/// \brief Update free space
+	/// \brief Request a free space update
+	/// \note The query is debounced and runs off the session threads
 	static void updateFreeSpace ();
 
+	/// \brief Adjust free space until the next update
+	/// \param delta_ Bytes freed (positive) or used (negative)
+	static void adjustFreeSpace (std::int64_t delta_);
+
 	/// \brief Server start time
 	static std::time_t startTime ();
 
@@ -71,6 +88,10 @@ public:
 #endif
 
 private:
+	/// \brief Session worker
+	class Worker;
+	using UniqueWorker = std::unique_ptr<Worker>;
+
 	/// \brief Paramterized constructor
 	/// \param config_ FTP config
 	FtpServer (UniqueFtpConfig config_);
@@ -81,6 +102,19 @@ private:
 	/// \brief Handle when network is lost
 	void handleNetworkLost ();
 
+	/// \brief Close the listen and mDNS sockets, then their poller
+	void closeListeners ();
+
+#if FTPD_HAS_POLLER_WAKE
+	/// \brief Interrupt the server thread's wait
+	void wake ();
+#endif
+
+	/// \brief Accept pending connections and hand them to the workers
+	/// \param socket_ Listen socket
+	/// \returns false if the listen socket failed
+	bool acceptSessions (Socket &socket_);
+
 #ifndef CLASSIC
 	/// \brief Show menu in the current window
 	void showMenu ();
@@ -88,6 +122,9 @@ private:
 	/// \brief Show settings menu
 	void showSettings ();
 
+	/// \brief Show statistics window
+	void showStats ();
+
 	/// \brief Show about window
 	void showAbout ();
 #endif
@@ -109,9 +146,18 @@ private:
 	/// \brief Config
 	UniqueFtpConfig m_config;
 
+	/// \brief Listen and mDNS socket poller
+	/// \note Declared before the sockets, which must be destroyed first; only replaced under m_lock
+	UniquePoller m_poller;
+
 	/// \brief Listen socket
 	UniqueSocket m_socket;
 
+#ifndef NO_IPV6
+	/// \brief IPv6 listen socket (same port as m_socket)
+	UniqueSocket m_socket6;
+#endif
+
 #ifndef __NDS__
 	/// \brief mDNS socket
 	UniqueSocket m_mdnsSocket;
@@ -120,12 +166,19 @@ private:
 	/// \brief ImGui window name
 	std::string m_name;
 
-	/// \brief Sessions
-	std::vector<UniqueFtpSession> m_sessions;
+	/// \brief Passive listener pool
+	/// \note Outlives the sessions, which return their listeners to it
+	UniquePasvPool m_pasvPool;
+
+	/// \brief Session workers
+	std::vector<UniqueWorker> m_workers;
 
 	/// \brief Whether thread should quit
 	std::atomic_bool m_quit = false;
 
+	/// \brief Whether the server thread should rebind the listen sockets
+	std::atomic_bool m_rebind = false;
+
 #ifndef CLASSIC
 	/// \brief Log upload cURL context
 	CURLM *m_uploadLogCurlM = nullptr;
@@ -149,6 +202,9 @@ private:
 	bool m_showAP = false;
 #endif
 
+	/// \brief Whether to show statistics window
+	bool m_showStats = false;
+
 	/// \brief Whether to show about window
 	bool m_showAbout = false;
 
@@ -167,6 +223,15 @@ private:
 	/// \brief Deflate level setting
 	int m_deflateLevelSetting = Z_NO_COMPRESSION;
 
+	/// \brief Low-UI setting
+	bool m_lowUISetting = false;
+
+	/// \brief Transfer byte count at the last frame
+	std::uint64_t m_drawBytes = 0;
+
+	/// \brief Whether the UI is throttled for this frame
+	bool m_throttleUI = false;
+
 #ifdef __3DS__
 	/// \brief getMTime setting
 	bool m_getMTimeSetting;
@@ -22,29 +22,49 @@
 
 #pragma once
 
+#ifndef __NDS__
+#include "asyncFile.h"
+#include "cachedFile.h"
+#include "storeFile.h"
+#endif
+#include "checksum.h"
+#include "codec.h"
+#include "deflateTuner.h"
 #include "fs.h"
 #include "ftpConfig.h"
+#include "hashJob.h"
 #include "ioBuffer.h"
+#include "ioChain.h"
+#include "listingCache.h"
+#include "parallelDeflate.h"
+#include "pasvPool.h"
 #include "platform.h"
+#include "poller.h"
 #include "socket.h"
+#include "tokenBucket.h"
+#include "zStreamPool.h"
 
-#if __has_include(<glob.h>)
-#include <glob.h>
+#if __has_include(<fnmatch.h>)
+#include <fnmatch.h>
 #define FTPD_HAS_GLOB 1
 #else
 #define FTPD_HAS_GLOB 0
 #endif
 
-#include <zlib.h>
-
 #include <sys/stat.h>
 using stat_t = struct stat;
 
+#ifndef __NDS__
+#include <atomic>
+#endif
 #include <chrono>
+#include <cstdint>
 #include <ctime>
 #include <memory>
 #include <optional>
+#include <string>
 #include <string_view>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -61,19 +81,26 @@ public:
 	bool dead ();
 
 	/// \brief Draw session status
-	void draw ();
+	/// \param interval_ Time between refreshes of the drawn snapshot
+	void draw (std::chrono::milliseconds interval_);
 
 	/// \brief Draw session connections
 	void drawConnections ();
 
 	/// \brief Create session
 	/// \param config_ FTP config
+	/// \param pasvPool_ Passive listener pool
 	/// \param commandSocket_ Command socket
-	static UniqueFtpSession create (FtpConfig &config_, UniqueSocket commandSocket_);
+	static UniqueFtpSession
+	    create (FtpConfig &config_, PasvPool &pasvPool_, UniqueSocket commandSocket_);
 
 	/// \brief Poll for activity
+	/// \param poller_ Poller the sessions are registered with
 	/// \param sessions_ Sessions to poll
-	static bool poll (std::vector<UniqueFtpSession> const &sessions_);
+	/// \param timeout_ Longest time to wait for activity
+	static bool poll (Poller &poller_,
+	    std::vector<UniqueFtpSession> const &sessions_,
+	    std::chrono::milliseconds timeout_);
 
 private:
 	/// \brief Command buffer size
@@ -83,37 +110,70 @@ private:
 	/// \brief Response buffer size
 	constexpr static auto RESPONSE_BUFFERSIZE = 4096;
 
+	/// \brief Queued response size which triggers a flush
+	constexpr static auto RESPONSE_FLUSHSIZE = 1024;
+
 	/// \brief Transfer buffersize
 	constexpr static auto XFER_BUFFERSIZE = 8192;
+
+	/// \brief Maximum number of directories waiting in a recursive listing
+	constexpr static auto LIST_TREE_DIRS = 256;
 #else
 	/// \brief Response buffer size
 	constexpr static auto RESPONSE_BUFFERSIZE = 32768;
 
+	/// \brief Queued response size which triggers a flush
+	constexpr static auto RESPONSE_FLUSHSIZE = 8192;
+
 	/// \brief Transfer buffersize
 	constexpr static auto XFER_BUFFERSIZE = 65536;
+
+	/// \brief Maximum number of directories waiting in a recursive listing
+	constexpr static auto LIST_TREE_DIRS = 4096;
 #endif
 
+	/// \brief Maximum number of response segments
+	constexpr static auto RESPONSE_SEGMENTS = 2;
+
+	/// \brief Maximum number of compressed download segments
+	constexpr static auto DEFLATE_SEGMENTS = 2;
+
+	/// \brief Directory entries a glob examines per call without a match
+	constexpr static auto GLOB_SCAN = 1024;
+
 	/// \brief File buffersize
 	constexpr static auto FILE_BUFFERSIZE = 4 * XFER_BUFFERSIZE;
 
+	/// \brief Seconds of transfer at the measured rate to keep read ahead
+	constexpr static auto READ_AHEAD_TIME = 0.25f;
+
+	/// \brief Time constant in seconds of the transfer rate filter
+	constexpr static auto XFER_RATE_TAU = 1.66f;
+
+	/// \brief Seconds between read-ahead rate samples
+	constexpr static auto IO_RATE_PERIOD = 0.1f;
+
+	/// \brief Bytes of credit a transfer gets per scheduling round
+	constexpr static auto XFER_QUANTUM = XFER_BUFFERSIZE;
+
 #if defined(__NDS__)
-	/// \brief Socket buffer size
-	constexpr static auto SOCK_BUFFERSIZE = 4096;
+	/// \brief Upload write size (and alignment)
+	constexpr static auto STORE_BUFFERSIZE = 32768;
 
-	/// \brief Amount of file position history to keep
-	constexpr static auto POSITION_HISTORY = 60;
+	/// \brief Number of transfer rate samples to plot
+	constexpr static auto RATE_HISTORY = 60;
 #elif defined(__3DS__)
-	/// \brief Socket buffer size
-	constexpr static auto SOCK_BUFFERSIZE = 32768;
+	/// \brief Upload write size (and alignment)
+	constexpr static auto STORE_BUFFERSIZE = 256 * 1024;
 
-	/// \brief Amount of file position history to keep
-	constexpr static auto POSITION_HISTORY = 100;
+	/// \brief Number of transfer rate samples to plot
+	constexpr static auto RATE_HISTORY = 100;
 #else
-	/// \brief Socket buffer size
-	constexpr static auto SOCK_BUFFERSIZE = XFER_BUFFERSIZE;
+	/// \brief Upload write size (and alignment)
+	constexpr static auto STORE_BUFFERSIZE = 1024 * 1024;
 
-	/// \brief Amount of file position history to keep
-	constexpr static auto POSITION_HISTORY = 300;
+	/// \brief Number of transfer rate samples to plot
+	constexpr static auto RATE_HISTORY = 300;
 #endif
 
 	/// \brief Session state
@@ -144,18 +204,44 @@ private:
 
 	/// \brief Parameterized constructor
 	/// \param config_ FTP config
+	/// \param pasvPool_ Passive listener pool
 	/// \param commandSocket_ Command socket
-	FtpSession (FtpConfig &config_, UniqueSocket commandSocket_);
+	FtpSession (FtpConfig &config_, PasvPool &pasvPool_, UniqueSocket commandSocket_);
 
 	/// \brief Whether session is authorized
 	bool authorized () const;
 
+	/// \brief Refresh the snapshot the UI draws from
+	/// \param now_ Current time
+	void refreshDraw (platform::steady_clock::time_point now_);
+
+	/// \brief Update socket registrations to match session state
+	/// \param poller_ Poller to register with
+	void updatePollEvents (Poller &poller_);
+
+	/// \brief Handle ready event
+	/// \param event_ Event to handle
+	void handleEvent (Poller::Event const &event_);
+
 	/// \brief Set session state
 	/// \param state_ State to set
 	/// \param closePasv_ Whether to close listening socket
 	/// \param closeData_ Whether to close data socket
 	void setState (State state_, bool closePasv_, bool closeData_);
 
+	/// \brief Check out transfer buffers from the buffer pool
+	/// \note They go back to the pool when the session returns to State::COMMAND
+	void acquireBuffers ();
+
+	/// \brief Drop an idle session to a minimal footprint
+	/// \param poller_ Poller the session is registered with
+	/// \note Only the sockets, working directory and login survive; does nothing while a
+	/// command, reply or transfer is pending
+	void hibernate (Poller &poller_);
+
+	/// \brief Restore a hibernated session
+	void wake ();
+
 	/// \brief Close socket
 	/// \param socket_ Socket to close
 	void closeSocket (SharedSocket &socket_);
@@ -175,6 +261,14 @@ private:
 	/// \brief Connect data socket
 	bool dataConnect ();
 
+	/// \brief Apply configured data socket options
+	/// \param socket_ Data or passive socket
+	void tuneDataSocket (Socket &socket_);
+
+	/// \brief Lease passive listening socket on the command connection's address
+	/// \note Sends the error response on failure
+	bool listenPassive ();
+
 	/// \brief Perform stat and apply tz offset to mtime
 	/// \param path_ Path to stat
 	/// \param st_ Output stat
@@ -185,17 +279,68 @@ private:
 	/// \param st_ Output stat
 	int tzLStat (char const *const path_, stat_t *st_);
 
+	/// \brief Perform stat or lstat through the stat cache and apply tz offset to mtime
+	/// \param path_ Resolved path
+	/// \param st_ Output stat
+	/// \param follow_ Whether to follow symlinks (stat rather than lstat)
+	int cachedStat (char const *const path_, stat_t *st_, bool follow_);
+
+	/// \brief Format directory entry
+	/// \tparam mode_ Directory transfer mode
+	/// \param buffer_ Buffer to append to
+	/// \param st_ Entry status (unused for NLST)
+	/// \param name_ Entry name (unencoded)
+	/// \param type_ MLST type
+	/// \returns 0 on success, EAGAIN if the entry doesn't fit, or errno
+	template <XferDirMode mode_>
+	int formatDirent (IOBuffer &buffer_,
+	    stat_t const &st_,
+	    std::string_view name_,
+	    char const *type_) const;
+
 	/// \brief Fill directory entry
 	/// \param st_ Entry status
-	/// \param path_ Path name
+	/// \param name_ Entry name (unencoded)
 	/// \param type_ MLST type
-	int fillDirent (stat_t const &st_, std::string_view path_, char const *type_ = nullptr);
+	int fillDirent (stat_t const &st_, std::string_view name_, char const *type_ = nullptr);
 
 	/// \brief Fill directory entry
 	/// \param path_ Path name
 	/// \param type_ MLST type
 	int fillDirent (std::string const &path_, char const *type_ = nullptr);
 
+	/// \brief Fill buffer with as many directory entries as fit
+	/// \tparam mode_ Directory transfer mode
+	/// \param buffer_ Buffer to fill
+	/// \returns 0 on success, or errno
+	template <XferDirMode mode_>
+	int fillListing (IOBuffer &buffer_);
+
+	/// \brief Get status of the directory entry named by m_listPath
+	/// \param st_ Output stat
+	/// \param getMTime_ Whether mtime is needed
+	/// \note getMTime_ only effective on 3DS
+	bool listStat (stat_t &st_, bool getMTime_);
+
+	/// \brief Open the next directory of a recursive listing
+	/// \returns Whether a directory was opened
+	bool nextListDir ();
+
+	/// \brief Look up the cached listing of a directory, or start recording one
+	/// \param path_ Resolved directory path
+	/// \param level_ Deflate level of the transfer
+	/// \returns Whether the cached listing will be replayed
+	bool listCached (std::string const &path_, int level_);
+
+	/// \brief Append rendered listing data to the recording
+	/// \param data_ Rendered data
+	/// \param size_ Data size
+	/// \param deflated_ Whether data is compressed
+	void recordListing (char const *data_, std::size_t size_, bool deflated_);
+
+	/// \brief Fill transfer buffer from the cached listing
+	void fillCachedListing ();
+
 	/// \brief Transfer file
 	/// \param args_ Command arguments
 	/// \param mode_ Transfer file mode
@@ -204,15 +349,42 @@ private:
 	/// \brief Transfer directory
 	/// \param args_ Command arguments
 	/// \param mode_ Transfer directory mode
-	/// \param workaround_ Workaround broken clients who use LIST -a/-l
-	void xferDir (char const *args_, XferDirMode mode_, bool workaround_);
+	/// \param workaround_ Workaround broken clients who use LIST -a/-l, and accept -R
+	/// \param recursive_ Whether to list subdirectories as well
+	void xferDir (char const *args_, XferDirMode mode_, bool workaround_, bool recursive_ = false);
+
+	/// \brief Compute file checksum
+	/// \param args_ Command arguments
+	/// \param algorithm_ Checksum algorithm
+	/// \param hash_ Whether this is HASH (otherwise XCRC/XMD5/XSHA1/XSHA256)
+	void xferHash (char const *args_, checksum::Algorithm algorithm_, bool hash_);
+
+	/// \brief Copy file on the server
+	/// \param from_ Resolved path from SITE CPFR
+	/// \param to_ Path to copy to
+	void xferCopy (std::string const &from_, char const *to_);
+
+	/// \brief Send checksum reply
+	/// \param algorithm_ Checksum algorithm
+	/// \param start_ Offset hashing started at
+	/// \param end_ Offset hashing stopped at
+	/// \param digest_ Lower-case hex digest
+	void sendHash (checksum::Algorithm algorithm_,
+	    std::uint64_t start_,
+	    std::uint64_t end_,
+	    std::string const &digest_);
 
 	/// \brief Read command
 	/// \param events_ Poll events
 	void readCommand (int events_);
 
-	/// \brief Write response
-	void writeResponse ();
+	/// \brief Run every complete command line in m_commandBuffer
+	/// \note Stops at a command which has to wait for the transfer to end
+	void processCommands ();
+
+	/// \brief Write queued responses
+	/// \param more_ Whether more responses follow shortly
+	void writeResponse (bool more_ = false);
 
 	/// \brief Send response
 	/// \param fmt_ Message format
@@ -222,9 +394,21 @@ private:
 	/// \param response_ Response message
 	void sendResponse (std::string_view response_);
 
+	/// \brief Queue formatted response
+	/// \param size_ Size of response written to the free area of the last response segment
+	void queueResponse (std::size_t size_);
+
 	/// \brief Deflate buffer
+	/// \param out_ Output buffer
 	/// \param flush_ Whether to flush
-	bool deflateBuffer (bool flush_);
+	bool deflateBuffer (IOBuffer &out_, bool flush_);
+
+#if FTPD_HAS_PARALLEL_DEFLATE
+	/// \brief Deflate buffer on the compression threads
+	/// \param out_ Output buffer
+	/// \param flush_ Whether to flush
+	bool parallelDeflateBuffer (IOBuffer &out_, bool flush_);
+#endif
 
 	/// \brief Inflate buffer
 	bool inflateBuffer ();
@@ -232,6 +416,38 @@ private:
 	/// \brief Transfer function
 	bool (FtpSession::*m_transfer) () = nullptr;
 
+	/// \brief Run one step of the transfer function
+	/// \returns Whether the transfer can continue without waiting
+	bool transfer ();
+
+	/// \brief Share transfer bandwidth between sessions
+	/// \param sessions_ Sessions to schedule
+	/// \note Ready transfers take turns spending XFER_QUANTUM bytes of credit (deficit round robin)
+	/// while the per-session and total rate limits allow
+	static void schedule (std::vector<UniqueFtpSession> const &sessions_);
+
+	/// \brief Whether the rate limits allow transferring
+	/// \param now_ Current time
+	bool rateAvailable (platform::steady_clock::time_point now_);
+
+	/// \brief Time until the rate limits allow transferring
+	/// \param now_ Current time
+	std::chrono::milliseconds rateWait (platform::steady_clock::time_point now_);
+
+	/// \brief I/O counters of this session's sockets, including closed ones
+	stats::IO io () const;
+
+#ifndef __NDS__
+	/// \brief Whether pipelined work the transfer is waiting on has progressed
+	bool ioReady ();
+#endif
+
+	/// \brief Wait for the file checksum and send it
+	bool hashTransfer ();
+
+	/// \brief Copy a chunk of the file for SITE CPTO
+	bool copyTransfer ();
+
 	/// \brief Transfer directory list
 	bool listTransfer ();
 
@@ -243,21 +459,57 @@ private:
 	/// \brief Transfer download
 	bool retrieveTransfer ();
 
+	/// \brief Transfer deflate download
+	bool deflateTransfer ();
+
+	/// \brief Read the next block of the download
+	/// \param buffer_ Output buffer
+	/// \returns Whether to continue; the end of file sets m_eof
+	bool readDownload (IOBuffer &buffer_);
+
+	/// \brief Read the next block of m_file, stopping at the end of the RANG byte range
+	/// \param buffer_ Output buffer
+	std::make_signed_t<std::size_t> readFile (IOBuffer &buffer_);
+
+#if FTPD_HAS_SENDFILE
+	/// \brief Transfer download directly from the file to the data socket
+	/// \note Only used for plain (non-deflate) transfers of regular files
+	bool sendFileTransfer ();
+#endif
+
 	/// \brief Transfer upload
 	bool storeTransfer ();
 
+	/// \brief Write staged upload data
+	/// \returns Whether the transfer can continue
+	bool writeStore ();
+
+	/// \brief Hand the rest of an interrupted upload to the file
+	void finishStore ();
+
+	/// \brief Charge free space for upload data written past m_storeReserved
+	void reserveStore ();
+
 #ifndef __NDS__
 	/// \brief Mutex
 	platform::Mutex m_lock;
 #endif
 
 	/// \brief FTP config
+	/// \note Only used to change settings; reads go through m_settings
 	FtpConfig &m_config;
 
+	/// \brief Config snapshot, refreshed for each command
+	SharedFtpConfig m_settings;
+
+	/// \brief Passive listener pool
+	PasvPool &m_pasvPool;
+
 	/// \brief Command socket
 	SharedSocket m_commandSocket;
 
 	/// \brief Data listen socker
+	/// \note Leased from m_pasvPool
 	UniqueSocket m_pasvSocket;
 
 	/// \brief Data socket
@@ -266,17 +518,26 @@ private:
 	/// \brief Sockets pending close
 	std::vector<SharedSocket> m_pendingCloseSocket;
 
+	/// \brief I/O counters of closed sockets
+	stats::IO m_io;
+
 	/// \brief Command buffer
 	IOBuffer m_commandBuffer;
 
 	/// \brief Response buffer
-	IOBuffer m_responseBuffer;
+	IOChain m_responseBuffer;
 
 	/// \brief Transfer buffer
+	/// \note Only holds storage during a transfer
 	IOBuffer m_xferBuffer;
 	/// \brief z-stream buffer
+	/// \note Only holds storage during a deflate transfer
 	IOBuffer m_zStreamBuffer;
 
+	/// \brief Compressed download data waiting to be sent
+	/// \note Only holds storage during a deflate download
+	IOChain m_deflateChain;
+
 	/// \brief Address from last PORT command
 	SockAddr m_portAddr;
 
@@ -289,37 +550,131 @@ private:
 	/// \brief Path from RNFR command
 	std::string m_rename;
 
+	/// \brief Path from SITE CPFR command
+	std::string m_copyFrom;
+
 	/// \brief Current work item
 	std::string m_workItem;
 
-	/// \brief ImGui window name
-	std::string m_windowName;
-
-	/// \brief ImGui plot widget name
-	std::string m_plotName;
-
 	/// \brief Position from REST command
 	std::uint64_t m_restartPosition = 0;
 
+	/// \brief End (exclusive) of the byte range from RANG command, or 0 for end of file
+	std::uint64_t m_rangeEnd = 0;
+
+	/// \brief Size from ALLO command
+	std::uint64_t m_allocSize = 0;
+
+	/// \brief Transfer progress
+	/// \note Written by the session's worker and read by the UI without taking m_lock
+	class Progress
+	{
+	public:
+		/// \brief Progress snapshot
+		struct Snapshot
+		{
+			/// \brief Transfer generation; changes whenever reset () is called
+			unsigned generation = 0;
+
+			/// \brief File position
+			std::uint64_t position = 0;
+
+			/// \brief File size, or 0 if unknown
+			std::uint64_t size = 0;
+		};
+
+		/// \brief Publish the start (or end) of a transfer
+		/// \param position_ File position
+		/// \param size_ File size
+		void reset (std::uint64_t position_, std::uint64_t size_);
+
+		/// \brief Publish a new file position
+		/// \param position_ File position
+		void update (std::uint64_t position_);
+
+		/// \brief Read a consistent snapshot
+		/// \param[out] snapshot_ Snapshot; left alone while reset () is in flight
+		void load (Snapshot &snapshot_) const;
+
+	private:
+#ifdef __NDS__
+		/// \brief Published progress
+		Snapshot m_snapshot;
+#else
+		/// \brief Sequence; odd while reset () is in flight
+		std::atomic<unsigned> m_sequence = 0;
+
+		/// \brief File position
+		std::atomic<std::uint64_t> m_position = 0;
+
+		/// \brief File size
+		std::atomic<std::uint64_t> m_size = 0;
+#endif
+	};
+
+	/// \brief Published transfer progress
+	Progress m_progress;
+
+	/// \brief Transfer progress as of the last draw (UI only)
+	Progress::Snapshot m_drawProgress;
+
 	/// \brief Current file position
+	/// \note Worker only; published through m_progress
 	std::uint64_t m_filePosition = 0;
 	/// \brief Current z-stream position
 	std::uint64_t m_zStreamPosition = 0;
 
-	/// \brief File size of current transfer
-	std::uint64_t m_fileSize = 0;
+	/// \brief Upload data staged for the next large write
+	std::unique_ptr<IOBuffer> m_storeBuffer;
+
+	/// \brief File offset past the upload data handed to the file
+	std::uint64_t m_storeOffset = 0;
+
+	/// \brief File offset up to which the upload is charged against free space
+	std::uint64_t m_storeReserved = 0;
+
+	/// \brief Amount of staged data which reaches the next aligned offset
+	std::size_t m_storeFill = 0;
+
+	/// \brief Whether preallocated space must be trimmed when the upload ends
+	bool m_storeTruncate = false;
+
+	/// \brief Transfer rate plot data
+	struct RateHistory
+	{
+		/// \brief Transfer rate samples
+		float rates[RATE_HISTORY] = {};
+	};
 
-	/// \brief Last file position update timestamp
-	platform::steady_clock::time_point m_filePositionTime;
+	/// \brief Transfer rate plot data (UI only)
+	/// \note Only allocated while a transfer is drawn and visible
+	std::unique_ptr<RateHistory> m_rateHistory;
 
-	/// \brief File position history
-	std::uint64_t m_filePositionHistory[POSITION_HISTORY];
+	/// \brief Next draw snapshot refresh (UI only)
+	platform::steady_clock::time_point m_drawTime;
 
-	/// \brief File position history deltas
-	float m_filePositionDeltas[POSITION_HISTORY];
+	/// \brief Work item or cwd as of the last refresh (UI only)
+	std::string m_drawName;
+
+	/// \brief Formatted transfer progress as of the last refresh (UI only)
+	std::string m_drawSize;
+
+#ifndef CLASSIC
+	/// \brief Formatted transfer rate as of the last refresh (UI only)
+	std::string m_drawRate;
+
+	/// \brief File position at the last rate sample (UI only)
+	std::uint64_t m_ratePosition = 0;
+
+	/// \brief Time of the last rate sample (UI only)
+	platform::steady_clock::time_point m_rateTime;
+
+	/// \brief Whether the session was visible at the last draw (UI only)
+	bool m_drawVisible = true;
+#endif
 
 	/// \brief Transfer rate (EWMA low-pass filtered)
-	float m_xferRate;
+	float m_xferRate = -1.0f;
 
 	/// \brief Session state
 	State m_state = State::COMMAND;
@@ -327,45 +682,162 @@ private:
 	/// \brief File being transferred
 	fs::File m_file;
 
+	/// \brief Destination of SITE CPTO
+	/// \note Only open while the copy is unfinished
+	fs::File m_copyFile;
+
+	/// \brief Staging buffer for copies which go through user space
+	std::unique_ptr<IOBuffer> m_copyBuffer;
+
+#ifndef __NDS__
+	/// \brief Pipelined file being transferred
+	/// \note Takes ownership of m_file for the duration of the transfer
+	SharedAsyncFile m_asyncFile;
+
+	/// \brief Download rate seen by the worker (EWMA low-pass filtered), sizes the read-ahead
+	float m_ioRate = 0.0f;
+
+	/// \brief File position at the last read-ahead rate sample
+	std::uint64_t m_ioRatePosition = 0;
+
+	/// \brief Time of the last read-ahead rate sample
+	platform::steady_clock::time_point m_ioRateTime;
+
+	/// \brief Shared file opened for the download
+	/// \note Handed to m_asyncFile once the transfer starts
+	SharedCachedFile m_cachedFile;
+
+	/// \brief Shared file opened for a ranged upload
+	/// \note Released with finish or abandon when the upload ends
+	SharedStoreFile m_storeFile;
+#endif
+
+	/// \brief Checksum being computed
+	SharedHashJob m_hashJob;
+
+	/// \brief Path name echoed in the HASH reply, or empty for XCRC/XMD5/XSHA1/XSHA256
+	std::string m_hashPath;
+
+	/// \brief Algorithm used by HASH
+	checksum::Algorithm m_hashAlgorithm = checksum::Algorithm::SHA256;
+
 	/// \brief Directory being transferred
 	fs::Dir m_dir;
 
+	/// \brief Scratch path of the directory entry being listed
+	std::string m_listPath;
+
+	/// \brief Directory entry which didn't fit in the last batch
+	dirent *m_pendingDirent = nullptr;
+
+	/// \brief Subdirectories still to be listed by a recursive listing
+	/// \note Each directory's children are reversed once it is done, so they pop in order
+	std::vector<std::string> m_listStack;
+
+	/// \brief Size of m_listStack when the current directory was opened
+	std::size_t m_listStackBase = 0;
+
+	/// \brief Length of the root path of a recursive listing
+	std::size_t m_listRootSize = 0;
+
+	/// \brief Root of a recursive listing as the client named it
+	std::string m_listRoot;
+
+	/// \brief Status of m_pendingDirent
+	stat_t m_pendingSt;
+
+	/// \brief Cached listing being replayed
+	ListingCache::SharedListing m_listing;
+
+	/// \brief Replay position in m_listing
+	std::size_t m_listingPos = 0;
+
+	/// \brief Listing being recorded for the cache
+	std::shared_ptr<ListingCache::Listing> m_listingRecord;
+
 #if FTPD_HAS_GLOB
-	/// \brief Glob wrappre
+	/// \brief Incremental glob matcher
+	/// Matches are produced while the directories are enumerated, so a wildcard over a huge
+	/// directory neither builds the whole match list nor delays the first byte
 	class Glob
 	{
 	public:
 		~Glob () noexcept;
 		Glob () noexcept;
 
-		/// \brief Perform glob
+		/// \brief Start glob
+		/// \param cwd_ Directory relative patterns are resolved against
 		/// \param pattern_ Glob pattern
-		bool glob (char const *pattern_) noexcept;
+		bool glob (std::string_view cwd_, char const *pattern_) noexcept;
 
 		/// \brief Get next glob result
-		/// \note returns nullptr when no more entries exist
+		/// \note returns nullptr when no more entries exist, or with errno set to EAGAIN when
+		/// GLOB_SCAN entries were examined without a match
 		char const *next () noexcept;
 
-	private:
 		/// \brief Clear glob
 		void clear () noexcept;
 
-		/// \brief Glob result
-		std::optional<glob_t> m_glob = std::nullopt;
-
-		/// \brief Result counter
-		unsigned m_offset = 0;
+	private:
+		/// \brief Directory being matched against a pattern component
+		struct Level
+		{
+			/// \brief Directory handle
+			fs::Dir dir;
+			/// \brief Pattern component entries are matched against
+			std::size_t component;
+			/// \brief Length of m_path up to this directory
+			std::size_t base;
+		};
+
+		/// \brief Append literal components to m_path and descend
+		/// \param component_ Next component to match
+		/// \returns whether m_path is a complete match
+		bool descend (std::size_t component_) noexcept;
+
+		/// \brief Pattern components
+		std::vector<std::string> m_components;
+
+		/// \brief Directories being enumerated
+		std::vector<Level> m_stack;
+
+		/// \brief Current path
+		std::string m_path;
+
+		/// \brief Length of the m_path prefix not part of the results
+		std::size_t m_prefix = 0;
+
+		/// \brief Whether a literal pattern is still to be returned
+		bool m_literal = false;
 	};
 
 	/// \brief Glob
 	Glob m_glob;
+
+	/// \brief Glob entry which didn't fit in the last batch
+	char const *m_pendingGlob = nullptr;
 #endif
 
 	/// \brief Directory transfer mode
 	XferDirMode m_xferDirMode;
 
 	/// \brief z-stream
-	std::unique_ptr<z_stream, int (*) (z_streamp)> m_zStream;
+	/// \note Checked out of the stream pool for each deflate transfer
+	zStreamPool::UniqueZStream m_zStream;
+
+#if FTPD_HAS_PARALLEL_DEFLATE
+	/// \brief Block-parallel deflate (used instead of m_zStream at higher levels)
+	UniqueParallelDeflate m_parallelDeflate;
+#endif
+
+	/// \brief Deflate level controller (only for the auto deflate level)
+	UniqueDeflateTuner m_deflateTuner;
+
+	/// \brief Per-session rate limiter
+	TokenBucket m_bucket;
+
+	/// \brief Deficit round robin credit in bytes
+	std::int64_t m_deficit = 0;
 
 	/// \brief Last activity timestamp
 	time_t m_timestamp;
@@ -378,6 +850,8 @@ private:
 	bool m_pasv : 1;
 	/// \brief Whether previous command was PORT
 	bool m_port : 1;
+	/// \brief Whether EPSV ALL locked the session to EPSV
+	bool m_epsvAll : 1;
 	/// \brief Whether receiving data
 	bool m_recv : 1;
 	/// \brief Whether sending data
@@ -390,6 +864,12 @@ private:
 	bool m_zFlushed : 1;
 	/// \brief Whether we finished reading data
 	bool m_eof : 1;
+	/// \brief Whether m_listing's compressed copy is replayed
+	bool m_listingDeflated : 1;
+	/// \brief Whether subdirectories are listed as well
+	bool m_listRecursive : 1;
+	/// \brief Whether the header of the current directory is still to be sent
+	bool m_listHeader : 1;
 
 	/// \brief Whether MLST type fact is enabled
 	bool m_mlstType : 1;
@@ -405,6 +885,26 @@ private:
 	/// \brief Whether emulating /dev/zero
 	bool m_devZero : 1;
 
+	/// \brief Whether any socket was ready in the last poll
+	bool m_ready : 1;
+
+	/// \brief Whether the transfer can make progress
+	bool m_xferReady : 1;
+
+	/// \brief Whether the transfer is waiting on the rate limit
+	bool m_throttled : 1;
+
+	/// \brief Whether a buffered command waits for the transfer to end
+	bool m_deferred : 1;
+
+	/// \brief Whether the session is hibernated
+	bool m_hibernated : 1;
+
+#ifndef __NDS__
+	/// \brief Whether the transfer is waiting on pipelined file I/O
+	bool m_ioWait : 1;
+#endif
+
 	/// \brief Abort a transfer
 	/// \param args_ Command arguments
 	void ABOR (char const *args_);
@@ -429,10 +929,22 @@ private:
 	/// \param args_ Command arguments
 	void DELE (char const *args_);
 
+	/// \brief Provide an extended address to connect to for data transfers
+	/// \param args_ Command arguments
+	void EPRT (char const *args_);
+
+	/// \brief Request an extended address to connect to for data transfers
+	/// \param args_ Command arguments
+	void EPSV (char const *args_);
+
 	/// \brief List server features
 	/// \param args_ Command arguments
 	void FEAT (char const *args_);
 
+	/// \brief Compute file checksum
+	/// \param args_ Command arguments
+	void HASH (char const *args_);
+
 	/// \brief Print server help
 	/// \param args_ Command arguments
 	void HELP (char const *args_);
@@ -493,6 +1005,10 @@ private:
 	/// \param args_ Command arguments
 	void QUIT (char const *args_);
 
+	/// \brief Set byte range for the next file transfer
+	/// \param args_ Command arguments
+	void RANG (char const *args_);
+
 	/// \brief Restart a file transfer
 	/// \param args_ Command arguments
 	void REST (char const *args_);
@@ -554,7 +1070,48 @@ private:
 	/// \param args_ Command arguments
 	void USER (char const *args_);
 
-	/// \brief Map of command handlers
-	static std::vector<std::pair<std::string_view, void (FtpSession::*) (char const *)>> const
-	    handlers;
+	/// \brief Compute file crc32
+	/// \param args_ Command arguments
+	void XCRC (char const *args_);
+
+	/// \brief Compute file MD5
+	/// \param args_ Command arguments
+	void XMD5 (char const *args_);
+
+	/// \brief Compute file SHA-1
+	/// \param args_ Command arguments
+	void XSHA1 (char const *args_);
+
+	/// \brief Compute file SHA-256
+	/// \param args_ Command arguments
+	void XSHA256 (char const *args_);
+
+	/// \brief Command flags
+	enum CommandFlag : unsigned
+	{
+		PRE_AUTH    = 1 << 0, ///< Allowed before login
+		DURING_XFER = 1 << 1, ///< Allowed during data transfer
+		KEEP_RENAME = 1 << 2, ///< Keeps the pending RNFR
+	};
+
+	/// \brief Command handler
+	struct Command
+	{
+		/// \brief Command verb
+		std::string_view name;
+
+		/// \brief Handler
+		void (FtpSession::*handler) (char const *);
+
+		/// \brief Command flags
+		unsigned flags;
+	};
+
+	/// \brief Command table and its perfect hash
+	struct CommandTable;
+
+	/// \brief Look up command
+	/// \param verb_ Command verb
+	/// \returns Command, or nullptr if there is none
+	static Command const *findCommand (std::string_view verb_);
 };
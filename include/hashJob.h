@@ -0,0 +1,157 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "checksum.h"
+#include "fs.h"
+
+#include <sys/stat.h>
+using stat_t = struct stat;
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class HashJob;
+using SharedHashJob = std::shared_ptr<HashJob>;
+
+/// \brief File checksum computed off the poll loop
+/// \note Runs on a background thread; on NDS the owner drives it with step (). Whole-file digests
+/// are added to the StatCache, keyed by the file's size and mtime.
+class HashJob : public std::enable_shared_from_this<HashJob>
+{
+public:
+	~HashJob ();
+
+	/// \brief Create checksum job
+	/// \param path_ Resolved path of the file
+	/// \param st_ File status
+	/// \param algorithm_ Algorithm
+	/// \param offset_ Offset to start hashing at
+	/// \param end_ Offset to stop hashing at
+	/// \param cache_ Whether to cache a whole-file digest
+	static SharedHashJob create (std::string path_,
+	    stat_t const &st_,
+	    checksum::Algorithm algorithm_,
+	    std::uint64_t offset_,
+	    std::uint64_t end_,
+	    bool cache_);
+
+#ifdef __NDS__
+	/// \brief Hash the next chunk on the calling thread
+	void step ();
+#endif
+
+	/// \brief Stop hashing as soon as possible
+	void cancel ();
+
+	/// \brief Whether the job has finished
+	bool done () const;
+
+	/// \brief Offset hashed up to so far
+	std::uint64_t position () const;
+
+	/// \brief Error from hashing, or 0
+	/// \note Only valid once done
+	int error () const;
+
+	/// \brief Lower-case hex digest
+	/// \note Only valid once done
+	std::string const &digest () const;
+
+	/// \brief Algorithm
+	checksum::Algorithm algorithm () const;
+
+	/// \brief Offset hashing started at
+	std::uint64_t offset () const;
+
+	/// \brief Offset hashing stops at
+	std::uint64_t end () const;
+
+private:
+	/// \brief Parameterized constructor
+	/// \param path_ Resolved path of the file
+	/// \param st_ File status
+	/// \param algorithm_ Algorithm
+	/// \param offset_ Offset to start hashing at
+	/// \param end_ Offset to stop hashing at
+	/// \param cache_ Whether to cache a whole-file digest
+	HashJob (std::string path_,
+	    stat_t const &st_,
+	    checksum::Algorithm algorithm_,
+	    std::uint64_t offset_,
+	    std::uint64_t end_,
+	    bool cache_);
+
+	/// \brief Hash the next chunk
+	/// \returns Whether there is more to do
+	bool process ();
+
+	/// \brief Finish the job
+	/// \param error_ Error, or 0
+	void finish (int error_);
+
+	/// \brief Resolved path of the file
+	std::string const m_path;
+
+	/// \brief File status when the job was created
+	stat_t const m_st;
+
+	/// \brief File being hashed
+	fs::File m_file;
+
+	/// \brief Read buffer
+	std::vector<unsigned char> m_buffer;
+
+	/// \brief Running checksum
+	checksum::Hasher m_hasher;
+
+	/// \brief Algorithm
+	checksum::Algorithm const m_algorithm;
+
+	/// \brief Offset hashing started at
+	std::uint64_t const m_offset;
+
+	/// \brief Offset hashing stops at
+	std::uint64_t const m_end;
+
+	/// \brief Offset hashed up to
+	std::atomic<std::uint64_t> m_position;
+
+	/// \brief Digest
+	std::string m_digest;
+
+	/// \brief Error from hashing
+	int m_error = 0;
+
+	/// \brief Whether to cache a whole-file digest
+	bool const m_cache;
+
+	/// \brief Whether the job was cancelled
+	std::atomic<bool> m_cancel = false;
+
+	/// \brief Whether the job has finished
+	std::atomic<bool> m_done = false;
+};
@@ -27,6 +27,8 @@
 
 /// \brief I/O buffer
 /// [unusable][usedArea][freeArea]
+/// \note Storage is recycled through a process-wide pool, so buffers which are only needed for
+/// part of their owner's lifetime can hand it back in between
 class IOBuffer
 {
 public:
@@ -34,7 +36,17 @@ public:
 
 	/// \brief Parameterized constructor
 	/// \param size_ Buffer size
-	IOBuffer (std::size_t size_);
+	/// \param acquire_ Whether to acquire storage now rather than on acquire ()
+	IOBuffer (std::size_t size_, bool acquire_ = true);
+
+	/// \brief Whether storage is held
+	bool acquired () const;
+
+	/// \brief Check out storage from the pool if not already held
+	void acquire ();
+
+	/// \brief Return storage to the pool; usedArea becomes empty
+	void release ();
 
 	/// \brief Get pointer to writable area
 	char *freeArea () const;
@@ -76,6 +88,10 @@ public:
 	/// [usedArea][freeArea++++++++++]
 	void coalesce ();
 
+	/// \brief Exchange contents with another buffer of the same capacity
+	/// \param that_ Buffer to exchange with
+	void swap (IOBuffer &that_);
+
 private:
 	/// \brief Buffer
 	std::unique_ptr<char[]> m_buffer;
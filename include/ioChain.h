@@ -0,0 +1,88 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "ioBuffer.h"
+
+#include <cstddef>
+#include <deque>
+
+/// \brief Chain of I/O buffer segments
+/// [segment][segment][segment]
+/// \note Producers fill the last segment and consumers drain the first one, so stages of
+/// different sizes can hand data off without compacting or copying it into one flat buffer.
+/// Segment storage comes from the IOBuffer pool and goes back as soon as a segment is drained.
+class IOChain
+{
+public:
+	~IOChain ();
+
+	/// \brief Parameterized constructor
+	/// \param segmentSize_ Size of each segment
+	/// \param maxSegments_ Maximum number of segments
+	IOChain (std::size_t segmentSize_, std::size_t maxSegments_);
+
+	/// \brief Get segment to produce into
+	/// \returns Last segment if it has free space, otherwise a new segment, or nullptr if the
+	/// chain is full
+	IOBuffer *tail ();
+
+	/// \brief Get empty segment to produce into
+	/// \returns Last segment if it is empty, otherwise a new segment, or nullptr if the chain is
+	/// full
+	IOBuffer *extend ();
+
+	/// \brief Produce data to the end of the last segment
+	/// \param size_ Size to produce
+	void markUsed (std::size_t size_);
+
+	/// \brief Consume data from the beginning of the chain
+	/// \param size_ Size to consume
+	void markFree (std::size_t size_);
+
+	/// \brief Get total size of readable data
+	std::size_t usedSize () const;
+
+	/// \brief Whether there is no readable data
+	bool empty () const;
+
+	/// \brief Number of segments
+	std::size_t segments () const;
+
+	/// \brief Get segment
+	/// \param index_ Segment index
+	IOBuffer &segment (std::size_t index_);
+
+	/// \brief Clear chain; storage is returned to the pool
+	void clear ();
+
+private:
+	/// \brief Segments
+	std::deque<IOBuffer> m_segments;
+
+	/// \brief Size of each segment
+	std::size_t const m_segmentSize;
+
+	/// \brief Maximum number of segments
+	std::size_t const m_maxSegments;
+};
@@ -0,0 +1,127 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "platform.h"
+
+#include <cstddef>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// \brief Shared LRU cache of rendered directory listings
+/// \note Entries are keyed by resolved directory path and a variant describing how the listing
+/// was rendered. They are dropped when the directory's mtime changes or a server-side mutation
+/// invalidates them; anything changed behind our back is seen again once the entry outlives the
+/// TTL
+class ListingCache
+{
+public:
+	/// \brief Rendered listing
+	struct Listing
+	{
+		/// \brief Resolved directory path
+		std::string path;
+
+		/// \brief Rendering variant (mode and facts)
+		unsigned variant = 0;
+
+		/// \brief Directory mtime when rendered
+		std::time_t mtime = 0;
+
+		/// \brief Rendered listing
+		std::vector<char> data;
+
+		/// \brief Complete zlib stream of data, if any
+		std::vector<char> deflated;
+
+		/// \brief Compression level of deflated
+		int level = 0;
+	};
+
+	using SharedListing = std::shared_ptr<Listing const>;
+
+	/// \brief Largest listing which is cached
+	static std::size_t maxSize ();
+
+	/// \brief Get the cache shared by all sessions
+	static ListingCache &instance ();
+
+	/// \brief Look up cached listing
+	/// \param path_ Resolved directory path
+	/// \param variant_ Rendering variant
+	/// \param mtime_ Current directory mtime
+	/// \param ttl_ Maximum entry age in seconds
+	/// \returns Fresh listing, or nullptr
+	SharedListing
+	    lookup (std::string_view path_, unsigned variant_, std::time_t mtime_, unsigned ttl_);
+
+	/// \brief Insert listing
+	/// \param listing_ Listing to insert; replaces any entry with the same path and variant
+	void insert (SharedListing listing_);
+
+	/// \brief Invalidate path, its parent directory and anything below it
+	/// \param path_ Resolved path
+	void invalidate (std::string_view path_);
+
+	/// \brief Remove all entries
+	void clear ();
+
+private:
+	/// \brief Cache entry
+	struct Entry
+	{
+		/// \brief Insertion timestamp
+		platform::steady_clock::time_point time;
+
+		/// \brief Listing
+		SharedListing listing;
+	};
+
+	ListingCache ();
+
+	/// \brief Evict least recently used entries until there is room
+	/// \param size_ Size to make room for
+	/// \note Must be called with m_lock held
+	void evict (std::size_t size_);
+
+	/// \brief Remove entry
+	/// \param it_ Entry to remove
+	/// \note Must be called with m_lock held
+	std::list<Entry>::iterator erase (std::list<Entry>::iterator it_);
+
+#ifndef __NDS__
+	/// \brief Mutex
+	platform::Mutex m_lock;
+#endif
+
+	/// \brief Entries from most to least recently used
+	/// \note There are few enough entries that a linear search is cheaper than indexing them
+	std::list<Entry> m_lru;
+
+	/// \brief Total size of cached listings
+	std::size_t m_size = 0;
+};
@@ -28,6 +28,7 @@
 #include "sockAddr.h"
 #include "socket.h"
 
+#include <chrono>
 #include <cstddef>
 
 namespace mdns
@@ -36,5 +37,7 @@ void setHostname (std::string hostname_);
 
 UniqueSocket createSocket ();
 
-void handleSocket (Socket *socket_, SockAddr const &addr_);
+void handleSocket (Socket *socket_, SockAddr const &addr_, SockAddr const *addr6_ = nullptr);
+
+std::chrono::milliseconds timeout ();
 }
@@ -0,0 +1,169 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#if defined(__NDS__) || defined(__3DS__)
+#define FTPD_HAS_PARALLEL_DEFLATE 0
+#else
+#define FTPD_HAS_PARALLEL_DEFLATE 1
+#endif
+
+#if FTPD_HAS_PARALLEL_DEFLATE
+#include "codec.h"
+#include "ioBuffer.h"
+#include "platform.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+class ParallelDeflate;
+using UniqueParallelDeflate = std::unique_ptr<ParallelDeflate>;
+
+/// \brief Block-parallel deflate
+/// \note Input is split into independent blocks which are compressed on the compression threads,
+/// each primed with the tail of the previous block as its dictionary. The blocks end on byte
+/// boundaries, so concatenating them inside a zlib header and trailer yields one valid stream.
+/// Blocks that would grow are sent as stored blocks instead. With libdeflate, input that fits in
+/// a single block is compressed in one shot.
+class ParallelDeflate
+{
+public:
+	/// \brief Compression statistics
+	struct Stats
+	{
+		/// \brief Uncompressed bytes
+		std::size_t in = 0;
+
+		/// \brief Compressed bytes
+		std::size_t out = 0;
+
+		/// \brief Compressor time spent
+		platform::steady_clock::duration duration{};
+	};
+
+	~ParallelDeflate ();
+
+	/// \brief Create parallel deflate
+	/// \param level_ Compression level
+	static UniqueParallelDeflate create (int level_);
+
+	/// \brief Queue input data
+	/// \param buffer_ Input data; consumed data is marked free
+	/// \returns Number of bytes consumed, or -1 (EWOULDBLOCK if too many blocks are in flight)
+	std::make_signed_t<std::size_t> write (IOBuffer &buffer_);
+
+	/// \brief Mark end of input
+	void finish ();
+
+	/// \brief Read compressed data
+	/// \param buffer_ Output buffer
+	/// \returns Number of bytes read, 0 once the stream is complete, or -1 (EWOULDBLOCK if the
+	/// next block isn't compressed yet)
+	std::make_signed_t<std::size_t> read (IOBuffer &buffer_);
+
+	/// \brief Whether read would not block
+	bool ready () const;
+
+	/// \brief Whether write would not block
+	bool writable () const;
+
+	/// \brief Set compression level
+	/// \param level_ Compression level for blocks not yet submitted
+	void setLevel (int level_);
+
+	/// \brief Hint total input size
+	/// \param size_ Expected number of bytes to be written
+	/// \note Must be called before the first write; input small enough to be compressed in one
+	/// shot is kept in a single block
+	void sizeHint (std::uint64_t size_);
+
+	/// \brief Get and clear statistics of blocks read since the last call
+	Stats takeStats ();
+
+	/// \brief Number of compression threads
+	static unsigned threads ();
+
+private:
+	/// \brief Compressed block
+	struct Block;
+
+	/// \brief Block size
+	constexpr static std::size_t BLOCK_SIZE = 128 * 1024;
+
+	/// \brief Dictionary size
+	constexpr static std::size_t DICT_SIZE = 32 * 1024;
+
+#if FTPD_HAS_LIBDEFLATE
+	/// \brief Largest input compressed in one shot
+	constexpr static std::size_t WHOLE_SIZE = 1024 * 1024;
+#endif
+
+	/// \brief Parameterized constructor
+	/// \param level_ Compression level
+	ParallelDeflate (int level_);
+
+	/// \brief Submit block being filled
+	/// \param last_ Whether this is the final block
+	void submit (bool last_);
+
+	/// \brief Compression level
+	int m_level;
+
+	/// \brief Maximum number of blocks in flight
+	std::size_t const m_maxBlocks;
+
+	/// \brief Input size of each block
+	std::size_t m_blockSize = BLOCK_SIZE;
+
+	/// \brief Blocks in stream order
+	std::deque<std::shared_ptr<Block>> m_blocks;
+
+	/// \brief Block being filled
+	std::shared_ptr<Block> m_fill;
+
+	/// \brief Output header/trailer
+	std::vector<unsigned char> m_extra;
+
+	/// \brief Read position in m_extra
+	std::size_t m_extraPos = 0;
+
+	/// \brief Read position in front block output
+	std::size_t m_outPos = 0;
+
+	/// \brief Statistics of blocks read
+	Stats m_stats;
+
+	/// \brief Running adler32 of the input
+	std::uint32_t m_adler;
+
+	/// \brief Whether finish() was called
+	bool m_finished : 1;
+
+	/// \brief Whether the trailer was queued
+	bool m_trailer : 1;
+};
+#endif
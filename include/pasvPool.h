@@ -0,0 +1,103 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "platform.h"
+#include "sockAddr.h"
+#include "socket.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class PasvPool;
+using UniquePasvPool = std::unique_ptr<PasvPool>;
+
+/// \brief Server-wide pool of bound passive data listeners
+/// \note A listener is leased to a session for one PASV/EPSV and returned once the data
+/// connection is accepted (or abandoned), so back-to-back transfers skip the socket setup and
+/// don't wander into ports still in TIME_WAIT
+class PasvPool
+{
+public:
+	~PasvPool ();
+
+	/// \brief Create pool
+	static UniquePasvPool create ();
+
+	/// \brief Lease a listener
+	/// \param addr_ Local address of the command connection (port is ignored)
+	/// \param bufferSize_ Data socket buffer size; 0 keeps the system default
+	/// \param minPort_ Lowest port; 0 for an ephemeral port
+	/// \param maxPort_ Highest port; 0 for an ephemeral port
+	/// \returns nullptr on error; check errno
+	/// \note Connections which queued while the listener was idle are dropped
+	UniqueSocket lease (SockAddr const &addr_,
+	    unsigned bufferSize_,
+	    std::uint16_t minPort_,
+	    std::uint16_t maxPort_);
+
+	/// \brief Return a listener for reuse
+	/// \param socket_ Listener from lease
+	/// \note Connections waiting on the listener are dropped
+	void release (UniqueSocket socket_);
+
+	/// \brief Close all idle listeners
+	void clear ();
+
+private:
+	PasvPool ();
+
+	/// \brief Drop connections waiting on a listener
+	/// \param socket_ Listener to drain
+	/// \returns Whether the listener is still usable
+	static bool drain (Socket &socket_);
+
+	/// \brief Bind a new listener
+	/// \param addr_ Local address
+	/// \param bufferSize_ Data socket buffer size; 0 keeps the system default
+	/// \param minPort_ Lowest port; 0 for an ephemeral port
+	/// \param maxPort_ Highest port; 0 for an ephemeral port
+	UniqueSocket
+	    bind (SockAddr addr_, unsigned bufferSize_, std::uint16_t minPort_, std::uint16_t maxPort_);
+
+#ifndef __NDS__
+	/// \brief Mutex
+	platform::Mutex m_lock;
+#endif
+
+	/// \brief Idle listeners, most recently returned last
+	std::vector<UniqueSocket> m_idle;
+
+	/// \brief Buffer size the idle listeners were tuned with
+	unsigned m_bufferSize = 0;
+
+	/// \brief Lowest port of the range the idle listeners were bound in
+	std::uint16_t m_minPort = 0;
+
+	/// \brief Highest port of the range the idle listeners were bound in
+	std::uint16_t m_maxPort = 0;
+
+	/// \brief Next port tried in the configured range
+	std::uint16_t m_nextPort = 0;
+};
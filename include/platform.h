@@ -33,10 +33,12 @@
 #endif
 
 #include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <memory>
 #include <string>
+#include <type_traits>
 
 #ifdef CLASSIC
 extern PrintConsole g_statusConsole;
@@ -77,6 +79,9 @@ bool networkAddress (SockAddr &addr_);
 /// \brief Get hostname
 std::string const &hostname ();
 
+/// \brief Get heap memory still available for allocation in bytes
+std::size_t freeMemory ();
+
 /// \brief Platform loop
 bool loop ();
 
@@ -113,6 +118,191 @@ struct steady_clock
 using steady_clock = std::chrono::steady_clock;
 #endif
 
+#ifdef __3DS__
+/// \brief sdmc directory read in large batches
+/// \note Entries come from FSDIR_Read a batch at a time instead of one devoptab call each.
+/// Modification times take a slow FS service call per entry, so when wanted they are fetched on a
+/// worker thread while the caller keeps serving other sessions.
+class ArchiveDir
+{
+public:
+	~ArchiveDir ();
+
+	/// \brief Open directory
+	/// \param path_ Path on sdmc
+	/// \returns nullptr on error
+	static std::unique_ptr<ArchiveDir> open (char const *path_);
+
+	/// \brief Fetch modification times of the entries ahead of reading them
+	void fetchMTimes ();
+
+	/// \brief Read next entry
+	/// \param[out] name_ UTF-8 name
+	/// \param size_ Size of name_
+	/// \returns false at the end of the directory or on error; errno is EWOULDBLOCK while the
+	/// entry's modification time is still being fetched
+	bool read (char *name_, std::size_t size_);
+
+	/// \brief Whether read would not block
+	bool ready () const;
+
+	/// \brief Get last entry read
+	FS_DirectoryEntry const &entry () const;
+
+	/// \brief Get modification time of last entry read
+	/// \param[out] mtime_ Modification time
+	/// \returns false if it wasn't fetched
+	bool mtime (std::uint64_t &mtime_) const;
+
+private:
+	/// \brief Batch of entries
+	struct Batch;
+
+	/// \brief Parameterized constructor
+	/// \param handle_ Directory handle
+	/// \param path_ Directory path ending in '/'
+	ArchiveDir (Handle handle_, std::string path_);
+
+	/// \brief Start fetching modification times of the current batch
+	void submit ();
+
+	/// \brief Directory handle
+	Handle const m_handle;
+
+	/// \brief Directory path ending in '/'
+	std::string const m_path;
+
+	/// \brief Current batch
+	std::shared_ptr<Batch> m_batch;
+
+	/// \brief Index of next entry in m_batch
+	std::size_t m_index = 0;
+
+	/// \brief Whether modification times are fetched
+	bool m_fetchMTimes = false;
+
+	/// \brief Whether FSDIR_Read reached the end
+	bool m_end = false;
+};
+#endif
+
+#ifdef __SWITCH__
+/// \brief File on an fsdev device, accessed through FsFile instead of stdio
+/// \note Reads and writes go straight to the FS service with the caller's buffer, without the
+/// devoptab lock and the stdio copies
+class NxFile
+{
+public:
+	~NxFile ();
+
+	/// \brief Open file
+	/// \param path_ Path to open
+	/// \param mode_ Access mode (\sa std::fopen); only binary modes are supported
+	/// \returns nullptr if the path isn't on an fsdev device or can't be opened
+	static std::unique_ptr<NxFile> open (char const *path_, char const *mode_);
+
+	/// \brief Read data at the file position
+	/// \param buffer_ Output buffer
+	/// \param size_ Size to read
+	std::make_signed_t<std::size_t> read (void *buffer_, std::size_t size_);
+
+	/// \brief Read data at an offset
+	/// \param buffer_ Output buffer
+	/// \param size_ Size to read
+	/// \param offset_ File offset
+	/// \note The file position is not changed
+	std::make_signed_t<std::size_t>
+	    readAt (void *buffer_, std::size_t size_, std::uint64_t offset_);
+
+	/// \brief Write data at the file position
+	/// \param buffer_ Input data
+	/// \param size_ Size to write
+	std::make_signed_t<std::size_t> write (void const *buffer_, std::size_t size_);
+
+	/// \brief Write data at an offset
+	/// \param buffer_ Input data
+	/// \param size_ Size to write
+	/// \param offset_ File offset
+	/// \note The file position is not changed
+	std::make_signed_t<std::size_t>
+	    writeAt (void const *buffer_, std::size_t size_, std::uint64_t offset_);
+
+	/// \brief Seek to file position
+	/// \param pos_ File position
+	/// \param origin_ Reference position (\sa std::fseek)
+	bool seek (std::int64_t pos_, int origin_);
+
+	/// \brief Get file position
+	std::uint64_t tell () const;
+
+	/// \brief Flush written data to storage
+	bool flush ();
+
+	/// \brief Get file size
+	/// \param[out] size_ File size
+	bool size (std::uint64_t &size_);
+
+	/// \brief Set file size
+	/// \param size_ File size
+	/// \note Growing the file allocates it up front
+	bool setSize (std::uint64_t size_);
+
+private:
+	/// \brief Parameterized constructor
+	/// \param file_ File handle
+	/// \param offset_ File position
+	NxFile (FsFile file_, std::uint64_t offset_);
+
+	NxFile (NxFile const &that_) = delete;
+
+	NxFile &operator= (NxFile const &that_) = delete;
+
+	/// \brief File handle
+	FsFile m_file;
+
+	/// \brief File position
+	std::uint64_t m_offset;
+};
+
+/// \brief Directory on an fsdev device read in large batches
+/// \note Entries come from fsDirRead a batch at a time instead of one devoptab call each
+class NxDir
+{
+public:
+	~NxDir ();
+
+	/// \brief Open directory
+	/// \param path_ Path to open
+	/// \returns nullptr if the path isn't on an fsdev device or can't be opened
+	static std::unique_ptr<NxDir> open (char const *path_);
+
+	/// \brief Read next entry
+	/// \returns nullptr at the end of the directory or on error; check errno
+	FsDirectoryEntry const *read ();
+
+private:
+	/// \brief Parameterized constructor
+	/// \param dir_ Directory handle
+	NxDir (FsDir dir_);
+
+	NxDir (NxDir const &that_) = delete;
+
+	NxDir &operator= (NxDir const &that_) = delete;
+
+	/// \brief Directory handle
+	FsDir m_dir;
+
+	/// \brief Current batch
+	std::unique_ptr<FsDirectoryEntry[]> m_entries;
+
+	/// \brief Number of entries in m_entries
+	std::size_t m_count = 0;
+
+	/// \brief Index of next entry in m_entries
+	std::size_t m_index = 0;
+};
+#endif
+
 #ifndef __NDS__
 /// \brief Platform thread
 class Thread
@@ -164,6 +354,26 @@ public:
 	/// \brief Unlock mutex
 	void unlock ();
 
+private:
+	class privateData_t;
+
+	/// \brief pimpl
+	std::unique_ptr<privateData_t> m_d;
+};
+
+/// \brief Platform counting semaphore
+class Semaphore
+{
+public:
+	~Semaphore ();
+	Semaphore ();
+
+	/// \brief Increment count, waking one waiter
+	void post ();
+
+	/// \brief Wait for count to be non-zero, then decrement it
+	void wait ();
+
 private:
 	class privateData_t;
 
@@ -0,0 +1,151 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "socket.h"
+
+#if __has_include(<sys/epoll.h>)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define FTPD_HAS_EPOLL 1
+#else
+#define FTPD_HAS_EPOLL 0
+#endif
+
+#if !FTPD_HAS_EPOLL && __has_include(<sys/event.h>)
+#include <sys/event.h>
+#define FTPD_HAS_KQUEUE 1
+#else
+#define FTPD_HAS_KQUEUE 0
+#endif
+
+#ifdef __NDS__
+#define FTPD_HAS_POLLER_WAKE 0
+#else
+#define FTPD_HAS_POLLER_WAKE 1
+#endif
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class Poller;
+using UniquePoller = std::unique_ptr<Poller>;
+
+/// \brief Persistent socket event registry
+/// \note Uses epoll or kqueue where available, otherwise poll with a loopback socket for wakeups
+class Poller
+{
+public:
+	/// \brief Ready event
+	struct Event
+	{
+		/// \brief Ready socket
+		/// \note Only use for comparison; the socket may be closed by an earlier event
+		Socket const *socket;
+
+		/// \brief Registration owner
+		void *owner;
+
+		/// \brief Output events
+		int revents;
+	};
+
+	~Poller ();
+
+	/// \brief Create poller
+	static UniquePoller create ();
+
+	/// \brief Update socket registration
+	/// \param socket_ Socket to register
+	/// \param events_ Input events; 0 removes the registration
+	/// \param owner_ Registration owner
+	/// \note This is a no-op if the registration is unchanged
+	bool update (Socket &socket_, int events_, void *owner_);
+
+	/// \brief Remove socket registration
+	/// \param socket_ Socket to remove
+	void remove (Socket &socket_);
+
+	/// \brief Wait for events
+	/// \param timeout_ Wait timeout; negative waits until an event or wakeup
+	/// \returns Number of ready events, or -1 on error
+	int wait (std::chrono::milliseconds timeout_);
+
+	/// \brief Ready events from last wait
+	std::vector<Event> const &events () const;
+
+#if FTPD_HAS_POLLER_WAKE
+	/// \brief Interrupt a wait from another thread
+	/// \note The interrupted wait returns without events
+	void wake ();
+#endif
+
+private:
+	Poller ();
+
+	Poller (Poller const &that_) = delete;
+
+	Poller (Poller &&that_) = delete;
+
+	Poller &operator= (Poller const &that_) = delete;
+
+	Poller &operator= (Poller &&that_) = delete;
+
+#if FTPD_HAS_EPOLL
+	/// \brief epoll fd
+	int m_fd = -1;
+
+	/// \brief epoll output events
+	std::vector<epoll_event> m_epollEvents;
+
+	/// \brief eventfd which interrupts a wait
+	int m_wakeFd = -1;
+#elif FTPD_HAS_KQUEUE
+	/// \brief kqueue fd
+	int m_fd = -1;
+
+	/// \brief kqueue output events
+	std::vector<struct kevent> m_kevents;
+#else
+	/// \brief Registered poll fds (parallel to m_sockets)
+	/// \note The wakeup socket is appended for the duration of a wait
+	std::vector<pollfd> m_pollFds;
+
+#if FTPD_HAS_POLLER_WAKE
+	/// \brief Datagram socket connected to itself which interrupts a wait
+	int m_wakeFd = -1;
+#endif
+#endif
+
+	/// \brief Registered sockets
+	/// \note Unregistered on destruction so they never reach back into a freed poller
+	std::vector<Socket *> m_sockets;
+
+	/// \brief Number of registered sockets
+	std::size_t m_count = 0;
+
+	/// \brief Ready events from last wait
+	std::vector<Event> m_events;
+};
@@ -23,9 +23,12 @@
 #pragma once
 
 #include "ioBuffer.h"
+#include "ioChain.h"
 #include "sockAddr.h"
+#include "stats.h"
 
 #include <chrono>
+#include <cstdint>
 #include <memory>
 
 #ifdef __NDS__
@@ -49,6 +52,21 @@ extern "C" int poll (pollfd *fds_, nfds_t nfds_, int timeout_);
 #include <poll.h>
 #endif
 
+#if defined(__NDS__) || defined(__3DS__)
+#define FTPD_HAS_SENDMSG 0
+#else
+#define FTPD_HAS_SENDMSG 1
+#endif
+
+#if __has_include(<sys/sendfile.h>)
+#include <sys/sendfile.h>
+#define FTPD_HAS_SENDFILE 1
+#else
+#define FTPD_HAS_SENDFILE 0
+#endif
+
+class Poller;
+
 class Socket;
 using UniqueSocket = std::unique_ptr<Socket>;
 using SharedSocket = std::shared_ptr<Socket>;
@@ -96,6 +114,10 @@ public:
 	/// \param backlog_ Queue size for incoming connections
 	bool listen (int backlog_);
 
+	/// \brief Remove the poller registration
+	/// \note Lets the socket be registered with another poller
+	void detach ();
+
 	/// \brief Shutdown socket
 	/// \param how_ Type of shutdown (\sa ::shutdown)
 	bool shutdown (int how_);
@@ -113,6 +135,13 @@ public:
 	/// \param reuse_ Whether to reuse address
 	bool setReuseAddress (bool reuse_ = true);
 
+#ifndef NO_IPV6
+	/// \brief Restrict IPv6 socket to IPv6 traffic
+	/// \param v6Only_ Whether to refuse IPv4-mapped addresses
+	/// \note Lets an IPv4 socket share the port
+	bool setV6Only (bool v6Only_ = true);
+#endif
+
 	/// \brief Set recv buffer size
 	/// \param size_ Buffer size
 	bool setRecvBufferSize (std::size_t size_);
@@ -121,6 +150,24 @@ public:
 	/// \param size_ Buffer size
 	bool setSendBufferSize (std::size_t size_);
 
+	/// \brief Set recv low watermark
+	/// \param size_ Bytes which must be queued before the socket polls readable
+	bool setRecvLowWatermark (std::size_t size_);
+
+	/// \brief Disable Nagle's algorithm
+	/// \param noDelay_ Whether to send partial segments immediately
+	bool setNoDelay (bool noDelay_ = true);
+
+	/// \brief Hold back partial segments until uncorked
+	/// \param cork_ Whether to cork
+	/// \note Uncorking flushes any held back data
+	bool setCork (bool cork_);
+
+	/// \brief Set keepalive option
+	/// \param enable_ Whether to enable keepalive
+	/// \param idle_ Idle time before the first probe; 0 keeps the system default
+	bool setKeepAlive (bool enable_, std::chrono::seconds idle_);
+
 #ifndef __NDS__
 	/// \brief Join multicast group
 	/// \param addr_ Multicast group address
@@ -153,12 +200,19 @@ public:
 	/// \brief Write data
 	/// \param buffer_ Input buffer
 	/// \param size_ Size to write
-	std::make_signed_t<std::size_t> write (void const *buffer_, std::size_t size_);
+	/// \param more_ Hint that more data follows shortly (holds back a partial segment)
+	std::make_signed_t<std::size_t>
+	    write (void const *buffer_, std::size_t size_, bool more_ = false);
 
 	/// \brief Write data
 	/// \param buffer_ Input buffer
-	/// \param size_ Size to write
-	std::make_signed_t<std::size_t> write (IOBuffer &buffer_);
+	/// \param more_ Hint that more data follows shortly (holds back a partial segment)
+	std::make_signed_t<std::size_t> write (IOBuffer &buffer_, bool more_ = false);
+
+	/// \brief Write data
+	/// \param chain_ Input buffers; sent together where the platform can gather them
+	/// \param more_ Hint that more data follows shortly (holds back a partial segment)
+	std::make_signed_t<std::size_t> write (IOChain &chain_, bool more_ = false);
 
 	/// \brief Write data
 	/// \param buffer_ Input buffer
@@ -167,6 +221,21 @@ public:
 	std::make_signed_t<std::size_t>
 	    writeTo (void const *buffer_, std::size_t size_, SockAddr const &addr_);
 
+#if FTPD_HAS_SENDFILE
+	/// \brief Write data directly from a file
+	/// \param fd_ Input file descriptor
+	/// \param[in,out] offset_ File offset; advanced by the amount written
+	/// \param size_ Size to write
+	/// \note The file's own position is not changed
+	std::make_signed_t<std::size_t> sendFile (int fd_, off_t &offset_, std::size_t size_);
+#endif
+
+	/// \brief Number of bytes sent and received
+	std::uint64_t bytes () const;
+
+	/// \brief I/O counters
+	stats::IO const &io () const;
+
 	/// \brief Local name
 	SockAddr const &sockName () const;
 	/// \brief Peer name
@@ -174,7 +243,8 @@ public:
 
 	/// \brief Create socket
 	/// \param type_ Socket type
-	static UniqueSocket create (Type type_);
+	/// \param domain_ Socket domain
+	static UniqueSocket create (Type type_, SockAddr::Domain domain_ = SockAddr::Domain::IPv4);
 
 	/// \brief Poll sockets
 	/// \param info_ Poll info
@@ -211,9 +281,26 @@ private:
 	/// \param Socket fd
 	int const m_fd;
 
+	/// \param I/O counters
+	stats::IO m_io;
+
 	/// \param Whether listening
 	bool m_listening : 1;
 
 	/// \param Whether connected
 	bool m_connected : 1;
+
+	/// \brief Poller this socket is registered with
+	Poller *m_poller = nullptr;
+
+	/// \brief Poller registration owner
+	void *m_pollOwner = nullptr;
+
+	/// \brief Poller registration events
+	int m_pollEvents = 0;
+
+	/// \brief Poller registration index
+	std::size_t m_pollIndex = 0;
+
+	friend class Poller;
 };
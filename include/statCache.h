@@ -0,0 +1,154 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "checksum.h"
+#include "platform.h"
+
+#include <sys/stat.h>
+using stat_t = struct stat;
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/// \brief Shared LRU cache of stat results keyed by resolved path
+/// \note Server-side mutations invalidate entries; anything changed behind our back is seen again
+/// once its entry outlives the TTL. File digests are kept alongside; they don't expire, but are
+/// checked against the file's size and mtime.
+class StatCache
+{
+public:
+	/// \brief Get the cache shared by all sessions
+	static StatCache &instance ();
+
+	/// \brief Look up cached stat
+	/// \param path_ Resolved path
+	/// \param follow_ Whether symlinks are followed (stat rather than lstat)
+	/// \param ttl_ Maximum entry age in seconds
+	/// \param st_ Output stat
+	/// \returns Whether a fresh entry was found
+	bool lookup (std::string_view path_, bool follow_, unsigned ttl_, stat_t &st_);
+
+	/// \brief Insert stat result
+	/// \param path_ Resolved path
+	/// \param follow_ Whether symlinks were followed (stat rather than lstat)
+	/// \param st_ Stat result
+	void insert (std::string_view path_, bool follow_, stat_t const &st_);
+
+	/// \brief Look up cached file digest
+	/// \param path_ Resolved path
+	/// \param algorithm_ Checksum algorithm
+	/// \param st_ Current file status
+	/// \param digest_ Output digest
+	/// \returns Whether a digest of this size and mtime was found
+	bool lookupDigest (std::string_view path_,
+	    checksum::Algorithm algorithm_,
+	    stat_t const &st_,
+	    std::string &digest_);
+
+	/// \brief Insert file digest
+	/// \param path_ Resolved path
+	/// \param algorithm_ Checksum algorithm
+	/// \param st_ File status the digest was computed for
+	/// \param digest_ Digest
+	void insertDigest (std::string_view path_,
+	    checksum::Algorithm algorithm_,
+	    stat_t const &st_,
+	    std::string digest_);
+
+	/// \brief Invalidate path, its parent directory and anything below it
+	/// \param path_ Resolved path
+	void invalidate (std::string_view path_);
+
+	/// \brief Remove all entries
+	void clear ();
+
+private:
+	/// \brief Cached file digest
+	struct Digest
+	{
+		/// \brief Checksum algorithm
+		checksum::Algorithm algorithm;
+
+		/// \brief File size
+		off_t size;
+
+		/// \brief File mtime
+		time_t mtime;
+
+		/// \brief Digest
+		std::string value;
+	};
+
+	/// \brief Cache entry
+	struct Entry
+	{
+		/// \brief Resolved path
+		std::string path;
+
+		/// \brief Insertion timestamp
+		platform::steady_clock::time_point time;
+
+		/// \brief stat result
+		stat_t stat;
+
+		/// \brief lstat result
+		stat_t lstat;
+
+		/// \brief File digests
+		std::vector<Digest> digests;
+
+		/// \brief Whether stat is valid
+		bool hasStat : 1;
+
+		/// \brief Whether lstat is valid
+		bool hasLStat : 1;
+	};
+
+	StatCache ();
+
+	/// \brief Find or create entry, and make it the most recently used
+	/// \param path_ Resolved path
+	/// \note Must be called with m_lock held
+	Entry &touch (std::string_view path_);
+
+	/// \brief Remove entry
+	/// \param path_ Resolved path
+	/// \note Must be called with m_lock held
+	void erase (std::string_view path_);
+
+#ifndef __NDS__
+	/// \brief Mutex
+	platform::Mutex m_lock;
+#endif
+
+	/// \brief Entries from most to least recently used
+	std::list<Entry> m_lru;
+
+	/// \brief Entries by path
+	std::unordered_map<std::string_view, std::list<Entry>::iterator> m_entries;
+};
@@ -0,0 +1,209 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "platform.h"
+
+#ifndef __NDS__
+#include <atomic>
+#endif
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace stats
+{
+/// \brief Event counter
+/// \note Updated with relaxed atomics; readers only need an eventually consistent view
+class Counter
+{
+public:
+	/// \brief Add to counter
+	/// \param value_ Value to add
+	void add (std::uint64_t const value_ = 1)
+	{
+#ifdef __NDS__
+		m_value += value_;
+#else
+		m_value.fetch_add (value_, std::memory_order_relaxed);
+#endif
+	}
+
+	/// \brief Get counter value
+	std::uint64_t load () const
+	{
+#ifdef __NDS__
+		return m_value;
+#else
+		return m_value.load (std::memory_order_relaxed);
+#endif
+	}
+
+	/// \brief Reset counter
+	void reset ()
+	{
+#ifdef __NDS__
+		m_value = 0;
+#else
+		m_value.store (0, std::memory_order_relaxed);
+#endif
+	}
+
+private:
+#ifdef __NDS__
+	/// \brief Counter value
+	std::uint64_t m_value = 0;
+#else
+	/// \brief Counter value
+	std::atomic<std::uint64_t> m_value = 0;
+#endif
+};
+
+/// \brief Socket I/O counters
+/// \note Each socket is only used by one thread, so these are plain integers
+struct IO
+{
+	/// \brief Add counters
+	/// \param that_ Counters to add
+	IO &operator+= (IO const &that_);
+
+	/// \brief Bytes received
+	std::uint64_t bytesIn = 0;
+
+	/// \brief Bytes sent
+	std::uint64_t bytesOut = 0;
+
+	/// \brief Send/receive calls
+	std::uint64_t syscalls = 0;
+
+	/// \brief Sends which wrote less than requested
+	std::uint64_t shortWrites = 0;
+
+	/// \brief Calls which failed with EWOULDBLOCK
+	std::uint64_t wouldBlock = 0;
+};
+
+/// \brief Server-wide counters
+struct Global
+{
+	/// \brief Bytes received
+	Counter bytesIn;
+
+	/// \brief Bytes sent
+	Counter bytesOut;
+
+	/// \brief Send/receive calls
+	Counter syscalls;
+
+	/// \brief Sends which wrote less than requested
+	Counter shortWrites;
+
+	/// \brief Calls which failed with EWOULDBLOCK
+	Counter wouldBlock;
+
+	/// \brief Poller waits
+	Counter polls;
+
+	/// \brief Events returned by poller waits
+	Counter pollEvents;
+
+	/// \brief Data transfers started
+	Counter transfers;
+
+	/// \brief Nanoseconds spent in deflate
+	Counter deflateTime;
+
+	/// \brief Nanoseconds spent in inflate
+	Counter inflateTime;
+
+	/// \brief Directory listings started
+	Counter listings;
+
+	/// \brief stat/lstat calls which missed the stat cache
+	Counter statCalls;
+
+	/// \brief Directory listings served from the listing cache
+	Counter listingHits;
+
+	/// \brief File checksums requested
+	Counter hashes;
+
+	/// \brief File checksums served from the stat cache
+	Counter hashHits;
+
+	/// \brief Log producers which lost a race for a ring slot
+	Counter logRetries;
+
+	/// \brief Log messages dropped because the ring was full
+	Counter logDropped;
+};
+
+/// \brief Get server-wide counters
+Global &global ();
+
+/// \brief Reset server-wide counters
+void reset ();
+
+/// \brief Add socket I/O to the server-wide counters
+/// \param io_ Socket counters to update as well
+/// \param rc_ Result of the call
+/// \param size_ Requested size
+/// \param write_ Whether data was sent
+void account (IO &io_, std::make_signed_t<std::size_t> rc_, std::size_t size_, bool write_);
+
+/// \brief Scoped timer
+class Timer
+{
+public:
+	/// \brief Parameterized constructor
+	/// \param counter_ Counter to receive the elapsed nanoseconds
+	explicit Timer (Counter &counter_)
+	    : m_counter (counter_), m_start (platform::steady_clock::now ())
+	{
+	}
+
+	~Timer ()
+	{
+		auto const elapsed = platform::steady_clock::now () - m_start;
+		m_counter.add (std::chrono::duration_cast<std::chrono::nanoseconds> (elapsed).count ());
+	}
+
+	Timer (Timer const &that_) = delete;
+
+	Timer &operator= (Timer const &that_) = delete;
+
+private:
+	/// \brief Counter to update
+	Counter &m_counter;
+
+	/// \brief Start time
+	platform::steady_clock::time_point const m_start;
+};
+
+/// \brief Format counters for display
+/// \param session_ Session counters to include, if any
+std::vector<std::string> describe (IO const *session_ = nullptr);
+}
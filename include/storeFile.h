@@ -0,0 +1,122 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "fs.h"
+#include "ioBuffer.h"
+#include "platform.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class StoreFile;
+using SharedStoreFile = std::shared_ptr<StoreFile>;
+
+/// \brief Write handle shared by every ranged upload of the same path
+/// \note Sessions uploading parts of one file write at their own offsets through a single handle.
+/// Finished ranges are tracked so the session that completes an announced size can tell the file is
+/// whole. The file never shrinks below its size at open; only unused preallocated space is trimmed.
+class StoreFile
+{
+public:
+	~StoreFile ();
+
+	/// \brief Open file for a ranged upload, sharing the handle of uploads already running
+	/// \param path_ Resolved path
+	/// \note Every successful open must be paired with finish or abandon
+	/// \returns nullptr on error
+	static SharedStoreFile open (std::string const &path_);
+
+	/// \brief Stop sharing the handle for path; uploads already using it are unaffected
+	/// \param path_ Resolved path
+	static void invalidate (std::string_view path_);
+
+	/// \brief Write data (thread-safe)
+	/// \param buffer_ Input data
+	/// \param offset_ File offset
+	/// \note Can return partial writes
+	std::make_signed_t<std::size_t> write (IOBuffer &buffer_, std::uint64_t offset_);
+
+	/// \brief Reserve storage so the file can grow to a size (thread-safe)
+	/// \param size_ Size to reserve
+	/// \note Never shrinks the file
+	bool preallocate (std::uint64_t size_);
+
+	/// \brief Set the size the client announced for the whole file (thread-safe)
+	/// \param size_ File size
+	void announce (std::uint64_t size_);
+
+	/// \brief Record a completely written range and release the upload (thread-safe)
+	/// \param start_ Range start
+	/// \param end_ Range end (exclusive)
+	/// \returns Whether this range completed the announced file size
+	bool finish (std::uint64_t start_, std::uint64_t end_);
+
+	/// \brief Release a failed upload without recording its range (thread-safe)
+	/// \param end_ End of the data it handed to the file
+	void abandon (std::uint64_t end_);
+
+private:
+	/// \brief Parameterized constructor
+	/// \param file_ File to take ownership of
+	/// \param size_ File size at open
+	StoreFile (fs::File file_, std::uint64_t size_);
+
+	/// \brief Release an upload; the last one trims unused preallocated space
+	/// \param end_ End of the data it handed to the file
+	/// \note m_lock must be held
+	void release (std::uint64_t end_);
+
+	/// \brief Mutex
+	platform::Mutex m_lock;
+
+	/// \brief Underlying file
+	fs::File m_file;
+
+	/// \brief Completely written ranges, sorted and merged
+	std::vector<std::pair<std::uint64_t, std::uint64_t>> m_ranges;
+
+	/// \brief File size at open
+	std::uint64_t const m_openSize;
+
+	/// \brief Highest offset preallocated through the handle
+	std::uint64_t m_reserved = 0;
+
+	/// \brief Highest offset written through the handle
+	std::uint64_t m_written = 0;
+
+	/// \brief File size announced by the client; 0 if unknown
+	std::uint64_t m_size = 0;
+
+	/// \brief Number of uploads using the handle
+	unsigned m_writers = 0;
+
+	/// \brief Whether an upload already reported the file complete
+	bool m_complete = false;
+};
@@ -0,0 +1,75 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "platform.h"
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+/// \brief Fixed-size pool of background threads
+class ThreadPool
+{
+public:
+	/// \brief Stops the threads; queued work that hasn't started is still run
+	~ThreadPool ();
+
+	/// \brief Parameterized constructor
+	/// \param threads_ Number of threads
+	ThreadPool (unsigned threads_);
+
+	ThreadPool (ThreadPool const &that_) = delete;
+
+	ThreadPool (ThreadPool &&that_) = delete;
+
+	ThreadPool &operator= (ThreadPool const &that_) = delete;
+
+	ThreadPool &operator= (ThreadPool &&that_) = delete;
+
+	/// \brief Queue work
+	/// \param work_ Work to run on a pool thread
+	void submit (std::function<void ()> work_);
+
+	/// \brief Number of threads
+	unsigned size () const;
+
+private:
+	/// \brief Thread entry point
+	void threadFunc ();
+
+	/// \brief Threads
+	std::vector<platform::Thread> m_threads;
+
+	/// \brief Mutex
+	platform::Mutex m_lock;
+
+	/// \brief Work signal
+	platform::Semaphore m_semaphore;
+
+	/// \brief Queued work
+	std::deque<std::function<void ()>> m_queue;
+
+	/// \brief Whether threads should quit
+	bool m_quit = false;
+};
@@ -0,0 +1,72 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "platform.h"
+
+#include <chrono>
+#include <cstdint>
+
+/// \brief Token bucket rate limiter
+/// \note Tokens are bytes. Consumption may overdraw the bucket, so a large write is paid back
+/// before the next one is allowed and the average rate holds.
+class TokenBucket
+{
+public:
+	/// \brief Set rate
+	/// \param rate_ Bytes per second; 0 is unlimited
+	void setRate (std::uint64_t rate_);
+
+	/// \brief Get rate
+	/// \note 0 is unlimited
+	std::uint64_t rate () const;
+
+	/// \brief Whether tokens are available
+	/// \param now_ Current time
+	bool available (platform::steady_clock::time_point now_);
+
+	/// \brief Consume tokens
+	/// \param bytes_ Number of bytes transferred
+	void consume (std::uint64_t bytes_);
+
+	/// \brief Time until tokens are available
+	/// \param now_ Current time
+	std::chrono::milliseconds wait (platform::steady_clock::time_point now_);
+
+private:
+	/// \brief Add tokens accumulated since the last refill
+	/// \param now_ Current time
+	void refill (platform::steady_clock::time_point now_);
+
+	/// \brief Maximum number of tokens
+	std::int64_t burst () const;
+
+	/// \brief Bytes per second
+	std::uint64_t m_rate = 0;
+
+	/// \brief Available tokens; negative when overdrawn
+	std::int64_t m_tokens = 0;
+
+	/// \brief Last refill time
+	platform::steady_clock::time_point m_refill{};
+};
@@ -0,0 +1,56 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "codec.h"
+
+#include <memory>
+
+/// \brief Pool of initialized zlib streams shared by all sessions
+/// \note Streams are reset rather than torn down between transfers, so zlib's internal state is
+/// only allocated once per pooled stream
+namespace zStreamPool
+{
+/// \brief Returns a stream to the pool
+struct Recycle
+{
+	/// \brief Recycle stream
+	/// \param stream_ Stream to recycle
+	void operator() (codec::Stream *stream_) const;
+
+	/// \brief Whether the stream inflates (otherwise deflates)
+	bool inflate = false;
+};
+
+/// \brief Pooled z-stream
+using UniqueZStream = std::unique_ptr<codec::Stream, Recycle>;
+
+/// \brief Check out deflate stream
+/// \param level_ Compression level
+/// \returns Stream, or nullptr with errno set
+UniqueZStream acquireDeflate (int level_);
+
+/// \brief Check out inflate stream
+/// \returns Stream, or nullptr with errno set
+UniqueZStream acquireInflate ();
+}
@@ -25,6 +25,7 @@
 #include "fs.h"
 #include "ftpServer.h"
 #include "log.h"
+#include "threadPool.h"
 
 #include "imgui_citro3d.h"
 #include "imgui_ctru.h"
@@ -40,18 +41,26 @@
 
 #include <arpa/inet.h>
 #include <malloc.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
+#include <climits>
+#include <cstdint>
 #include <cstring>
 #include <ctime>
 #include <mutex>
 #include <random>
 #include <span>
+#include <string>
 #include <vector>
 
+/// \brief End of the heap sbrk hands out from (set up by libctru)
+extern "C" char *fake_heap_end;
+
 #ifdef CLASSIC
 PrintConsole g_statusConsole;
 PrintConsole g_logConsole;
@@ -496,6 +505,33 @@ void drawStatus ()
 	ImGui::GetForegroundDrawList ()->AddText (p5, ImGui::GetColorU32 (ImGuiCol_Text), buffer);
 #endif
 }
+
+/// \brief Number of directory entries read at once
+constexpr auto ARCHIVE_BATCH = 64;
+
+/// \brief Get sdmc archive
+/// \note Kept open for the life of the process
+FS_Archive sdmcArchive ()
+{
+	static auto const archive = [] {
+		FS_Archive archive = 0;
+
+		auto const rc = FSUSER_OpenArchive (&archive, ARCHIVE_SDMC, fsMakePath (PATH_EMPTY, ""));
+		if (R_FAILED (rc))
+			error ("FSUSER_OpenArchive: 0x%lx\n", rc);
+
+		return archive;
+	}();
+
+	return archive;
+}
+
+/// \brief Get modification time thread pool
+ThreadPool &mtimePool ()
+{
+	static ThreadPool pool (1);
+	return pool;
+}
 }
 
 bool platform::init ()
@@ -615,6 +651,16 @@ std::string const &platform::hostname ()
 	return hostname;
 }
 
+std::size_t platform::freeMemory ()
+{
+	// free chunks inside the heap plus what sbrk can still hand out
+	auto const info  = mallinfo ();
+	auto const brk   = static_cast<char *> (sbrk (0));
+	auto const spare = brk < fake_heap_end ? fake_heap_end - brk : 0;
+
+	return info.fordblks + spare;
+}
+
 bool platform::loop ()
 {
 	if (!aptMainLoop ())
@@ -847,3 +893,225 @@ void platform::Mutex::unlock ()
 {
 	LightLock_Unlock (&m_d->mutex);
 }
+
+///////////////////////////////////////////////////////////////////////////
+/// \brief Platform semaphore pimpl
+class platform::Semaphore::privateData_t
+{
+public:
+	/// \brief Underlying semaphore
+	LightSemaphore semaphore;
+};
+
+///////////////////////////////////////////////////////////////////////////
+platform::Semaphore::~Semaphore () = default;
+
+platform::Semaphore::Semaphore () : m_d (new privateData_t ())
+{
+	LightSemaphore_Init (&m_d->semaphore, 0, INT16_MAX);
+}
+
+void platform::Semaphore::post ()
+{
+	LightSemaphore_Release (&m_d->semaphore, 1);
+}
+
+void platform::Semaphore::wait ()
+{
+	LightSemaphore_Acquire (&m_d->semaphore, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////
+struct platform::ArchiveDir::Batch
+{
+	/// \brief Entries
+	std::vector<FS_DirectoryEntry> entries;
+
+	/// \brief Modification times; fetched until UINT64_MAX
+	std::vector<std::uint64_t> mtimes;
+
+	/// \brief Number of entries whose modification time was fetched
+	std::atomic<std::size_t> fetched = 0;
+
+	/// \brief Whether the directory was closed
+	std::atomic<bool> cancel = false;
+};
+
+///////////////////////////////////////////////////////////////////////////
+platform::ArchiveDir::~ArchiveDir ()
+{
+	if (m_batch)
+		m_batch->cancel.store (true, std::memory_order_relaxed);
+
+	FSDIR_Close (m_handle);
+}
+
+platform::ArchiveDir::ArchiveDir (Handle const handle_, std::string path_)
+    : m_handle (handle_), m_path (std::move (path_))
+{
+}
+
+std::unique_ptr<platform::ArchiveDir> platform::ArchiveDir::open (char const *const path_)
+{
+	auto const archive = sdmcArchive ();
+	if (!archive)
+	{
+		errno = EIO;
+		return nullptr;
+	}
+
+	u16 path[PATH_MAX + 1];
+	auto const units =
+	    utf8_to_utf16 (path, reinterpret_cast<std::uint8_t const *> (path_), PATH_MAX);
+	if (units < 0 || units >= PATH_MAX)
+	{
+		errno = ENAMETOOLONG;
+		return nullptr;
+	}
+	path[units] = 0;
+
+	Handle handle;
+	auto const rc = FSUSER_OpenDirectory (&handle, archive, fsMakePath (PATH_UTF16, path));
+	if (R_FAILED (rc))
+	{
+		errno = ENOENT;
+		return nullptr;
+	}
+
+	std::string dir = path_;
+	if (dir.empty () || dir.back () != '/')
+		dir.push_back ('/');
+
+	return std::unique_ptr<ArchiveDir> (new ArchiveDir (handle, std::move (dir)));
+}
+
+void platform::ArchiveDir::fetchMTimes ()
+{
+	if (m_fetchMTimes)
+		return;
+
+	m_fetchMTimes = true;
+	if (m_batch)
+		submit ();
+}
+
+bool platform::ArchiveDir::read (char *const name_, std::size_t const size_)
+{
+	while (true)
+	{
+		if (!m_batch || m_index == m_batch->entries.size ())
+		{
+			if (m_end)
+			{
+				errno = 0;
+				return false;
+			}
+
+			// a short batch doesn't mean the end; only an empty one does
+			auto batch = std::make_shared<Batch> ();
+			batch->entries.resize (ARCHIVE_BATCH);
+
+			u32 count     = 0;
+			auto const rc = FSDIR_Read (m_handle, &count, ARCHIVE_BATCH, batch->entries.data ());
+			if (R_FAILED (rc))
+			{
+				error ("FSDIR_Read: 0x%lx\n", rc);
+				errno = EIO;
+				return false;
+			}
+
+			if (count == 0)
+			{
+				m_end = true;
+				errno = 0;
+				return false;
+			}
+
+			batch->entries.resize (count);
+			batch->mtimes.assign (count, UINT64_MAX);
+
+			m_batch = std::move (batch);
+			m_index = 0;
+
+			if (m_fetchMTimes)
+				submit ();
+		}
+
+		if (!ready ())
+		{
+			errno = EWOULDBLOCK;
+			return false;
+		}
+
+		auto const &entry = m_batch->entries[m_index++];
+
+		auto const units =
+		    utf16_to_utf8 (reinterpret_cast<std::uint8_t *> (name_), entry.name, size_ - 1);
+		if (units < 0 || static_cast<std::size_t> (units) >= size_ - 1)
+		{
+			error ("Skipping entry of %s: Name too long\n", m_path.c_str ());
+			continue;
+		}
+
+		name_[units] = 0;
+		return true;
+	}
+}
+
+bool platform::ArchiveDir::ready () const
+{
+	if (!m_fetchMTimes || !m_batch || m_index == m_batch->entries.size ())
+		return true;
+
+	return m_batch->fetched.load (std::memory_order_acquire) > m_index;
+}
+
+FS_DirectoryEntry const &platform::ArchiveDir::entry () const
+{
+	assert (m_batch && m_index > 0);
+	return m_batch->entries[m_index - 1];
+}
+
+bool platform::ArchiveDir::mtime (std::uint64_t &mtime_) const
+{
+	assert (m_batch && m_index > 0);
+
+	if (!m_fetchMTimes || m_batch->fetched.load (std::memory_order_acquire) < m_index)
+		return false;
+
+	mtime_ = m_batch->mtimes[m_index - 1];
+	return mtime_ != UINT64_MAX;
+}
+
+void platform::ArchiveDir::submit ()
+{
+	mtimePool ().submit ([batch = m_batch, path = m_path] () mutable {
+		auto const base = path.size ();
+
+		// one slow FS service call per entry; results are published in order
+		char name[NAME_MAX + 1];
+		for (std::size_t i = 0; i < batch->entries.size (); ++i)
+		{
+			if (batch->cancel.load (std::memory_order_relaxed))
+				return;
+
+			auto const units = utf16_to_utf8 (
+			    reinterpret_cast<std::uint8_t *> (name), batch->entries[i].name, NAME_MAX);
+			if (units >= 0 && units < NAME_MAX)
+			{
+				name[units] = 0;
+				path.resize (base);
+				path.append (name);
+
+				std::uint64_t mtime = 0;
+				auto const rc       = archive_getmtime (path.c_str (), &mtime);
+				if (rc == 0)
+					batch->mtimes[i] = mtime;
+				else
+					error ("sdmc_getmtime %s 0x%lx\n", path.c_str (), rc);
+			}
+
+			batch->fetched.store (i + 1, std::memory_order_release);
+		}
+	});
+}
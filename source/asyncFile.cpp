@@ -0,0 +1,379 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "asyncFile.h"
+
+#include "threadPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <mutex>
+
+namespace
+{
+#ifdef __3DS__
+/// \brief Number of I/O threads
+constexpr auto IO_THREADS = 1;
+#else
+/// \brief Number of I/O threads
+constexpr auto IO_THREADS = 2;
+#endif
+
+/// \brief Get I/O thread pool
+ThreadPool &ioPool ()
+{
+	static ThreadPool pool (IO_THREADS);
+	return pool;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+AsyncFile::~AsyncFile () = default;
+
+AsyncFile::AsyncFile (fs::File file_, bool const write_, std::size_t const bufferSize_)
+    : m_file (std::move (file_)),
+      m_bufferSize (bufferSize_),
+      m_write (write_),
+      m_busy (false),
+      m_eof (false),
+      m_flush (false),
+      m_flushed (false),
+      m_truncate (false)
+{
+	for (std::size_t i = 0; i < RING_SIZE; ++i)
+		m_ring.emplace_back (std::make_unique<IOBuffer> (bufferSize_));
+}
+
+SharedAsyncFile AsyncFile::create (fs::File file_, bool const write_, std::size_t const bufferSize_)
+{
+	auto file = SharedAsyncFile (new AsyncFile (std::move (file_), write_, bufferSize_));
+
+	if (!write_)
+	{
+		// start reading ahead immediately
+		auto const lock = std::scoped_lock (file->m_lock);
+		file->schedule ();
+	}
+
+	return file;
+}
+
+SharedAsyncFile AsyncFile::create (SharedCachedFile file_,
+    std::uint64_t const offset_,
+    std::uint64_t const end_,
+    std::size_t const bufferSize_)
+{
+	auto file = SharedAsyncFile (new AsyncFile (fs::File (), false, bufferSize_));
+
+	file->m_cachedFile = std::move (file_);
+	file->m_offset     = offset_;
+	file->m_end        = std::max (offset_, end_);
+
+	// start reading ahead immediately
+	auto const lock = std::scoped_lock (file->m_lock);
+	file->schedule ();
+
+	return file;
+}
+
+SharedAsyncFile AsyncFile::create (SharedStoreFile file_,
+    std::uint64_t const offset_,
+    std::size_t const bufferSize_)
+{
+	auto file = SharedAsyncFile (new AsyncFile (fs::File (), true, bufferSize_));
+
+	file->m_storeFile = std::move (file_);
+	file->m_offset    = offset_;
+
+	return file;
+}
+
+std::make_signed_t<std::size_t> AsyncFile::read (IOBuffer &buffer_)
+{
+	assert (!m_write);
+
+	auto const lock = std::scoped_lock (m_lock);
+
+	if (m_count == 0)
+	{
+		if (m_error)
+		{
+			errno = m_error;
+			return -1;
+		}
+
+		if (m_eof)
+			return 0;
+
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+
+	// hand over the filled buffer and take the caller's buffer for refilling
+	buffer_.swap (*m_ring[m_head]);
+	m_head = (m_head + 1) % m_ring.size ();
+	--m_count;
+
+	schedule ();
+
+	return buffer_.usedSize ();
+}
+
+std::make_signed_t<std::size_t> AsyncFile::write (IOBuffer &buffer_)
+{
+	assert (m_write);
+	assert (!m_flush);
+
+	auto const lock = std::scoped_lock (m_lock);
+
+	if (m_error)
+	{
+		errno = m_error;
+		return -1;
+	}
+
+	if (m_count == m_ring.size ())
+	{
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+
+	// queue the caller's buffer and hand back an empty one
+	auto &slot = *m_ring[(m_head + m_count) % m_ring.size ()];
+	slot.clear ();
+	slot.swap (buffer_);
+	++m_count;
+
+	schedule ();
+
+	return slot.usedSize ();
+}
+
+int AsyncFile::flush ()
+{
+	assert (m_write);
+
+	auto const lock = std::scoped_lock (m_lock);
+
+	if (m_error)
+	{
+		errno = m_error;
+		return -1;
+	}
+
+	if (!m_flush)
+	{
+		m_flush = true;
+		schedule ();
+	}
+
+	if (!m_flushed)
+	{
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+
+	return 0;
+}
+
+void AsyncFile::truncate (std::uint64_t const size_)
+{
+	assert (m_write);
+
+	auto const lock = std::scoped_lock (m_lock);
+	assert (!m_flush);
+
+	// other uploads may still be writing past this one
+	assert (!m_storeFile);
+
+	m_size     = size_;
+	m_truncate = true;
+}
+
+bool AsyncFile::ready ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+
+	if (m_error)
+		return true;
+
+	if (!m_write)
+		return m_count != 0 || m_eof;
+
+	if (m_flush)
+		return m_flushed;
+
+	return m_count != m_ring.size ();
+}
+
+void AsyncFile::readAhead (std::size_t const size_)
+{
+	assert (!m_write);
+
+	auto const lock = std::scoped_lock (m_lock);
+
+	auto const slots = std::min ((size_ + m_bufferSize - 1) / m_bufferSize, MAX_RING_SIZE);
+	if (slots <= m_ring.size ())
+		return;
+
+	// unroll the ring so the new slots follow the filled ones
+	std::rotate (std::begin (m_ring), std::begin (m_ring) + m_head, std::end (m_ring));
+	m_head = 0;
+
+	while (m_ring.size () < slots)
+		m_ring.emplace_back (std::make_unique<IOBuffer> (m_bufferSize));
+
+	schedule ();
+}
+
+void AsyncFile::schedule ()
+{
+	if (m_busy || m_error)
+		return;
+
+	if (m_write)
+	{
+		if (m_count == 0 && (!m_flush || m_flushed))
+			return;
+	}
+	else if (m_count == m_ring.size () || m_eof)
+		return;
+
+	m_busy = true;
+	ioPool ().submit ([file = shared_from_this ()] { file->process (); });
+}
+
+void AsyncFile::process ()
+{
+	if (m_write)
+		processWrite ();
+	else
+		processRead ();
+}
+
+void AsyncFile::processRead ()
+{
+	auto lock = std::unique_lock (m_lock);
+
+	while (m_count != m_ring.size () && !m_eof && !m_error)
+	{
+		// the slot past the filled ones is not touched by the network side
+		auto &slot = *m_ring[(m_head + m_count) % m_ring.size ()];
+
+		lock.unlock ();
+		slot.clear ();
+		auto const rc    = m_cachedFile ? readCached (slot) : m_file.read (slot);
+		auto const error = errno;
+		lock.lock ();
+
+		if (rc < 0)
+			m_error = error;
+		else if (rc == 0)
+			m_eof = true;
+		else
+			++m_count;
+	}
+
+	m_busy = false;
+}
+
+std::make_signed_t<std::size_t> AsyncFile::readCached (IOBuffer &buffer_)
+{
+	if (m_offset == m_end)
+		return 0;
+
+	auto const size = std::min<std::uint64_t> (m_end - m_offset, buffer_.freeSize ());
+	auto const rc   = m_cachedFile->read (buffer_, m_offset, size);
+	if (rc > 0)
+		m_offset += rc;
+
+	return rc;
+}
+
+void AsyncFile::processWrite ()
+{
+	auto lock = std::unique_lock (m_lock);
+
+	while (!m_error)
+	{
+		if (m_count == 0)
+		{
+			if (!m_flush || m_flushed)
+				break;
+
+			auto const truncate = m_truncate;
+			auto const size     = m_size;
+
+			lock.unlock ();
+			// positional writes to a shared file aren't buffered
+			auto const flushed = m_storeFile || m_file.flush ();
+			auto const rc      = flushed && (!truncate || m_file.truncate (size));
+			auto const error   = errno;
+			lock.lock ();
+
+			if (!rc)
+				m_error = error;
+			else
+				m_flushed = true;
+
+			continue;
+		}
+
+		// the head slot is not touched by the network side until it is released
+		auto &slot = *m_ring[m_head];
+
+		lock.unlock ();
+		int error = 0;
+		while (!slot.empty ())
+		{
+			// the slots are already large; stdio buffering would only add a copy
+			auto const rc = m_storeFile ? writeShared (slot) : m_file.writeDirect (slot);
+			if (rc <= 0)
+			{
+				error = rc < 0 ? errno : EIO;
+				break;
+			}
+		}
+		lock.lock ();
+
+		if (error)
+			m_error = error;
+		else
+		{
+			m_head = (m_head + 1) % m_ring.size ();
+			--m_count;
+		}
+	}
+
+	m_busy = false;
+}
+
+std::make_signed_t<std::size_t> AsyncFile::writeShared (IOBuffer &buffer_)
+{
+	auto const rc = m_storeFile->write (buffer_, m_offset);
+	if (rc > 0)
+		m_offset += rc;
+
+	return rc;
+}
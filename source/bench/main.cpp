@@ -0,0 +1,807 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "codec.h"
+#include "ftpConfig.h"
+#include "ftpServer.h"
+#include "platform.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+/// \brief Data buffer size
+constexpr std::size_t BUFFER_SIZE = 256 * 1024;
+
+/// \brief Benchmark options
+struct Options
+{
+	/// \brief Number of concurrent clients
+	unsigned clients = 4;
+
+	/// \brief Duration of each scenario in seconds
+	unsigned seconds = 5;
+
+	/// \brief Size of transferred files
+	std::size_t fileSize = 64 * 1024 * 1024;
+
+	/// \brief Number of entries in the listed directory
+	unsigned files = 1000;
+
+	/// \brief Server port
+	std::uint16_t port = 5021;
+};
+
+/// \brief Shared scenario inputs
+struct Context
+{
+	/// \brief Benchmark options
+	Options options;
+
+	/// \brief Scratch directory
+	std::string dir;
+
+	/// \brief Incompressible file
+	std::string randPath;
+
+	/// \brief Compressible file
+	std::string textPath;
+
+	/// \brief Listed directory
+	std::string listPath;
+
+	/// \brief Upload payload
+	std::vector<char> payload;
+
+	/// \brief Deflated upload payload
+	std::vector<char> zPayload;
+};
+
+/// \brief Connect to loopback
+/// \param port_ Port to connect to
+/// \returns Socket descriptor, or -1 on error
+int connectLoopback (std::uint16_t const port_)
+{
+	auto const fd = ::socket (AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	sockaddr_in addr{};
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons (port_);
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	if (::connect (fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr)) != 0)
+	{
+		::close (fd);
+		return -1;
+	}
+
+	int const nodelay = 1;
+	::setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof (nodelay));
+
+	return fd;
+}
+
+/// \brief Send all data
+/// \param fd_ Socket descriptor
+/// \param buffer_ Data to send
+/// \param size_ Size of data
+bool sendAll (int const fd_, void const *const buffer_, std::size_t size_)
+{
+	auto p = static_cast<char const *> (buffer_);
+	while (size_)
+	{
+		auto const rc = ::send (fd_, p, size_, 0);
+		if (rc <= 0)
+		{
+			if (rc < 0 && errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		p += rc;
+		size_ -= rc;
+	}
+
+	return true;
+}
+
+/// \brief Blocking FTP client
+class Client
+{
+public:
+	~Client ()
+	{
+		if (m_fd >= 0)
+			::close (m_fd);
+	}
+
+	/// \brief Connect and log in
+	/// \param port_ Server port
+	/// \param mode_ Transfer mode
+	bool connect (std::uint16_t const port_, char const mode_)
+	{
+		m_fd = connectLoopback (port_);
+		if (m_fd < 0 || reply () != 220)
+			return false;
+
+		auto code = command ("USER bench");
+		if (code == 331)
+			code = command ("PASS bench");
+
+		return code == 230 && command ("TYPE I") == 200 && command ("MODE %c", mode_) == 200;
+	}
+
+	/// \brief Send command and wait for its reply
+	/// \param fmt_ Format string
+	/// \returns Reply code, or -1 on error
+	[[gnu::format (printf, 2, 3)]] int command (char const *const fmt_, ...)
+	{
+		char line[1024];
+
+		va_list ap;
+		va_start (ap, fmt_);
+		auto const rc = std::vsnprintf (line, sizeof (line) - 2, fmt_, ap);
+		va_end (ap);
+
+		if (rc < 0 || static_cast<std::size_t> (rc) >= sizeof (line) - 2)
+			return -1;
+
+		std::memcpy (&line[rc], "\r\n", 2);
+
+		auto const start = platform::steady_clock::now ();
+		if (!sendAll (m_fd, line, rc + 2))
+			return -1;
+
+		auto const code = reply ();
+		m_latency.emplace_back (platform::steady_clock::now () - start);
+
+		return code;
+	}
+
+	/// \brief Read reply
+	/// \returns Reply code, or -1 on error
+	int reply ()
+	{
+		int code = -1;
+		while (true)
+		{
+			auto const eol = m_buffer.find ("\r\n");
+			if (eol == std::string::npos)
+			{
+				char buffer[4096];
+				auto const rc = ::recv (m_fd, buffer, sizeof (buffer), 0);
+				if (rc <= 0)
+					return -1;
+
+				m_buffer.append (buffer, rc);
+				continue;
+			}
+
+			m_line.assign (m_buffer, 0, eol);
+			m_buffer.erase (0, eol + 2);
+
+			if (m_line.size () < 4 || !std::isdigit (m_line[0]))
+				continue;
+
+			auto const lineCode = std::atoi (m_line.c_str ());
+			if (code < 0)
+				code = lineCode;
+
+			// multi-line replies end with the code followed by a space
+			if (lineCode == code && m_line[3] == ' ')
+				return code;
+		}
+	}
+
+	/// \brief Open passive data connection
+	/// \returns Socket descriptor, or -1 on error
+	int openData ()
+	{
+		if (command ("PASV") != 227)
+			return -1;
+
+		unsigned h[4], p[2];
+		auto const paren = m_line.find ('(');
+		if (paren == std::string::npos ||
+		    std::sscanf (&m_line[paren],
+		        "(%u,%u,%u,%u,%u,%u)",
+		        &h[0],
+		        &h[1],
+		        &h[2],
+		        &h[3],
+		        &p[0],
+		        &p[1]) != 6)
+			return -1;
+
+		return connectLoopback (p[0] << 8 | p[1]);
+	}
+
+	/// \brief Command latencies
+	std::vector<platform::steady_clock::duration> m_latency;
+
+private:
+	/// \brief Control socket
+	int m_fd = -1;
+
+	/// \brief Unparsed reply data
+	std::string m_buffer;
+
+	/// \brief Last reply line
+	std::string m_line;
+};
+
+/// \brief Download file or listing
+/// \param client_ Client
+/// \param command_ Transfer command
+/// \param path_ Path argument
+/// \param inflate_ Whether the data is deflated
+/// \returns Number of payload bytes, or -1 on error
+std::int64_t download (Client &client_,
+    char const *const command_,
+    std::string const &path_,
+    bool const inflate_)
+{
+	auto const fd = client_.openData ();
+	if (fd < 0)
+		return -1;
+
+	if (client_.command ("%s %s", command_, path_.c_str ()) != 150)
+	{
+		::close (fd);
+		return -1;
+	}
+
+	codec::Stream zStream{};
+	if (inflate_ && codec::initInflate (&zStream) != Z_OK)
+	{
+		::close (fd);
+		return -1;
+	}
+
+	static thread_local std::vector<unsigned char> buffer (BUFFER_SIZE);
+	static thread_local std::vector<unsigned char> zBuffer (BUFFER_SIZE);
+
+	std::int64_t total = 0;
+	bool ok            = true;
+	while (true)
+	{
+		auto const rc = ::recv (fd, buffer.data (), buffer.size (), 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+
+		if (rc <= 0)
+		{
+			ok = rc == 0;
+			break;
+		}
+
+		if (!inflate_)
+		{
+			total += rc;
+			continue;
+		}
+
+		zStream.next_in  = buffer.data ();
+		zStream.avail_in = rc;
+		do
+		{
+			zStream.next_out  = zBuffer.data ();
+			zStream.avail_out = zBuffer.size ();
+
+			auto const zrc = codec::inflate (&zStream, Z_NO_FLUSH);
+			if (zrc != Z_OK && zrc != Z_STREAM_END && zrc != Z_BUF_ERROR)
+			{
+				ok = false;
+				break;
+			}
+
+			total += zBuffer.size () - zStream.avail_out;
+		} while (zStream.avail_in || !zStream.avail_out);
+
+		if (!ok)
+			break;
+	}
+
+	if (inflate_)
+		codec::inflateEnd (&zStream);
+
+	::close (fd);
+
+	if (client_.reply () != 226 || !ok)
+		return -1;
+
+	return total;
+}
+
+/// \brief Upload file
+/// \param client_ Client
+/// \param path_ Path to store
+/// \param data_ Data to send
+/// \param size_ Payload size
+/// \returns Number of payload bytes, or -1 on error
+std::int64_t upload (Client &client_,
+    std::string const &path_,
+    std::vector<char> const &data_,
+    std::size_t const size_)
+{
+	auto const fd = client_.openData ();
+	if (fd < 0)
+		return -1;
+
+	if (client_.command ("STOR %s", path_.c_str ()) != 150)
+	{
+		::close (fd);
+		return -1;
+	}
+
+	auto const ok = sendAll (fd, data_.data (), data_.size ());
+	::close (fd);
+
+	if (client_.reply () != 226 || !ok)
+		return -1;
+
+	return size_;
+}
+
+/// \brief Benchmark scenario
+struct Scenario
+{
+	/// \brief Name
+	char const *name;
+
+	/// \brief Transfer mode
+	char mode;
+
+	/// \brief Perform one operation
+	/// \returns Number of payload bytes, or -1 on error
+	std::int64_t (*op) (Client &client_, Context const &context_, unsigned id_);
+};
+
+/// \brief Benchmark scenarios
+Scenario const SCENARIOS[] = {
+    // clang-format off
+	{"retr", 'S', [] (Client &client_, Context const &context_, unsigned) {
+		return download (client_, "RETR", context_.randPath, false);
+	}},
+	{"stor", 'S', [] (Client &client_, Context const &context_, unsigned id_) {
+		auto const path = context_.dir + "/stor" + std::to_string (id_);
+		return upload (client_, path, context_.payload, context_.payload.size ());
+	}},
+	{"list", 'S', [] (Client &client_, Context const &context_, unsigned) {
+		return download (client_, "LIST", context_.listPath, false);
+	}},
+	{"mlsd", 'S', [] (Client &client_, Context const &context_, unsigned) {
+		return download (client_, "MLSD", context_.listPath, false);
+	}},
+	{"retrz", 'Z', [] (Client &client_, Context const &context_, unsigned) {
+		return download (client_, "RETR", context_.textPath, true);
+	}},
+	{"storz", 'Z', [] (Client &client_, Context const &context_, unsigned id_) {
+		auto const path = context_.dir + "/stor" + std::to_string (id_);
+		return upload (client_, path, context_.zPayload, context_.payload.size ());
+	}},
+    // clang-format on
+};
+
+/// \brief Scenario result
+struct Result
+{
+	/// \brief Payload bytes transferred
+	std::uint64_t bytes = 0;
+
+	/// \brief Operations completed
+	std::size_t ops = 0;
+
+	/// \brief Command latencies
+	std::vector<platform::steady_clock::duration> latency;
+
+	/// \brief Whether any operation failed
+	bool failed = false;
+};
+
+/// \brief Run server until SIGTERM (in the child process)
+/// \param port_ Port to listen on
+[[noreturn]] void runServer (std::uint16_t const port_)
+{
+	// the server threads inherit the mask, so sigwait sees the signal
+	sigset_t set;
+	sigemptyset (&set);
+	sigaddset (&set, SIGTERM);
+	pthread_sigmask (SIG_BLOCK, &set, nullptr);
+
+	auto config = FtpConfig::create ();
+	config->setPort (port_);
+
+	auto server = FtpServer::create (std::move (config));
+
+	int signal;
+	sigwait (&set, &signal);
+
+	server.reset ();
+	std::_Exit (EXIT_SUCCESS);
+}
+
+/// \brief Wait for server to accept connections
+/// \param port_ Server port
+bool waitForServer (std::uint16_t const port_)
+{
+	for (unsigned i = 0; i < 100; ++i)
+	{
+		auto const fd = connectLoopback (port_);
+		if (fd >= 0)
+		{
+			::close (fd);
+			return true;
+		}
+
+		std::this_thread::sleep_for (std::chrono::milliseconds (50));
+	}
+
+	return false;
+}
+
+/// \brief Run scenario
+/// \param scenario_ Scenario to run
+/// \param context_ Scenario inputs
+bool run (Scenario const &scenario_, Context const &context_)
+{
+	auto const &options = context_.options;
+
+	// a fresh server per scenario keeps its CPU time separate from ours
+	auto const pid = ::fork ();
+	if (pid < 0)
+	{
+		std::fprintf (stderr, "fork: %s\n", std::strerror (errno));
+		return false;
+	}
+
+	if (pid == 0)
+		runServer (options.port);
+
+	if (!waitForServer (options.port))
+	{
+		std::fprintf (stderr, "%s: server did not start\n", scenario_.name);
+		::kill (pid, SIGKILL);
+		::waitpid (pid, nullptr, 0);
+		return false;
+	}
+
+	std::vector<Result> results (options.clients);
+	std::vector<std::thread> threads;
+
+	auto const start    = platform::steady_clock::now ();
+	auto const deadline = start + std::chrono::seconds (options.seconds);
+
+	for (unsigned i = 0; i < options.clients; ++i)
+	{
+		threads.emplace_back ([&, i] {
+			auto &result = results[i];
+
+			Client client;
+			if (!client.connect (options.port, scenario_.mode))
+			{
+				result.failed = true;
+				return;
+			}
+
+			while (platform::steady_clock::now () < deadline)
+			{
+				auto const rc = scenario_.op (client, context_, i);
+				if (rc < 0)
+				{
+					result.failed = true;
+					break;
+				}
+
+				result.bytes += rc;
+				++result.ops;
+			}
+
+			result.latency = std::move (client.m_latency);
+		});
+	}
+
+	for (auto &thread : threads)
+		thread.join ();
+
+	auto const elapsed = std::chrono::duration<double> (platform::steady_clock::now () - start);
+
+	::kill (pid, SIGTERM);
+
+	int status;
+	rusage usage{};
+	if (::wait4 (pid, &status, 0, &usage) < 0)
+	{
+		std::fprintf (stderr, "wait4: %s\n", std::strerror (errno));
+		return false;
+	}
+
+	Result total;
+	for (auto &result : results)
+	{
+		total.bytes += result.bytes;
+		total.ops += result.ops;
+		total.failed |= result.failed;
+		total.latency.insert (
+		    std::end (total.latency), std::begin (result.latency), std::end (result.latency));
+	}
+
+	std::sort (std::begin (total.latency), std::end (total.latency));
+
+	auto const percentile = [&total] (unsigned const p_) {
+		if (total.latency.empty ())
+			return 0.0;
+
+		auto const index = std::min (total.latency.size () - 1, total.latency.size () * p_ / 100);
+		return std::chrono::duration<double, std::milli> (total.latency[index]).count ();
+	};
+
+	auto const cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+	                 (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+
+	std::printf ("%-6s %7u %10.1f %8zu %9.3f %9.3f %10.3f%s\n",
+	    scenario_.name,
+	    options.clients,
+	    total.bytes / elapsed.count () / (1024 * 1024),
+	    total.ops,
+	    percentile (50),
+	    percentile (99),
+	    total.bytes ? cpu * 1e9 / total.bytes : 0.0,
+	    total.failed ? " (errors)" : "");
+	std::fflush (stdout);
+
+	return !total.failed;
+}
+
+/// \brief Create scratch files
+/// \param context_ Scenario inputs
+bool prepare (Context &context_)
+{
+	auto const &options = context_.options;
+
+	char dir[] = "/tmp/ftpd-bench.XXXXXX";
+	if (!::mkdtemp (dir))
+	{
+		std::fprintf (stderr, "mkdtemp: %s\n", std::strerror (errno));
+		return false;
+	}
+
+	context_.dir      = dir;
+	context_.randPath = context_.dir + "/rand.bin";
+	context_.textPath = context_.dir + "/text.txt";
+	context_.listPath = context_.dir + "/list";
+
+	// xorshift is plenty to defeat deflate
+	std::vector<char> rand (options.fileSize);
+	std::uint64_t state = 0x9E3779B97F4A7C15ull;
+	for (auto &c : rand)
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		c = static_cast<char> (state);
+	}
+
+	std::vector<char> text;
+	text.reserve (options.fileSize + 64);
+	for (unsigned i = 0; text.size () < options.fileSize; ++i)
+	{
+		char line[64];
+		auto const size = std::sprintf (line, "%08u ftpd-bench compressible line of text\n", i);
+		text.insert (std::end (text), line, line + size);
+	}
+	text.resize (options.fileSize);
+
+	auto const writeFile = [] (std::string const &path_, std::vector<char> const &data_) {
+		auto const fp = std::fopen (path_.c_str (), "wb");
+		if (!fp)
+			return false;
+
+		auto const ok = std::fwrite (data_.data (), 1, data_.size (), fp) == data_.size ();
+		return std::fclose (fp) == 0 && ok;
+	};
+
+	if (!writeFile (context_.randPath, rand) || !writeFile (context_.textPath, text) ||
+	    ::mkdir (context_.listPath.c_str (), 0755) != 0)
+	{
+		std::fprintf (stderr, "%s: %s\n", dir, std::strerror (errno));
+		return false;
+	}
+
+	for (unsigned i = 0; i < options.files; ++i)
+	{
+		auto const path = context_.listPath + "/entry" + std::to_string (i);
+		if (!writeFile (path, {}))
+		{
+			std::fprintf (stderr, "%s: %s\n", path.c_str (), std::strerror (errno));
+			return false;
+		}
+	}
+
+	codec::Stream zStream{};
+	if (codec::initDeflate (&zStream, Z_BEST_SPEED) != Z_OK)
+	{
+		std::fprintf (stderr, "deflateInit failed\n");
+		return false;
+	}
+
+	context_.zPayload.resize (codec::deflateBound (&zStream, text.size ()));
+
+	zStream.next_in   = reinterpret_cast<unsigned char *> (text.data ());
+	zStream.avail_in  = text.size ();
+	zStream.next_out  = reinterpret_cast<unsigned char *> (context_.zPayload.data ());
+	zStream.avail_out = context_.zPayload.size ();
+
+	auto const rc = codec::deflate (&zStream, Z_FINISH);
+	codec::deflateEnd (&zStream);
+	if (rc != Z_STREAM_END)
+	{
+		std::fprintf (stderr, "deflate failed\n");
+		return false;
+	}
+
+	context_.zPayload.resize (context_.zPayload.size () - zStream.avail_out);
+	context_.payload = std::move (text);
+
+	return true;
+}
+
+/// \brief Remove scratch files
+/// \param context_ Scenario inputs
+void cleanup (Context const &context_)
+{
+	if (context_.dir.empty ())
+		return;
+
+	for (unsigned i = 0; i < context_.options.files; ++i)
+		::unlink ((context_.listPath + "/entry" + std::to_string (i)).c_str ());
+
+	for (unsigned i = 0; i < context_.options.clients; ++i)
+		::unlink ((context_.dir + "/stor" + std::to_string (i)).c_str ());
+
+	::rmdir (context_.listPath.c_str ());
+	::unlink (context_.randPath.c_str ());
+	::unlink (context_.textPath.c_str ());
+	::rmdir (context_.dir.c_str ());
+}
+
+/// \brief Print usage
+/// \param argv0_ Program name
+void usage (char const *const argv0_)
+{
+	std::fprintf (stderr,
+	    "Usage: %s [-c clients] [-t seconds] [-s MiB] [-f files] [-p port] [scenario...]\n"
+	    "Scenarios: retr stor list mlsd retrz storz (default: all)\n",
+	    argv0_);
+}
+}
+
+int main (int argc_, char *argv_[])
+{
+	Context context;
+	auto &options = context.options;
+
+	int opt;
+	while ((opt = ::getopt (argc_, argv_, "c:t:s:f:p:h")) != -1)
+	{
+		auto const value = std::strtoul (optarg ? optarg : "", nullptr, 0);
+		switch (opt)
+		{
+		case 'c':
+			options.clients = std::max (1ul, value);
+			break;
+
+		case 't':
+			options.seconds = std::max (1ul, value);
+			break;
+
+		case 's':
+			options.fileSize = std::max (1ul, value) * 1024 * 1024;
+			break;
+
+		case 'f':
+			options.files = value;
+			break;
+
+		case 'p':
+			options.port = value;
+			break;
+
+		default:
+			usage (argv_[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::vector<Scenario const *> scenarios;
+	for (int i = optind; i < argc_; ++i)
+	{
+		auto const it = std::find_if (std::begin (SCENARIOS),
+		    std::end (SCENARIOS),
+		    [name = argv_[i]] (Scenario const &scenario_) {
+			    return std::strcmp (scenario_.name, name) == 0;
+		    });
+		if (it == std::end (SCENARIOS))
+		{
+			usage (argv_[0]);
+			return EXIT_FAILURE;
+		}
+
+		scenarios.emplace_back (it);
+	}
+
+	if (scenarios.empty ())
+	{
+		for (auto const &scenario : SCENARIOS)
+			scenarios.emplace_back (&scenario);
+	}
+
+	std::signal (SIGPIPE, SIG_IGN);
+
+	if (!prepare (context))
+	{
+		cleanup (context);
+		return EXIT_FAILURE;
+	}
+
+	std::printf ("%-6s %7s %10s %8s %9s %9s %10s\n",
+	    "test",
+	    "clients",
+	    "MiB/s",
+	    "ops",
+	    "p50 ms",
+	    "p99 ms",
+	    "cpu ns/B");
+
+	auto ok = true;
+	for (auto const scenario : scenarios)
+		ok &= run (*scenario, context);
+
+	cleanup (context);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
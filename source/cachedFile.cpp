@@ -0,0 +1,242 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "cachedFile.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+namespace
+{
+#ifdef __3DS__
+/// \brief Number of cached blocks per file
+constexpr std::size_t CACHE_BLOCKS = 4;
+#else
+/// \brief Number of cached blocks per file
+constexpr std::size_t CACHE_BLOCKS = 16;
+#endif
+
+/// \brief Open files keyed by resolved path
+struct Registry
+{
+	/// \brief Mutex
+	platform::Mutex lock;
+
+	/// \brief Open files
+	std::unordered_map<std::string, std::weak_ptr<CachedFile>> files;
+};
+
+/// \brief Get open file registry
+Registry &registry ()
+{
+	static Registry registry;
+	return registry;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+CachedFile::~CachedFile () = default;
+
+CachedFile::CachedFile (fs::File file_, stat_t const &st_)
+    : m_file (std::move (file_)), m_size (st_.st_size), m_mtime (st_.st_mtime)
+{
+}
+
+SharedCachedFile
+    CachedFile::open (std::string const &path_, stat_t const &st_, std::size_t const bufferSize_)
+{
+	auto &registry  = ::registry ();
+	auto const lock = std::scoped_lock (registry.lock);
+
+	// forget files nobody is reading anymore
+	for (auto it = std::begin (registry.files); it != std::end (registry.files);)
+	{
+		if (it->second.expired ())
+			it = registry.files.erase (it);
+		else
+			++it;
+	}
+
+	auto const it = registry.files.find (path_);
+	if (it != std::end (registry.files))
+	{
+		// share the handle as long as the file looks the same
+		auto file = it->second.lock ();
+		if (file && file->m_size == static_cast<std::uint64_t> (st_.st_size) &&
+		    file->m_mtime == st_.st_mtime)
+			return file;
+	}
+
+	fs::File file;
+	if (!file.open (path_.c_str (), "rb"))
+		return nullptr;
+
+#if FTPD_HAS_PREAD
+	// blocks are read straight into the cache; a stdio buffer would only add a copy
+	(void)bufferSize_;
+#else
+	file.setBufferSize (bufferSize_);
+#endif
+
+	auto cached = SharedCachedFile (new CachedFile (std::move (file), st_));
+	registry.files[path_] = cached;
+
+	return cached;
+}
+
+void CachedFile::invalidate (std::string_view const path_)
+{
+	auto &registry  = ::registry ();
+	auto const lock = std::scoped_lock (registry.lock);
+
+	auto const it = registry.files.find (std::string (path_));
+	if (it != std::end (registry.files))
+		registry.files.erase (it);
+}
+
+int CachedFile::fd () const
+{
+	std::FILE *const fp = m_file;
+	return fp ? ::fileno (fp) : -1;
+}
+
+std::make_signed_t<std::size_t>
+    CachedFile::read (IOBuffer &buffer_, std::uint64_t offset_, std::size_t size_)
+{
+	auto const lock = std::scoped_lock (m_lock);
+
+	std::size_t total = 0;
+	while (size_ && buffer_.freeSize ())
+	{
+		auto const block = fetch (offset_);
+		if (!block)
+		{
+			if (total)
+				break;
+
+			return -1;
+		}
+
+		// end of file
+		if (offset_ >= block->offset + block->size)
+			break;
+
+		auto const start = offset_ - block->offset;
+		auto const size  = std::min ({size_, buffer_.freeSize (), block->size - start});
+
+		std::memcpy (buffer_.freeArea (), &block->data[start], size);
+		buffer_.markUsed (size);
+
+		offset_ += size;
+		size_ -= size;
+		total += size;
+	}
+
+	return total;
+}
+
+CachedFile::Block *CachedFile::fetch (std::uint64_t const offset_)
+{
+	auto const offset = offset_ - offset_ % BLOCK_SIZE;
+
+	Block *lru = nullptr;
+	for (auto &block : m_blocks)
+	{
+		if (block.data && block.offset == offset)
+		{
+			block.tick = ++m_tick;
+			return &block;
+		}
+
+		if (!lru || block.tick < lru->tick)
+			lru = &block;
+	}
+
+	if (m_blocks.size () < CACHE_BLOCKS)
+		lru = &m_blocks.emplace_back ();
+
+	assert (lru);
+	auto &block = *lru;
+
+	block.tick = ++m_tick;
+	if (!block.data)
+		block.data = std::make_unique<char[]> (BLOCK_SIZE);
+
+#if FTPD_HAS_PREAD
+	std::size_t size = 0;
+	while (size < BLOCK_SIZE)
+	{
+		auto const rc = m_file.readAt (&block.data[size], BLOCK_SIZE - size, offset + size);
+		if (rc < 0)
+		{
+			block.data.reset ();
+			return nullptr;
+		}
+
+		if (rc == 0)
+			break;
+
+		size += rc;
+	}
+#else
+	// sequential readers don't need to seek, which keeps the stdio buffer useful
+	if (m_position != offset)
+	{
+		if (m_file.seek (offset, SEEK_SET) != 0)
+		{
+			block.data.reset ();
+			return nullptr;
+		}
+
+		m_position = offset;
+	}
+
+	std::size_t size = 0;
+	while (size < BLOCK_SIZE)
+	{
+		auto const rc = m_file.read (&block.data[size], BLOCK_SIZE - size);
+		if (rc < 0)
+		{
+			// the stdio position is unknown now
+			block.data.reset ();
+			m_position = UINT64_MAX;
+			return nullptr;
+		}
+
+		if (rc == 0)
+			break;
+
+		size += rc;
+		m_position += rc;
+	}
+#endif
+
+	block.offset = offset;
+	block.size   = size;
+
+	return &block;
+}
@@ -0,0 +1,632 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "checksum.h"
+
+#include "codec.h"
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if defined(__ARM_FEATURE_SHA2)
+#include <arm_neon.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define FTPD_HAS_SHA_NI 1
+#else
+#define FTPD_HAS_SHA_NI 0
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <strings.h>
+
+namespace
+{
+/// \brief Block size of the block-based algorithms
+constexpr std::size_t BLOCK_SIZE = 64;
+
+/// \brief MD5 round constants
+// clang-format off
+constexpr std::uint32_t MD5_K[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+// clang-format on
+
+/// \brief MD5 rotations, four per round
+constexpr unsigned MD5_S[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+/// \brief SHA-256 round constants
+// clang-format off
+alignas (16) constexpr std::uint32_t SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+// clang-format on
+
+/// \brief Algorithm names
+constexpr char const *NAMES[checksum::ALGORITHMS] = {"CRC32", "MD5", "SHA-1", "SHA-256"};
+
+/// \brief Rotate left
+/// \param x_ Value
+/// \param n_ Bits
+constexpr std::uint32_t rotl (std::uint32_t const x_, unsigned const n_)
+{
+	return x_ << n_ | x_ >> (32 - n_);
+}
+
+/// \brief Rotate right
+/// \param x_ Value
+/// \param n_ Bits
+constexpr std::uint32_t rotr (std::uint32_t const x_, unsigned const n_)
+{
+	return x_ >> n_ | x_ << (32 - n_);
+}
+
+/// \brief Load little-endian word
+/// \param data_ Data
+std::uint32_t loadLE (unsigned char const *const data_)
+{
+	return data_[0] | data_[1] << 8 | data_[2] << 16 | static_cast<std::uint32_t> (data_[3]) << 24;
+}
+
+/// \brief Load big-endian word
+/// \param data_ Data
+std::uint32_t loadBE (unsigned char const *const data_)
+{
+	return static_cast<std::uint32_t> (data_[0]) << 24 | data_[1] << 16 | data_[2] << 8 | data_[3];
+}
+
+/// \brief Update crc32
+/// \param crc_ Running checksum
+/// \param data_ Data
+/// \param size_ Data size
+std::uint32_t crc32 (std::uint32_t const crc_, void const *const data_, std::size_t size_)
+{
+#if defined(__ARM_FEATURE_CRC32)
+	// the ARMv8 crc32 instructions use the same polynomial as zlib
+	auto p   = static_cast<unsigned char const *> (data_);
+	auto crc = ~crc_;
+	for (; size_ >= 8; size_ -= 8, p += 8)
+	{
+		std::uint64_t word;
+		std::memcpy (&word, p, sizeof (word));
+		crc = __crc32d (crc, word);
+	}
+
+	for (; size_; --size_)
+		crc = __crc32b (crc, *p++);
+
+	return ~crc;
+#else
+	// SSE4.2 only has crc32c, but zlib's own crc32 is vectorized where it can be
+	return codec::crc32 (crc_, data_, size_);
+#endif
+}
+
+/// \brief Hash MD5 blocks
+/// \param state_ Running state
+/// \param data_ Blocks
+/// \param blocks_ Number of blocks
+void md5Blocks (std::uint32_t *const state_, unsigned char const *data_, std::size_t blocks_)
+{
+	for (; blocks_; --blocks_, data_ += BLOCK_SIZE)
+	{
+		std::uint32_t m[16];
+		for (unsigned i = 0; i < 16; ++i)
+			m[i] = loadLE (&data_[4 * i]);
+
+		auto a = state_[0];
+		auto b = state_[1];
+		auto c = state_[2];
+		auto d = state_[3];
+
+		for (unsigned i = 0; i < 64; ++i)
+		{
+			std::uint32_t f;
+			unsigned g;
+			switch (i / 16)
+			{
+			case 0:
+				f = (b & c) | (~b & d);
+				g = i;
+				break;
+
+			case 1:
+				f = (d & b) | (~d & c);
+				g = (5 * i + 1) % 16;
+				break;
+
+			case 2:
+				f = b ^ c ^ d;
+				g = (3 * i + 5) % 16;
+				break;
+
+			default:
+				f = c ^ (b | ~d);
+				g = (7 * i) % 16;
+				break;
+			}
+
+			f += a + MD5_K[i] + m[g];
+			a = d;
+			d = c;
+			c = b;
+			b += rotl (f, MD5_S[i / 16 * 4 + i % 4]);
+		}
+
+		state_[0] += a;
+		state_[1] += b;
+		state_[2] += c;
+		state_[3] += d;
+	}
+}
+
+/// \brief Hash SHA-1 blocks
+/// \param state_ Running state
+/// \param data_ Blocks
+/// \param blocks_ Number of blocks
+void sha1Blocks (std::uint32_t *const state_, unsigned char const *data_, std::size_t blocks_)
+{
+	for (; blocks_; --blocks_, data_ += BLOCK_SIZE)
+	{
+		std::uint32_t w[80];
+		for (unsigned i = 0; i < 16; ++i)
+			w[i] = loadBE (&data_[4 * i]);
+		for (unsigned i = 16; i < 80; ++i)
+			w[i] = rotl (w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+		auto a = state_[0];
+		auto b = state_[1];
+		auto c = state_[2];
+		auto d = state_[3];
+		auto e = state_[4];
+
+		for (unsigned i = 0; i < 80; ++i)
+		{
+			std::uint32_t f;
+			std::uint32_t k;
+			if (i < 20)
+			{
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			}
+			else if (i < 40)
+			{
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			}
+			else if (i < 60)
+			{
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			}
+			else
+			{
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+
+			auto const t = rotl (a, 5) + f + e + k + w[i];
+			e            = d;
+			d            = c;
+			c            = rotl (b, 30);
+			b            = a;
+			a            = t;
+		}
+
+		state_[0] += a;
+		state_[1] += b;
+		state_[2] += c;
+		state_[3] += d;
+		state_[4] += e;
+	}
+}
+
+/// \brief Hash SHA-256 blocks
+/// \param state_ Running state
+/// \param data_ Blocks
+/// \param blocks_ Number of blocks
+void sha256BlocksGeneric (std::uint32_t *const state_,
+    unsigned char const *data_,
+    std::size_t blocks_)
+{
+	for (; blocks_; --blocks_, data_ += BLOCK_SIZE)
+	{
+		std::uint32_t w[64];
+		for (unsigned i = 0; i < 16; ++i)
+			w[i] = loadBE (&data_[4 * i]);
+
+		for (unsigned i = 16; i < 64; ++i)
+		{
+			auto const s0 = rotr (w[i - 15], 7) ^ rotr (w[i - 15], 18) ^ (w[i - 15] >> 3);
+			auto const s1 = rotr (w[i - 2], 17) ^ rotr (w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i]          = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		auto a = state_[0];
+		auto b = state_[1];
+		auto c = state_[2];
+		auto d = state_[3];
+		auto e = state_[4];
+		auto f = state_[5];
+		auto g = state_[6];
+		auto h = state_[7];
+
+		for (unsigned i = 0; i < 64; ++i)
+		{
+			auto const s1  = rotr (e, 6) ^ rotr (e, 11) ^ rotr (e, 25);
+			auto const ch  = (e & f) ^ (~e & g);
+			auto const t1  = h + s1 + ch + SHA256_K[i] + w[i];
+			auto const s0  = rotr (a, 2) ^ rotr (a, 13) ^ rotr (a, 22);
+			auto const maj = (a & b) ^ (a & c) ^ (b & c);
+
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + s0 + maj;
+		}
+
+		state_[0] += a;
+		state_[1] += b;
+		state_[2] += c;
+		state_[3] += d;
+		state_[4] += e;
+		state_[5] += f;
+		state_[6] += g;
+		state_[7] += h;
+	}
+}
+
+#if defined(__ARM_FEATURE_SHA2)
+/// \brief Hash SHA-256 blocks with the ARMv8 crypto extension
+/// \param state_ Running state
+/// \param data_ Blocks
+/// \param blocks_ Number of blocks
+void sha256BlocksArm (std::uint32_t *const state_, unsigned char const *data_, std::size_t blocks_)
+{
+	auto state0 = vld1q_u32 (&state_[0]);
+	auto state1 = vld1q_u32 (&state_[4]);
+
+	for (; blocks_; --blocks_, data_ += BLOCK_SIZE)
+	{
+		auto const save0 = state0;
+		auto const save1 = state1;
+
+		uint32x4_t w[4];
+		for (unsigned i = 0; i < 4; ++i)
+			w[i] = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (&data_[16 * i])));
+
+		// four rounds at a time; the schedule runs three groups ahead
+		for (unsigned i = 0; i < 16; ++i)
+		{
+			auto const k    = vaddq_u32 (w[i % 4], vld1q_u32 (&SHA256_K[4 * i]));
+			auto const prev = state0;
+			state0          = vsha256hq_u32 (state0, state1, k);
+			state1          = vsha256h2q_u32 (state1, prev, k);
+
+			if (i < 12)
+			{
+				w[i % 4] = vsha256su1q_u32 (
+				    vsha256su0q_u32 (w[i % 4], w[(i + 1) % 4]), w[(i + 2) % 4], w[(i + 3) % 4]);
+			}
+		}
+
+		state0 = vaddq_u32 (state0, save0);
+		state1 = vaddq_u32 (state1, save1);
+	}
+
+	vst1q_u32 (&state_[0], state0);
+	vst1q_u32 (&state_[4], state1);
+}
+#endif
+
+#if FTPD_HAS_SHA_NI
+/// \brief Hash SHA-256 blocks with the SHA extensions
+/// \param state_ Running state
+/// \param data_ Blocks
+/// \param blocks_ Number of blocks
+__attribute__ ((target ("sha,sse4.1"))) void
+    sha256BlocksShaNi (std::uint32_t *const state_, unsigned char const *data_, std::size_t blocks_)
+{
+	auto const mask = _mm_set_epi64x (0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+
+	// the instructions want the state as ABEF/CDGH
+	auto tmp = _mm_shuffle_epi32 (_mm_loadu_si128 (reinterpret_cast<__m128i *> (&state_[0])), 0xB1);
+	auto state1 =
+	    _mm_shuffle_epi32 (_mm_loadu_si128 (reinterpret_cast<__m128i *> (&state_[4])), 0x1B);
+	auto state0 = _mm_alignr_epi8 (tmp, state1, 8);
+	state1      = _mm_blend_epi16 (state1, tmp, 0xF0);
+
+	for (; blocks_; --blocks_, data_ += BLOCK_SIZE)
+	{
+		auto const save0 = state0;
+		auto const save1 = state1;
+
+		__m128i w[4];
+		for (unsigned i = 0; i < 4; ++i)
+		{
+			w[i] = _mm_shuffle_epi8 (
+			    _mm_loadu_si128 (reinterpret_cast<__m128i const *> (&data_[16 * i])), mask);
+		}
+
+		// four rounds at a time; the schedule runs three groups ahead
+		for (unsigned i = 0; i < 16; ++i)
+		{
+			auto k = _mm_add_epi32 (
+			    w[i % 4], _mm_load_si128 (reinterpret_cast<__m128i const *> (&SHA256_K[4 * i])));
+			state1 = _mm_sha256rnds2_epu32 (state1, state0, k);
+			k      = _mm_shuffle_epi32 (k, 0x0E);
+			state0 = _mm_sha256rnds2_epu32 (state0, state1, k);
+
+			if (i < 12)
+			{
+				auto const next = _mm_add_epi32 (_mm_sha256msg1_epu32 (w[i % 4], w[(i + 1) % 4]),
+				    _mm_alignr_epi8 (w[(i + 3) % 4], w[(i + 2) % 4], 4));
+				w[i % 4]        = _mm_sha256msg2_epu32 (next, w[(i + 3) % 4]);
+			}
+		}
+
+		state0 = _mm_add_epi32 (state0, save0);
+		state1 = _mm_add_epi32 (state1, save1);
+	}
+
+	tmp    = _mm_shuffle_epi32 (state0, 0x1B);
+	state1 = _mm_shuffle_epi32 (state1, 0xB1);
+	state0 = _mm_blend_epi16 (tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8 (state1, tmp, 8);
+
+	_mm_storeu_si128 (reinterpret_cast<__m128i *> (&state_[0]), state0);
+	_mm_storeu_si128 (reinterpret_cast<__m128i *> (&state_[4]), state1);
+}
+
+/// \brief Whether the CPU has the SHA extensions
+bool hasShaNi ()
+{
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+		return false;
+
+	if (!__get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return ebx & bit_SHA;
+}
+#endif
+
+/// \brief Hash SHA-256 blocks with the best available kernel
+/// \param state_ Running state
+/// \param data_ Blocks
+/// \param blocks_ Number of blocks
+void sha256Blocks (std::uint32_t *const state_, unsigned char const *data_, std::size_t blocks_)
+{
+#if defined(__ARM_FEATURE_SHA2)
+	sha256BlocksArm (state_, data_, blocks_);
+#elif FTPD_HAS_SHA_NI
+	static auto const shaNi = hasShaNi ();
+	if (shaNi)
+		sha256BlocksShaNi (state_, data_, blocks_);
+	else
+		sha256BlocksGeneric (state_, data_, blocks_);
+#else
+	sha256BlocksGeneric (state_, data_, blocks_);
+#endif
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+char const *checksum::name (Algorithm const algorithm_)
+{
+	return NAMES[static_cast<unsigned> (algorithm_)];
+}
+
+bool checksum::parse (std::string_view const name_, Algorithm &algorithm_)
+{
+	for (unsigned i = 0; i < ALGORITHMS; ++i)
+	{
+		if (name_.size () == std::strlen (NAMES[i]) &&
+		    ::strncasecmp (name_.data (), NAMES[i], name_.size ()) == 0)
+		{
+			algorithm_ = static_cast<Algorithm> (i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////
+checksum::Hasher::Hasher (Algorithm const algorithm_) : m_algorithm (algorithm_)
+{
+	switch (m_algorithm)
+	{
+	case Algorithm::CRC32:
+		m_state[0] = 0;
+		break;
+
+	case Algorithm::MD5:
+		m_state[0] = 0x67452301;
+		m_state[1] = 0xefcdab89;
+		m_state[2] = 0x98badcfe;
+		m_state[3] = 0x10325476;
+		break;
+
+	case Algorithm::SHA1:
+		m_state[0] = 0x67452301;
+		m_state[1] = 0xefcdab89;
+		m_state[2] = 0x98badcfe;
+		m_state[3] = 0x10325476;
+		m_state[4] = 0xc3d2e1f0;
+		break;
+
+	case Algorithm::SHA256:
+		m_state[0] = 0x6a09e667;
+		m_state[1] = 0xbb67ae85;
+		m_state[2] = 0x3c6ef372;
+		m_state[3] = 0xa54ff53a;
+		m_state[4] = 0x510e527f;
+		m_state[5] = 0x9b05688c;
+		m_state[6] = 0x1f83d9ab;
+		m_state[7] = 0x5be0cd19;
+		break;
+	}
+}
+
+void checksum::Hasher::update (void const *const data_, std::size_t size_)
+{
+	m_length += size_;
+
+	if (m_algorithm == Algorithm::CRC32)
+	{
+		m_state[0] = crc32 (m_state[0], data_, size_);
+		return;
+	}
+
+	auto p = static_cast<unsigned char const *> (data_);
+	if (m_blockSize)
+	{
+		// top up the partial block first
+		auto const size = std::min (size_, BLOCK_SIZE - m_blockSize);
+		std::memcpy (&m_block[m_blockSize], p, size);
+		m_blockSize += size;
+		p += size;
+		size_ -= size;
+
+		if (m_blockSize < BLOCK_SIZE)
+			return;
+
+		process (m_block, 1);
+		m_blockSize = 0;
+	}
+
+	// whole blocks are hashed in place
+	process (p, size_ / BLOCK_SIZE);
+	p += size_ / BLOCK_SIZE * BLOCK_SIZE;
+	size_ %= BLOCK_SIZE;
+
+	std::memcpy (m_block, p, size_);
+	m_blockSize = size_;
+}
+
+std::string checksum::Hasher::finish ()
+{
+	unsigned char digest[32];
+	std::size_t size = 0;
+
+	if (m_algorithm == Algorithm::CRC32)
+	{
+		for (unsigned i = 0; i < 4; ++i)
+			digest[i] = m_state[0] >> (24 - 8 * i);
+		size = 4;
+	}
+	else
+	{
+		auto const bits = m_length * 8;
+
+		// pad with a one bit, zeros and the message length in bits
+		m_block[m_blockSize++] = 0x80;
+		if (m_blockSize > BLOCK_SIZE - 8)
+		{
+			std::memset (&m_block[m_blockSize], 0, BLOCK_SIZE - m_blockSize);
+			process (m_block, 1);
+			m_blockSize = 0;
+		}
+
+		std::memset (&m_block[m_blockSize], 0, BLOCK_SIZE - 8 - m_blockSize);
+		for (unsigned i = 0; i < 8; ++i)
+		{
+			// MD5 is little-endian, SHA is big-endian
+			auto const shift            = m_algorithm == Algorithm::MD5 ? 8 * i : 56 - 8 * i;
+			m_block[BLOCK_SIZE - 8 + i] = bits >> shift;
+		}
+
+		process (m_block, 1);
+		m_blockSize = 0;
+
+		size = m_algorithm == Algorithm::MD5 ? 16 : m_algorithm == Algorithm::SHA1 ? 20 : 32;
+		for (unsigned i = 0; i < size; ++i)
+		{
+			auto const word  = m_state[i / 4];
+			auto const shift = m_algorithm == Algorithm::MD5 ? 8 * (i % 4) : 24 - 8 * (i % 4);
+			digest[i]        = word >> shift;
+		}
+	}
+
+	static char const hex[] = "0123456789abcdef";
+
+	std::string result;
+	result.reserve (2 * size);
+	for (unsigned i = 0; i < size; ++i)
+	{
+		result.push_back (hex[digest[i] >> 4]);
+		result.push_back (hex[digest[i] & 0xF]);
+	}
+
+	return result;
+}
+
+void checksum::Hasher::process (unsigned char const *const data_, std::size_t const blocks_)
+{
+	if (!blocks_)
+		return;
+
+	switch (m_algorithm)
+	{
+	case Algorithm::CRC32:
+		assert (false);
+		break;
+
+	case Algorithm::MD5:
+		md5Blocks (m_state, data_, blocks_);
+		break;
+
+	case Algorithm::SHA1:
+		sha1Blocks (m_state, data_, blocks_);
+		break;
+
+	case Algorithm::SHA256:
+		sha256Blocks (m_state, data_, blocks_);
+		break;
+	}
+}
@@ -0,0 +1,264 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "codec.h"
+
+#if FTPD_HAS_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include <memory>
+#include <string>
+
+#if FTPD_HAS_LIBDEFLATE
+namespace
+{
+/// \brief Get compressor for this thread
+/// \param level_ Compression level
+libdeflate_compressor *compressor (int const level_)
+{
+	// compressors are costly to set up; keep the last one used by each compression thread
+	thread_local auto compressor =
+	    std::unique_ptr<libdeflate_compressor, void (*) (libdeflate_compressor *)> (
+	        nullptr, &libdeflate_free_compressor);
+	thread_local int compressorLevel = -1;
+
+	if (!compressor || compressorLevel != level_)
+	{
+		compressor.reset (libdeflate_alloc_compressor (level_));
+		compressorLevel = compressor ? level_ : -1;
+	}
+
+	return compressor.get ();
+}
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+char const *codec::name ()
+{
+	static auto const name = [] {
+#if FTPD_HAS_ZLIB_NG
+		auto name = std::string ("zlib-ng ") + zlibng_version ();
+#else
+		auto name = std::string ("zlib ") + zlibVersion ();
+#endif
+
+#if FTPD_HAS_LIBDEFLATE
+		name += ", libdeflate " LIBDEFLATE_VERSION_STRING;
+#endif
+		return name;
+	}();
+
+	return name.c_str ();
+}
+
+#if FTPD_HAS_ZLIB_NG
+int codec::initDeflate (Stream *const stream_, int const level_)
+{
+	return zng_deflateInit (stream_, level_);
+}
+
+int codec::initRawDeflate (Stream *const stream_, int const level_)
+{
+	return zng_deflateInit2 (stream_, level_, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+}
+
+int codec::initInflate (Stream *const stream_)
+{
+	return zng_inflateInit (stream_);
+}
+
+int codec::deflate (Stream *const stream_, int const flush_)
+{
+	return zng_deflate (stream_, flush_);
+}
+
+int codec::deflateParams (Stream *const stream_, int const level_)
+{
+	return zng_deflateParams (stream_, level_, Z_DEFAULT_STRATEGY);
+}
+
+int codec::deflateSetDictionary (Stream *const stream_,
+    unsigned char const *const dict_,
+    std::size_t const size_)
+{
+	return zng_deflateSetDictionary (stream_, dict_, size_);
+}
+
+std::size_t codec::deflateBound (Stream *const stream_, std::size_t const size_)
+{
+	return zng_deflateBound (stream_, size_);
+}
+
+int codec::deflateReset (Stream *const stream_)
+{
+	return zng_deflateReset (stream_);
+}
+
+int codec::deflateEnd (Stream *const stream_)
+{
+	return zng_deflateEnd (stream_);
+}
+
+int codec::inflate (Stream *const stream_, int const flush_)
+{
+	return zng_inflate (stream_, flush_);
+}
+
+int codec::inflateReset (Stream *const stream_)
+{
+	return zng_inflateReset (stream_);
+}
+
+int codec::inflateEnd (Stream *const stream_)
+{
+	return zng_inflateEnd (stream_);
+}
+
+std::uint32_t codec::adler32 (std::uint32_t const adler_,
+    void const *const data_,
+    std::size_t const size_)
+{
+	return zng_adler32_z (adler_, static_cast<std::uint8_t const *> (data_), size_);
+}
+
+std::uint32_t codec::adler32Combine (std::uint32_t const adler1_,
+    std::uint32_t const adler2_,
+    std::uint64_t const size2_)
+{
+	return zng_adler32_combine (adler1_, adler2_, size2_);
+}
+
+std::uint32_t codec::crc32 (std::uint32_t const crc_,
+    void const *const data_,
+    std::size_t const size_)
+{
+	return zng_crc32_z (crc_, static_cast<std::uint8_t const *> (data_), size_);
+}
+#else
+int codec::initDeflate (Stream *const stream_, int const level_)
+{
+	return deflateInit (stream_, level_);
+}
+
+int codec::initRawDeflate (Stream *const stream_, int const level_)
+{
+	return deflateInit2 (stream_, level_, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+}
+
+int codec::initInflate (Stream *const stream_)
+{
+	return inflateInit (stream_);
+}
+
+int codec::deflate (Stream *const stream_, int const flush_)
+{
+	return ::deflate (stream_, flush_);
+}
+
+int codec::deflateParams (Stream *const stream_, int const level_)
+{
+	return ::deflateParams (stream_, level_, Z_DEFAULT_STRATEGY);
+}
+
+int codec::deflateSetDictionary (Stream *const stream_,
+    unsigned char const *const dict_,
+    std::size_t const size_)
+{
+	return ::deflateSetDictionary (stream_, dict_, size_);
+}
+
+std::size_t codec::deflateBound (Stream *const stream_, std::size_t const size_)
+{
+	return ::deflateBound (stream_, size_);
+}
+
+int codec::deflateReset (Stream *const stream_)
+{
+	return ::deflateReset (stream_);
+}
+
+int codec::deflateEnd (Stream *const stream_)
+{
+	return ::deflateEnd (stream_);
+}
+
+int codec::inflate (Stream *const stream_, int const flush_)
+{
+	return ::inflate (stream_, flush_);
+}
+
+int codec::inflateReset (Stream *const stream_)
+{
+	return ::inflateReset (stream_);
+}
+
+int codec::inflateEnd (Stream *const stream_)
+{
+	return ::inflateEnd (stream_);
+}
+
+std::uint32_t codec::adler32 (std::uint32_t const adler_,
+    void const *const data_,
+    std::size_t const size_)
+{
+	return ::adler32_z (adler_, static_cast<Bytef const *> (data_), size_);
+}
+
+std::uint32_t codec::adler32Combine (std::uint32_t const adler1_,
+    std::uint32_t const adler2_,
+    std::uint64_t const size2_)
+{
+	return ::adler32_combine (adler1_, adler2_, size2_);
+}
+
+std::uint32_t codec::crc32 (std::uint32_t const crc_,
+    void const *const data_,
+    std::size_t const size_)
+{
+	return ::crc32_z (crc_, static_cast<Bytef const *> (data_), size_);
+}
+#endif
+
+#if FTPD_HAS_LIBDEFLATE
+std::size_t codec::wholeDeflateBound (std::size_t const size_)
+{
+	return libdeflate_deflate_compress_bound (nullptr, size_);
+}
+
+std::size_t codec::wholeDeflate (int level_,
+    void const *const in_,
+    std::size_t const inSize_,
+    void *const out_,
+    std::size_t const outSize_)
+{
+	if (level_ == Z_DEFAULT_COMPRESSION)
+		level_ = 6;
+
+	auto const compressor = ::compressor (level_);
+	if (!compressor)
+		return 0;
+
+	return libdeflate_deflate_compress (compressor, in_, inSize_, out_, outSize_);
+}
+#endif
@@ -0,0 +1,214 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "deflateTuner.h"
+
+#include "codec.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <chrono>
+
+namespace
+{
+/// \brief Sample interval
+constexpr auto SAMPLE_INTERVAL = std::chrono::milliseconds (250);
+
+/// \brief How long to stay at level 0 before probing again
+constexpr auto PROBE_INTERVAL = std::chrono::seconds (2);
+
+/// \brief Minimum uncompressed bytes to evaluate a sample
+constexpr std::uint64_t SAMPLE_MIN = 64 * 1024;
+
+/// \brief Compression ratio above which data is considered incompressible
+constexpr double INCOMPRESSIBLE_RATIO = 0.97;
+
+/// \brief Fraction of the interval the compressor must be busy to be the bottleneck
+constexpr double BUSY_RATIO = 0.9;
+
+/// \brief Compressor headroom needed to step up a level
+/// \note Each level costs very roughly half again as much CPU as the previous one
+constexpr double HEADROOM = 2.0;
+
+/// \brief Extensions of formats that are already compressed or encrypted
+constexpr std::array<std::string_view, 22> COMPRESSED_EXTENSIONS = {
+    "7z",
+    "bz2",
+    "cia",
+    "flac",
+    "gz",
+    "jpeg",
+    "jpg",
+    "lz4",
+    "mkv",
+    "mp3",
+    "mp4",
+    "nca",
+    "nsp",
+    "nsz",
+    "ogg",
+    "png",
+    "rar",
+    "webm",
+    "xci",
+    "xz",
+    "zip",
+    "zst",
+};
+}
+
+///////////////////////////////////////////////////////////////////////////
+DeflateTuner::~DeflateTuner () = default;
+
+DeflateTuner::DeflateTuner (int const level_, unsigned const threads_)
+    : m_threads (std::max (threads_, 1u)),
+      m_level (level_),
+      m_appliedLevel (level_),
+      m_probeLevel (std::max (level_, Z_BEST_SPEED))
+{
+	auto const now = platform::steady_clock::now ();
+	m_probeTime    = now + PROBE_INTERVAL;
+	reset (now);
+}
+
+UniqueDeflateTuner DeflateTuner::create (int const level_, unsigned const threads_)
+{
+	return UniqueDeflateTuner (new DeflateTuner (level_, threads_));
+}
+
+bool DeflateTuner::incompressible (std::string_view const path_)
+{
+	auto const dot = path_.find_last_of ('.');
+	if (dot == std::string_view::npos)
+		return false;
+
+	auto const ext = path_.substr (dot + 1);
+	return std::any_of (std::begin (COMPRESSED_EXTENSIONS),
+	    std::end (COMPRESSED_EXTENSIONS),
+	    [ext] (std::string_view const candidate_) {
+		    return std::equal (std::begin (ext),
+		        std::end (ext),
+		        std::begin (candidate_),
+		        std::end (candidate_),
+		        [] (char const a_, char const b_) { return std::tolower (a_) == b_; });
+	    });
+}
+
+int DeflateTuner::level () const
+{
+	return m_level;
+}
+
+void DeflateTuner::compressed (std::size_t const in_,
+    std::size_t const out_,
+    platform::steady_clock::duration const duration_)
+{
+	m_in += in_;
+	m_out += out_;
+	m_busy += duration_;
+}
+
+void DeflateTuner::sent (std::size_t const size_, bool const blocked_)
+{
+	m_sent += size_;
+	if (blocked_)
+		++m_blocked;
+}
+
+void DeflateTuner::skip ()
+{
+	if (m_level == Z_NO_COMPRESSION)
+		return;
+
+	auto const now = platform::steady_clock::now ();
+	m_probeLevel   = m_level;
+	m_probeTime    = now + PROBE_INTERVAL;
+	m_level        = Z_NO_COMPRESSION;
+	reset (now);
+}
+
+bool DeflateTuner::update ()
+{
+	evaluate ();
+
+	if (m_level == m_appliedLevel)
+		return false;
+
+	m_appliedLevel = m_level;
+	return true;
+}
+
+void DeflateTuner::evaluate ()
+{
+	auto const now = platform::steady_clock::now ();
+	if (m_level == Z_NO_COMPRESSION)
+	{
+		if (now < m_probeTime)
+			return;
+
+		// see whether the data has become compressible again
+		m_level = m_probeLevel;
+		reset (now);
+		return;
+	}
+
+	if (now - m_start < SAMPLE_INTERVAL || m_in < SAMPLE_MIN)
+		return;
+
+	auto const wall  = std::chrono::duration<double> (now - m_start).count ();
+	auto const busy  = std::chrono::duration<double> (m_busy).count () / m_threads;
+	auto const ratio = static_cast<double> (m_out) / m_in;
+
+	if (ratio > INCOMPRESSIBLE_RATIO)
+	{
+		// not worth the CPU; send stored blocks for a while
+		skip ();
+		return;
+	}
+
+	if (m_blocked)
+	{
+		// the link is the bottleneck; compress harder if the compressor can keep up
+		auto const capacity = m_in / std::max (busy, 1e-6);
+		auto const demand   = m_sent / wall / ratio;
+		if (capacity > HEADROOM * demand)
+			m_level = std::min (m_level + 1, Z_BEST_COMPRESSION);
+	}
+	else if (busy > BUSY_RATIO * wall)
+	{
+		// the compressor is the bottleneck
+		m_level = std::max (m_level - 1, Z_BEST_SPEED);
+	}
+
+	reset (now);
+}
+
+void DeflateTuner::reset (platform::steady_clock::time_point const now_)
+{
+	m_start   = now_;
+	m_busy    = {};
+	m_in      = 0;
+	m_out     = 0;
+	m_sent    = 0;
+	m_blocked = 0;
+}
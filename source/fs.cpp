@@ -33,7 +33,13 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -113,6 +119,11 @@ fs::File &fs::File::operator= (File &&that_) = default;
 
 fs::File::operator bool () const
 {
+#ifdef __SWITCH__
+	if (m_native)
+		return true;
+#endif
+
 	return static_cast<bool> (m_fp);
 }
 
@@ -133,6 +144,17 @@ void fs::File::setBufferSize (std::size_t const size_)
 bool fs::File::open (gsl::not_null<char const *> const path_,
     gsl::not_null<char const *> const mode_)
 {
+#ifdef __SWITCH__
+	// binary modes on fsdev bypass stdio; anything else, or a failure, goes to fopen which also
+	// sets errno the way callers expect
+	m_native = platform::NxFile::open (path_, mode_);
+	if (m_native)
+	{
+		m_fp.reset ();
+		return true;
+	}
+#endif
+
 	gsl::owner<FILE *> fp = std::fopen (path_, mode_);
 	if (!fp)
 		return false;
@@ -148,20 +170,53 @@ bool fs::File::open (gsl::not_null<char const *> const path_,
 void fs::File::close ()
 {
 	m_fp.reset ();
+#ifdef __SWITCH__
+	m_native.reset ();
+#endif
 }
 
 std::make_signed_t<std::size_t> fs::File::seek (std::make_signed_t<std::size_t> const pos_,
     int const origin_)
 {
+#ifdef __SWITCH__
+	if (m_native)
+		return m_native->seek (pos_, origin_) ? 0 : -1;
+#endif
+
 	return std::fseek (m_fp.get (), pos_, origin_);
 }
 
+std::make_signed_t<std::size_t> fs::File::tell ()
+{
+#ifdef __SWITCH__
+	if (m_native)
+		return gsl::narrow_cast<std::make_signed_t<std::size_t>> (m_native->tell ());
+#endif
+
+	return std::ftell (m_fp.get ());
+}
+
+bool fs::File::flush ()
+{
+#ifdef __SWITCH__
+	if (m_native)
+		return m_native->flush ();
+#endif
+
+	return std::fflush (m_fp.get ()) == 0;
+}
+
 std::make_signed_t<std::size_t> fs::File::read (gsl::not_null<void *> const buffer_,
     std::size_t const size_)
 {
 	assert (buffer_);
 	assert (size_ > 0);
 
+#ifdef __SWITCH__
+	if (m_native)
+		return m_native->read (buffer_, size_);
+#endif
+
 	auto const rc = std::fread (buffer_, 1, size_, m_fp.get ());
 	if (rc == 0)
 	{
@@ -184,8 +239,30 @@ std::make_signed_t<std::size_t> fs::File::read (IOBuffer &buffer_)
 	return rc;
 }
 
+#if FTPD_HAS_PREAD
+std::make_signed_t<std::size_t> fs::File::readAt (gsl::not_null<void *> const buffer_,
+    std::size_t const size_,
+    std::uint64_t const offset_)
+{
+	assert (buffer_);
+	assert (size_ > 0);
+
+#ifdef __SWITCH__
+	if (m_native)
+		return m_native->readAt (buffer_, size_, offset_);
+#endif
+
+	return ::pread (::fileno (m_fp.get ()), buffer_, size_, offset_);
+}
+#endif
+
 std::string_view fs::File::readLine ()
 {
+#ifdef __SWITCH__
+	// text files are never opened natively
+	assert (!m_native);
+#endif
+
 	while (true)
 	{
 		auto rc = ::getline (&m_lineBuffer, &m_lineBufferSize, m_fp.get ());
@@ -231,6 +308,11 @@ std::make_signed_t<std::size_t> fs::File::write (gsl::not_null<void const *> con
 	assert (buffer_);
 	assert (size_ > 0);
 
+#ifdef __SWITCH__
+	if (m_native)
+		return m_native->write (buffer_, size_);
+#endif
+
 	auto const rc = std::fwrite (buffer_, 1, size_, m_fp.get ());
 	if (rc == 0)
 		return -1;
@@ -269,6 +351,108 @@ bool fs::File::writeAll (gsl::not_null<void const *> const buffer_, std::size_t
 	return true;
 }
 
+std::make_signed_t<std::size_t> fs::File::writeDirect (IOBuffer &buffer_)
+{
+	assert (buffer_.usedSize () > 0);
+
+#ifdef __SWITCH__
+	// native writes are already unbuffered
+	if (m_native)
+		return write (buffer_);
+#endif
+
+	// anything written through stdio has to land first
+	if (std::fflush (m_fp.get ()) != 0)
+		return -1;
+
+	auto const rc = ::write (::fileno (m_fp.get ()), buffer_.usedArea (), buffer_.usedSize ());
+	if (rc > 0)
+		buffer_.markFree (rc);
+
+	return rc;
+}
+
+#if FTPD_HAS_PREAD
+std::make_signed_t<std::size_t> fs::File::writeAt (gsl::not_null<void const *> const buffer_,
+    std::size_t const size_,
+    std::uint64_t const offset_)
+{
+	assert (buffer_);
+	assert (size_ > 0);
+
+#ifdef __SWITCH__
+	if (m_native)
+		return m_native->writeAt (buffer_, size_, offset_);
+#endif
+
+	return ::pwrite (::fileno (m_fp.get ()), buffer_, size_, offset_);
+}
+#endif
+
+#if FTPD_HAS_COPY_FILE_RANGE
+std::make_signed_t<std::size_t> fs::File::copyFrom (File &that_, std::size_t const size_)
+{
+	// anything written through stdio has to land first
+	if (std::fflush (m_fp.get ()) != 0)
+		return -1;
+
+	return ::copy_file_range (
+	    ::fileno (that_.m_fp.get ()), nullptr, ::fileno (m_fp.get ()), nullptr, size_, 0);
+}
+#endif
+
+bool fs::File::preallocate (std::uint64_t const size_)
+{
+#ifdef __SWITCH__
+	if (m_native)
+	{
+		std::uint64_t size;
+		if (!m_native->size (size))
+			return false;
+
+		if (size >= size_)
+			return true;
+
+		return m_native->setSize (size_);
+	}
+#endif
+
+	auto const fd = ::fileno (m_fp.get ());
+
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+	// reserve without changing the visible size in case the transfer is cut short
+	return ::fallocate (fd, FALLOC_FL_KEEP_SIZE, 0, size_) == 0;
+#elif defined(__NDS__) || defined(__3DS__) || defined(__SWITCH__)
+	// growing the file allocates its whole cluster chain up front
+	struct stat st;
+	if (::fstat (fd, &st) != 0)
+		return false;
+
+	if (static_cast<std::uint64_t> (st.st_size) >= size_)
+		return true;
+
+	return ::ftruncate (fd, size_) == 0;
+#else
+	(void)fd;
+	(void)size_;
+	errno = ENOTSUP;
+	return false;
+#endif
+}
+
+bool fs::File::truncate (std::uint64_t const size_)
+{
+#ifdef __SWITCH__
+	if (m_native)
+		return m_native->setSize (size_);
+#endif
+
+	if (std::fflush (m_fp.get ()) != 0)
+		return false;
+
+	return ::ftruncate (::fileno (m_fp.get ()), size_) == 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 fs::Dir::~Dir () = default;
 
@@ -280,6 +464,16 @@ fs::Dir &fs::Dir::operator= (Dir &&that_) = default;
 
 fs::Dir::operator bool () const
 {
+#ifdef __3DS__
+	if (m_archive)
+		return true;
+#endif
+
+#ifdef __SWITCH__
+	if (m_native)
+		return true;
+#endif
+
 	return static_cast<bool> (m_dp);
 }
 
@@ -290,6 +484,30 @@ fs::Dir::operator DIR * () const
 
 bool fs::Dir::open (gsl::not_null<char const *> const path_)
 {
+#ifdef __3DS__
+	// paths without a device are on sdmc; if the bulk reader fails, opendir tells us why
+	m_archive.reset ();
+	if (!std::strchr (path_, ':'))
+	{
+		m_archive = platform::ArchiveDir::open (path_);
+		if (m_archive)
+		{
+			m_dp.reset ();
+			return true;
+		}
+	}
+#endif
+
+#ifdef __SWITCH__
+	// fsdev paths are read in batches; if that fails, opendir tells us why
+	m_native = platform::NxDir::open (path_);
+	if (m_native)
+	{
+		m_dp.reset ();
+		return true;
+	}
+#endif
+
 	auto const dp = ::opendir (path_);
 	if (!dp)
 		return false;
@@ -301,10 +519,47 @@ bool fs::Dir::open (gsl::not_null<char const *> const path_)
 void fs::Dir::close ()
 {
 	m_dp.reset ();
+#ifdef __3DS__
+	m_archive.reset ();
+#endif
+#ifdef __SWITCH__
+	m_native.reset ();
+#endif
 }
 
 dirent *fs::Dir::read ()
 {
+#ifdef __3DS__
+	if (m_archive)
+	{
+		if (!m_archive->read (m_dirent.d_name, sizeof (m_dirent.d_name)))
+			return nullptr;
+
+		return &m_dirent;
+	}
+#endif
+
+#ifdef __SWITCH__
+	if (m_native)
+	{
+		auto const entry = m_native->read ();
+		if (!entry)
+			return nullptr;
+
+		auto const size = std::min (std::strlen (entry->name), sizeof (m_dirent.d_name) - 1);
+		std::memcpy (m_dirent.d_name, entry->name, size);
+		m_dirent.d_name[size] = 0;
+		return &m_dirent;
+	}
+#endif
+
 	errno = 0;
 	return ::readdir (m_dp.get ());
 }
+
+#ifdef __3DS__
+platform::ArchiveDir *fs::Dir::archive () const
+{
+	return m_archive.get ();
+}
+#endif
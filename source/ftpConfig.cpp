@@ -22,22 +22,23 @@
 
 #include "ftpConfig.h"
 
+#include "codec.h"
 #include "fs.h"
 #include "log.h"
 #include "platform.h"
 
 #include <gsl/pointers>
 
-#include <zlib.h>
-
 #include <sys/stat.h>
 using stat_t = struct stat;
 
+#include <algorithm>
 #include <cctype>
 #include <cerrno>
 #include <charconv>
 #include <cstdint>
 #include <cstdio>
+#include <limits>
 #include <mutex>
 #include <string>
 #include <string_view>
@@ -48,6 +49,39 @@ namespace
 {
 constexpr std::uint16_t DEFAULT_PORT = 5000;
 constexpr int DEFAULT_DEFLATE_LEVEL  = 6;
+constexpr unsigned DEFAULT_STAT_TTL  = 10;
+
+// setting a buffer size turns off the kernel's autotuning on Linux, which would cap the window
+#if defined(__NDS__) || defined(__3DS__)
+// the network stack hands out ephemeral ports which may still be in use; pick our own
+constexpr std::uint16_t DEFAULT_PASV_PORT_MIN = 5001;
+constexpr std::uint16_t DEFAULT_PASV_PORT_MAX = 10000;
+#else
+constexpr std::uint16_t DEFAULT_PASV_PORT_MIN = 0;
+constexpr std::uint16_t DEFAULT_PASV_PORT_MAX = 0;
+#endif
+
+#if defined(__NDS__)
+constexpr unsigned DEFAULT_DATA_BUFFER_SIZE    = 4096;
+constexpr unsigned DEFAULT_CONTROL_BUFFER_SIZE = 0;
+constexpr unsigned DEFAULT_KEEPALIVE           = 0;
+constexpr unsigned DEFAULT_BACKLOG             = 10;
+#elif defined(__3DS__)
+constexpr unsigned DEFAULT_DATA_BUFFER_SIZE    = 32768;
+constexpr unsigned DEFAULT_CONTROL_BUFFER_SIZE = 0;
+constexpr unsigned DEFAULT_KEEPALIVE           = 0;
+constexpr unsigned DEFAULT_BACKLOG             = 10;
+#elif defined(__SWITCH__)
+constexpr unsigned DEFAULT_DATA_BUFFER_SIZE    = 65536;
+constexpr unsigned DEFAULT_CONTROL_BUFFER_SIZE = 0;
+constexpr unsigned DEFAULT_KEEPALIVE           = 60;
+constexpr unsigned DEFAULT_BACKLOG             = 10;
+#else
+constexpr unsigned DEFAULT_DATA_BUFFER_SIZE    = 0;
+constexpr unsigned DEFAULT_CONTROL_BUFFER_SIZE = 0;
+constexpr unsigned DEFAULT_KEEPALIVE           = 60;
+constexpr unsigned DEFAULT_BACKLOG             = 128;
+#endif
 
 bool mkdirParent (std::string_view const path_)
 {
@@ -110,21 +144,66 @@ bool parseInt (T &out_, std::string_view const val_)
 ///////////////////////////////////////////////////////////////////////////
 FtpConfig::~FtpConfig () = default;
 
-FtpConfig::FtpConfig () : m_port (DEFAULT_PORT), m_deflateLevel (DEFAULT_DEFLATE_LEVEL)
+FtpConfig::FtpConfig ()
+    : m_port (DEFAULT_PORT),
+      m_backlog (DEFAULT_BACKLOG),
+      m_deflateLevel (DEFAULT_DEFLATE_LEVEL),
+      m_statCacheTTL (DEFAULT_STAT_TTL),
+      m_dataBufferSize (DEFAULT_DATA_BUFFER_SIZE),
+      m_controlBufferSize (DEFAULT_CONTROL_BUFFER_SIZE),
+      m_keepAlive (DEFAULT_KEEPALIVE),
+      m_pasvPortMin (DEFAULT_PASV_PORT_MIN),
+      m_pasvPortMax (DEFAULT_PASV_PORT_MAX)
+{
+}
+
+FtpConfig::FtpConfig (FtpConfig const &that_)
+    : m_user (that_.m_user),
+      m_pass (that_.m_pass),
+      m_hostname (that_.m_hostname),
+      m_port (that_.m_port),
+      m_backlog (that_.m_backlog),
+      m_deflateLevel (that_.m_deflateLevel),
+      m_statCacheTTL (that_.m_statCacheTTL),
+      m_rateLimit (that_.m_rateLimit),
+      m_sessionRateLimit (that_.m_sessionRateLimit),
+      m_dataBufferSize (that_.m_dataBufferSize),
+      m_controlBufferSize (that_.m_controlBufferSize),
+      m_keepAlive (that_.m_keepAlive),
+      m_pasvPortMin (that_.m_pasvPortMin),
+      m_pasvPortMax (that_.m_pasvPortMax),
+      m_pasvPeerCheck (that_.m_pasvPeerCheck)
+#ifndef CLASSIC
+      ,
+      m_lowUI (that_.m_lowUI)
+#endif
+#ifdef __3DS__
+      ,
+      m_getMTime (that_.m_getMTime)
+#endif
+#ifdef __SWITCH__
+      ,
+      m_enableAP (that_.m_enableAP),
+      m_ssid (that_.m_ssid),
+      m_passphrase (that_.m_passphrase)
+#endif
 {
 }
 
 UniqueFtpConfig FtpConfig::create ()
 {
-	return UniqueFtpConfig (new FtpConfig ());
+	auto config = UniqueFtpConfig (new FtpConfig ());
+	config->publish ();
+	return config;
 }
 
 UniqueFtpConfig FtpConfig::load (gsl::not_null<gsl::czstring> const path_)
 {
 	auto config = create ();
 
+	// text mode keeps the config on stdio for readLine
 	auto fp = fs::File ();
-	if (!fp.open (path_))
+	if (!fp.open (path_, "r"))
 		return config;
 
 	std::uint16_t port = DEFAULT_PORT;
@@ -154,8 +233,53 @@ UniqueFtpConfig FtpConfig::load (gsl::not_null<gsl::czstring> const path_)
 			config->m_pass = val;
 		else if (key == "port")
 			parseInt (port, val);
+		else if (key == "backlog")
+			config->setBacklog (val);
 		else if (key == "deflateLevel")
-			parseInt (deflateLevel, val);
+		{
+			if (val == "auto")
+				deflateLevel = DEFLATE_LEVEL_AUTO;
+			else
+				parseInt (deflateLevel, val);
+		}
+		else if (key == "statCacheTTL")
+			config->setStatCacheTTL (val);
+		else if (key == "rateLimit")
+			config->setRateLimit (val);
+		else if (key == "sessionRateLimit")
+			config->setSessionRateLimit (val);
+		else if (key == "dataBufferSize")
+			config->setDataBufferSize (val);
+		else if (key == "controlBufferSize")
+			config->setControlBufferSize (val);
+		else if (key == "keepAlive")
+			config->setKeepAlive (val);
+		else if (key == "pasvPorts")
+			config->setPasvPorts (val);
+		else if (key == "pasvPeerCheck")
+		{
+			if (val == "0")
+				config->m_pasvPeerCheck = false;
+			else if (val == "1")
+				config->m_pasvPeerCheck = true;
+			else
+				error ("Invalid value for pasvPeerCheck: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+#ifndef CLASSIC
+		else if (key == "lowUI")
+		{
+			if (val == "0")
+				config->m_lowUI = false;
+			else if (val == "1")
+				config->m_lowUI = true;
+			else
+				error ("Invalid value for lowUI: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+#endif
 #ifdef __3DS__
 		else if (key == "mtime")
 		{
@@ -191,6 +315,9 @@ UniqueFtpConfig FtpConfig::load (gsl::not_null<gsl::czstring> const path_)
 	config->setPort (port);
 	config->setDeflateLevel (deflateLevel);
 
+	// some keys were stored directly
+	config->publish ();
+
 	return config;
 }
 
@@ -201,13 +328,34 @@ std::scoped_lock<platform::Mutex> FtpConfig::lockGuard ()
 }
 #endif
 
+SharedFtpConfig FtpConfig::snapshot () const
+{
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_snapshotLock);
+#endif
+	return m_snapshot;
+}
+
+void FtpConfig::publish ()
+{
+	// the copy is made before taking the lock, and the old snapshot is released after it
+	auto snapshot = SharedFtpConfig (new FtpConfig (*this));
+	{
+#ifndef __NDS__
+		auto const lock = std::scoped_lock (m_snapshotLock);
+#endif
+		m_snapshot.swap (snapshot);
+	}
+}
+
 bool FtpConfig::save (gsl::not_null<gsl::czstring> const path_)
 {
 	if (!mkdirParent (path_.get ()))
 		return false;
 
+	// text mode keeps the config on stdio for fprintf
 	auto fp = fs::File ();
-	if (!fp.open (path_, "wb"))
+	if (!fp.open (path_, "w"))
 		return false;
 
 	if (!m_user.empty ())
@@ -215,7 +363,25 @@ bool FtpConfig::save (gsl::not_null<gsl::czstring> const path_)
 	if (!m_pass.empty ())
 		(void)std::fprintf (fp, "pass=%s\n", m_pass.c_str ());
 	(void)std::fprintf (fp, "port=%u\n", m_port);
-	(void)std::fprintf (fp, "deflateLevel=%u", m_deflateLevel);
+	(void)std::fprintf (fp, "backlog=%u\n", m_backlog);
+	if (m_deflateLevel == DEFLATE_LEVEL_AUTO)
+		(void)std::fprintf (fp, "deflateLevel=auto\n");
+	else
+		(void)std::fprintf (fp, "deflateLevel=%d\n", m_deflateLevel);
+	(void)std::fprintf (fp, "statCacheTTL=%u\n", m_statCacheTTL);
+	if (m_rateLimit)
+		(void)std::fprintf (fp, "rateLimit=%u\n", m_rateLimit);
+	if (m_sessionRateLimit)
+		(void)std::fprintf (fp, "sessionRateLimit=%u\n", m_sessionRateLimit);
+	(void)std::fprintf (fp, "dataBufferSize=%u\n", m_dataBufferSize);
+	(void)std::fprintf (fp, "controlBufferSize=%u\n", m_controlBufferSize);
+	(void)std::fprintf (fp, "keepAlive=%u\n", m_keepAlive);
+	(void)std::fprintf (fp, "pasvPorts=%u-%u\n", m_pasvPortMin, m_pasvPortMax);
+	(void)std::fprintf (fp, "pasvPeerCheck=%u\n", m_pasvPeerCheck);
+
+#ifndef CLASSIC
+	(void)std::fprintf (fp, "lowUI=%u\n", m_lowUI);
+#endif
 
 #ifdef __3DS__
 	(void)std::fprintf (fp, "mtime=%u\n", m_getMTime);
@@ -252,11 +418,68 @@ std::uint16_t FtpConfig::port () const
 	return m_port;
 }
 
+unsigned FtpConfig::backlog () const
+{
+	return m_backlog;
+}
+
 int FtpConfig::deflateLevel () const
 {
 	return m_deflateLevel;
 }
 
+unsigned FtpConfig::statCacheTTL () const
+{
+	return m_statCacheTTL;
+}
+
+unsigned FtpConfig::rateLimit () const
+{
+	return m_rateLimit;
+}
+
+unsigned FtpConfig::sessionRateLimit () const
+{
+	return m_sessionRateLimit;
+}
+
+unsigned FtpConfig::dataBufferSize () const
+{
+	return m_dataBufferSize;
+}
+
+unsigned FtpConfig::controlBufferSize () const
+{
+	return m_controlBufferSize;
+}
+
+unsigned FtpConfig::keepAlive () const
+{
+	return m_keepAlive;
+}
+
+std::uint16_t FtpConfig::pasvPortMin () const
+{
+	return m_pasvPortMin;
+}
+
+std::uint16_t FtpConfig::pasvPortMax () const
+{
+	return m_pasvPortMax;
+}
+
+bool FtpConfig::pasvPeerCheck () const
+{
+	return m_pasvPeerCheck;
+}
+
+#ifndef CLASSIC
+bool FtpConfig::lowUI () const
+{
+	return m_lowUI;
+}
+#endif
+
 #ifdef __3DS__
 bool FtpConfig::getMTime () const
 {
@@ -284,16 +507,19 @@ std::string const &FtpConfig::passphrase () const
 void FtpConfig::setUser (std::string user_)
 {
 	m_user = std::move (user_);
+	publish ();
 }
 
 void FtpConfig::setPass (std::string pass_)
 {
 	m_pass = std::move (pass_);
+	publish ();
 }
 
 void FtpConfig::setHostname (std::string hostname_)
 {
 	m_hostname = std::move (hostname_);
+	publish ();
 }
 
 bool FtpConfig::setPort (std::string_view const port_)
@@ -325,11 +551,42 @@ bool FtpConfig::setPort (std::uint16_t const port_)
 #endif
 
 	m_port = port_;
+	publish ();
+	return true;
+}
+
+bool FtpConfig::setBacklog (std::string_view const backlog_)
+{
+	unsigned parsed;
+	if (!parseInt (parsed, backlog_))
+		return false;
+
+	return setBacklog (parsed);
+}
+
+bool FtpConfig::setBacklog (unsigned const backlog_)
+{
+	if (backlog_ == 0 || backlog_ > static_cast<unsigned> (std::numeric_limits<int>::max ()))
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	m_backlog = backlog_;
+	publish ();
 	return true;
 }
 
 bool FtpConfig::setDeflateLevel (std::string_view const level_)
 {
+	constexpr std::string_view AUTO = "auto";
+	if (std::equal (std::begin (level_),
+	        std::end (level_),
+	        std::begin (AUTO),
+	        std::end (AUTO),
+	        [] (char const a_, char const b_) { return std::tolower (a_) == b_; }))
+		return setDeflateLevel (DEFLATE_LEVEL_AUTO);
+
 	int parsed;
 	if (!parseInt (parsed, level_))
 		return false;
@@ -339,17 +596,177 @@ bool FtpConfig::setDeflateLevel (std::string_view const level_)
 
 bool FtpConfig::setDeflateLevel (int const level_)
 {
-	if (level_ < Z_NO_COMPRESSION || level_ > Z_BEST_COMPRESSION)
+	if (level_ != DEFLATE_LEVEL_AUTO && (level_ < Z_NO_COMPRESSION || level_ > Z_BEST_COMPRESSION))
+	{
+		errno = EINVAL;
 		return false;
+	}
 
 	m_deflateLevel = level_;
+	publish ();
+	return true;
+}
+
+bool FtpConfig::setStatCacheTTL (std::string_view const ttl_)
+{
+	unsigned parsed;
+	if (!parseInt (parsed, ttl_))
+		return false;
+
+	setStatCacheTTL (parsed);
+	return true;
+}
+
+void FtpConfig::setStatCacheTTL (unsigned const ttl_)
+{
+	m_statCacheTTL = ttl_;
+	publish ();
+}
+
+bool FtpConfig::setRateLimit (std::string_view const limit_)
+{
+	unsigned parsed;
+	if (!parseInt (parsed, limit_))
+		return false;
+
+	setRateLimit (parsed);
+	return true;
+}
+
+void FtpConfig::setRateLimit (unsigned const limit_)
+{
+	m_rateLimit = limit_;
+	publish ();
+}
+
+bool FtpConfig::setSessionRateLimit (std::string_view const limit_)
+{
+	unsigned parsed;
+	if (!parseInt (parsed, limit_))
+		return false;
+
+	setSessionRateLimit (parsed);
+	return true;
+}
+
+void FtpConfig::setSessionRateLimit (unsigned const limit_)
+{
+	m_sessionRateLimit = limit_;
+	publish ();
+}
+
+bool FtpConfig::setDataBufferSize (std::string_view const size_)
+{
+	unsigned parsed;
+	if (!parseInt (parsed, size_))
+		return false;
+
+	setDataBufferSize (parsed);
+	return true;
+}
+
+void FtpConfig::setDataBufferSize (unsigned const size_)
+{
+	m_dataBufferSize = size_;
+	publish ();
+}
+
+bool FtpConfig::setControlBufferSize (std::string_view const size_)
+{
+	unsigned parsed;
+	if (!parseInt (parsed, size_))
+		return false;
+
+	setControlBufferSize (parsed);
 	return true;
 }
 
+void FtpConfig::setControlBufferSize (unsigned const size_)
+{
+	m_controlBufferSize = size_;
+	publish ();
+}
+
+bool FtpConfig::setKeepAlive (std::string_view const idle_)
+{
+	unsigned parsed;
+	if (!parseInt (parsed, idle_))
+		return false;
+
+	setKeepAlive (parsed);
+	return true;
+}
+
+void FtpConfig::setKeepAlive (unsigned const idle_)
+{
+	m_keepAlive = idle_;
+	publish ();
+}
+
+bool FtpConfig::setPasvPorts (std::string_view const range_)
+{
+	auto const pos = range_.find_first_of ('-');
+	if (pos == std::string_view::npos)
+	{
+		std::uint16_t parsed;
+		if (!parseInt (parsed, range_))
+			return false;
+
+		return setPasvPorts (parsed, parsed);
+	}
+
+	std::uint16_t min;
+	std::uint16_t max;
+	if (!parseInt (min, strip (range_.substr (0, pos))) ||
+	    !parseInt (max, strip (range_.substr (pos + 1))))
+		return false;
+
+	return setPasvPorts (min, max);
+}
+
+bool FtpConfig::setPasvPorts (std::uint16_t const min_, std::uint16_t const max_)
+{
+	// either both ephemeral or a non-empty range
+	if ((min_ == 0) != (max_ == 0) || min_ > max_)
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+#ifdef __SWITCH__
+	// Switch is not allowed < 1024, except 0
+	if (min_ < 1024 && min_ != 0)
+	{
+		errno = EPERM;
+		return false;
+	}
+#endif
+
+	m_pasvPortMin = min_;
+	m_pasvPortMax = max_;
+	publish ();
+	return true;
+}
+
+void FtpConfig::setPasvPeerCheck (bool const check_)
+{
+	m_pasvPeerCheck = check_;
+	publish ();
+}
+
+#ifndef CLASSIC
+void FtpConfig::setLowUI (bool const lowUI_)
+{
+	m_lowUI = lowUI_;
+	publish ();
+}
+#endif
+
 #ifdef __3DS__
 void FtpConfig::setGetMTime (bool const getMTime_)
 {
 	m_getMTime = getMTime_;
+	publish ();
 }
 #endif
 
@@ -357,15 +774,18 @@ void FtpConfig::setGetMTime (bool const getMTime_)
 void FtpConfig::setEnableAP (bool const enable_)
 {
 	m_enableAP = enable_;
+	publish ();
 }
 
 void FtpConfig::setSSID (std::string_view const ssid_)
 {
 	m_ssid = ssid_.substr (0, ssid_.find_first_of ('\0'));
+	publish ();
 }
 
 void FtpConfig::setPassphrase (std::string_view const passphrase_)
 {
 	m_passphrase = passphrase_.substr (0, passphrase_.find_first_of ('\0'));
+	publish ();
 }
 #endif
@@ -26,13 +26,18 @@
 #include "ftpConfig.h"
 #include "ftpSession.h"
 #include "licenses.h"
+#include "listingCache.h"
 #include "log.h"
 #include "platform.h"
+#include "poller.h"
 #include "sockAddr.h"
 #include "socket.h"
+#include "statCache.h"
+#include "stats.h"
 
 #ifndef __NDS__
 #include "mdns.h"
+#include "threadPool.h"
 #endif
 
 #ifdef __NDS__
@@ -96,13 +101,132 @@ auto const s_startTime = std::time (nullptr);
 int s_tzOffset = 0;
 #endif
 
+/// \brief Minimum time between free space queries
+constexpr auto FREE_SPACE_INTERVAL = 2s;
+
+/// \brief Time between session snapshot refreshes
+constexpr auto DRAW_INTERVAL = 100ms;
+
+#ifndef CLASSIC
+/// \brief Time between session snapshot refreshes in low-UI mode
+constexpr auto LOW_UI_DRAW_INTERVAL = 1000ms;
+
+/// \brief Time to idle after each frame in low-UI mode while transfers are active
+constexpr auto LOW_UI_FRAME_IDLE = 100ms;
+#endif
+
+#ifdef __NDS__
+/// \brief Free bytes; adjusted by writes and deletes between queries
+std::int64_t s_freeBytes = 0;
+
+/// \brief Whether s_freeBytes has been queried
+bool s_freeSpaceValid = false;
+
+/// \brief Whether a free space query was requested
+bool s_freeSpacePending = false;
+#else
+/// \brief Free bytes; adjusted by writes and deletes between queries
+std::atomic<std::int64_t> s_freeBytes = 0;
+
+/// \brief Whether s_freeBytes has been queried
+std::atomic_bool s_freeSpaceValid = false;
+
+/// \brief Whether a free space query was requested
+std::atomic_bool s_freeSpacePending = false;
+
+/// \brief Whether a free space query is running
+std::atomic_bool s_freeSpaceBusy = false;
+#endif
+
+/// \brief Start time of the last free space query
+/// \note Only used by the server thread
+platform::steady_clock::time_point s_freeSpaceTime;
+
+/// \brief Longest wait for connections before the server loop runs again
+/// \note Free space requests, hostname changes and worker failures are picked up by then
+constexpr auto SERVER_TIMEOUT = 1000ms;
+
+/// \brief Connections accepted from a listen socket per wakeup
+constexpr auto ACCEPT_BATCH = 32;
+
+#if FTPD_HAS_POLLER_WAKE
+/// \brief Longest wait of a worker with sessions
+/// \note Only the idle timeouts, counted in whole seconds, need it; the rest wakes the worker
+constexpr auto WORKER_TIMEOUT = 1000ms;
+#else
+/// \brief Longest wait of a worker with sessions
+/// \note The worker runs on the main thread, which also has to draw
+constexpr auto WORKER_TIMEOUT = 16ms;
+#endif
+
+#if defined(__NDS__) || defined(__3DS__)
+/// \brief Number of session workers
+constexpr auto WORKER_COUNT = 1;
+#elif defined(__SWITCH__)
+/// \brief Number of session workers
+/// \note Leave a core for the UI thread
+constexpr auto WORKER_COUNT = 3;
+#else
+/// \brief Number of session workers
+constexpr auto WORKER_COUNT = 4;
+#endif
+
 #ifndef __NDS__
-/// \brief Mutex for s_freeSpace
-platform::Mutex s_lock;
+/// \brief Get free space query thread pool
+ThreadPool &freeSpacePool ()
+{
+	static ThreadPool pool (1);
+	return pool;
+}
 #endif
 
-/// \brief Free space string
-std::string s_freeSpace;
+/// \brief Query free space
+/// \note Slow on FAT, which may walk its allocation table
+void queryFreeSpace ()
+{
+	statvfs_t st = {};
+#if defined(__NDS__) || defined(__3DS__) || defined(__SWITCH__)
+	if (::statvfs ("sdmc:/", &st) != 0)
+#else
+	if (::statvfs ("/", &st) != 0)
+#endif
+		return;
+
+	auto const bytes = static_cast<std::uint64_t> (st.f_bsize) * st.f_bfree;
+	s_freeBytes      = static_cast<std::int64_t> (bytes);
+	s_freeSpaceValid = true;
+}
+
+/// \brief Start a requested free space query once the last one is old enough
+/// \note Bursts of small uploads and deletes share one query
+void scheduleFreeSpace ()
+{
+	if (!s_freeSpacePending)
+		return;
+
+#ifndef __NDS__
+	if (s_freeSpaceBusy)
+		return;
+#endif
+
+	auto const now = platform::steady_clock::now ();
+	if (now - s_freeSpaceTime < FREE_SPACE_INTERVAL)
+		return;
+
+	// requests made while the query runs start another one
+	s_freeSpacePending = false;
+	s_freeSpaceTime    = now;
+
+#ifdef __NDS__
+	queryFreeSpace ();
+#else
+	s_freeSpaceBusy = true;
+	freeSpacePool ().submit ([] {
+		queryFreeSpace ();
+		s_freeSpaceBusy = false;
+	});
+#endif
+}
 
 #ifndef CLASSIC
 #ifndef NDEBUG
@@ -205,10 +329,206 @@ std::size_t curlCallback (void *const contents_,
 #endif
 }
 
+///////////////////////////////////////////////////////////////////////////
+/// \brief Session worker
+/// \note Each worker polls its own sessions; a slow transfer only stalls its own worker
+class FtpServer::Worker
+{
+public:
+	~Worker ();
+
+	/// \brief Create worker
+	static UniqueWorker create ();
+
+	/// \brief Hand a session to this worker
+	/// \param session_ Session to adopt
+	void adopt (UniqueFtpSession session_);
+
+	/// \brief Number of sessions owned by this worker
+	std::size_t load () const;
+
+	/// \brief Whether polling failed
+	bool failed () const;
+
+	/// \brief Draw sessions
+	/// \param separator_ Whether to separate the first session from previous output
+	/// \param interval_ Time between session snapshot refreshes
+	/// \returns Whether a following session needs a separator
+	bool draw (bool separator_, std::chrono::milliseconds interval_);
+
+#ifndef CLASSIC
+	/// \brief Draw session connections
+	void drawConnections ();
+#endif
+
+	/// \brief Worker loop
+	void loop ();
+
+private:
+	Worker () = default;
+
+	/// \brief Thread entry point
+	void threadFunc ();
+
+#ifndef __NDS__
+	/// \brief Thread
+	platform::Thread m_thread;
+
+	/// \brief Mutex
+	platform::Mutex m_lock;
+#endif
+
+	/// \brief Session socket poller
+	UniquePoller m_poller;
+
+	/// \brief Sessions
+	std::vector<UniqueFtpSession> m_sessions;
+
+	/// \brief Sessions waiting to be adopted by the worker thread
+	std::vector<UniqueFtpSession> m_pendingSessions;
+
+	/// \brief Number of owned sessions
+	std::atomic<std::size_t> m_load = 0;
+
+	/// \brief Whether polling failed
+	std::atomic_bool m_failed = false;
+
+	/// \brief Whether thread should quit
+	std::atomic_bool m_quit = false;
+};
+
+FtpServer::Worker::~Worker ()
+{
+	m_quit = true;
+#if FTPD_HAS_POLLER_WAKE
+	m_poller->wake ();
+#endif
+
+#ifndef __NDS__
+	m_thread.join ();
+#endif
+}
+
+FtpServer::UniqueWorker FtpServer::Worker::create ()
+{
+	auto poller = Poller::create ();
+	if (!poller)
+		return nullptr;
+
+	auto worker      = UniqueWorker (new Worker ());
+	worker->m_poller = std::move (poller);
+
+#ifndef __NDS__
+	worker->m_thread = platform::Thread (std::bind (&Worker::threadFunc, worker.get ()));
+#endif
+
+	return worker;
+}
+
+void FtpServer::Worker::adopt (UniqueFtpSession session_)
+{
+	m_load.fetch_add (1, std::memory_order_relaxed);
+	LOCKED (m_pendingSessions.emplace_back (std::move (session_)));
+
+#if FTPD_HAS_POLLER_WAKE
+	// let the worker pick it up right away
+	m_poller->wake ();
+#endif
+}
+
+std::size_t FtpServer::Worker::load () const
+{
+	return m_load.load (std::memory_order_relaxed);
+}
+
+bool FtpServer::Worker::failed () const
+{
+	return m_failed;
+}
+
+bool FtpServer::Worker::draw (bool separator_, std::chrono::milliseconds const interval_)
+{
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+	for (auto &session : m_sessions)
+	{
+#ifdef CLASSIC
+		if (separator_)
+			std::fputc ('\n', stdout);
+		separator_ = true;
+#endif
+		session->draw (interval_);
+	}
+
+	return separator_;
+}
+
+#ifndef CLASSIC
+void FtpServer::Worker::drawConnections ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	for (auto const &session : m_sessions)
+		session->drawConnections ();
+}
+#endif
+
+void FtpServer::Worker::loop ()
+{
+	{
+		std::vector<UniqueFtpSession> deadSessions;
+		{
+			// adopt new sessions and remove dead sessions
+#ifndef __NDS__
+			auto const lock = std::scoped_lock (m_lock);
+#endif
+			for (auto &session : m_pendingSessions)
+				m_sessions.emplace_back (std::move (session));
+			m_pendingSessions.clear ();
+
+			auto it = std::begin (m_sessions);
+			while (it != std::end (m_sessions))
+			{
+				auto &session = *it;
+				if (session->dead ())
+				{
+					deadSessions.emplace_back (std::move (session));
+					it = m_sessions.erase (it);
+				}
+				else
+					++it;
+			}
+		}
+
+		m_load.fetch_sub (deadSessions.size (), std::memory_order_relaxed);
+	}
+
+	// poll sessions
+	if (!m_sessions.empty ())
+	{
+		if (!FtpSession::poll (*m_poller, m_sessions, WORKER_TIMEOUT))
+			m_failed = true;
+	}
+#if FTPD_HAS_POLLER_WAKE
+	// nothing to do until a session is adopted, which ends the wait
+	else
+		m_poller->wait (-1ms);
+#endif
+}
+
+void FtpServer::Worker::threadFunc ()
+{
+	while (!m_quit && !m_failed)
+		loop ();
+}
+
 ///////////////////////////////////////////////////////////////////////////
 FtpServer::~FtpServer ()
 {
 	m_quit = true;
+#if FTPD_HAS_POLLER_WAKE
+	wake ();
+#endif
 
 #ifndef __NDS__
 	m_thread.join ();
@@ -228,7 +548,7 @@ FtpServer::~FtpServer ()
 }
 
 FtpServer::FtpServer (UniqueFtpConfig config_)
-    : m_config (std::move (config_))
+    : m_config (std::move (config_)), m_pasvPool (PasvPool::create ())
 #ifndef CLASSIC
       ,
       m_hostnameSetting (m_config->hostname ())
@@ -281,15 +601,13 @@ void FtpServer::draw ()
 	}
 
 	{
-#ifndef __NDS__
-		auto const lock = std::scoped_lock (s_lock);
-#endif
-		if (!s_freeSpace.empty ())
+		auto const freeSpace = getFreeSpace ();
+		if (!freeSpace.empty ())
 		{
 			consoleSelect (&g_statusConsole);
 			std::printf ("\x1b[0;%uH\x1b[32;1m%s",
-			    static_cast<unsigned> (g_statusConsole.windowWidth - s_freeSpace.size () + 1),
-			    s_freeSpace.c_str ());
+			    static_cast<unsigned> (g_statusConsole.windowWidth - freeSpace.size () + 1),
+			    freeSpace.c_str ());
 			std::fflush (stdout);
 		}
 	}
@@ -300,17 +618,22 @@ void FtpServer::draw ()
 #endif
 		consoleSelect (&g_sessionConsole);
 		std::fputs ("\x1b[2J", stdout);
-		for (auto &session : m_sessions)
-		{
-			session->draw ();
-			if (&session != &m_sessions.back ())
-				std::fputc ('\n', stdout);
-		}
+		bool separator = false;
+		for (auto &worker : m_workers)
+			separator = worker->draw (separator, DRAW_INTERVAL);
 		std::fflush (stdout);
 	}
 
 	drawLog ();
 #else
+	{
+		// low-UI mode only throttles frames while bytes are moving
+		auto const &global = stats::global ();
+		auto const bytes   = global.bytesIn.load () + global.bytesOut.load ();
+		m_throttleUI       = bytes != m_drawBytes && m_config->snapshot ()->lowUI ();
+		m_drawBytes        = bytes;
+	}
+
 	auto const &io    = ImGui::GetIO ();
 	auto const width  = io.DisplaySize.x;
 	auto const height = io.DisplaySize.y;
@@ -372,15 +695,24 @@ void FtpServer::draw ()
 #endif
 
 	{
+		auto const interval = m_throttleUI ? LOW_UI_DRAW_INTERVAL : DRAW_INTERVAL;
+
 		auto const lock = std::scoped_lock (m_lock);
-		for (auto &session : m_sessions)
-			session->draw ();
+		for (auto &worker : m_workers)
+			worker->draw (false, interval);
 	}
 
 	ImGui::End ();
 #endif
 }
 
+#ifndef CLASSIC
+std::chrono::milliseconds FtpServer::frameIdle () const
+{
+	return m_throttleUI ? LOW_UI_FRAME_IDLE : 0ms;
+}
+#endif
+
 bool FtpServer::quit ()
 {
 	return m_quit;
@@ -388,38 +720,33 @@ bool FtpServer::quit ()
 
 UniqueFtpServer FtpServer::create ()
 {
-	updateFreeSpace ();
+	return create (FtpConfig::load (FTPDCONFIG));
+}
 
-	auto config = FtpConfig::load (FTPDCONFIG);
+UniqueFtpServer FtpServer::create (UniqueFtpConfig config_)
+{
+	updateFreeSpace ();
 
-	return UniqueFtpServer (new FtpServer (std::move (config)));
+	return UniqueFtpServer (new FtpServer (std::move (config_)));
 }
 
 std::string FtpServer::getFreeSpace ()
 {
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
-	return s_freeSpace;
+	if (!s_freeSpaceValid)
+		return {};
+
+	return fs::printSize (std::max<std::int64_t> (s_freeBytes, 0));
 }
 
 void FtpServer::updateFreeSpace ()
 {
-	statvfs_t st = {};
-#if defined(__NDS__) || defined(__3DS__) || defined(__SWITCH__)
-	if (::statvfs ("sdmc:/", &st) != 0)
-#else
-	if (::statvfs ("/", &st) != 0)
-#endif
-		return;
-
-	auto freeSpace = fs::printSize (static_cast<std::uint64_t> (st.f_bsize) * st.f_bfree);
+	// picked up by the server thread
+	s_freeSpacePending = true;
+}
 
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
-	if (freeSpace != s_freeSpace)
-		s_freeSpace = std::move (freeSpace);
+void FtpServer::adjustFreeSpace (std::int64_t const delta_)
+{
+	s_freeBytes += delta_;
 }
 
 std::time_t FtpServer::startTime ()
@@ -440,17 +767,16 @@ void FtpServer::handleNetworkFound ()
 	if (!platform::networkAddress (addr))
 		return;
 
-	std::uint16_t port;
-
-	{
-#ifndef __NDS__
-		auto const lock = m_config->lockGuard ();
-#endif
-		port = m_config->port ();
-	}
+	auto const settings = m_config->snapshot ();
+	auto const port     = settings->port ();
+	auto const backlog  = settings->backlog ();
 
 	addr.setPort (port);
 
+	auto poller = Poller::create ();
+	if (!poller)
+		return;
+
 	auto socket = Socket::create (Socket::eStream);
 	if (!socket)
 		return;
@@ -461,7 +787,11 @@ void FtpServer::handleNetworkFound ()
 	if (!socket->bind (addr))
 		return;
 
-	if (!socket->listen (10))
+	if (!socket->listen (backlog))
+		return;
+
+	// connections are accepted until the backlog is drained
+	if (!socket->setNonBlocking ())
 		return;
 
 	auto const &sockName = socket->sockName ();
@@ -470,15 +800,63 @@ void FtpServer::handleNetworkFound ()
 	m_name.resize (std::strlen (name) + 3 + 5);
 	m_name.resize (std::sprintf (m_name.data (), "[%s]:%u", name, sockName.port ()));
 
+#ifndef NO_IPV6
+	// dual-stack; IPv6 clients get their own listener on the same port, and lacking IPv6 isn't
+	// fatal
+	auto const loopback = static_cast<sockaddr_in const &> (sockName).sin_addr.s_addr ==
+	                      htonl (INADDR_LOOPBACK);
+	auto const addr6 = SockAddr (loopback ? in6addr_loopback : in6addr_any, sockName.port ());
+
+	auto socket6 = Socket::create (Socket::eStream, SockAddr::Domain::IPv6);
+	if (socket6 && (!socket6->setV6Only () || (port != 0 && !socket6->setReuseAddress (true)) ||
+	                   !socket6->bind (addr6) || !socket6->listen (backlog) ||
+	                   !socket6->setNonBlocking ()))
+		socket6.reset ();
+
+	if (socket6)
+		info ("Listening on [%s]:%u\n", socket6->sockName ().name (), socket6->sockName ().port ());
+#endif
+
+	// sessions survive a rebind of the listen sockets; only network loss stops the workers
+	std::vector<UniqueWorker> workers;
+	for (unsigned i = 0; m_workers.empty () && i < WORKER_COUNT; ++i)
+	{
+		auto worker = Worker::create ();
+		if (!worker)
+			return;
+
+		workers.emplace_back (std::move (worker));
+	}
+
 	info ("Started server at %s\n", m_name.c_str ());
 
+	// each listen socket is the owner of its registration
+	if (!poller->update (*socket, POLLIN, socket.get ()))
+		return;
+#ifndef NO_IPV6
+	if (socket6 && !poller->update (*socket6, POLLIN, socket6.get ()))
+		return;
+#endif
+
+	// old sockets must leave the old poller before it goes away
+	closeListeners ();
+
+	LOCKED (m_poller = std::move (poller));
+	if (!workers.empty ())
+		LOCKED (m_workers = std::move (workers));
 	LOCKED (m_socket = std::move (socket));
+#ifndef NO_IPV6
+	LOCKED (m_socket6 = std::move (socket6));
+#endif
 
 #ifndef __NDS__
 	socket = mdns::createSocket ();
 	if (!socket)
 		return;
 
+	// queries only wake the loop; mdns::handleSocket reads them
+	m_poller->update (*socket, POLLIN, nullptr);
+
 	LOCKED (m_mdnsSocket = std::move (socket));
 #endif
 }
@@ -486,16 +864,29 @@ void FtpServer::handleNetworkFound ()
 void FtpServer::handleNetworkLost ()
 {
 	{
-		// destroy sessions
-		std::vector<UniqueFtpSession> sessions;
-		LOCKED (sessions = std::move (m_sessions));
+		// stop workers and destroy sessions
+		std::vector<UniqueWorker> workers;
+		LOCKED (workers = std::move (m_workers));
 	}
 
+	closeListeners ();
+
+	// listeners are bound to the address which went away
+	m_pasvPool->clear ();
+
+	info ("Stopped server at %s\n", m_name.c_str ());
+}
+
+void FtpServer::closeListeners ()
+{
 	{
 		UniqueSocket sock;
 
 		// destroy command socket
 		LOCKED (sock = std::move (m_socket));
+#ifndef NO_IPV6
+		LOCKED (sock = std::move (m_socket6));
+#endif
 
 #ifndef __NDS__
 		// destroy mDNS socket
@@ -503,13 +894,59 @@ void FtpServer::handleNetworkLost ()
 #endif
 	}
 
-	info ("Stopped server at %s\n", m_name.c_str ());
+	UniquePoller poller;
+	LOCKED (poller = std::move (m_poller));
+}
+
+#if FTPD_HAS_POLLER_WAKE
+void FtpServer::wake ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	if (m_poller)
+		m_poller->wake ();
+}
+#endif
+
+bool FtpServer::acceptSessions (Socket &socket_)
+{
+	for (unsigned i = 0; i < ACCEPT_BATCH; ++i)
+	{
+		auto socket = socket_.accept ();
+		if (!socket)
+		{
+			auto const err = errno;
+			if (err == EWOULDBLOCK || err == EINTR || err == ECONNABORTED || err == EPROTO)
+				return true;
+
+			// out of descriptors or memory; back off instead of spinning on the backlog
+			if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+			{
+#ifndef __NDS__
+				platform::Thread::sleep (16ms);
+#endif
+				return true;
+			}
+
+			return false;
+		}
+
+		// hand the session to the least-loaded worker
+		auto const worker = std::min_element (std::begin (m_workers),
+		    std::end (m_workers),
+		    [] (auto const &lhs_, auto const &rhs_) { return lhs_->load () < rhs_->load (); });
+
+		(*worker)->adopt (FtpSession::create (*m_config, *m_pasvPool, std::move (socket)));
+	}
+
+	// the rest are picked up on the next wakeup
+	return true;
 }
 
 #ifndef CLASSIC
 void FtpServer::showMenu ()
 {
 	auto const prevShowSettings = m_showSettings;
+	auto const prevShowStats    = m_showStats;
 	auto const prevShowAbout    = m_showAbout;
 
 	if (ImGui::BeginMenuBar ())
@@ -523,6 +960,9 @@ void FtpServer::showMenu ()
 			if (ImGui::MenuItem ("Settings"))
 				m_showSettings = true;
 
+			if (ImGui::MenuItem ("Statistics"))
+				m_showStats = true;
+
 			if (ImGui::MenuItem ("Upload Log"))
 			{
 #ifndef __NDS__
@@ -567,6 +1007,8 @@ void FtpServer::showMenu ()
 					// signal network thread to process
 					m_uploadLogMime = mime;
 					m_uploadLogCurl.store (handle, std::memory_order_relaxed);
+					if (m_poller)
+						m_poller->wake ();
 				}
 			}
 
@@ -606,6 +1048,8 @@ void FtpServer::showMenu ()
 
 			m_deflateLevelSetting = m_config->deflateLevel ();
 
+			m_lowUISetting = m_config->lowUI ();
+
 #ifdef __3DS__
 			m_getMTimeSetting = m_config->getMTime ();
 #endif
@@ -626,6 +1070,14 @@ void FtpServer::showMenu ()
 		showSettings ();
 	}
 
+	if (m_showStats)
+	{
+		if (!prevShowStats)
+			ImGui::OpenPopup ("Statistics");
+
+		showStats ();
+	}
+
 	if (m_showAbout)
 	{
 		if (!prevShowAbout)
@@ -674,8 +1126,14 @@ void FtpServer::showSettings ()
 		    "%u",
 		    ImGuiInputTextFlags_AutoSelectAll);
 
-		ImGui::SliderInt (
-		    "Deflate Level", &m_deflateLevelSetting, Z_NO_COMPRESSION, Z_BEST_COMPRESSION);
+		// the leftmost slider position is the auto level
+		ImGui::SliderInt ("Deflate Level",
+		    &m_deflateLevelSetting,
+		    FtpConfig::DEFLATE_LEVEL_AUTO,
+		    Z_BEST_COMPRESSION,
+		    m_deflateLevelSetting == FtpConfig::DEFLATE_LEVEL_AUTO ? "auto" : "%d");
+
+		ImGui::Checkbox ("Max throughput (low UI)", &m_lowUISetting);
 
 #ifdef __3DS__
 		ImGui::Checkbox ("Get mtime", &m_getMTimeSetting);
@@ -744,9 +1202,12 @@ void FtpServer::showSettings ()
 			m_config->setHostname (m_hostnameSetting);
 			m_config->setPort (m_portSetting);
 			m_config->setDeflateLevel (m_deflateLevelSetting);
+			m_config->setLowUI (m_lowUISetting);
 
 #ifdef __3DS__
 			m_config->setGetMTime (m_getMTimeSetting);
+			StatCache::instance ().clear ();
+			ListingCache::instance ().clear ();
 #endif
 
 #ifdef __SWITCH__
@@ -756,10 +1217,11 @@ void FtpServer::showSettings ()
 			m_apError = false;
 #endif
 
-			UniqueSocket socket;
-			LOCKED (socket = std::move (m_socket));
+			// the server thread owns the listen sockets and dispatches their events
+			m_rebind = true;
 
 			mdns::setHostname (m_hostnameSetting);
+			wake ();
 		}
 
 		if (save)
@@ -779,6 +1241,7 @@ void FtpServer::showSettings ()
 			m_passSetting     = defaults->pass ();
 			m_hostnameSetting = defaults->hostname ();
 			m_portSetting     = defaults->port ();
+			m_lowUISetting    = defaults->lowUI ();
 #ifdef __3DS__
 			m_getMTimeSetting = defaults->getMTime ();
 #endif
@@ -800,6 +1263,43 @@ void FtpServer::showSettings ()
 	}
 }
 
+void FtpServer::showStats ()
+{
+	auto const &io    = ImGui::GetIO ();
+	auto const width  = io.DisplaySize.x;
+	auto const height = io.DisplaySize.y;
+
+#ifdef __3DS__
+	ImGui::SetNextWindowSize (ImVec2 (width * 0.8f, height * 0.5f));
+	ImGui::SetNextWindowPos (ImVec2 (width * 0.1f, height * 0.5f));
+#else
+	ImGui::SetNextWindowSize (ImVec2 (width * 0.8f, height * 0.8f));
+	ImGui::SetNextWindowPos (ImVec2 (width * 0.1f, height * 0.1f));
+#endif
+	if (ImGui::BeginPopupModal ("Statistics",
+	        nullptr,
+	        ImGuiWindowFlags_NoCollapse | ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize))
+	{
+		for (auto const &line : stats::describe ())
+			ImGui::TextUnformatted (line.c_str ());
+
+		ImGui::Separator ();
+
+		if (ImGui::Button ("Reset", ImVec2 (100, 0)))
+			stats::reset ();
+
+		ImGui::SameLine ();
+
+		if (ImGui::Button ("OK", ImVec2 (100, 0)))
+		{
+			m_showStats = false;
+			ImGui::CloseCurrentPopup ();
+		}
+
+		ImGui::EndPopup ();
+	}
+}
+
 void FtpServer::showAbout ()
 {
 	auto const &io    = ImGui::GetIO ();
@@ -838,8 +1338,9 @@ void FtpServer::showAbout ()
 		ImGui::Separator ();
 		if (ImGui::TreeNode ("Connections"))
 		{
-			for (auto const &session : m_sessions)
-				session->drawConnections ();
+			auto const lock = std::scoped_lock (m_lock);
+			for (auto const &worker : m_workers)
+				worker->drawConnections ();
 			ImGui::TreePop ();
 		}
 
@@ -929,24 +1430,23 @@ void FtpServer::showAbout ()
 
 void FtpServer::loop ()
 {
+	scheduleFreeSpace ();
+
+	// settings changes rebind the listen sockets; sessions keep running
+	if (m_rebind.exchange (false) && m_socket)
+		closeListeners ();
+
 	if (!m_socket)
 	{
 #ifndef CLASSIC
 #ifdef __SWITCH__
 		if (!m_apError)
 		{
-			bool enable;
-			std::string ssid;
-			std::string passphrase;
-
-			{
-				auto const lock = m_config->lockGuard ();
-				enable          = m_config->enableAP ();
-				ssid            = m_config->ssid ();
-				passphrase      = m_config->passphrase ();
-			}
+			auto const settings = m_config->snapshot ();
 
-			m_apError = !platform::enableAP (enable, ssid, passphrase);
+			m_apError = !platform::enableAP (settings->enableAP (),
+			    settings->ssid (),
+			    settings->passphrase ());
 		}
 #endif
 #endif
@@ -1006,71 +1506,79 @@ void FtpServer::loop ()
 	}
 #endif
 
-	// poll listen socket
+	// a worker failing to poll means the network went away
+	for (auto const &worker : m_workers)
+	{
+		if (worker->failed ())
+		{
+			handleNetworkLost ();
+			return;
+		}
+	}
+
+	// wait for connections and mDNS queries
 	if (m_socket)
 	{
-		Socket::PollInfo info{*m_socket, POLLIN, 0};
-		auto const rc = Socket::poll (&info, 1, 0ms);
+#ifdef __NDS__
+		auto const rc = m_poller->wait (0ms);
+#else
+		auto timeout = SERVER_TIMEOUT;
+#ifndef CLASSIC
+		// keep the log upload moving
+		if (m_uploadLogCurl.load (std::memory_order_relaxed))
+			timeout = 16ms;
+#endif
+
+		// mDNS probes and announcements go out from this loop
+		if (m_mdnsSocket)
+		{
+			auto const mdnsTimeout = mdns::timeout ();
+			if (mdnsTimeout >= 0ms)
+				timeout = std::min (timeout, mdnsTimeout);
+		}
+
+		auto const rc = m_poller->wait (timeout);
+#endif
 		if (rc < 0)
 		{
 			handleNetworkLost ();
 			return;
 		}
 
-		if (rc > 0 && (info.revents & POLLIN))
+		for (auto const &event : m_poller->events ())
 		{
-			auto socket = m_socket->accept ();
-			if (socket)
-			{
-				auto session = FtpSession::create (*m_config, std::move (socket));
-				LOCKED (m_sessions.emplace_back (std::move (session)));
-			}
-			else
+			// mDNS queries have no owner
+			if (!event.owner || !(event.revents & POLLIN))
+				continue;
+
+			if (!acceptSessions (*static_cast<Socket *> (event.owner)))
 			{
 				handleNetworkLost ();
 				return;
 			}
 		}
 	}
+#ifndef __NDS__
+	else
+		platform::Thread::sleep (16ms);
+#endif
 
 #ifndef __NDS__
 	// poll mDNS socket
 	if (m_socket && m_mdnsSocket)
-		mdns::handleSocket (m_mdnsSocket.get (), m_socket->sockName ());
-#endif
-
 	{
-		std::vector<UniqueFtpSession> deadSessions;
-		{
-			// remove dead sessions
-#ifndef __NDS__
-			auto const lock = std::scoped_lock (m_lock);
+#ifndef NO_IPV6
+		mdns::handleSocket (m_mdnsSocket.get (),
+		    m_socket->sockName (),
+		    m_socket6 ? &m_socket6->sockName () : nullptr);
+#else
+		mdns::handleSocket (m_mdnsSocket.get (), m_socket->sockName ());
 #endif
-			auto it = std::begin (m_sessions);
-			while (it != std::end (m_sessions))
-			{
-				auto &session = *it;
-				if (session->dead ())
-				{
-					deadSessions.emplace_back (std::move (session));
-					it = m_sessions.erase (it);
-				}
-				else
-					++it;
-			}
-		}
 	}
-
-	// poll sessions
-	if (!m_sessions.empty ())
-	{
-		if (!FtpSession::poll (m_sessions))
-			handleNetworkLost ();
-	}
-#ifndef __NDS__
-	// avoid busy polling in background thread
-	else
-		platform::Thread::sleep (16ms);
+#else
+	// no threads; poll sessions inline
+	for (auto const &worker : m_workers)
+		worker->loop ();
 #endif
 }
 
@@ -23,9 +23,12 @@
 #include "ftpSession.h"
 
 #include "ftpServer.h"
+#include "listingCache.h"
 #include "log.h"
 #include "mdns.h"
 #include "platform.h"
+#include "statCache.h"
+#include "stats.h"
 
 #ifndef CLASSIC
 #include <imgui.h>
@@ -36,17 +39,21 @@
 #include <unistd.h>
 
 #if FTPD_HAS_GLOB
-#include <glob.h>
+#include <fnmatch.h>
 #endif
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cerrno>
 #include <chrono>
 #include <cinttypes>
+#include <cmath>
 #include <cstdarg>
+#include <cstdint>
 #include <cstring>
 #include <ctime>
+#include <iterator>
 #include <mutex>
 #include <string>
 using namespace std::chrono_literals;
@@ -71,6 +78,42 @@ namespace
 /// \brief Idle timeout
 constexpr auto IDLE_TIMEOUT = 60;
 
+/// \brief Time in State::COMMAND after which an idle session hibernates
+constexpr auto HIBERNATE_TIMEOUT = 10;
+
+/// \brief Idle timeout of a hibernated session
+/// \note Monitoring clients hold idle control connections for hours
+constexpr auto HIBERNATED_IDLE_TIMEOUT = 24 * 60 * 60;
+
+#if FTPD_HAS_PARALLEL_DEFLATE
+/// \brief Initial auto deflate level
+constexpr auto AUTO_DEFLATE_LEVEL = 6;
+#else
+/// \brief Initial auto deflate level
+/// \note Without the compression threads start cheap and only climb on a slow link
+constexpr auto AUTO_DEFLATE_LEVEL = Z_BEST_SPEED;
+#endif
+
+#ifndef __NDS__
+/// \brief Poll timeout while a session is waiting on pipelined file I/O
+constexpr auto IO_WAIT_TIMEOUT = 2ms;
+#endif
+
+/// \brief Maximum number of scheduling rounds per poll
+constexpr auto XFER_ROUNDS = 10;
+
+/// \brief Minimum credit charged per transfer step
+/// \note Steps which only fill buffers still use up the session's turn
+constexpr std::int64_t XFER_STEP_COST = 4096;
+
+#ifndef __NDS__
+/// \brief Mutex for the total rate limiter
+platform::Mutex s_rateLock;
+#endif
+
+/// \brief Total rate limiter shared by all sessions
+TokenBucket s_rateBucket;
+
 /// \brief Check if string view is a C string
 /// \param str_ String to check
 bool isCString (std::string_view const str_)
@@ -118,6 +161,88 @@ std::pair<char *, char *> parseCommand (char *const buffer_, std::size_t const s
 	return {nullptr, nullptr};
 }
 
+/// \brief Number of command hash slots (log2)
+constexpr unsigned COMMAND_HASH_BITS = 8;
+
+/// \brief Empty command hash slot
+constexpr std::uint8_t COMMAND_HASH_EMPTY = 0xFF;
+
+/// \brief Pack a command verb into a case-insensitive key
+/// \param verb_ Command verb
+/// \returns Key, or 0 if the verb can't name a command
+/// \note Verbs are letters and digits; only a-z is folded so no other byte aliases a command
+constexpr std::uint64_t commandKey (std::string_view const verb_)
+{
+	// XSHA256 is the longest verb
+	if (verb_.size () < 3 || verb_.size () > 8)
+		return 0;
+
+	std::uint64_t key = 0;
+	for (std::size_t i = 0; i < 8; ++i)
+	{
+		auto c = i < verb_.size () ? static_cast<unsigned char> (verb_[i]) : 0u;
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		else if (i < verb_.size () && !(c >= 'A' && c <= 'Z') && !(c >= '0' && c <= '9'))
+			return 0;
+
+		key = key << 8 | c;
+	}
+
+	return key;
+}
+
+/// \brief Hash command key
+/// \param key_ Command key
+/// \param mult_ Hash multiplier
+constexpr unsigned commandHash (std::uint64_t const key_, std::uint64_t const mult_)
+{
+	return (key_ * mult_) >> (64 - COMMAND_HASH_BITS);
+}
+
+/// \brief Perfect hash of command keys
+struct CommandHash
+{
+	/// \brief Hash multiplier
+	std::uint64_t mult = 0;
+
+	/// \brief Key in each slot
+	std::array<std::uint64_t, 1u << COMMAND_HASH_BITS> keys{};
+
+	/// \brief Command index in each slot
+	std::array<std::uint8_t, 1u << COMMAND_HASH_BITS> index{};
+};
+
+/// \brief Find a collision-free multiplicative hash of the command names
+/// \param commands_ Commands
+template <typename T, std::size_t N>
+constexpr CommandHash makeCommandHash (T const (&commands_)[N])
+{
+	static_assert (N < COMMAND_HASH_EMPTY);
+
+	for (std::uint64_t mult = 0x9E3779B97F4A7C15ull;; mult += 2)
+	{
+		CommandHash hash;
+		hash.mult = mult;
+		for (auto &index : hash.index)
+			index = COMMAND_HASH_EMPTY;
+
+		bool ok = true;
+		for (std::size_t i = 0; ok && i < N; ++i)
+		{
+			auto const key  = commandKey (commands_[i].name);
+			auto const slot = commandHash (key, mult);
+
+			ok               = hash.index[slot] == COMMAND_HASH_EMPTY;
+			hash.keys[slot]  = key;
+			hash.index[slot] = i;
+		}
+
+		if (ok)
+			return hash;
+	}
+}
+
 /// \brief Decode path
 /// \param buffer_ Buffer to decode
 /// \param size_ Size of buffer
@@ -210,6 +335,7 @@ std::string resolvePath (std::string_view const path_)
 
 	// make sure parent is a directory
 	stat_t st;
+	stats::global ().statCalls.add ();
 	if (::stat (dirName (path_).c_str (), &st) != 0)
 		return {};
 
@@ -306,6 +432,59 @@ std::string buildResolvedPath (std::string_view const cwd_, std::string_view con
 }
 }
 
+///////////////////////////////////////////////////////////////////////////
+void FtpSession::Progress::reset (std::uint64_t const position_, std::uint64_t const size_)
+{
+#ifdef __NDS__
+	++m_snapshot.generation;
+	m_snapshot.position = position_;
+	m_snapshot.size     = size_;
+#else
+	// single writer; an odd sequence tells readers a reset is in flight
+	auto const sequence = m_sequence.load (std::memory_order_relaxed);
+	m_sequence.store (sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence (std::memory_order_release);
+
+	m_position.store (position_, std::memory_order_relaxed);
+	m_size.store (size_, std::memory_order_relaxed);
+
+	m_sequence.store (sequence + 2, std::memory_order_release);
+#endif
+}
+
+void FtpSession::Progress::update (std::uint64_t const position_)
+{
+#ifdef __NDS__
+	m_snapshot.position = position_;
+#else
+	// the size only changes in reset (), so the position alone needs no sequence bump
+	m_position.store (position_, std::memory_order_relaxed);
+#endif
+}
+
+void FtpSession::Progress::load (Snapshot &snapshot_) const
+{
+#ifdef __NDS__
+	snapshot_ = m_snapshot;
+#else
+	// don't spin; on a single core the writer may not run again until the reader yields
+	auto const sequence = m_sequence.load (std::memory_order_acquire);
+	if (sequence & 1)
+		return;
+
+	auto const position = m_position.load (std::memory_order_relaxed);
+	auto const size     = m_size.load (std::memory_order_relaxed);
+
+	std::atomic_thread_fence (std::memory_order_acquire);
+	if (m_sequence.load (std::memory_order_relaxed) != sequence)
+		return;
+
+	snapshot_.generation = sequence / 2;
+	snapshot_.position   = position;
+	snapshot_.size       = size;
+#endif
+}
+
 ///////////////////////////////////////////////////////////////////////////
 #if FTPD_HAS_GLOB
 FtpSession::Glob::~Glob () noexcept
@@ -315,54 +494,143 @@ FtpSession::Glob::~Glob () noexcept
 
 FtpSession::Glob::Glob () noexcept = default;
 
-bool FtpSession::Glob::glob (char const *const pattern_) noexcept
+bool FtpSession::Glob::glob (std::string_view const cwd_, char const *const pattern_) noexcept
 {
-	if (!m_glob.has_value ())
-		m_glob.emplace ();
-	else
-		::globfree (&m_glob.value ());
+	clear ();
+
+	try
+	{
+		// split the pattern into path components
+		auto pattern = std::string_view (pattern_);
+		while (!pattern.empty ())
+		{
+			auto const pos       = pattern.find ('/');
+			auto const component = pattern.substr (0, pos);
+			if (!component.empty () && component != ".")
+				m_components.emplace_back (component);
+
+			if (pos == std::string_view::npos)
+				break;
+
+			pattern.remove_prefix (pos + 1);
+		}
+
+		if (m_components.empty ())
+		{
+			errno = EINVAL;
+			return false;
+		}
 
-	std::memset (&m_glob.value (), 0, sizeof (glob_t));
+		// results are reported the way the pattern was given
+		if (pattern_[0] != '/')
+		{
+			m_path.assign (cwd_);
+			if (!m_path.empty () && m_path.back () == '/')
+				m_path.pop_back ();
+			m_prefix = m_path.size () + 1;
+		}
 
-	auto const rc = ::glob (pattern_, GLOB_NOSORT, nullptr, &m_glob.value ());
-	if (rc == GLOB_NOSPACE)
+		m_literal = descend (0);
+		if (!m_literal && m_stack.empty ())
+		{
+			clear ();
+			errno = ENOENT;
+			return false;
+		}
+	}
+	catch (...)
 	{
 		clear ();
 		errno = ENOMEM;
 		return false;
 	}
-	else if (rc != 0)
+
+	return true;
+}
+
+bool FtpSession::Glob::descend (std::size_t component_) noexcept
+{
+	try
 	{
-		clear ();
-		errno = EIO;
-		return false;
+		// literal components need no directory scan
+		while (component_ < m_components.size () &&
+		       m_components[component_].find_first_of ("*?[") == std::string::npos)
+		{
+			m_path.push_back ('/');
+			m_path.append (m_components[component_++]);
+		}
+
+		if (component_ == m_components.size ())
+		{
+			stat_t st;
+			return ::lstat (m_path.c_str (), &st) == 0;
+		}
+
+		fs::Dir dir;
+		if (!dir.open (m_path.empty () ? "/" : m_path.c_str ()))
+			return false;
+
+		m_stack.emplace_back (Level{std::move (dir), component_, m_path.size ()});
+	}
+	catch (...)
+	{
+		// an unusable branch just doesn't match
 	}
 
-	m_offset = 0;
-	return true;
+	return false;
 }
 
 char const *FtpSession::Glob::next () noexcept
 {
-	if (!m_glob.has_value ())
-		return nullptr;
+	if (std::exchange (m_literal, false))
+		return m_path.c_str () + m_prefix;
 
-	if (m_glob->gl_pathc <= 0 || m_offset >= static_cast<unsigned> (m_glob->gl_pathc))
+	for (unsigned scanned = 0; !m_stack.empty ();)
 	{
-		clear ();
-		return nullptr;
+		auto &level = m_stack.back ();
+
+		auto const dent = level.dir.read ();
+		if (!dent)
+		{
+			// this directory is exhausted
+			m_stack.pop_back ();
+			continue;
+		}
+
+		if (std::strcmp (dent->d_name, ".") == 0 || std::strcmp (dent->d_name, "..") == 0 ||
+		    ::fnmatch (m_components[level.component].c_str (), dent->d_name, FNM_PERIOD) != 0)
+		{
+			if (++scanned >= GLOB_SCAN)
+			{
+				// let other sessions run
+				errno = EAGAIN;
+				return nullptr;
+			}
+
+			continue;
+		}
+
+		m_path.resize (level.base);
+		m_path.push_back ('/');
+		m_path.append (dent->d_name);
+
+		// level is invalidated if descend pushes a directory
+		auto const component = level.component + 1;
+		if (component == m_components.size () || descend (component))
+			return m_path.c_str () + m_prefix;
 	}
 
-	return m_glob->gl_pathv[m_offset++];
+	errno = 0;
+	return nullptr;
 }
 
 void FtpSession::Glob::clear () noexcept
 {
-	if (!m_glob.has_value ())
-		return;
-
-	::globfree (&m_glob.value ());
-	m_glob.reset ();
+	m_components.clear ();
+	m_stack.clear ();
+	m_path.clear ();
+	m_prefix  = 0;
+	m_literal = false;
 }
 #endif
 
@@ -372,49 +640,70 @@ FtpSession::~FtpSession ()
 	closeCommand ();
 	closePasv ();
 	closeData ();
+
+#ifndef __NDS__
+	// don't hold up the other ranges of an upload cut short by the disconnect
+	if (m_storeFile)
+		m_storeFile->abandon (m_storeOffset);
+#endif
 }
 
-FtpSession::FtpSession (FtpConfig &config_, UniqueSocket commandSocket_)
+FtpSession::FtpSession (FtpConfig &config_, PasvPool &pasvPool_, UniqueSocket commandSocket_)
     : m_config (config_),
+      m_settings (config_.snapshot ()),
+      m_pasvPool (pasvPool_),
       m_commandSocket (std::move (commandSocket_)),
       m_commandBuffer (COMMAND_BUFFERSIZE),
-      m_responseBuffer (RESPONSE_BUFFERSIZE),
-      m_xferBuffer (XFER_BUFFERSIZE),
-      m_zStreamBuffer (XFER_BUFFERSIZE),
-      m_zStream (nullptr, nullptr),
+      m_responseBuffer (RESPONSE_BUFFERSIZE, RESPONSE_SEGMENTS),
+      m_xferBuffer (XFER_BUFFERSIZE, false),
+      m_zStreamBuffer (XFER_BUFFERSIZE, false),
+      m_deflateChain (XFER_BUFFERSIZE, DEFLATE_SEGMENTS),
       m_authorizedUser (false),
       m_authorizedPass (false),
       m_pasv (false),
       m_port (false),
+      m_epsvAll (false),
       m_recv (false),
       m_send (false),
       m_urgent (false),
       m_deflate (false),
       m_zFlushed (false),
       m_eof (false),
+      m_listingDeflated (false),
+      m_listRecursive (false),
+      m_listHeader (false),
       m_mlstType (true),
       m_mlstSize (true),
       m_mlstModify (true),
       m_mlstPerm (true),
       m_mlstUnixMode (false),
-      m_devZero (false)
-{
-	{
+      m_devZero (false),
+      m_ready (false),
+      m_xferReady (false),
+      m_throttled (false),
+      m_deferred (false),
+      m_hibernated (false)
 #ifndef __NDS__
-		auto const lock = m_config.lockGuard ();
+      ,
+      m_ioWait (false)
 #endif
-		if (m_config.user ().empty ())
-			m_authorizedUser = true;
-		if (m_config.pass ().empty ())
-			m_authorizedPass = true;
-	}
+{
+	if (m_settings->user ().empty ())
+		m_authorizedUser = true;
+	if (m_settings->pass ().empty ())
+		m_authorizedPass = true;
 
-	char buffer[32];
-	std::sprintf (buffer, "Session#%p", this);
-	m_windowName = buffer;
+	// replies are small and interactive; don't let Nagle hold them back
+	m_commandSocket->setNoDelay ();
 
-	std::sprintf (buffer, "Plot#%p", this);
-	m_plotName = buffer;
+	if (auto const size = m_settings->controlBufferSize ())
+	{
+		m_commandSocket->setRecvBufferSize (size);
+		m_commandSocket->setSendBufferSize (size);
+	}
+
+	if (auto const idle = m_settings->keepAlive ())
+		m_commandSocket->setKeepAlive (true, std::chrono::seconds (idle));
 
 	m_commandSocket->setNonBlocking ();
 
@@ -432,73 +721,129 @@ bool FtpSession::dead ()
 	return true;
 }
 
-void FtpSession::draw ()
+void FtpSession::refreshDraw (platform::steady_clock::time_point const now_)
 {
+	// progress is read without m_lock so the UI never waits on a transfer
+	auto const generation = m_drawProgress.generation;
+	m_progress.load (m_drawProgress);
+	auto const &progress = m_drawProgress;
+
+	// a new transfer starts a new plot
+	if (progress.generation != generation)
+	{
+		m_rateHistory.reset ();
+		m_xferRate = -1.0f;
+	}
+
+	{
 #ifndef __NDS__
-	auto const lock = std::scoped_lock (m_lock);
+		auto const lock = std::scoped_lock (m_lock);
 #endif
+		m_drawName = m_workItem.empty () ? m_cwd : m_workItem;
+	}
 
 #ifdef CLASSIC
-	if (m_filePosition)
+	(void)now_;
+
+	if (progress.position)
+		m_drawSize = fs::printSize (progress.position) + ' ';
+	else
+		m_drawSize.clear ();
+#else
+	if (progress.size)
+		m_drawSize = fs::printSize (progress.position) + '/' + fs::printSize (progress.size);
+	else if (progress.position)
+		m_drawSize = fs::printSize (progress.position) + "/???";
+	else
+		m_drawSize.clear ();
+
+	if (m_drawSize.empty ())
+	{
+		m_rateHistory.reset ();
+		return;
+	}
+
+	// the rate is only shown on the plot, so hidden sessions skip it and start over when shown
+	if (!m_drawVisible)
+	{
+		m_xferRate = -1.0f;
+		return;
+	}
+
+	auto rate = 0.0f;
+	if (m_xferRate == -1.0f)
+		m_xferRate = 0.0f;
+	else
 	{
-		std::fputs (fs::printSize (m_filePosition).c_str (), stdout);
-		std::fputc (' ', stdout);
+		auto const seconds = std::chrono::duration<float> (now_ - m_rateTime).count ();
+		if (seconds > 0.0f)
+		{
+			rate = gsl::narrow_cast<float> (progress.position - m_ratePosition) / seconds;
+
+			// scale the filter by the sample period so the UI refresh rate does not change it
+			auto const alpha = 1.0f - std::exp (-seconds / XFER_RATE_TAU);
+			m_xferRate       = alpha * rate + (1.0f - alpha) * m_xferRate;
+		}
+	}
+
+	m_ratePosition = progress.position;
+	m_rateTime     = now_;
+	m_drawRate     = fs::printSize (m_xferRate) + "/s";
+
+	if (!m_rateHistory)
+		m_rateHistory = std::make_unique<RateHistory> ();
+
+	// MiB/s plot lines
+	auto &history = *m_rateHistory;
+	std::copy (std::next (std::begin (history.rates)),
+	    std::end (history.rates),
+	    std::begin (history.rates));
+	history.rates[RATE_HISTORY - 1] = rate;
+#endif
+}
+
+void FtpSession::draw (std::chrono::milliseconds const interval_)
+{
+	// frames draw from a snapshot so they neither lock the session nor reformat it
+	auto const now = platform::steady_clock::now ();
+	if (now >= m_drawTime)
+	{
+		refreshDraw (now);
+		m_drawTime = now + interval_;
 	}
 
-	std::fputs (m_workItem.empty () ? m_cwd.c_str () : m_workItem.c_str (), stdout);
+#ifdef CLASSIC
+	std::fputs (m_drawSize.c_str (), stdout);
+	std::fputs (m_drawName.c_str (), stdout);
 #else
+	char windowName[32];
+	std::sprintf (windowName, "Session#%p", this);
+
+	// collapsed or clipped sessions skip their text and plot
 #ifdef __3DS__
-	ImGui::BeginChild (m_windowName.c_str (), ImVec2 (0.0f, 45.0f), true);
+	m_drawVisible = ImGui::BeginChild (windowName, ImVec2 (0.0f, 45.0f), true);
 #else
-	ImGui::BeginChild (m_windowName.c_str (), ImVec2 (0.0f, 80.0f), true);
+	m_drawVisible = ImGui::BeginChild (windowName, ImVec2 (0.0f, 80.0f), true);
 #endif
 
-	if (!m_workItem.empty ())
-		ImGui::TextUnformatted (m_workItem.c_str ());
+	if (!m_drawVisible)
+		m_rateHistory.reset ();
 	else
-		ImGui::TextUnformatted (m_cwd.c_str ());
-
-	if (m_fileSize)
-		ImGui::Text (
-		    "%s/%s", fs::printSize (m_filePosition).c_str (), fs::printSize (m_fileSize).c_str ());
-	else if (m_filePosition)
-		ImGui::Text ("%s/???", fs::printSize (m_filePosition).c_str ());
-
-	if (m_fileSize || m_filePosition)
 	{
-		// MiB/s plot lines
-		for (std::size_t i = 0; i < POSITION_HISTORY - 1; ++i)
-		{
-			m_filePositionDeltas[i]  = m_filePositionHistory[i + 1] - m_filePositionHistory[i];
-			m_filePositionHistory[i] = m_filePositionHistory[i + 1];
-		}
+		ImGui::TextUnformatted (m_drawName.c_str ());
 
-		auto const diff = m_filePosition - m_filePositionHistory[POSITION_HISTORY - 1];
-		m_filePositionDeltas[POSITION_HISTORY - 1]  = diff;
-		m_filePositionHistory[POSITION_HISTORY - 1] = m_filePosition;
+		if (!m_drawSize.empty ())
+			ImGui::TextUnformatted (m_drawSize.c_str ());
 
-		if (m_xferRate == -1.0f)
-		{
-			m_xferRate         = 0.0f;
-			m_filePositionTime = platform::steady_clock::now ();
-		}
-		else
+		if (m_rateHistory)
 		{
-			auto const now      = platform::steady_clock::now ();
-			auto const timeDiff = now - m_filePositionTime;
-			m_filePositionTime  = now;
-
-			auto const rate =
-			    gsl::narrow_cast<float> (diff) / std::chrono::duration<float> (timeDiff).count ();
-			auto const alpha = 0.01f;
-			m_xferRate       = alpha * rate + (1.0f - alpha) * m_xferRate;
+			ImGui::SameLine ();
+			ImGui::PlotLines ("",
+			    m_rateHistory->rates,
+			    IM_ARRAYSIZE (m_rateHistory->rates),
+			    0,
+			    m_drawRate.c_str ());
 		}
-
-		auto const rateString = fs::printSize (m_xferRate) + "/s";
-
-		ImGui::SameLine ();
-		ImGui::PlotLines (
-		    "", m_filePositionDeltas, IM_ARRAYSIZE (m_filePositionDeltas), 0, rateString.c_str ());
 	}
 
 	ImGui::EndChild ();
@@ -559,211 +904,408 @@ void FtpSession::drawConnections ()
 #endif
 }
 
-UniqueFtpSession FtpSession::create (FtpConfig &config_, UniqueSocket commandSocket_)
+UniqueFtpSession
+    FtpSession::create (FtpConfig &config_, PasvPool &pasvPool_, UniqueSocket commandSocket_)
 {
-	return UniqueFtpSession (new FtpSession (config_, std::move (commandSocket_)));
+	return UniqueFtpSession (new FtpSession (config_, pasvPool_, std::move (commandSocket_)));
 }
 
-bool FtpSession::poll (std::vector<UniqueFtpSession> const &sessions_)
+bool FtpSession::poll (Poller &poller_,
+    std::vector<UniqueFtpSession> const &sessions_,
+    std::chrono::milliseconds const timeout_)
 {
-	// poll for pending close sockets first
-	std::vector<Socket::PollInfo> pollInfo;
+	if (sessions_.empty ())
+		return true;
+
+	auto timeout = timeout_;
+
+	// refresh registrations; this is a no-op unless interest changed
 	for (auto &session : sessions_)
 	{
-		for (auto &pending : session->m_pendingCloseSocket)
+		session->m_ready = false;
+
+		// hibernated sessions keep their command registration until woken
+		if (session->m_hibernated)
+			continue;
+
+		session->updatePollEvents (poller_);
+
+		// a transfer which used up its share last time continues right away
+		if (session->m_xferReady)
+			timeout = 0ms;
+		else if (session->m_throttled)
 		{
-			assert (pending.unique ());
-			pollInfo.emplace_back (*pending, POLLIN, 0);
+			auto const wait = session->rateWait (platform::steady_clock::now ());
+			timeout         = std::min (timeout, std::max (wait, 1ms));
 		}
+
+#ifndef __NDS__
+		// check back soon on sessions waiting for the I/O threads
+		if (session->m_ioWait)
+			timeout = IO_WAIT_TIMEOUT;
+#endif
 	}
 
-	if (!pollInfo.empty ())
-	{
-		auto const rc = Socket::poll (pollInfo.data (), pollInfo.size (), 0ms);
-		if (rc < 0)
-		{
-			error ("poll: %s\n", std::strerror (errno));
-			return false;
-		}
-		else
-		{
-			for (auto const &i : pollInfo)
-			{
-				if (!i.revents)
-					continue;
+	// poll for activity
+	auto const rc = poller_.wait (timeout);
+	if (rc < 0)
+		return false;
 
-				for (auto &session : sessions_)
-				{
-					for (auto it = std::begin (session->m_pendingCloseSocket);
-					     it != std::end (session->m_pendingCloseSocket);)
-					{
-						auto &socket = *it;
-						if (&i.socket.get () != socket.get ())
-						{
-							++it;
-							continue;
-						}
-
-						it = session->m_pendingCloseSocket.erase (it);
-					}
-				}
-			}
-		}
+	for (auto const &event : poller_.events ())
+	{
+		auto const session = static_cast<FtpSession *> (event.owner);
+		session->m_ready   = true;
+		session->handleEvent (event);
 	}
 
-	// poll for everything else
-	pollInfo.clear ();
+#ifndef __NDS__
+	// resume transfers whose file I/O completed
 	for (auto &session : sessions_)
 	{
-		if (session->m_commandSocket)
-		{
-			pollInfo.emplace_back (*session->m_commandSocket, POLLIN | POLLPRI, 0);
-			if (session->m_responseBuffer.usedSize () != 0)
-				pollInfo.back ().events |= POLLOUT;
-		}
-
-		switch (session->m_state)
+		if (session->m_ioWait && session->ioReady ())
 		{
-		case State::COMMAND:
-			// we are waiting to read a command
-			break;
-
-		case State::DATA_CONNECT:
-			if (session->m_pasv)
-			{
-				assert (!session->m_port);
-				// we are waiting for a PASV connection
-				pollInfo.emplace_back (*session->m_pasvSocket, POLLIN, 0);
-			}
-			else
-			{
-				// we are waiting to complete a PORT connection
-				pollInfo.emplace_back (*session->m_dataSocket, POLLOUT, 0);
-			}
-			break;
-
-		case State::DATA_TRANSFER:
-			// we need to transfer data
-			if (session->m_recv)
-			{
-				assert (!session->m_send);
-				pollInfo.emplace_back (*session->m_dataSocket, POLLIN, 0);
-			}
-			else
-			{
-				assert (session->m_send);
-				pollInfo.emplace_back (*session->m_dataSocket, POLLOUT, 0);
-			}
-			break;
+			session->m_ioWait    = false;
+			session->m_ready     = true;
+			session->m_xferReady = true;
 		}
 	}
+#endif
 
-	if (pollInfo.empty ())
-		return true;
+	schedule (sessions_);
 
-	// poll for activity
-	auto const rc = Socket::poll (pollInfo.data (), pollInfo.size (), 100ms);
-	if (rc < 0)
+	// pipelined commands which arrived during a transfer run once it ends
+	for (auto &session : sessions_)
 	{
-		error ("poll: %s\n", std::strerror (errno));
-		return false;
+		if (session->m_deferred && session->m_state == State::COMMAND)
+			session->processCommands ();
 	}
 
-	auto const now = std::time (nullptr);
+	// send the replies queued during this iteration
+	for (auto &session : sessions_)
+		session->writeResponse ();
 
+	auto const now = std::time (nullptr);
 	for (auto &session : sessions_)
 	{
-		bool handled = false;
-		for (auto const &i : pollInfo)
+		// throttled transfers may legitimately go quiet for a while
+		auto const timeout = session->m_hibernated ? HIBERNATED_IDLE_TIMEOUT : IDLE_TIMEOUT;
+		if (!session->m_ready && !session->m_throttled && now - session->m_timestamp >= timeout)
 		{
-			if (!i.revents)
-				continue;
-
-			handled = true;
+			session->closeCommand ();
+			session->closePasv ();
+			session->closeData ();
+		}
+		else if (!session->m_hibernated && now - session->m_timestamp >= HIBERNATE_TIMEOUT)
+			session->hibernate (poller_);
+	}
 
-			// check command socket
-			if (&i.socket.get () == session->m_commandSocket.get ())
-			{
-				if (i.revents & ~(POLLIN | POLLPRI | POLLOUT))
-					debug ("Command revents 0x%X\n", i.revents);
+	return true;
+}
 
-				if (!session->m_dataSocket && (i.revents & POLLOUT))
-					session->writeResponse ();
+void FtpSession::updatePollEvents (Poller &poller_)
+{
+	for (auto &pending : m_pendingCloseSocket)
+	{
+		assert (pending.unique ());
+		poller_.update (*pending, POLLIN, this);
+	}
+
+	int commandEvents = 0;
+	if (m_commandSocket)
+	{
+		// a full buffer of deferred commands has to drain first
+		commandEvents = POLLPRI;
+		if (!m_deferred || m_commandBuffer.freeSize () != 0)
+			commandEvents |= POLLIN;
+		if (m_responseBuffer.usedSize () != 0)
+			commandEvents |= POLLOUT;
+	}
+
+	int pasvEvents = 0;
+	int dataEvents = 0;
+	switch (m_state)
+	{
+	case State::COMMAND:
+		// we are waiting to read a command
+		break;
+
+	case State::DATA_CONNECT:
+		if (m_pasv)
+		{
+			assert (!m_port);
+			// we are waiting for a PASV connection
+			pasvEvents = POLLIN;
+		}
+		else
+		{
+			// we are waiting to complete a PORT connection
+			dataEvents = POLLOUT;
+		}
+		break;
+
+	case State::DATA_TRANSFER:
+#ifndef __NDS__
+		// the socket isn't serviced until the file I/O completes
+		if (m_ioWait)
+			break;
+#endif
+
+		// nor until the rate limit allows
+		if (m_throttled)
+			break;
+
+		// we need to transfer data
+		if (m_recv)
+		{
+			assert (!m_send);
+			dataEvents = POLLIN;
+		}
+		else
+		{
+			assert (m_send);
+			dataEvents = POLLOUT;
+		}
+		break;
+	}
+
+	// the data socket may be the command socket (MLST/STAT); use a single registration
+	if (m_dataSocket && m_dataSocket == m_commandSocket)
+	{
+		commandEvents |= dataEvents;
+		dataEvents = 0;
+	}
+	else if (m_dataSocket)
+		poller_.update (*m_dataSocket, dataEvents, this);
+
+	if (m_commandSocket)
+		poller_.update (*m_commandSocket, commandEvents, this);
+
+	if (m_pasvSocket)
+		poller_.update (*m_pasvSocket, pasvEvents, this);
+}
+
+void FtpSession::handleEvent (Poller::Event const &event_)
+{
+	if (m_hibernated)
+		wake ();
+
+	auto const revents = event_.revents;
+
+	// check pending close sockets
+	for (auto it = std::begin (m_pendingCloseSocket); it != std::end (m_pendingCloseSocket); ++it)
+	{
+		if (event_.socket != it->get ())
+			continue;
+
+		if (revents & ~POLLOUT)
+			LOCKED (m_pendingCloseSocket.erase (it));
+		return;
+	}
+
+	// check command socket
+	if (event_.socket == m_commandSocket.get ())
+	{
+		if (revents & ~(POLLIN | POLLPRI | POLLOUT))
+			debug ("Command revents 0x%X\n", revents);
+
+		// the transfer drains replies itself when it shares the command socket
+		if (m_dataSocket != m_commandSocket && (revents & POLLOUT))
+			writeResponse ();
+
+		if (revents & (POLLIN | POLLPRI))
+			readCommand (revents);
+
+		if (revents & (POLLERR | POLLHUP))
+			closeCommand ();
+	}
+
+	// check the data socket
+	if (event_.socket == m_pasvSocket.get () || event_.socket == m_dataSocket.get ())
+	{
+		switch (m_state)
+		{
+		case State::COMMAND:
+			// the socket was registered for a transfer which has since ended
+			break;
+
+		case State::DATA_CONNECT:
+			if (revents & ~(POLLIN | POLLPRI | POLLOUT))
+				debug ("Data revents 0x%X\n", revents);
+
+			if (revents & (POLLERR | POLLHUP))
+			{
+				sendResponse ("426 Data connection failed\r\n");
+				setState (State::COMMAND, true, true);
+			}
+			else if (revents & POLLIN)
+			{
+				// we need to accept the PASV connection
+				dataAccept ();
+			}
+			else if (revents & POLLOUT)
+			{
+				// PORT connection completed
+				auto const &sockName = m_dataSocket->peerName ();
+				info ("Connected to [%s]:%u\n", sockName.name (), sockName.port ());
+
+				sendResponse ("150 Ready\r\n");
+				setState (State::DATA_TRANSFER, true, false);
+			}
+			break;
 
-				if (i.revents & (POLLIN | POLLPRI))
-					session->readCommand (i.revents);
+		case State::DATA_TRANSFER:
+			if (revents & ~(POLLIN | POLLPRI | POLLOUT))
+				debug ("Data revents 0x%X\n", revents);
 
-				if (i.revents & (POLLERR | POLLHUP))
-					session->closeCommand ();
+			// we need to transfer data
+			if (revents & (POLLERR | POLLHUP))
+			{
+				sendResponse ("426 Data connection failed\r\n");
+				setState (State::COMMAND, true, true);
 			}
+			else if (revents & (POLLIN | POLLOUT))
+				m_xferReady = true;
+			break;
+		}
+	}
+}
+
+#ifndef __NDS__
+bool FtpSession::ioReady ()
+{
+#if FTPD_HAS_PARALLEL_DEFLATE
+	if (m_parallelDeflate && m_parallelDeflate->ready ())
+		return true;
+#endif
+
+	// progress is reported as it goes
+	if (m_hashJob)
+		return m_hashJob->done () || m_hashJob->position () != m_filePosition;
+
+#ifdef __3DS__
+	if (m_dir.archive () && m_dir.archive ()->ready ())
+		return true;
+#endif
+
+	return m_asyncFile && m_asyncFile->ready ();
+}
+#endif
+
+bool FtpSession::transfer ()
+{
+	// replies queued ahead of data on the command socket must go out first
+	if (m_dataSocket && m_dataSocket == m_commandSocket && !m_responseBuffer.empty ())
+	{
+		writeResponse ();
+		if (!m_responseBuffer.empty ())
+			return false;
+	}
+
+	return (this->*m_transfer) ();
+}
+
+void FtpSession::schedule (std::vector<UniqueFtpSession> const &sessions_)
+{
+	// limits changed by SITE apply from the next poll, not the next command
+	auto const settings = sessions_.front ()->m_config.snapshot ();
+
+	std::uint64_t const rateLimit        = settings->rateLimit () * 1024ull;
+	std::uint64_t const sessionRateLimit = settings->sessionRateLimit () * 1024ull;
+
+	{
+#ifndef __NDS__
+		auto const lock = std::scoped_lock (s_rateLock);
+#endif
+		s_rateBucket.setRate (rateLimit);
+	}
+
+	auto now = platform::steady_clock::now ();
+
+	for (auto &session : sessions_)
+	{
+		session->m_bucket.setRate (sessionRateLimit);
+
+		// resume throttled transfers once the limits allow
+		if (session->m_throttled && session->rateAvailable (now))
+		{
+			session->m_throttled = false;
+			session->m_xferReady = true;
+			session->m_ready     = true;
+		}
+	}
+
+	for (unsigned round = 0; round < XFER_ROUNDS; ++round)
+	{
+		bool pending = false;
+
+		for (auto &session : sessions_)
+		{
+			if (!session->m_xferReady)
+				continue;
 
-			// check the data socket
-			if (&i.socket.get () == session->m_pasvSocket.get () ||
-			    &i.socket.get () == session->m_dataSocket.get ())
+			session->m_deficit += XFER_QUANTUM;
+			while (session->m_xferReady && session->m_deficit > 0)
 			{
-				switch (session->m_state)
+				if (!session->rateAvailable (now))
 				{
-				case State::COMMAND:
-					std::abort ();
+					session->m_xferReady = false;
+					session->m_throttled = true;
 					break;
+				}
 
-				case State::DATA_CONNECT:
-					if (i.revents & ~(POLLIN | POLLPRI | POLLOUT))
-						debug ("Data revents 0x%X\n", i.revents);
-
-					if (i.revents & (POLLERR | POLLHUP))
-					{
-						session->sendResponse ("426 Data connection failed\r\n");
-						session->setState (State::COMMAND, true, true);
-					}
-					else if (i.revents & POLLIN)
-					{
-						// we need to accept the PASV connection
-						session->dataAccept ();
-					}
-					else if (i.revents & POLLOUT)
-					{
-						// PORT connection completed
-						auto const &sockName = session->m_dataSocket->peerName ();
-						info ("Connected to [%s]:%u\n", sockName.name (), sockName.port ());
-
-						session->sendResponse ("150 Ready\r\n");
-						session->setState (State::DATA_TRANSFER, true, false);
-					}
-					break;
+				// a closed data socket lingers in m_pendingCloseSocket, so this stays valid
+				auto const socket = session->m_dataSocket.get ();
+				auto const before = socket ? socket->bytes () : 0;
 
-				case State::DATA_TRANSFER:
-					if (i.revents & ~(POLLIN | POLLPRI | POLLOUT))
-						debug ("Data revents 0x%X\n", i.revents);
-
-					// we need to transfer data
-					if (i.revents & (POLLERR | POLLHUP))
-					{
-						session->sendResponse ("426 Data connection failed\r\n");
-						session->setState (State::COMMAND, true, true);
-					}
-					else if (i.revents & (POLLIN | POLLOUT))
-					{
-						for (unsigned i = 0; i < 10; ++i)
-						{
-							if (!((*session).*(session->m_transfer)) ())
-								break;
-						}
-					}
-					break;
+				if (!session->transfer ())
+					session->m_xferReady = false;
+
+				auto const bytes = socket ? socket->bytes () - before : 0;
+				session->m_deficit -= std::max (static_cast<std::int64_t> (bytes), XFER_STEP_COST);
+
+				session->m_bucket.consume (bytes);
+				if (rateLimit)
+				{
+#ifndef __NDS__
+					auto const lock = std::scoped_lock (s_rateLock);
+#endif
+					s_rateBucket.consume (bytes);
 				}
 			}
-		}
 
-		if (!handled && now - session->m_timestamp >= IDLE_TIMEOUT)
-		{
-			session->closeCommand ();
-			session->closePasv ();
-			session->closeData ();
+			// only backlogged transfers keep their credit
+			if (!session->m_xferReady)
+				session->m_deficit = 0;
+			else
+				pending = true;
 		}
+
+		if (!pending)
+			break;
+
+		now = platform::steady_clock::now ();
 	}
+}
 
-	return true;
+bool FtpSession::rateAvailable (platform::steady_clock::time_point const now_)
+{
+	if (!m_bucket.available (now_))
+		return false;
+
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (s_rateLock);
+#endif
+	return s_rateBucket.available (now_);
+}
+
+std::chrono::milliseconds FtpSession::rateWait (platform::steady_clock::time_point const now_)
+{
+	auto const wait = m_bucket.wait (now_);
+
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (s_rateLock);
+#endif
+	return std::max (wait, s_rateBucket.wait (now_));
 }
 
 bool FtpSession::authorized () const
@@ -771,11 +1313,33 @@ bool FtpSession::authorized () const
 	return m_authorizedUser && m_authorizedPass;
 }
 
+stats::IO FtpSession::io () const
+{
+	auto io = m_io;
+
+	if (m_commandSocket)
+		io += m_commandSocket->io ();
+
+	if (m_dataSocket && m_dataSocket != m_commandSocket)
+		io += m_dataSocket->io ();
+
+	return io;
+}
+
 void FtpSession::setState (State const state_, bool const closePasv_, bool const closeData_)
 {
+	// closing the data socket clears m_recv
+	auto const recv = m_recv;
+
 	m_state     = state_;
 	m_timestamp = std::time (nullptr);
 
+	if (state_ == State::DATA_CONNECT)
+		stats::global ().transfers.add ();
+
+	if (state_ != State::COMMAND)
+		acquireBuffers ();
+
 	if (closePasv_)
 		closePasv ();
 	if (closeData_)
@@ -783,33 +1347,142 @@ void FtpSession::setState (State const state_, bool const closePasv_, bool const
 
 	if (state_ == State::COMMAND)
 	{
+		// an unfinished copy leaves nothing behind
+		if (m_copyFile)
+		{
+			m_copyFile.close ();
+			if (::unlink (m_workItem.c_str ()) != 0)
+				error ("unlink: %s\n", std::strerror (errno));
+
+			StatCache::instance ().invalidate (m_workItem);
+			ListingCache::instance ().invalidate (m_workItem);
+#ifndef __NDS__
+			CachedFile::invalidate (m_workItem);
+#endif
+			FtpServer::updateFreeSpace ();
+		}
+		m_copyBuffer.reset ();
+
 		{
 #ifndef __NDS__
 			auto const lock = std::scoped_lock (m_lock);
 #endif
 
 			m_restartPosition = 0;
-			m_fileSize        = 0;
+			m_rangeEnd        = 0;
 			m_filePosition    = 0;
+			m_progress.reset (0, 0);
 
-			for (auto &pos : m_filePositionHistory)
-				pos = 0;
-			m_xferRate = -1.0f;
+			// the upload changed the file's size and mtime
+			if (recv && !m_workItem.empty ())
+			{
+				StatCache::instance ().invalidate (m_workItem);
+				ListingCache::instance ().invalidate (m_workItem);
+			}
 
 			m_workItem.clear ();
 		}
 
-		m_devZero = false;
+		if (m_storeBuffer)
+			finishStore ();
+
+		// settle the estimate once the upload is done
+		if (recv)
+			FtpServer::updateFreeSpace ();
+
+		m_devZero   = false;
+		m_xferReady = false;
+		m_throttled = false;
+		m_deficit   = 0;
+#ifndef __NDS__
+		m_ioWait = false;
+		m_asyncFile.reset ();
+		m_cachedFile.reset ();
+#endif
+		if (m_hashJob)
+			m_hashJob->cancel ();
+		m_hashJob.reset ();
 		m_file.close ();
 		m_dir.close ();
+		m_pendingDirent = nullptr;
+		m_listStack.clear ();
+		m_listRecursive = false;
+		m_listHeader    = false;
+		m_listing.reset ();
+		m_listingRecord.reset ();
+		m_listingPos      = 0;
+		m_listingDeflated = false;
+#if FTPD_HAS_GLOB
+		m_glob.clear ();
+		m_pendingGlob = nullptr;
+#endif
 		m_zStream.reset ();
+#if FTPD_HAS_PARALLEL_DEFLATE
+		m_parallelDeflate.reset ();
+#endif
+		m_deflateTuner.reset ();
+
+		// idle sessions don't pin transfer-sized buffers
+		m_xferBuffer.release ();
+		m_zStreamBuffer.release ();
+		m_deflateChain.clear ();
+	}
+}
+
+void FtpSession::acquireBuffers ()
+{
+	m_xferBuffer.acquire ();
+	if (m_deflate)
+		m_zStreamBuffer.acquire ();
+}
+
+void FtpSession::hibernate (Poller &poller_)
+{
+	if (m_state != State::COMMAND || m_deferred || m_pasvSocket || m_dataSocket ||
+	    !m_commandBuffer.empty () || !m_responseBuffer.empty ())
+		return;
+
+	{
+#ifndef __NDS__
+		auto const lock = std::scoped_lock (m_lock);
+#endif
+		if (!m_pendingCloseSocket.empty ())
+			return;
+
+		m_pendingCloseSocket.shrink_to_fit ();
+		m_workItem.shrink_to_fit ();
 	}
+
+	// transfer buffers were already released when the session returned to State::COMMAND
+	m_commandBuffer.release ();
+	m_responseBuffer.clear ();
+
+	m_lwd.clear ();
+	m_lwd.shrink_to_fit ();
+	m_listPath.clear ();
+	m_listPath.shrink_to_fit ();
+	m_listStack.shrink_to_fit ();
+	m_hashPath.clear ();
+	m_hashPath.shrink_to_fit ();
+
+	m_hibernated = true;
+
+	// the registration must match the idle state while poll skips this session
+	updatePollEvents (poller_);
+}
+
+void FtpSession::wake ()
+{
+	m_commandBuffer.acquire ();
+	m_hibernated = false;
 }
 
 void FtpSession::closeSocket (SharedSocket &socket_)
 {
 	if (socket_ && socket_.unique ())
 	{
+		m_io += socket_->io ();
+
 		socket_->shutdown (SHUT_WR);
 		socket_->setLinger (true, 0s);
 		LOCKED (m_pendingCloseSocket.emplace_back (std::move (socket_)));
@@ -820,6 +1493,9 @@ void FtpSession::closeSocket (SharedSocket &socket_)
 
 void FtpSession::closeCommand ()
 {
+	// send any queued replies (e.g. 221 for QUIT) before closing
+	writeResponse ();
+
 	closeSocket (m_commandSocket);
 }
 
@@ -827,6 +1503,9 @@ void FtpSession::closePasv ()
 {
 	UniqueSocket pasv;
 	LOCKED (pasv = std::move (m_pasvSocket));
+
+	// the listener is kept for the next PASV/EPSV
+	m_pasvPool.release (std::move (pasv));
 }
 
 void FtpSession::closeData ()
@@ -881,6 +1560,23 @@ bool FtpSession::dataAccept ()
 	m_pasv = false;
 
 	auto peer = m_pasvSocket->accept ();
+	if (peer && m_commandSocket && m_settings->pasvPeerCheck ())
+	{
+		// the passive port may be known to others, so only the client may connect to it
+		auto const &client = m_commandSocket->peerName ();
+		auto name          = peer->peerName ();
+		name.setPort (client.port ());
+		if (!(name == client))
+		{
+			error ("Rejected data connection from [%s]:%u\n",
+			    peer->peerName ().name (),
+			    peer->peerName ().port ());
+			sendResponse ("425 Data connection from a foreign address\r\n");
+			setState (State::COMMAND, true, true);
+			return false;
+		}
+	}
+
 	LOCKED (m_dataSocket = std::move (peer));
 	if (!m_dataSocket)
 	{
@@ -890,8 +1586,7 @@ bool FtpSession::dataAccept ()
 	}
 
 #ifndef __3DS__
-	m_dataSocket->setRecvBufferSize (SOCK_BUFFERSIZE);
-	m_dataSocket->setSendBufferSize (SOCK_BUFFERSIZE);
+	tuneDataSocket (*m_dataSocket);
 #endif
 
 	if (!m_dataSocket->setNonBlocking ())
@@ -913,13 +1608,12 @@ bool FtpSession::dataConnect ()
 
 	m_port = false;
 
-	auto data = Socket::create (Socket::eStream);
+	auto data = Socket::create (Socket::eStream, m_portAddr.domain ());
 	LOCKED (m_dataSocket = std::move (data));
 	if (!m_dataSocket)
 		return false;
 
-	m_dataSocket->setRecvBufferSize (SOCK_BUFFERSIZE);
-	m_dataSocket->setSendBufferSize (SOCK_BUFFERSIZE);
+	tuneDataSocket (*m_dataSocket);
 
 	if (!m_dataSocket->setNonBlocking ())
 		return false;
@@ -938,35 +1632,65 @@ bool FtpSession::dataConnect ()
 	return true;
 }
 
-int FtpSession::tzStat (char const *const path_, stat_t *st_)
+void FtpSession::tuneDataSocket (Socket &socket_)
 {
-	auto const rc = ::stat (path_, st_);
-	if (rc != 0)
-		return rc;
+	auto const size = m_settings->dataBufferSize ();
+	if (!size)
+		return;
 
-#ifdef __3DS__
-	if (m_config.getMTime ())
+	socket_.setRecvBufferSize (size);
+	socket_.setSendBufferSize (size);
+}
+
+bool FtpSession::listenPassive ()
+{
+	// listen on the same address family as the command connection
+	auto pasv = m_pasvPool.lease (m_commandSocket->sockName (),
+	    m_settings->dataBufferSize (),
+	    m_settings->pasvPortMin (),
+	    m_settings->pasvPortMax ());
+	LOCKED (m_pasvSocket = std::move (pasv));
+	if (!m_pasvSocket)
 	{
-		std::uint64_t mtime = 0;
-		auto const rc       = archive_getmtime (path_, &mtime);
-		if (rc != 0)
-			error ("sdmc_getmtime %s 0x%lx\n", path_, rc);
-		else
-			st_->st_mtime = mtime - FtpServer::tzOffset ();
+		sendResponse ("451 Failed to listen on socket\r\n");
+		return false;
 	}
-#endif
 
-	return 0;
+	// we are now listening on the socket
+	auto const &sockName = m_pasvSocket->sockName ();
+	info ("Listening on [%s]:%u\n", sockName.name (), sockName.port ());
+	return true;
+}
+
+int FtpSession::tzStat (char const *const path_, stat_t *st_)
+{
+	return cachedStat (path_, st_, true);
 }
 
 int FtpSession::tzLStat (char const *const path_, stat_t *st_)
 {
-	auto const rc = ::lstat (path_, st_);
+	return cachedStat (path_, st_, false);
+}
+
+int FtpSession::cachedStat (char const *const path_, stat_t *st_, bool const follow_)
+{
+	auto const ttl = m_settings->statCacheTTL ();
+#ifdef __3DS__
+	auto const getMTime = m_settings->getMTime ();
+#endif
+
+	auto &cache = StatCache::instance ();
+	if (cache.lookup (path_, follow_, ttl, *st_))
+		return 0;
+
+	stats::global ().statCalls.add ();
+
+	auto const rc = follow_ ? ::stat (path_, st_) : ::lstat (path_, st_);
 	if (rc != 0)
 		return rc;
 
 #ifdef __3DS__
-	if (m_config.getMTime ())
+	if (getMTime)
 	{
 		std::uint64_t mtime = 0;
 		auto const rc       = archive_getmtime (path_, &mtime);
@@ -977,21 +1701,26 @@ int FtpSession::tzLStat (char const *const path_, stat_t *st_)
 	}
 #endif
 
+	if (ttl)
+		cache.insert (path_, follow_, *st_);
+
 	return 0;
 }
 
-int FtpSession::fillDirent (stat_t const &st_, std::string_view const path_, char const *type_)
+template <FtpSession::XferDirMode mode_>
+int FtpSession::formatDirent (IOBuffer &buffer_,
+    stat_t const &st_,
+    std::string_view const name_,
+    char const *type_) const
 {
-	auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
-
-	auto const buffer = ioBuffer.freeArea ();
-	auto const size   = ioBuffer.freeSize ();
+	auto const buffer = buffer_.freeArea ();
+	auto const size   = buffer_.freeSize ();
 
 	std::size_t pos = 0;
 
-	if (m_xferDirMode == XferDirMode::MLSD || m_xferDirMode == XferDirMode::MLST)
+	if constexpr (mode_ == XferDirMode::MLSD || mode_ == XferDirMode::MLST)
 	{
-		if (m_xferDirMode == XferDirMode::MLST)
+		if constexpr (mode_ == XferDirMode::MLST)
 		{
 			if (pos >= size)
 				return EAGAIN;
@@ -1049,11 +1778,11 @@ int FtpSession::fillDirent (stat_t const &st_, std::string_view const path_, cha
 		// mtime fact
 		if (m_mlstModify)
 		{
-			auto const tm = std::gmtime (&st_.st_mtime);
-			if (!tm)
+			std::tm tm;
+			if (!::gmtime_r (&st_.st_mtime, &tm))
 				return errno;
 
-			auto const rc = std::strftime (&buffer[pos], size - pos, "Modify=%Y%m%d%H%M%S;", tm);
+			auto const rc = std::strftime (&buffer[pos], size - pos, "Modify=%Y%m%d%H%M%S;", &tm);
 			if (rc == 0)
 				return EAGAIN;
 
@@ -1167,7 +1896,7 @@ int FtpSession::fillDirent (stat_t const &st_, std::string_view const path_, cha
 		}
 
 		// make sure space precedes name
-		if (buffer[pos - 1] != ' ')
+		if (pos == 0 || buffer[pos - 1] != ' ')
 		{
 			if (pos >= size)
 				return EAGAIN;
@@ -1175,9 +1904,9 @@ int FtpSession::fillDirent (stat_t const &st_, std::string_view const path_, cha
 			buffer[pos++] = ' ';
 		}
 	}
-	else if (m_xferDirMode != XferDirMode::NLST)
+	else if constexpr (mode_ != XferDirMode::NLST)
 	{
-		if (m_xferDirMode == XferDirMode::STAT)
+		if constexpr (mode_ == XferDirMode::STAT)
 		{
 			if (pos >= size)
 				return EAGAIN;
@@ -1235,88 +1964,131 @@ int FtpSession::fillDirent (stat_t const &st_, std::string_view const path_, cha
 		pos += rc;
 
 		// timestamp
-		auto const tm = std::gmtime (&st_.st_mtime);
-		if (!tm)
+		std::tm tm;
+		if (!::gmtime_r (&st_.st_mtime, &tm))
 			return errno;
 
 		auto fmt = "%b %e %Y ";
 		if (m_timestamp > st_.st_mtime && m_timestamp - st_.st_mtime < (60 * 60 * 24 * 365 / 2))
 			fmt = "%b %e %H:%M ";
-		rc = std::strftime (&buffer[pos], size - pos, fmt, tm);
-		if (rc < 0)
-			return errno;
-		if (static_cast<std::size_t> (rc) > size - pos)
+		rc = std::strftime (&buffer[pos], size - pos, fmt, &tm);
+		if (rc == 0)
 			return EAGAIN;
 
 		pos += rc;
 	}
 
-	if (size - pos < path_.size () + 2)
+	if (size - pos < name_.size () + 2)
 		return EAGAIN;
 
-	// path
-	std::memcpy (&buffer[pos], path_.data (), path_.size ());
-	pos += path_.size ();
+	// name; encoded \n is \0
+	for (auto const c : name_)
+		buffer[pos++] = c == '\n' ? '\0' : c;
 	buffer[pos++] = '\r';
 	buffer[pos++] = '\n';
 
-	ioBuffer.markUsed (pos);
-	LOCKED (m_filePosition += pos);
-
+	buffer_.markUsed (pos);
 	return 0;
 }
 
-int FtpSession::fillDirent (std::string const &path_, char const *type_)
+int FtpSession::fillDirent (stat_t const &st_, std::string_view const name_, char const *type_)
 {
-	stat_t st;
-	if (tzStat (path_.c_str (), &st) != 0)
-		return errno;
+	auto &ioBuffer  = m_deflate ? m_zStreamBuffer : m_xferBuffer;
+	auto const used = ioBuffer.usedSize ();
 
-	return fillDirent (st, encodePath (path_), type_);
-}
+	int rc = EINVAL;
+	switch (m_xferDirMode)
+	{
+	case XferDirMode::LIST:
+		rc = formatDirent<XferDirMode::LIST> (ioBuffer, st_, name_, type_);
+		break;
 
-void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
+	case XferDirMode::MLSD:
+		rc = formatDirent<XferDirMode::MLSD> (ioBuffer, st_, name_, type_);
+		break;
+
+	case XferDirMode::MLST:
+		rc = formatDirent<XferDirMode::MLST> (ioBuffer, st_, name_, type_);
+		break;
+
+	case XferDirMode::NLST:
+		rc = formatDirent<XferDirMode::NLST> (ioBuffer, st_, name_, type_);
+		break;
+
+	case XferDirMode::STAT:
+		rc = formatDirent<XferDirMode::STAT> (ioBuffer, st_, name_, type_);
+		break;
+	}
+
+	if (rc == 0)
+	{
+		m_progress.update (m_filePosition += ioBuffer.usedSize () - used);
+		recordListing (ioBuffer.usedArea () + used, ioBuffer.usedSize () - used, false);
+	}
+
+	return rc;
+}
+
+int FtpSession::fillDirent (std::string const &path_, char const *type_)
+{
+	stat_t st;
+	if (tzStat (path_.c_str (), &st) != 0)
+		return errno;
+
+	return fillDirent (st, path_, type_);
+}
+
+void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 {
 	m_zFlushed = false;
 	m_eof      = false;
 
+	// an ALLO hint only applies to the command which follows it
+	auto const allocSize = std::exchange (m_allocSize, 0);
+
+	acquireBuffers ();
 	m_xferBuffer.clear ();
 	m_zStreamBuffer.clear ();
 
-	if (m_deflate)
+	if (m_deflate && mode_ == XferFileMode::RETR)
 	{
-		if (mode_ == XferFileMode::RETR)
-			m_zStream = std::unique_ptr<z_stream, int (*) (z_streamp)> (new z_stream, &deflateEnd);
-		else
-			m_zStream = std::unique_ptr<z_stream, int (*) (z_streamp)> (new z_stream, &inflateEnd);
-
-		m_zStream->zalloc    = Z_NULL;
-		m_zStream->zfree     = Z_NULL;
-		m_zStream->opaque    = Z_NULL;
-		m_zStream->next_in   = Z_NULL;
-		m_zStream->avail_in  = 0;
-		m_zStream->next_out  = Z_NULL;
-		m_zStream->avail_out = 0;
-
-		if (mode_ == XferFileMode::RETR)
+		auto level = m_settings->deflateLevel ();
+		if (level == FtpConfig::DEFLATE_LEVEL_AUTO)
 		{
-			if (deflateInit (m_zStream.get (), m_config.deflateLevel ()) != Z_OK)
-			{
-				sendResponse ("550 %s\r\n", m_zStream->msg ? m_zStream->msg : "zlib error");
-				setState (State::COMMAND, true, true);
-				return;
-			}
+#if FTPD_HAS_PARALLEL_DEFLATE
+			m_deflateTuner = DeflateTuner::create (AUTO_DEFLATE_LEVEL, ParallelDeflate::threads ());
+#else
+			m_deflateTuner = DeflateTuner::create (AUTO_DEFLATE_LEVEL, 1);
+#endif
+			level = m_deflateTuner->level ();
 		}
+
+#if FTPD_HAS_PARALLEL_DEFLATE
+		// deflate is the bottleneck at higher levels; spread it across the compression threads
+		if (m_deflateTuner || level > Z_BEST_SPEED)
+			m_parallelDeflate = ParallelDeflate::create (level);
 		else
+#endif
 		{
-			if (inflateInit (m_zStream.get ()) != Z_OK)
+			m_zStream = zStreamPool::acquireDeflate (level);
+			if (!m_zStream)
 			{
-				sendResponse ("550 %s\r\n", m_zStream->msg ? m_zStream->msg : "zlib error");
+				sendResponse ("550 %s\r\n", std::strerror (errno));
 				setState (State::COMMAND, true, true);
 				return;
 			}
 		}
 	}
+	else if (m_deflate)
+	{
+		m_zStream = zStreamPool::acquireInflate ();
+		if (!m_zStream)
+		{
+			sendResponse ("550 %s\r\n", std::strerror (errno));
+			setState (State::COMMAND, true, true);
+			return;
+		}
+	}
 
 	// build the path of the file to transfer
 	auto const path = buildResolvedPath (m_cwd, args_);
@@ -1341,6 +2113,21 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 			return;
 		}
 
+		// a RANG byte range ends the download early
+		std::uint64_t fileSize = st.st_size;
+		if (m_rangeEnd)
+			fileSize = std::min (fileSize, m_rangeEnd);
+
+#ifndef __NDS__
+		// sessions fetching the same file share one handle and its read-ahead; sendfile uses the
+		// shared descriptor with its own offset
+		m_cachedFile = CachedFile::open (path, st, FILE_BUFFERSIZE);
+		if (!m_cachedFile)
+		{
+			sendResponse ("450 %s\r\n", std::strerror (errno));
+			return;
+		}
+#else
 		// open the file in read mode
 		if (!m_file.open (path.c_str (), "rb"))
 		{
@@ -1348,8 +2135,7 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 			return;
 		}
 
-		LOCKED (m_fileSize = st.st_size);
-
+		// stdio reads go through a large buffer
 		m_file.setBufferSize (FILE_BUFFERSIZE);
 
 		if (m_restartPosition != 0)
@@ -1360,13 +2146,43 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 				return;
 			}
 		}
+#endif
+
+		m_filePosition = m_restartPosition;
+		m_progress.reset (m_filePosition, fileSize);
 
-		LOCKED (m_filePosition = m_restartPosition);
+#if FTPD_HAS_PARALLEL_DEFLATE
+		if (m_parallelDeflate && fileSize > m_restartPosition)
+			m_parallelDeflate->sizeHint (fileSize - m_restartPosition);
+#endif
 	}
 	else
 	{
 		auto const append = mode_ == XferFileMode::APPE;
 
+#ifdef __NDS__
+		if (m_rangeEnd)
+		{
+			sendResponse ("504 RANG is only supported for RETR\r\n");
+			setState (State::COMMAND, true, true);
+			return;
+		}
+
+		auto const ranged = false;
+#else
+		if (m_rangeEnd && append)
+		{
+			sendResponse ("504 RANG is not supported for APPE\r\n");
+			setState (State::COMMAND, true, true);
+			return;
+		}
+
+		// ranged uploads may run in parallel into one file, so they share a handle
+		auto const ranged = !append && (m_rangeEnd != 0 || m_restartPosition != 0);
+		if (ranged)
+			m_storeFile = StoreFile::open (path);
+#endif
+
 		char const *mode = "wb";
 		if (append)
 			mode = "ab";
@@ -1374,28 +2190,91 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 			mode = "r+b";
 
 		// open file in write mode
+#ifndef __NDS__
+		if (ranged ? !m_storeFile : !m_file.open (path.c_str (), mode))
+#else
 		if (!m_file.open (path.c_str (), mode))
+#endif
 		{
 			sendResponse ("450 %s\r\n", std::strerror (errno));
 			return;
 		}
 
-		FtpServer::updateFreeSpace ();
+		StatCache::instance ().invalidate (path);
+		ListingCache::instance ().invalidate (path);
+#ifndef __NDS__
+		CachedFile::invalidate (path);
 
-		m_file.setBufferSize (FILE_BUFFERSIZE);
+		// the ranged uploads still running write into a file this one replaces
+		if (!ranged)
+			StoreFile::invalidate (path);
+#endif
+
+		// uploads are written in large staged blocks which bypass the stdio buffer
+		m_storeOffset = 0;
 
 		// check if this had REST but not APPE
 		if (m_restartPosition != 0 && !append)
 		{
-			// seek to the REST offset
-			if (m_file.seek (m_restartPosition, SEEK_SET) != 0)
+			// seek to the REST offset; ranged uploads write at their own offsets
+			if (!ranged && m_file.seek (m_restartPosition, SEEK_SET) != 0)
+			{
+				sendResponse ("450 %s\r\n", std::strerror (errno));
+				return;
+			}
+
+			m_storeOffset = m_restartPosition;
+		}
+		else if (append)
+		{
+			// find where the appended data starts
+			if (m_file.seek (0, SEEK_END) != 0)
 			{
 				sendResponse ("450 %s\r\n", std::strerror (errno));
 				return;
 			}
+
+			m_storeOffset = m_file.tell ();
+		}
+
+		// the first write tops up to an aligned offset; later ones stay aligned
+		m_storeBuffer   = std::make_unique<IOBuffer> (STORE_BUFFERSIZE);
+		m_storeFill     = STORE_BUFFERSIZE - m_storeOffset % STORE_BUFFERSIZE;
+		m_storeReserved = m_storeOffset;
+		m_storeTruncate = false;
+
+		if (ranged)
+		{
+#ifndef __NDS__
+			// an ALLO ahead of a ranged upload announces the size of the whole file
+			if (allocSize)
+				m_storeFile->announce (allocSize);
+
+			// reserve the range; the last of the ranged uploads trims whatever isn't used
+			if (m_rangeEnd > m_storeOffset && m_storeFile->preallocate (m_rangeEnd))
+			{
+				auto const size = m_rangeEnd - m_storeOffset;
+				FtpServer::adjustFreeSpace (-static_cast<std::int64_t> (size));
+				m_storeReserved = m_rangeEnd;
+			}
+#endif
+		}
+		else if (allocSize)
+		{
+			// reserve the announced size so the file doesn't fragment as it grows
+			if (m_file.preallocate (m_storeOffset + allocSize))
+			{
+				m_storeTruncate = true;
+
+				FtpServer::adjustFreeSpace (-static_cast<std::int64_t> (allocSize));
+				m_storeReserved += allocSize;
+			}
+			else
+				debug ("preallocate: %s\n", std::strerror (errno));
 		}
 
-		LOCKED (m_filePosition = m_restartPosition);
+		m_filePosition = m_restartPosition;
+		m_progress.reset (m_filePosition, 0);
 	}
 
 	if (!m_port && !m_pasv)
@@ -1416,11 +2295,24 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 	}
 
 	// set up the transfer
+	LOCKED (m_workItem = path);
+
+	// don't spend CPU on formats which are already compressed
+	if (m_deflateTuner && DeflateTuner::incompressible (path))
+		m_deflateTuner->skip ();
+
 	if (mode_ == XferFileMode::RETR)
 	{
 		m_recv     = false;
 		m_send     = true;
 		m_transfer = &FtpSession::retrieveTransfer;
+#if FTPD_HAS_SENDFILE
+		if (!m_deflate && !m_devZero)
+		{
+			m_transfer = &FtpSession::sendFileTransfer;
+			return;
+		}
+#endif
 	}
 	else
 	{
@@ -1429,37 +2321,68 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 		m_transfer = &FtpSession::storeTransfer;
 	}
 
-	LOCKED (m_workItem = path);
+#ifndef __NDS__
+	// overlap file I/O with the network on the I/O threads
+	if (m_cachedFile)
+	{
+		// a RANG byte range stops the read-ahead early
+		auto const end = m_rangeEnd ? m_rangeEnd : UINT64_MAX;
+
+		m_asyncFile = AsyncFile::create (
+		    std::move (m_cachedFile), m_restartPosition, end, XFER_BUFFERSIZE);
+
+		// the read-ahead grows with the rate measured on the data path
+		m_ioRate         = 0.0f;
+		m_ioRatePosition = m_restartPosition;
+		m_ioRateTime     = platform::steady_clock::now ();
+	}
+	else if (m_storeFile)
+		m_asyncFile = AsyncFile::create (m_storeFile, m_restartPosition, STORE_BUFFERSIZE);
+	else if (!m_devZero)
+	{
+		m_asyncFile = AsyncFile::create (
+		    std::move (m_file), m_recv, m_recv ? STORE_BUFFERSIZE : XFER_BUFFERSIZE);
+	}
+#endif
 }
 
-void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool const workaround_)
+void FtpSession::xferDir (char const *const args_,
+    XferDirMode const mode_,
+    bool const workaround_,
+    bool const recursive_)
 {
 	// set up the transfer
-	m_xferDirMode = mode_;
-	m_recv        = false;
-	m_send        = true;
-	m_zFlushed    = false;
-	m_eof         = false;
+	m_xferDirMode   = mode_;
+	m_recv          = false;
+	m_send          = true;
+	m_zFlushed      = false;
+	m_eof           = false;
+	m_listRecursive = recursive_;
+	m_listHeader    = false;
+	m_listStack.clear ();
+	m_listStackBase = 0;
+	m_listRoot.clear ();
 
 	m_filePosition    = 0;
 	m_zStreamPosition = 0;
+	m_progress.reset (0, 0);
+	acquireBuffers ();
 	m_xferBuffer.clear ();
 	m_zStreamBuffer.clear ();
 
+	int level = Z_DEFAULT_COMPRESSION;
 	if (m_deflate)
 	{
-		m_zStream = std::unique_ptr<z_stream, int (*) (z_streamp)> (new z_stream, &deflateEnd);
-		m_zStream->zalloc    = Z_NULL;
-		m_zStream->zfree     = Z_NULL;
-		m_zStream->opaque    = Z_NULL;
-		m_zStream->next_in   = Z_NULL;
-		m_zStream->avail_in  = 0;
-		m_zStream->next_out  = Z_NULL;
-		m_zStream->avail_out = 0;
+		level = m_settings->deflateLevel ();
 
-		if (deflateInit (m_zStream.get (), m_config.deflateLevel ()) != Z_OK)
+		// listings are small; not worth tuning
+		if (level == FtpConfig::DEFLATE_LEVEL_AUTO)
+			level = Z_DEFAULT_COMPRESSION;
+
+		m_zStream = zStreamPool::acquireDeflate (level);
+		if (!m_zStream)
 		{
-			sendResponse ("550 %s\r\n", m_zStream->msg ? m_zStream->msg : "zlib error");
+			sendResponse ("550 %s\r\n", std::strerror (errno));
 			setState (State::COMMAND, true, true);
 			return;
 		}
@@ -1469,10 +2392,17 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 
 	if (std::strlen (args_) > 0)
 	{
-		// work around broken clients that think LIST -a/-l is valid
-		auto const needWorkaround = workaround_ && args_[0] == '-' &&
-		                            (args_[1] == 'a' || args_[1] == 'l') &&
-		                            (args_[2] == '\0' || args_[2] == ' ');
+		// work around broken clients that think LIST -a/-l is valid; also take -R from ls
+		auto optionsEnd = args_;
+		auto recursive  = false;
+		if (workaround_ && args_[0] == '-')
+		{
+			while (*++optionsEnd == 'a' || *optionsEnd == 'l' || *optionsEnd == 'R')
+				recursive = recursive || *optionsEnd == 'R';
+		}
+
+		auto const needWorkaround =
+		    optionsEnd - args_ > 1 && (*optionsEnd == '\0' || *optionsEnd == ' ');
 
 		// an argument was provided
 		auto const path = buildResolvedPath (m_cwd, args_);
@@ -1480,7 +2410,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 		{
 			if (needWorkaround)
 			{
-				xferDir (args_ + 2 + (args_[2] == ' '), mode_, false);
+				xferDir (optionsEnd + (*optionsEnd == ' '), mode_, false, recursive);
 				return;
 			}
 
@@ -1494,7 +2424,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 		{
 			if (needWorkaround)
 			{
-				xferDir (args_ + 2 + (args_[2] == ' '), mode_, false);
+				xferDir (optionsEnd + (*optionsEnd == ' '), mode_, false, recursive);
 				return;
 			}
 
@@ -1517,7 +2447,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 		}
 		else if (S_ISDIR (st.st_mode))
 		{
-			if (!m_dir.open (path.c_str ()))
+			if ((m_listRecursive || !listCached (path, level)) && !m_dir.open (path.c_str ()))
 			{
 				sendResponse ("550 %s\r\n", std::strerror (errno));
 				setState (State::COMMAND, true, true);
@@ -1525,9 +2455,11 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 			}
 
 			// set as lwd
-			m_lwd = std::move (path);
+			m_lwd          = std::move (path);
+			m_listRootSize = m_lwd.size ();
+			m_listRoot     = args_;
 
-			if (mode_ == XferDirMode::MLSD && m_mlstType)
+			if (mode_ == XferDirMode::MLSD && m_mlstType && !m_listing)
 			{
 				// send this directory as type=cdir
 				auto const rc = fillDirent (st, m_lwd, "cdir");
@@ -1550,18 +2482,14 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 		}
 		else
 		{
-			std::string name;
-			if (mode_ == XferDirMode::NLST)
-			{
-				// NLST uses full path name
-				name = encodePath (path);
-			}
-			else
+			// NLST uses full path name
+			auto name = std::string_view (path);
+			if (mode_ != XferDirMode::NLST)
 			{
 				// everything else uses basename
 				auto const pos = path.find_last_of ('/');
 				assert (pos != std::string::npos);
-				name = encodePath (std::string_view (path).substr (pos + 1));
+				name = name.substr (pos + 1);
 			}
 
 			auto const rc = fillDirent (st, name);
@@ -1587,7 +2515,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 
 		LOCKED (m_workItem = m_cwd);
 	}
-	else if (!m_dir.open (m_cwd.c_str ()))
+	else if ((m_listRecursive || !listCached (m_cwd, level)) && !m_dir.open (m_cwd.c_str ()))
 	{
 		// no argument, but opening cwd failed
 		sendResponse ("550 %s\r\n", std::strerror (errno));
@@ -1597,9 +2525,10 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 	else
 	{
 		// set the cwd as the lwd
-		m_lwd = m_cwd;
+		m_lwd          = m_cwd;
+		m_listRootSize = m_lwd.size ();
 
-		if (mode_ == XferDirMode::MLSD && m_mlstType)
+		if (mode_ == XferDirMode::MLSD && m_mlstType && !m_listing)
 		{
 			// send this directory as type=cdir
 			auto const rc = fillDirent (m_lwd, "cdir");
@@ -1635,6 +2564,8 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 	setState (State::DATA_CONNECT, false, true);
 	m_send = true;
 
+	stats::global ().listings.add ();
+
 	// setup connection
 	if (m_port && !dataConnect ())
 	{
@@ -1643,6 +2574,206 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 	}
 }
 
+void FtpSession::xferHash (char const *const args_,
+    checksum::Algorithm const algorithm_,
+    bool const hash_)
+{
+	// HASH honors the RANG byte range, which setState resets
+	auto const start    = hash_ ? m_restartPosition : 0;
+	auto const rangeEnd = hash_ ? m_rangeEnd : 0;
+
+	setState (State::COMMAND, false, false);
+
+	// XCRC and friends are commonly sent with a quoted path
+	std::string_view arg = args_;
+	if (!hash_ && arg.size () > 1 && arg.front () == '"' && arg.back () == '"')
+		arg = arg.substr (1, arg.size () - 2);
+
+	if (arg.empty ())
+	{
+		sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+		return;
+	}
+
+	// build the path to hash
+	auto const path = buildResolvedPath (m_cwd, std::string (arg).c_str ());
+	if (path.empty ())
+	{
+		sendResponse ("553 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	// stat the path
+	stat_t st;
+	if (tzStat (path.c_str (), &st) != 0)
+	{
+		sendResponse ("550 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	if (!S_ISREG (st.st_mode))
+	{
+		sendResponse ("550 Not a file\r\n");
+		return;
+	}
+
+	auto const size = static_cast<std::uint64_t> (st.st_size);
+	auto const end  = rangeEnd ? std::min (rangeEnd, size) : size;
+	if (start > end)
+	{
+		sendResponse ("501 Invalid range\r\n");
+		return;
+	}
+
+	auto const ttl = m_settings->statCacheTTL ();
+
+	stats::global ().hashes.add ();
+	m_hashPath = hash_ ? encodePath (args_) : std::string ();
+
+	// repeated verification of an unchanged file is free
+	std::string digest;
+	if (ttl && start == 0 && end == size &&
+	    StatCache::instance ().lookupDigest (path, algorithm_, st, digest))
+	{
+		stats::global ().hashHits.add ();
+		sendHash (algorithm_, start, end, digest);
+		return;
+	}
+
+	m_hashJob  = HashJob::create (path, st, algorithm_, start, end, ttl != 0);
+	m_transfer = &FtpSession::hashTransfer;
+
+	{
+#ifndef __NDS__
+		auto const lock = std::scoped_lock (m_lock);
+#endif
+		m_workItem = path;
+	}
+
+	m_filePosition = start;
+	m_progress.reset (start, end);
+
+	// the reply goes over the command socket once the checksum is ready
+	setState (State::DATA_TRANSFER, false, false);
+	LOCKED (m_dataSocket = m_commandSocket);
+	m_send = true;
+}
+
+void FtpSession::xferCopy (std::string const &from_, char const *const to_)
+{
+	// build the path to copy to
+	auto const path = buildResolvedPath (m_cwd, to_);
+	if (path.empty ())
+	{
+		sendResponse ("553 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	// the source may have gone away since SITE CPFR
+	stat_t st;
+	if (tzStat (from_.c_str (), &st) != 0)
+	{
+		sendResponse ("550 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	if (!S_ISREG (st.st_mode))
+	{
+		sendResponse ("550 Not a file\r\n");
+		return;
+	}
+
+	// opening the destination would truncate the source
+	stat_t dst;
+	if (path == from_ || (tzStat (path.c_str (), &dst) == 0 && dst.st_ino != 0 &&
+	                         dst.st_dev == st.st_dev && dst.st_ino == st.st_ino))
+	{
+		sendResponse ("553 Source and destination are the same file\r\n");
+		return;
+	}
+
+	if (!m_file.open (from_.c_str ()))
+	{
+		sendResponse ("550 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	if (!m_copyFile.open (path.c_str (), "wb"))
+	{
+		sendResponse ("550 %s\r\n", std::strerror (errno));
+		m_file.close ();
+		return;
+	}
+
+	StatCache::instance ().invalidate (path);
+	ListingCache::instance ().invalidate (path);
+#ifndef __NDS__
+	CachedFile::invalidate (path);
+	StoreFile::invalidate (path);
+#endif
+
+	auto const size = static_cast<std::uint64_t> (st.st_size);
+
+#if !FTPD_HAS_COPY_FILE_RANGE
+	// copy in large blocks; the native filesystem is much faster with fewer, bigger requests
+	m_copyBuffer = std::make_unique<IOBuffer> (STORE_BUFFERSIZE);
+
+	// reserve the whole file so it doesn't fragment as it grows
+	if (size && !m_copyFile.preallocate (size))
+		debug ("preallocate: %s\n", std::strerror (errno));
+#endif
+
+	// the query at the end of the copy settles the difference
+	FtpServer::adjustFreeSpace (-static_cast<std::int64_t> (size));
+
+	m_transfer = &FtpSession::copyTransfer;
+	LOCKED (m_workItem = path);
+
+	m_filePosition = 0;
+	m_progress.reset (0, size);
+
+	// the reply goes over the command socket once the copy is done
+	setState (State::DATA_TRANSFER, false, false);
+	LOCKED (m_dataSocket = m_commandSocket);
+	m_send = true;
+}
+
+void FtpSession::sendHash (checksum::Algorithm const algorithm_,
+    std::uint64_t const start_,
+    std::uint64_t const end_,
+    std::string const &digest_)
+{
+	if (!m_hashPath.empty ())
+	{
+		// an empty range has no last byte to report
+		if (start_ == end_)
+		{
+			sendResponse ("213 %s %" PRIu64 "- %s %s\r\n",
+			    checksum::name (algorithm_),
+			    start_,
+			    digest_.c_str (),
+			    m_hashPath.c_str ());
+			return;
+		}
+
+		// the range is inclusive, like RANG
+		sendResponse ("213 %s %" PRIu64 "-%" PRIu64 " %s %s\r\n",
+		    checksum::name (algorithm_),
+		    start_,
+		    end_ - 1,
+		    digest_.c_str (),
+		    m_hashPath.c_str ());
+		return;
+	}
+
+	// the X commands traditionally reply in upper-case
+	auto upper = digest_;
+	for (auto &c : upper)
+		c = std::toupper (c);
+
+	sendResponse ("250 %s\r\n", upper.c_str ());
+}
+
 void FtpSession::readCommand (int const events_)
 {
 #ifndef __NDS__
@@ -1694,10 +2825,14 @@ void FtpSession::readCommand (int const events_)
 	}
 #endif
 
-	if (events_ & POLLIN)
+	if (!(events_ & POLLIN))
+		return;
+
+	while (true)
 	{
 		// prepare to receive data
-		if (m_commandBuffer.freeSize () == 0)
+		auto const free = m_commandBuffer.freeSize ();
+		if (free == 0)
 		{
 			error ("Exceeded command buffer size\n");
 			closeCommand ();
@@ -1735,20 +2870,44 @@ void FtpSession::readCommand (int const events_)
 			m_commandBuffer.coalesce ();
 			m_urgent = false;
 		}
+
+		processCommands ();
+
+		// a full read means more pipelined lines may be waiting; take them in the same batch
+		if (static_cast<std::size_t> (rc) < free || m_deferred || !m_commandSocket)
+			return;
 	}
+}
 
-	// loop through commands
-	while (true)
+void FtpSession::processCommands ()
+{
+	m_deferred = false;
+
+	// the replies are queued and go out together once the batch is done
+	while (m_commandSocket)
 	{
 		// must have at least enough data for the delimiter
 		auto const size = m_commandBuffer.usedSize ();
 		if (size < 1)
-			return;
+			break;
 
 		auto const buffer        = m_commandBuffer.usedArea ();
 		auto const [delim, next] = parseCommand (buffer, size);
 		if (!next)
-			return;
+			break;
+
+		// split the verb from its arguments in place
+		auto verbEnd = buffer;
+		while (verbEnd < delim && *verbEnd && !std::isspace (*verbEnd))
+			++verbEnd;
+		auto const cmd = findCommand (std::string_view (buffer, verbEnd - buffer));
+
+		// everything else waits for the transfer to end, as the client expects replies in order
+		if (m_state != State::COMMAND && (!cmd || !(cmd->flags & DURING_XFER)))
+		{
+			m_deferred = true;
+			break;
+		}
 
 		*delim = '\0';
 		decodePath (buffer, delim - buffer);
@@ -1759,19 +2918,16 @@ void FtpSession::readCommand (int const events_)
 
 		char const *const command = buffer;
 
-		char *args = buffer;
-		while (*args && !std::isspace (*args))
-			++args;
+		char *args = verbEnd;
 		if (*args)
 			*args++ = 0;
 
-		auto const it = std::lower_bound (std::begin (handlers),
-		    std::end (handlers),
-		    command,
-		    [] (auto const &lhs_, auto const &rhs_) { return compare (lhs_.first, rhs_) < 0; });
-
 		m_timestamp = std::time (nullptr);
-		if (it == std::end (handlers) || compare (it->first, command) != 0)
+
+		// read the settings once per command; transfers never touch the config lock
+		m_settings = m_config.snapshot ();
+
+		if (!cmd)
 		{
 			std::string response = "502 Invalid command \"";
 			response += encodePath (command);
@@ -1789,47 +2945,49 @@ void FtpSession::readCommand (int const events_)
 		else if (m_state != State::COMMAND)
 		{
 			// only some commands are available during data transfer
-			if (compare (command, "ABOR") != 0 && compare (command, "NOOP") != 0 &&
-			    compare (command, "PWD") != 0 && compare (command, "QUIT") != 0 &&
-			    compare (command, "STAT") != 0 && compare (command, "XPWD") != 0)
-			{
-				sendResponse ("503 Invalid command during transfer\r\n");
-				setState (State::COMMAND, true, true);
-				closeCommand ();
-			}
-			else
-			{
-				auto const handler = it->second;
-				(this->*handler) (args);
-			}
+			(this->*cmd->handler) (args);
+		}
+		else if (!(cmd->flags & PRE_AUTH) && !authorized ())
+		{
+			setState (State::COMMAND, false, false);
+			sendResponse ("530 Not logged in\r\n");
 		}
 		else
 		{
 			// clear rename for all commands except RNTO
-			if (compare (command, "RNTO") != 0)
+			if (!(cmd->flags & KEEP_RENAME))
 				m_rename.clear ();
 
-			auto const handler = it->second;
-			(this->*handler) (args);
+			// SITE CPTO has to follow SITE CPFR; SITE checks its own subcommands
+			if (cmd->handler != &FtpSession::SITE)
+				m_copyFrom.clear ();
+
+			(this->*cmd->handler) (args);
 		}
 
 		m_commandBuffer.markFree (next - buffer);
-		m_commandBuffer.coalesce ();
 	}
+
+	m_commandBuffer.coalesce ();
 }
 
-void FtpSession::writeResponse ()
+void FtpSession::writeResponse (bool const more_)
 {
-	auto const rc = m_commandSocket->write (m_responseBuffer);
+	if (!m_commandSocket || m_responseBuffer.empty ())
+		return;
+
+	auto const rc = m_commandSocket->write (m_responseBuffer, more_);
 	if (rc <= 0)
 	{
-		closeCommand ();
+		if (rc == 0 || errno != EWOULDBLOCK)
+		{
+			m_responseBuffer.clear ();
+			closeCommand ();
+		}
 		return;
 	}
 
 	m_timestamp = std::time (nullptr);
-
-	m_responseBuffer.coalesce ();
 }
 
 void FtpSession::sendResponse (char const *fmt_, ...)
@@ -1837,48 +2995,49 @@ void FtpSession::sendResponse (char const *fmt_, ...)
 	if (!m_commandSocket)
 		return;
 
-	auto const buffer = m_responseBuffer.freeArea ();
-	auto const size   = m_responseBuffer.freeSize ();
-
 	va_list ap;
 
-	va_start (ap, fmt_);
-	addLog (RESPONSE, fmt_, ap);
-	va_end (ap);
-
-	va_start (ap, fmt_);
-	auto const rc = std::vsnprintf (buffer, size, fmt_, ap);
-	va_end (ap);
-
-	if (rc < 0)
+	for (unsigned i = 0; i < 2; ++i)
 	{
-		error ("vsnprintf: %s\n", std::strerror (errno));
-		closeCommand ();
-		return;
-	}
+		// a reply never straddles segments; retry at the start of a fresh one
+		auto segment = i == 0 ? m_responseBuffer.tail () : m_responseBuffer.extend ();
+		if (!segment)
+		{
+			// make room
+			writeResponse (true);
+			if (!m_commandSocket)
+				return;
 
-	if (static_cast<std::size_t> (rc) > size)
-	{
-		error ("Not enough space for response\n");
-		closeCommand ();
-		return;
-	}
+			segment = i == 0 ? m_responseBuffer.tail () : m_responseBuffer.extend ();
+			if (!segment)
+				break;
+		}
 
-	m_responseBuffer.markUsed (rc);
+		auto const buffer = segment->freeArea ();
+		auto const size   = segment->freeSize ();
 
-	// try to write data immediately
-	assert (m_commandSocket);
-	auto const bytes = m_commandSocket->write (m_responseBuffer);
-	if (bytes <= 0)
-	{
-		if (bytes == 0 || errno != EWOULDBLOCK)
+		va_start (ap, fmt_);
+		auto const rc = std::vsnprintf (buffer, size, fmt_, ap);
+		va_end (ap);
+
+		if (rc < 0)
+		{
+			error ("vsnprintf: %s\n", std::strerror (errno));
 			closeCommand ();
+			return;
+		}
+
+		if (static_cast<std::size_t> (rc) < size)
+		{
+			// log the formatted bytes rather than formatting again
+			addLog (RESPONSE, std::string_view (buffer, rc));
+			queueResponse (rc);
+			return;
+		}
 	}
-	else
-	{
-		m_timestamp = std::time (nullptr);
-		m_responseBuffer.coalesce ();
-	}
+
+	error ("Not enough space for response\n");
+	closeCommand ();
 }
 
 void FtpSession::sendResponse (std::string_view const response_)
@@ -1888,42 +3047,87 @@ void FtpSession::sendResponse (std::string_view const response_)
 
 	addLog (RESPONSE, response_);
 
-	auto const buffer = m_responseBuffer.freeArea ();
-	auto const size   = m_responseBuffer.freeSize ();
+	// a reply never straddles segments
+	auto segment = m_responseBuffer.tail ();
+	if (segment && response_.size () > segment->freeSize ())
+		segment = m_responseBuffer.extend ();
 
-	if (response_.size () > size)
+	if (!segment)
+	{
+		// make room
+		writeResponse (true);
+		if (!m_commandSocket)
+			return;
+
+		segment = m_responseBuffer.extend ();
+	}
+
+	if (!segment || response_.size () > segment->freeSize ())
 	{
 		error ("Not enough space for response\n");
 		closeCommand ();
 		return;
 	}
 
-	std::memcpy (buffer, response_.data (), response_.size ());
-	m_responseBuffer.markUsed (response_.size ());
+	std::memcpy (segment->freeArea (), response_.data (), response_.size ());
+	queueResponse (response_.size ());
+}
+
+void FtpSession::queueResponse (std::size_t const size_)
+{
+	m_responseBuffer.markUsed (size_);
+
+	// replies are flushed at the end of the poll iteration unless enough have accumulated
+	if (m_responseBuffer.usedSize () >= RESPONSE_FLUSHSIZE)
+		writeResponse (true);
 }
 
-bool FtpSession::deflateBuffer (bool const flush_)
+bool FtpSession::deflateBuffer (IOBuffer &out_, bool const flush_)
 {
+#if FTPD_HAS_PARALLEL_DEFLATE
+	if (m_parallelDeflate)
+		return parallelDeflateBuffer (out_, flush_);
+#endif
+
 	auto const inSize  = m_zStreamBuffer.usedSize ();
-	auto const outSize = m_xferBuffer.freeSize ();
+	auto const outSize = out_.freeSize ();
+
+	m_zStream->avail_out = outSize;
+	m_zStream->next_out  = reinterpret_cast<unsigned char *> (out_.freeArea ());
+
+	// change level between input buffers; zlib emits what it buffered at the old level
+	if (m_deflateTuner && !m_zStream->avail_in && !flush_ && m_deflateTuner->update ())
+	{
+		if (codec::deflateParams (m_zStream.get (), m_deflateTuner->level ()) != Z_OK)
+			error ("deflateParams: %s\n", m_zStream->msg ? m_zStream->msg : "zlib error");
+	}
 
 	if (!m_zStream->avail_in)
 	{
 		m_zStream->avail_in = inSize;
-		m_zStream->next_in  = reinterpret_cast<Bytef *> (m_zStreamBuffer.usedArea ());
+		m_zStream->next_in  = reinterpret_cast<unsigned char *> (m_zStreamBuffer.usedArea ());
 	}
 
-	m_zStream->avail_out = outSize;
-	m_zStream->next_out  = reinterpret_cast<Bytef *> (m_xferBuffer.freeArea ());
+	auto const availIn  = m_zStream->avail_in;
+	auto const availOut = m_zStream->avail_out;
+	auto const start    = platform::steady_clock::now ();
+
+	auto const rc = codec::deflate (m_zStream.get (), flush_ ? Z_FINISH : Z_NO_FLUSH);
+
+	auto const elapsed = platform::steady_clock::now () - start;
+	stats::global ().deflateTime.add (
+	    std::chrono::duration_cast<std::chrono::nanoseconds> (elapsed).count ());
 
-	auto const rc = deflate (m_zStream.get (), flush_ ? Z_FINISH : Z_NO_FLUSH);
+	if (m_deflateTuner)
+		m_deflateTuner->compressed (
+		    availIn - m_zStream->avail_in, availOut - m_zStream->avail_out, elapsed);
 
 	if (flush_)
 	{
 		if (rc == Z_OK || rc == Z_BUF_ERROR)
 		{
 			m_zStreamBuffer.markFree (inSize - m_zStream->avail_in);
-			m_xferBuffer.markUsed (outSize - m_zStream->avail_out);
+			out_.markUsed (outSize - m_zStream->avail_out);
 			m_zStreamPosition += outSize - m_zStream->avail_out;
 			return true;
 		}
@@ -1932,7 +3136,7 @@ bool FtpSession::deflateBuffer (bool const flush_)
 		{
 			m_zFlushed = true;
 			m_zStreamBuffer.markFree (inSize - m_zStream->avail_in);
-			m_xferBuffer.markUsed (outSize - m_zStream->avail_out);
+			out_.markUsed (outSize - m_zStream->avail_out);
 			m_zStreamPosition += outSize - m_zStream->avail_out;
 			return true;
 		}
@@ -1951,11 +3155,64 @@ bool FtpSession::deflateBuffer (bool const flush_)
 	}
 
 	m_zStreamBuffer.markFree (inSize - m_zStream->avail_in);
-	m_xferBuffer.markUsed (outSize - m_zStream->avail_out);
+	out_.markUsed (outSize - m_zStream->avail_out);
 	m_zStreamPosition += outSize - m_zStream->avail_out;
 	return true;
 }
 
+#if FTPD_HAS_PARALLEL_DEFLATE
+bool FtpSession::parallelDeflateBuffer (IOBuffer &out_, bool const flush_)
+{
+	bool progress = false;
+
+	// queue input; this fails with EWOULDBLOCK while too many blocks are in flight
+	if (!m_zStreamBuffer.empty () && m_parallelDeflate->write (m_zStreamBuffer) > 0)
+		progress = true;
+
+	if (flush_)
+	{
+		assert (m_zStreamBuffer.empty ());
+		m_parallelDeflate->finish ();
+	}
+
+	auto const rc = m_parallelDeflate->read (out_);
+
+	if (m_deflateTuner)
+	{
+		auto const stats = m_parallelDeflate->takeStats ();
+		m_deflateTuner->compressed (stats.in, stats.out, stats.duration);
+		if (m_deflateTuner->update ())
+			m_parallelDeflate->setLevel (m_deflateTuner->level ());
+	}
+
+	if (rc > 0)
+	{
+		m_zStreamPosition += rc;
+		return true;
+	}
+
+	if (rc == 0)
+	{
+		m_zFlushed = true;
+		return true;
+	}
+
+	if (errno != EWOULDBLOCK)
+	{
+		sendResponse ("501 zlib error\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
+	if (progress)
+		return true;
+
+	// wait for the compression threads
+	m_ioWait = true;
+	return false;
+}
+#endif
+
 bool FtpSession::inflateBuffer ()
 {
 	auto const inSize  = m_zStreamBuffer.usedSize ();
@@ -1964,13 +3221,17 @@ bool FtpSession::inflateBuffer ()
 	if (!m_zStream->avail_in)
 	{
 		m_zStream->avail_in = inSize;
-		m_zStream->next_in  = reinterpret_cast<Bytef *> (m_zStreamBuffer.usedArea ());
+		m_zStream->next_in  = reinterpret_cast<unsigned char *> (m_zStreamBuffer.usedArea ());
 	}
 
 	m_zStream->avail_out = outSize;
-	m_zStream->next_out  = reinterpret_cast<Bytef *> (m_xferBuffer.freeArea ());
+	m_zStream->next_out  = reinterpret_cast<unsigned char *> (m_xferBuffer.freeArea ());
 
-	auto const rc = inflate (m_zStream.get (), Z_NO_FLUSH);
+	int rc;
+	{
+		auto const timer = stats::Timer (stats::global ().inflateTime);
+		rc               = codec::inflate (m_zStream.get (), Z_NO_FLUSH);
+	}
 
 	if (rc == Z_STREAM_END)
 	{
@@ -1994,289 +3255,631 @@ bool FtpSession::inflateBuffer ()
 	return true;
 }
 
-bool FtpSession::listTransfer ()
+template <FtpSession::XferDirMode mode_>
+int FtpSession::fillListing (IOBuffer &buffer_)
 {
-	// check if we sent all available data
-	while (m_xferBuffer.empty ())
-	{
-		m_xferBuffer.clear ();
-
-		if (!m_zStreamBuffer.empty ())
-			return deflateBuffer (false);
-
-		if (m_deflate && !m_zFlushed && m_eof)
-			return deflateBuffer (true);
+	// one path buffer for the whole batch; only the name part changes per entry
+	m_listPath.assign (m_lwd);
+	if (m_listPath.empty () || m_listPath.back () != '/')
+		m_listPath.push_back ('/');
+	auto base = m_listPath.size ();
 
-		m_zStreamBuffer.clear ();
+	auto getMTime = mode_ != XferDirMode::MLSD || m_mlstModify;
+#ifdef __3DS__
+	if (!m_settings->getMTime ())
+		getMTime = false;
 
-		// check xfer dir type
-		int rc = 226;
-		if (m_xferDirMode == XferDirMode::MLST || m_xferDirMode == XferDirMode::STAT)
-			rc = 250;
+	// the bulk sdmc reader fetches modification times ahead on a worker thread
+	auto const fetchMTimes = getMTime && (mode_ != XferDirMode::NLST || m_listRecursive);
+#endif
 
-		if (m_eof && (m_deflate == m_zFlushed))
+	auto const used = buffer_.usedSize ();
+	while (true)
+	{
+		if (m_listHeader)
 		{
-			sendResponse ("%d OK\r\n", rc);
-			setState (State::COMMAND, true, true);
-			return false;
-		}
+			if constexpr (mode_ == XferDirMode::LIST)
+			{
+				// separate each subdirectory like ls -R does, named from the listing root
+				auto relative = std::string_view (m_lwd).substr (m_listRootSize);
+				if (relative.front () == '/')
+					relative.remove_prefix (1);
+
+				auto root = m_listRoot;
+				if (!root.empty () && root.back () != '/')
+					root.push_back ('/');
+				root.append (relative);
+
+				auto const name = encodePath (root);
+				auto const size = name.size () + 5;
+				if (buffer_.freeSize () < size)
+				{
+					if (buffer_.usedSize () != used)
+						break;
 
-		// check if this was for a file/MLST
-		if (!m_dir)
-		{
-			// we already sent the file's listing
-			m_eof = true;
-			return true;
-		}
+					return ENOMEM;
+				}
 
-		// get the next directory entry
-		auto const dent = m_dir.read ();
-		if (!dent)
-		{
-			// we have exhausted the directory listing
-			m_eof = true;
-			return true;
-		}
+				auto const header = buffer_.freeArea ();
+				header[0]         = '\r';
+				header[1]         = '\n';
+				std::memcpy (header + 2, name.data (), name.size ());
+				std::memcpy (header + 2 + name.size (), ":\r\n", 3);
+				buffer_.markUsed (size);
+			}
 
-		// I think we are supposed to return entries for . and ..
-		if (std::strcmp (dent->d_name, ".") == 0 || std::strcmp (dent->d_name, "..") == 0)
-			continue; // just skip it
+			m_listHeader = false;
+		}
 
-		// check if this was NLST
-		if (m_xferDirMode == XferDirMode::NLST)
+		auto dent = std::exchange (m_pendingDirent, nullptr);
+		if (dent)
 		{
-			auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
-			// NLST gives the whole path name
-			auto const path = encodePath (buildPath (m_lwd, dent->d_name)) + "\r\n";
-			if (ioBuffer.freeSize () < path.size ())
-			{
-				sendResponse ("501 %s\r\n", std::strerror (ENOMEM));
-				setState (State::COMMAND, true, true);
-				return false;
-			}
-
-			std::memcpy (ioBuffer.freeArea (), path.data (), path.size ());
-			ioBuffer.markUsed (path.size ());
-			LOCKED (m_filePosition += path.size ());
+			// retry the entry which didn't fit last time
+			m_listPath.resize (base);
+			m_listPath.append (dent->d_name);
 		}
 		else
 		{
-			// build the path
-			auto const fullPath = buildPath (m_lwd, dent->d_name);
-			stat_t st;
-
+			// get the next directory entry
 #ifdef __3DS__
-			// the sdmc directory entry already has the type and size, so no need to do a slow stat
-			auto const dp    = static_cast<DIR *> (m_dir);
-			auto const magic = *reinterpret_cast<u32 *> (dp->dirData->dirStruct);
-
-			if (magic == ARCHIVE_DIRITER_MAGIC)
+			if (fetchMTimes && m_dir.archive ())
+				m_dir.archive ()->fetchMTimes ();
+#endif
+			dent = m_dir.read ();
+			if (!dent)
 			{
-				auto const dir   = reinterpret_cast<archive_dir_t const *> (dp->dirData->dirStruct);
-				auto const entry = &dir->entry_data[dir->index];
-
-				if (entry->attributes & FS_ATTRIBUTE_DIRECTORY)
-					st.st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH;
-				else
-					st.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
-
-				if (!(entry->attributes & FS_ATTRIBUTE_READ_ONLY))
-					st.st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
-
-				st.st_size  = entry->fileSize;
-				st.st_mtime = 0;
-
-				bool getmtime = true;
-				if (m_xferDirMode == XferDirMode::MLSD || m_xferDirMode == XferDirMode::MLST)
+#ifdef __3DS__
+				if (errno == EWOULDBLOCK)
 				{
-					if (!m_mlstModify)
-						getmtime = false;
-				}
-				else if (m_xferDirMode == XferDirMode::NLST)
-					getmtime = false;
+					// send what we have while the worker catches up
+					if (buffer_.usedSize () != used)
+						break;
 
-				{
-					auto const lock = m_config.lockGuard ();
-					if (!m_config.getMTime ())
-						getmtime = false;
+					return EWOULDBLOCK;
 				}
+#endif
 
-				if (getmtime)
+				if (m_listRecursive && nextListDir ())
 				{
-					std::uint64_t mtime = 0;
-					auto const rc       = archive_getmtime (fullPath.c_str (), &mtime);
-					if (rc != 0)
-						error ("sdmc_getmtime %s 0x%lx\n", fullPath.c_str (), rc);
-					else
-						st.st_mtime = mtime - FtpServer::tzOffset ();
+					m_listPath.assign (m_lwd);
+					m_listPath.push_back ('/');
+					base = m_listPath.size ();
+					continue;
 				}
+
+				// we have exhausted the directory listing
+				m_eof = true;
+				break;
 			}
-			else
+
+			// I think we are supposed to return entries for . and ..
+			if (std::strcmp (dent->d_name, ".") == 0 || std::strcmp (dent->d_name, "..") == 0)
+				continue; // just skip it
+
+			m_listPath.resize (base);
+			m_listPath.append (dent->d_name);
+
+			if (mode_ != XferDirMode::NLST || m_listRecursive)
 			{
-#endif
-				// lstat the entry
-				if (tzLStat (fullPath.c_str (), &st) != 0)
+				if (!listStat (m_pendingSt, getMTime))
 				{
-					error ("Skipping %s: %s\n", fullPath.c_str (), std::strerror (errno));
+					error ("Skipping %s: %s\n", m_listPath.c_str (), std::strerror (errno));
 					continue; // just skip it
 				}
-#ifdef __3DS__
 			}
-#endif
 
-			auto const path = encodePath (dent->d_name);
-			auto const rc   = fillDirent (st, path);
-			if (rc != 0)
+			// symlinks are not followed, so the walk can't loop
+			if (m_listRecursive && S_ISDIR (m_pendingSt.st_mode))
 			{
-				sendResponse ("425 %s\r\n", std::strerror (errno));
-				setState (State::COMMAND, true, true);
-				return false;
+				if (m_listStack.size () < LIST_TREE_DIRS)
+					m_listStack.emplace_back (m_listPath);
+				else
+					error ("Skipping %s: Too many directories\n", m_listPath.c_str ());
 			}
 		}
 
-		if (m_deflate)
-			return true;
-	}
+		// NLST gives the whole path name
+		auto const name = mode_ == XferDirMode::NLST ? std::string_view (m_listPath)
+		                                             : std::string_view (dent->d_name);
 
-	// send any pending data
-	auto const rc = m_dataSocket->write (m_xferBuffer);
-	if (rc <= 0)
-	{
-		// error sending data
-		if (rc < 0 && errno == EWOULDBLOCK)
-			return false;
+		auto const rc = formatDirent<mode_> (buffer_, m_pendingSt, name, nullptr);
+		if (rc == EAGAIN && buffer_.usedSize () != used)
+		{
+			// buffer is full; send what we have
+			m_pendingDirent = dent;
+			break;
+		}
 
-		sendResponse ("426 Connection broken during transfer\r\n");
-		setState (State::COMMAND, true, true);
-		return false;
+		if (rc != 0)
+			return rc == EAGAIN ? ENOMEM : rc;
 	}
 
-	m_timestamp = std::time (nullptr);
-
-	// we can try to send more data
-	return true;
+	m_progress.update (m_filePosition += buffer_.usedSize () - used);
+	recordListing (buffer_.usedArea () + used, buffer_.usedSize () - used, false);
+	return 0;
 }
 
-bool FtpSession::globTransfer ()
+bool FtpSession::listStat (stat_t &st_, bool const getMTime_)
 {
-#if FTPD_HAS_GLOB
-	// check if we sent all available data
-	if (m_xferBuffer.empty ())
+#ifndef __3DS__
+	(void)getMTime_;
+#else
+	// the sdmc directory entry already has the type and size, so no need to do a slow stat
+	if (auto const archive = m_dir.archive ())
 	{
-		m_xferBuffer.clear ();
+		auto const &entry = archive->entry ();
 
-		auto const entry = m_glob.next ();
-		if (!entry)
-		{
-			// we have exhausted the glob listing
-			sendResponse ("226 OK\r\n");
-			setState (State::COMMAND, true, true);
-			return false;
-		}
+		if (entry.attributes & FS_ATTRIBUTE_DIRECTORY)
+			st_.st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH;
+		else
+			st_.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
 
-		// NLST gives the whole path name
-		auto const path = encodePath (entry) + "\r\n";
-		if (m_xferBuffer.freeSize () < path.size ())
-		{
-			sendResponse ("501 %s\r\n", std::strerror (ENOMEM));
-			setState (State::COMMAND, true, true);
-			return false;
-		}
+		if (!(entry.attributes & FS_ATTRIBUTE_READ_ONLY))
+			st_.st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
 
-		std::memcpy (m_xferBuffer.freeArea (), path.data (), path.size ());
-		m_xferBuffer.markUsed (path.size ());
-		LOCKED (m_filePosition += path.size ());
-	}
+		st_.st_size  = entry.fileSize;
+		st_.st_mtime = 0;
 
-	// send any pending data
-	auto const rc = m_dataSocket->write (m_xferBuffer);
-	if (rc <= 0)
-	{
-		// error sending data
-		if (rc < 0 && errno == EWOULDBLOCK)
-			return false;
+		// the worker already paid for the modification time; keep it for later stats
+		std::uint64_t mtime;
+		if (!getMTime_ || !archive->mtime (mtime))
+			return true;
 
-		sendResponse ("426 Connection broken during transfer\r\n");
-		setState (State::COMMAND, true, true);
-		return false;
-	}
+		st_.st_mtime = mtime - FtpServer::tzOffset ();
 
-	m_timestamp = std::time (nullptr);
+		if (m_settings->statCacheTTL ())
+			StatCache::instance ().insert (m_listPath, false, st_);
 
-	// we can try to send more data
-	return true;
-#else
-	/// \todo error code?
-	sendResponse ("451 Glob unsupported\r\n");
-	setState (State::COMMAND, true, true);
-	return false;
+		return true;
+	}
 #endif
+
+	// lstat the entry
+	return tzLStat (m_listPath.c_str (), &st_) == 0;
 }
 
-bool FtpSession::retrieveTransfer ()
+bool FtpSession::nextListDir ()
 {
-	if (m_xferBuffer.empty ())
-	{
-		m_xferBuffer.clear ();
+	// this directory's children come next, in the order they were listed
+	std::reverse (std::begin (m_listStack) + m_listStackBase, std::end (m_listStack));
 
-		auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
+	while (!m_listStack.empty ())
+	{
+		auto path = std::move (m_listStack.back ());
+		m_listStack.pop_back ();
 
-		if (!m_devZero)
+		if (!m_dir.open (path.c_str ()))
 		{
-			if (!m_zStreamBuffer.empty ())
-				return deflateBuffer (false);
+			error ("Skipping %s: %s\n", path.c_str (), std::strerror (errno));
+			continue;
+		}
 
-			if (m_deflate && !m_zFlushed && m_eof)
-				return deflateBuffer (true);
+		m_lwd           = std::move (path);
+		m_listStackBase = m_listStack.size ();
+		m_listHeader    = true;
 
-			m_zStreamBuffer.clear ();
+		LOCKED (m_workItem = m_lwd);
+		return true;
+	}
 
-			if (m_eof && (m_deflate == m_zFlushed))
-			{
-				sendResponse ("226 OK\r\n");
-				setState (State::COMMAND, true, true);
+	return false;
+}
+
+bool FtpSession::listCached (std::string const &path_, int const level_)
+{
+	auto const ttl = m_settings->statCacheTTL ();
+	auto variant   = static_cast<unsigned> (m_xferDirMode);
+#ifdef __3DS__
+	if (m_settings->getMTime ())
+		variant |= 1u << 8;
+#endif
+
+	if (!ttl)
+		return false;
+
+	if (m_xferDirMode == XferDirMode::MLSD)
+	{
+		variant |= m_mlstType << 3 | m_mlstSize << 4 | m_mlstModify << 5 | m_mlstPerm << 6 |
+		           m_mlstUnixMode << 7;
+	}
+
+	// the directory's own mtime changes when entries are added, removed or renamed
+	stat_t st;
+	stats::global ().statCalls.add ();
+	if (::stat (path_.c_str (), &st) != 0)
+		return false;
+
+	m_listing = ListingCache::instance ().lookup (path_, variant, st.st_mtime, ttl);
+	if (m_listing)
+	{
+		stats::global ().listingHits.add ();
+
+		m_listingPos      = 0;
+		m_listingDeflated =
+		    m_deflate && !m_listing->deflated.empty () && m_listing->level == level_;
+		if (m_listingDeflated)
+			m_zStream.reset ();
+		else if (m_deflate)
+		{
+			// compress it this time and keep the result
+			auto record = std::make_shared<ListingCache::Listing> (*m_listing);
+			record->deflated.clear ();
+			record->level   = level_;
+			m_listingRecord = std::move (record);
+		}
+
+		return true;
+	}
+
+	// a change within the second after rendering wouldn't change the mtime
+	if (std::time (nullptr) - st.st_mtime < 2)
+		return false;
+
+	auto record     = std::make_shared<ListingCache::Listing> ();
+	record->path    = path_;
+	record->variant = variant;
+	record->mtime   = st.st_mtime;
+	record->level   = level_;
+	m_listingRecord = std::move (record);
+	return false;
+}
+
+void FtpSession::recordListing (char const *const data_,
+    std::size_t const size_,
+    bool const deflated_)
+{
+	if (!m_listingRecord)
+		return;
+
+	auto &record = *m_listingRecord;
+	if (record.data.size () + record.deflated.size () + size_ > ListingCache::maxSize ())
+	{
+		// too big to cache
+		m_listingRecord.reset ();
+		return;
+	}
+
+	auto &out = deflated_ ? record.deflated : record.data;
+	out.insert (std::end (out), data_, data_ + size_);
+}
+
+void FtpSession::fillCachedListing ()
+{
+	auto const &src = m_listingDeflated ? m_listing->deflated : m_listing->data;
+	auto &buffer    = m_deflate && !m_listingDeflated ? m_zStreamBuffer : m_xferBuffer;
+
+	auto const size = std::min (buffer.freeSize (), src.size () - m_listingPos);
+	std::memcpy (buffer.freeArea (), src.data () + m_listingPos, size);
+	buffer.markUsed (size);
+	m_listingPos += size;
+
+	if (m_listingDeflated)
+		m_zStreamPosition += size;
+	else
+		m_progress.update (m_filePosition += size);
+
+	if (m_listingPos < src.size ())
+		return;
+
+	m_eof = true;
+	if (m_listingDeflated)
+	{
+		m_zFlushed = true;
+		m_progress.update (m_filePosition = m_listing->data.size ());
+	}
+}
+
+bool FtpSession::hashTransfer ()
+{
+	auto const &job = *m_hashJob;
+
+#ifdef __NDS__
+	// no threads; hash a chunk per turn
+	m_hashJob->step ();
+#endif
+
+	// a long checksum isn't an idle session
+	m_progress.update (m_filePosition = job.position ());
+	m_timestamp = std::time (nullptr);
+
+	if (!job.done ())
+	{
+#ifdef __NDS__
+		return true;
+#else
+		m_ioWait = true;
+		return false;
+#endif
+	}
+
+	if (job.error ())
+		sendResponse ("550 %s\r\n", std::strerror (job.error ()));
+	else
+		sendHash (job.algorithm (), job.offset (), job.end (), job.digest ());
+
+	setState (State::COMMAND, false, true);
+	return false;
+}
+
+bool FtpSession::copyTransfer ()
+{
+	// a long copy isn't an idle session
+	m_timestamp = std::time (nullptr);
+
+	std::make_signed_t<std::size_t> rc = -1;
+#if FTPD_HAS_COPY_FILE_RANGE
+	if (!m_copyBuffer)
+	{
+		rc = m_copyFile.copyFrom (m_file, STORE_BUFFERSIZE);
+
+		// not every pair of filesystems can copy in the kernel
+		if (rc < 0 && m_filePosition == 0 &&
+		    (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+			m_copyBuffer = std::make_unique<IOBuffer> (STORE_BUFFERSIZE);
+	}
+#endif
+
+	if (m_copyBuffer)
+	{
+		auto &buffer = *m_copyBuffer;
+		buffer.clear ();
+
+		rc = m_file.read (buffer);
+		if (rc > 0 && !m_copyFile.writeAll (buffer.usedArea (), buffer.usedSize ()))
+			rc = -1;
+	}
+
+	if (rc < 0)
+	{
+		// setState removes the partial copy
+		sendResponse ("550 %s\r\n", std::strerror (errno));
+		setState (State::COMMAND, false, true);
+		return false;
+	}
+
+	if (rc > 0)
+	{
+		m_progress.update (m_filePosition += rc);
+
+		// one chunk per poll so other sessions get a turn
+		return false;
+	}
+
+	// the file is complete once everything reaches the filesystem
+	if (!m_copyFile.flush ())
+	{
+		sendResponse ("550 %s\r\n", std::strerror (errno));
+		setState (State::COMMAND, false, true);
+		return false;
+	}
+
+	m_copyFile.close ();
+
+	StatCache::instance ().invalidate (m_workItem);
+	ListingCache::instance ().invalidate (m_workItem);
+#ifndef __NDS__
+	CachedFile::invalidate (m_workItem);
+#endif
+
+	FtpServer::updateFreeSpace ();
+	sendResponse ("250 OK\r\n");
+	setState (State::COMMAND, false, true);
+	return false;
+}
+
+bool FtpSession::listTransfer ()
+{
+	// check if we sent all available data
+	while (m_xferBuffer.empty ())
+	{
+		m_xferBuffer.clear ();
+
+		if (!m_zStreamBuffer.empty () || (m_deflate && !m_zFlushed && m_eof))
+		{
+			if (!deflateBuffer (m_xferBuffer, m_zStreamBuffer.empty ()))
 				return false;
-			}
 
-			// we have sent all the data, so read some more
-			auto const rc = m_file.read (ioBuffer);
-			if (rc < 0)
+			// keep the compressed copy as well
+			recordListing (m_xferBuffer.usedArea (), m_xferBuffer.usedSize (), true);
+			return true;
+		}
+
+		m_zStreamBuffer.clear ();
+
+		// check xfer dir type
+		int rc = 226;
+		if (m_xferDirMode == XferDirMode::MLST || m_xferDirMode == XferDirMode::STAT)
+			rc = 250;
+
+		if (m_eof && (m_deflate == m_zFlushed))
+		{
+			if (m_listingRecord)
+				ListingCache::instance ().insert (std::move (m_listingRecord));
+
+			sendResponse ("%d OK\r\n", rc);
+			setState (State::COMMAND, true, true);
+			return false;
+		}
+
+		if (m_listing)
+		{
+			fillCachedListing ();
+			if (m_deflate && !m_listingDeflated)
+				return true;
+
+			continue;
+		}
+
+		// check if this was for a file/MLST
+		if (!m_dir)
+		{
+			// we already sent the file's listing
+			m_eof = true;
+			return true;
+		}
+
+		// render as many entries as fit before sending
+		auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
+		switch (m_xferDirMode)
+		{
+		case XferDirMode::LIST:
+			rc = fillListing<XferDirMode::LIST> (ioBuffer);
+			break;
+
+		case XferDirMode::MLSD:
+			rc = fillListing<XferDirMode::MLSD> (ioBuffer);
+			break;
+
+		case XferDirMode::NLST:
+			rc = fillListing<XferDirMode::NLST> (ioBuffer);
+			break;
+
+		case XferDirMode::STAT:
+			rc = fillListing<XferDirMode::STAT> (ioBuffer);
+			break;
+
+		case XferDirMode::MLST:
+			// MLST never lists a directory
+			rc = EINVAL;
+			break;
+		}
+
+#ifdef __3DS__
+		if (rc == EWOULDBLOCK)
+		{
+			// the modification time worker hasn't reached the next entry yet
+			m_ioWait = true;
+			return false;
+		}
+#endif
+
+		if (rc != 0)
+		{
+			sendResponse ("425 %s\r\n", std::strerror (rc));
+			setState (State::COMMAND, true, true);
+			return false;
+		}
+
+		if (m_deflate)
+			return true;
+	}
+
+	// send any pending data
+	auto const rc = m_dataSocket->write (m_xferBuffer);
+	if (rc <= 0)
+	{
+		// error sending data
+		if (rc < 0 && errno == EWOULDBLOCK)
+			return false;
+
+		sendResponse ("426 Connection broken during transfer\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
+	m_timestamp = std::time (nullptr);
+
+	// we can try to send more data
+	return true;
+}
+
+bool FtpSession::globTransfer ()
+{
+#if FTPD_HAS_GLOB
+	// check if we sent all available data
+	if (m_xferBuffer.empty ())
+	{
+		m_xferBuffer.clear ();
+
+		// render as many entries as fit before sending
+		while (true)
+		{
+			auto const entry =
+			    m_pendingGlob ? std::exchange (m_pendingGlob, nullptr) : m_glob.next ();
+			if (!entry)
 			{
-				// failed to read data
-				sendResponse ("451 %s\r\n", std::strerror (errno));
-				setState (State::COMMAND, true, true);
-				return false;
+				// keep scanning on the next pass
+				if (errno == EAGAIN && m_xferBuffer.empty ())
+					return true;
+
+				break;
 			}
 
-			if (rc == 0)
+			// NLST gives the whole path name
+			auto const rc =
+			    formatDirent<XferDirMode::NLST> (m_xferBuffer, m_pendingSt, entry, nullptr);
+			if (rc == EAGAIN && !m_xferBuffer.empty ())
 			{
-				// reached end of file
-				m_eof = true;
-				return true;
+				// buffer is full; send what we have
+				m_pendingGlob = entry;
+				break;
 			}
 
-			LOCKED (m_filePosition += rc);
+			if (rc != 0)
+			{
+				sendResponse ("501 %s\r\n", std::strerror (rc == EAGAIN ? ENOMEM : rc));
+				setState (State::COMMAND, true, true);
+				return false;
+			}
 		}
-		else
+
+		if (m_xferBuffer.empty ())
 		{
-			if (!m_zStreamBuffer.empty ())
-				return deflateBuffer (false);
+			// we have exhausted the glob listing
+			sendResponse ("226 OK\r\n");
+			setState (State::COMMAND, true, true);
+			return false;
+		}
 
-			if (m_deflate && !m_zFlushed && m_eof)
-				return deflateBuffer (true);
+		m_progress.update (m_filePosition += m_xferBuffer.usedSize ());
+	}
 
-			m_zStreamBuffer.clear ();
+	// send any pending data
+	auto const rc = m_dataSocket->write (m_xferBuffer);
+	if (rc <= 0)
+	{
+		// error sending data
+		if (rc < 0 && errno == EWOULDBLOCK)
+			return false;
 
-			auto const buffer = ioBuffer.freeArea ();
-			auto const size   = ioBuffer.freeSize ();
+		sendResponse ("426 Connection broken during transfer\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
+	m_timestamp = std::time (nullptr);
+
+	// we can try to send more data
+	return true;
+#else
+	/// \todo error code?
+	sendResponse ("451 Glob unsupported\r\n");
+	setState (State::COMMAND, true, true);
+	return false;
+#endif
+}
+
+bool FtpSession::retrieveTransfer ()
+{
+	if (m_deflate)
+		return deflateTransfer ();
 
-			std::memset (buffer, 0, size);
-			ioBuffer.markUsed (size);
+	if (m_xferBuffer.empty ())
+	{
+		m_xferBuffer.clear ();
 
-			LOCKED (m_filePosition += size);
+		if (m_eof)
+		{
+			sendResponse ("226 OK\r\n");
+			setState (State::COMMAND, true, true);
+			return false;
 		}
 
-		if (m_deflate)
+		// we have sent all the data, so read some more
+		if (!readDownload (m_xferBuffer))
+			return false;
+
+		if (m_eof)
 			return true;
 	}
 
@@ -2299,6 +3902,198 @@ bool FtpSession::retrieveTransfer ()
 	return true;
 }
 
+bool FtpSession::deflateTransfer ()
+{
+	// compress until a whole segment is waiting so compressible data isn't sent in dribbles
+	if (!m_zFlushed && m_deflateChain.usedSize () < XFER_BUFFERSIZE)
+	{
+		if (m_zStreamBuffer.empty () && !m_eof)
+		{
+			m_zStreamBuffer.clear ();
+			return readDownload (m_zStreamBuffer);
+		}
+
+		auto const segment = m_deflateChain.tail ();
+		assert (segment);
+		return deflateBuffer (*segment, m_eof && m_zStreamBuffer.empty ());
+	}
+
+	if (m_deflateChain.empty ())
+	{
+		sendResponse ("226 OK\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
+	// send the waiting segments together
+	auto const rc = m_dataSocket->write (m_deflateChain);
+
+	// the tuner compares how fast the link drains against how fast we compress
+	if (m_deflateTuner)
+		m_deflateTuner->sent (rc > 0 ? rc : 0, rc < 0 && errno == EWOULDBLOCK);
+
+	if (rc <= 0)
+	{
+		// error sending data
+		if (rc < 0 && errno == EWOULDBLOCK)
+			return false;
+
+		sendResponse ("426 Connection broken during transfer\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
+	m_timestamp = std::time (nullptr);
+
+	// we can try to compress/send more data
+	return true;
+}
+
+bool FtpSession::readDownload (IOBuffer &buffer_)
+{
+	if (m_devZero)
+	{
+		auto const buffer = buffer_.freeArea ();
+		auto const size   = buffer_.freeSize ();
+
+		std::memset (buffer, 0, size);
+		buffer_.markUsed (size);
+
+		m_progress.update (m_filePosition += size);
+		return true;
+	}
+
+#ifndef __NDS__
+	auto const rc = m_asyncFile ? m_asyncFile->read (buffer_) : readFile (buffer_);
+#else
+	auto const rc = readFile (buffer_);
+#endif
+	if (rc < 0)
+	{
+#ifndef __NDS__
+		if (errno == EWOULDBLOCK)
+		{
+			// the I/O thread hasn't filled the next buffer yet
+			m_ioWait = true;
+			return false;
+		}
+#endif
+
+		// failed to read data
+		sendResponse ("451 %s\r\n", std::strerror (errno));
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
+	if (rc == 0)
+	{
+		// reached end of file
+		m_eof = true;
+		return true;
+	}
+
+	m_progress.update (m_filePosition += rc);
+
+#ifndef __NDS__
+	// fast clients drain the ring quicker than the disk refills it
+	if (m_asyncFile)
+	{
+		auto const now     = platform::steady_clock::now ();
+		auto const seconds = std::chrono::duration<float> (now - m_ioRateTime).count ();
+		if (seconds >= IO_RATE_PERIOD)
+		{
+			auto const rate =
+			    gsl::narrow_cast<float> (m_filePosition - m_ioRatePosition) / seconds;
+
+			auto const alpha = 1.0f - std::exp (-seconds / XFER_RATE_TAU);
+			m_ioRate         = alpha * rate + (1.0f - alpha) * m_ioRate;
+			m_ioRatePosition = m_filePosition;
+			m_ioRateTime     = now;
+
+			m_asyncFile->readAhead (m_ioRate * READ_AHEAD_TIME);
+		}
+	}
+#endif
+
+	return true;
+}
+
+std::make_signed_t<std::size_t> FtpSession::readFile (IOBuffer &buffer_)
+{
+	auto size = buffer_.freeSize ();
+	if (m_rangeEnd)
+	{
+		if (m_filePosition >= m_rangeEnd)
+			return 0;
+
+		size = std::min<std::uint64_t> (size, m_rangeEnd - m_filePosition);
+	}
+
+#if FTPD_HAS_PREAD
+	auto const rc = m_file.readAt (buffer_.freeArea (), size, m_filePosition);
+#else
+	auto const rc = m_file.read (buffer_.freeArea (), size);
+#endif
+	if (rc > 0)
+		buffer_.markUsed (rc);
+
+	return rc;
+}
+
+#if FTPD_HAS_SENDFILE
+bool FtpSession::sendFileTransfer ()
+{
+	// stop at the end of a RANG byte range
+	std::size_t size = FILE_BUFFERSIZE;
+	if (m_rangeEnd && m_filePosition >= m_rangeEnd)
+		size = 0;
+	else if (m_rangeEnd)
+		size = std::min<std::uint64_t> (size, m_rangeEnd - m_filePosition);
+
+	// the shared file position is left alone; the offset is tracked in m_filePosition
+	off_t offset  = m_filePosition;
+	auto const rc = size ? m_dataSocket->sendFile (m_cachedFile->fd (), offset, size) : 0;
+	if (rc < 0)
+	{
+		if (errno == EWOULDBLOCK)
+			return false;
+
+		if (errno == EINVAL || errno == ENOSYS)
+		{
+			// sendfile not supported for this file; fall back to reading through the I/O threads
+			auto const end = m_rangeEnd ? m_rangeEnd : UINT64_MAX;
+			m_asyncFile    = AsyncFile::create (
+			    std::move (m_cachedFile), m_filePosition, end, XFER_BUFFERSIZE);
+
+			m_ioRate         = 0.0f;
+			m_ioRatePosition = m_filePosition;
+			m_ioRateTime     = platform::steady_clock::now ();
+
+			m_transfer = &FtpSession::retrieveTransfer;
+			return true;
+		}
+
+		sendResponse ("426 Connection broken during transfer\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
+	if (rc == 0)
+	{
+		// reached end of file
+		sendResponse ("226 OK\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
+	m_progress.update (m_filePosition += rc);
+	m_timestamp = std::time (nullptr);
+
+	// we can try to send more data
+	return true;
+}
+#endif
+
 bool FtpSession::storeTransfer ()
 {
 	if (m_xferBuffer.empty ())
@@ -2315,6 +4110,57 @@ bool FtpSession::storeTransfer ()
 
 		if (m_eof && (m_deflate == m_zFlushed))
 		{
+			// write the last partial block
+			if (m_storeBuffer && !m_storeBuffer->empty () && !writeStore ())
+				return false;
+
+			if (m_storeTruncate)
+			{
+				// trim preallocated space past the end of the data
+				m_storeTruncate = false;
+#ifndef __NDS__
+				assert (m_asyncFile);
+				m_asyncFile->truncate (m_storeOffset);
+#else
+				if (!m_file.truncate (m_storeOffset))
+				{
+					sendResponse ("451 %s\r\n", std::strerror (errno));
+					setState (State::COMMAND, true, true);
+					return false;
+				}
+#endif
+			}
+
+#ifndef __NDS__
+			// make sure everything reached the file before reporting success
+			if (m_asyncFile && m_asyncFile->flush () != 0)
+			{
+				if (errno == EWOULDBLOCK)
+				{
+					m_ioWait = true;
+					return false;
+				}
+
+				sendResponse ("451 %s\r\n", std::strerror (errno));
+				setState (State::COMMAND, true, true);
+				return false;
+			}
+
+			// the upload which completes the announced size tells the client the file is whole
+			if (m_storeFile)
+			{
+				auto const complete = m_storeFile->finish (m_restartPosition, m_storeOffset);
+				m_storeFile.reset ();
+
+				if (complete)
+				{
+					sendResponse ("226 File complete\r\n");
+					setState (State::COMMAND, true, true);
+					return false;
+				}
+			}
+#endif
+
 			sendResponse ("226 OK\r\n");
 			setState (State::COMMAND, true, true);
 			return false;
@@ -2346,10 +4192,57 @@ bool FtpSession::storeTransfer ()
 			return true;
 	}
 
+	// a ranged upload must not spill into the next range
+	if (m_rangeEnd && m_filePosition + m_xferBuffer.usedSize () > m_rangeEnd)
+	{
+		sendResponse ("552 Data past the end of the range\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
 	if (!m_devZero)
 	{
-		// write any pending data
-		auto const rc = m_file.write (m_xferBuffer);
+		// stage received data so the file sees a few large writes at aligned offsets
+		auto &store = *m_storeBuffer;
+		if (store.usedSize () < m_storeFill)
+		{
+			auto const size = std::min (m_xferBuffer.usedSize (), m_storeFill - store.usedSize ());
+			std::memcpy (store.freeArea (), m_xferBuffer.usedArea (), size);
+			store.markUsed (size);
+			m_xferBuffer.markFree (size);
+
+			m_progress.update (m_filePosition += size);
+		}
+
+		// a full block which the I/O thread couldn't take yet is retried here
+		if (store.usedSize () == m_storeFill)
+			return writeStore ();
+	}
+	else
+	{
+		m_progress.update (m_filePosition += m_xferBuffer.usedSize ());
+		m_xferBuffer.clear ();
+	}
+
+	return true;
+}
+
+bool FtpSession::writeStore ()
+{
+	auto &store = *m_storeBuffer;
+	while (!store.empty ())
+	{
+#ifndef __NDS__
+		auto const rc = m_asyncFile ? m_asyncFile->write (store) : m_file.writeDirect (store);
+		if (rc < 0 && errno == EWOULDBLOCK)
+		{
+			// the I/O thread hasn't drained a buffer yet
+			m_ioWait = true;
+			return false;
+		}
+#else
+		auto const rc = m_file.writeDirect (store);
+#endif
 		if (rc <= 0)
 		{
 			// error writing data
@@ -2358,16 +4251,78 @@ bool FtpSession::storeTransfer ()
 			return false;
 		}
 
-		// we can try to recv/write more data
-		LOCKED (m_filePosition += rc);
+		m_storeOffset += rc;
+		reserveStore ();
 	}
-	else
+
+	// the next block ends on an aligned offset again
+	store.clear ();
+	m_storeFill = STORE_BUFFERSIZE;
+	return true;
+}
+
+void FtpSession::finishStore ()
+{
+	// best effort; a client resuming the upload picks up from whatever reached the file
+	auto &store = *m_storeBuffer;
+
+#ifndef __NDS__
+	if (m_asyncFile)
 	{
-		LOCKED (m_filePosition += m_xferBuffer.usedSize ());
-		m_xferBuffer.clear ();
+		if (!store.empty ())
+		{
+			auto const rc = m_asyncFile->write (store);
+			if (rc > 0)
+			{
+				m_storeOffset += rc;
+				reserveStore ();
+			}
+		}
+
+		// the I/O thread finishes the queued writes after the session lets go
+		if (m_storeTruncate)
+			m_asyncFile->truncate (m_storeOffset);
+		(void)m_asyncFile->flush ();
 	}
+#else
+	if (m_file)
+	{
+		while (!store.empty ())
+		{
+			auto const rc = m_file.writeDirect (store);
+			if (rc <= 0)
+				break;
 
-	return true;
+			m_storeOffset += rc;
+			reserveStore ();
+		}
+
+		if (m_storeTruncate)
+			(void)m_file.truncate (m_storeOffset);
+	}
+#endif
+
+#ifndef __NDS__
+	// the range isn't complete, so it doesn't count towards the file
+	if (m_storeFile)
+	{
+		m_storeFile->abandon (m_storeOffset);
+		m_storeFile.reset ();
+	}
+#endif
+
+	m_storeTruncate = false;
+	m_storeBuffer.reset ();
+}
+
+void FtpSession::reserveStore ()
+{
+	// overwritten data is counted too; the query after the upload corrects it
+	if (m_storeOffset <= m_storeReserved)
+		return;
+
+	FtpServer::adjustFreeSpace (-static_cast<std::int64_t> (m_storeOffset - m_storeReserved));
+	m_storeReserved = m_storeOffset;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -2389,21 +4344,35 @@ void FtpSession::ABOR (char const *args_)
 
 void FtpSession::ALLO (char const *args_)
 {
-	(void)args_;
+	setState (State::COMMAND, false, false);
+
+	// parse the size; an optional record size ("R <size>") doesn't apply to us
+	std::uint64_t size = 0;
+	auto p             = args_;
+	for (; std::isdigit (*p); ++p)
+	{
+		if (UINT64_MAX / 10 < size || UINT64_MAX - (*p - '0') < size * 10)
+		{
+			sendResponse ("504 %s\r\n", std::strerror (ERANGE));
+			return;
+		}
 
-	sendResponse ("202 Superfluous command\r\n");
-	setState (State::COMMAND, false, false);
-}
+		size = size * 10 + (*p - '0');
+	}
 
-void FtpSession::APPE (char const *args_)
-{
-	if (!authorized ())
+	if (p == args_ || (*p && *p != ' '))
 	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
+		sendResponse ("501 Invalid size\r\n");
 		return;
 	}
 
+	// the next upload preallocates this much; a ranged upload takes it as the whole file's size
+	m_allocSize = size;
+	sendResponse ("200 OK\r\n");
+}
+
+void FtpSession::APPE (char const *args_)
+{
 	// open the file in append mode
 	xferFile (args_, XferFileMode::APPE);
 }
@@ -2414,12 +4383,6 @@ void FtpSession::CDUP (char const *args_)
 
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	if (!changeDir (".."))
 	{
 		sendResponse ("550 %s\r\n", std::strerror (errno));
@@ -2433,12 +4396,6 @@ void FtpSession::CWD (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	if (!changeDir (args_))
 	{
 		sendResponse ("550 %s\r\n", std::strerror (errno));
@@ -2452,12 +4409,6 @@ void FtpSession::DELE (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// build the path to remove
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -2466,6 +4417,11 @@ void FtpSession::DELE (char const *args_)
 		return;
 	}
 
+	// a recently listed file tells us what it frees without another stat
+	stat_t st;
+	auto const cached =
+	    StatCache::instance ().lookup (path, false, m_settings->statCacheTTL (), st);
+
 	// unlink the path
 	if (::unlink (path.c_str ()) != 0)
 	{
@@ -2473,24 +4429,179 @@ void FtpSession::DELE (char const *args_)
 		return;
 	}
 
+	StatCache::instance ().invalidate (path);
+	ListingCache::instance ().invalidate (path);
+#ifndef __NDS__
+	CachedFile::invalidate (path);
+	StoreFile::invalidate (path);
+#endif
+
+	if (cached && S_ISREG (st.st_mode))
+		FtpServer::adjustFreeSpace (st.st_size);
 	FtpServer::updateFreeSpace ();
 	sendResponse ("250 OK\r\n");
 }
+
+void FtpSession::EPRT (char const *args_)
+{
+	// reset state
+	setState (State::COMMAND, true, true);
+	m_pasv = false;
+	m_port = false;
+
+	if (m_epsvAll)
+	{
+		sendResponse ("501 Only EPSV is allowed after EPSV ALL\r\n");
+		return;
+	}
+
+	// split <d><proto><d><addr><d><port><d>, where <d> is any printable character
+	auto const delim = args_[0];
+	if (delim < 33 || delim > 126)
+	{
+		sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+		return;
+	}
+
+	std::string fields[3];
+	auto p = args_ + 1;
+	for (auto &field : fields)
+	{
+		auto const end = std::strchr (p, delim);
+		if (!end)
+		{
+			sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+			return;
+		}
+
+		field.assign (p, end);
+		p = end + 1;
+	}
+
+	if (*p)
+	{
+		sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+		return;
+	}
+
+	// parse the port
+	unsigned port = 0;
+	auto valid    = !fields[2].empty ();
+	for (auto const c : fields[2])
+	{
+		if (!std::isdigit (c) || port > 0xFFFF)
+		{
+			valid = false;
+			break;
+		}
+
+		port = port * 10 + (c - '0');
+	}
+
+	if (!valid || port == 0 || port > 0xFFFF)
+	{
+		sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+		return;
+	}
+
+	// parse the address
+	if (fields[0] == "1")
+	{
+		in_addr addr;
+		if (!inet_aton (fields[1].c_str (), &addr))
+		{
+			sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+			return;
+		}
+
+		m_portAddr = SockAddr (addr, port);
+	}
+#ifndef NO_IPV6
+	else if (fields[0] == "2")
+	{
+		in6_addr addr;
+		if (inet_pton (AF_INET6, fields[1].c_str (), &addr) != 1)
+		{
+			sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+			return;
+		}
+
+		m_portAddr = SockAddr (addr, port);
+	}
+#endif
+	else
+	{
+#ifdef NO_IPV6
+		sendResponse ("522 Network protocol not supported, use (1)\r\n");
+#else
+		sendResponse ("522 Network protocol not supported, use (1,2)\r\n");
+#endif
+		return;
+	}
+
+	// we are ready to connect to the client
+	m_port = true;
+	sendResponse ("200 OK\r\n");
+}
+
+void FtpSession::EPSV (char const *args_)
+{
+	// reset state
+	setState (State::COMMAND, true, true);
+	m_pasv = false;
+	m_port = false;
+
+	// tells NAT devices not to expect any other data connection setup
+	if (compare (args_, "ALL") == 0)
+	{
+		m_epsvAll = true;
+		sendResponse ("200 EPSV ALL OK\r\n");
+		return;
+	}
+
+	// a protocol argument must match the command connection
+	if (*args_)
+	{
+		auto const proto =
+		    m_commandSocket->sockName ().domain () == SockAddr::Domain::IPv4 ? "1" : "2";
+		if (std::strcmp (args_, proto) != 0)
+		{
+			sendResponse ("522 Network protocol not supported, use (%s)\r\n", proto);
+			return;
+		}
+	}
+
+	if (!listenPassive ())
+		return;
+
+	m_pasv = true;
+	sendResponse (
+	    "229 Entering Extended Passive Mode (|||%u|)\r\n", m_pasvSocket->sockName ().port ());
+}
+
 void FtpSession::FEAT (char const *args_)
 {
 	(void)args_;
 
 	setState (State::COMMAND, false, false);
 	sendResponse ("211-\r\n"
+	              " EPRT\r\n"
+	              " EPSV\r\n"
+	              " HASH CRC32%s;MD5%s;SHA-1%s;SHA-256%s\r\n"
 	              " MDTM\r\n"
 	              " MLST Type%s;Size%s;Modify%s;Perm%s;UNIX.mode%s;\r\n"
 	              " MODE Z\r\n"
 	              " PASV\r\n"
+	              " RANG STREAM\r\n"
 	              " SIZE\r\n"
 	              " TVFS\r\n"
 	              " UTF8\r\n"
 	              "\r\n"
 	              "211 End\r\n",
+	    m_hashAlgorithm == checksum::Algorithm::CRC32 ? "*" : "",
+	    m_hashAlgorithm == checksum::Algorithm::MD5 ? "*" : "",
+	    m_hashAlgorithm == checksum::Algorithm::SHA1 ? "*" : "",
+	    m_hashAlgorithm == checksum::Algorithm::SHA256 ? "*" : "",
 	    m_mlstType ? "*" : "",
 	    m_mlstSize ? "*" : "",
 	    m_mlstModify ? "*" : "",
@@ -2498,6 +4609,11 @@ void FtpSession::FEAT (char const *args_)
 	    m_mlstUnixMode ? "*" : "");
 }
 
+void FtpSession::HASH (char const *args_)
+{
+	xferHash (args_, m_hashAlgorithm, true);
+}
+
 void FtpSession::HELP (char const *args_)
 {
 	(void)args_;
@@ -2505,21 +4621,15 @@ void FtpSession::HELP (char const *args_)
 	setState (State::COMMAND, false, false);
 	sendResponse ("214-\r\n"
 	              "The following commands are recognized\r\n"
-	              " ABOR ALLO APPE CDUP CWD DELE FEAT HELP LIST MDTM MKD MLSD MLST MODE\r\n"
-	              " NLST NOOP OPTS PASS PASV PORT PWD QUIT REST RETR RMD RNFR RNTO SITE\r\n"
-	              " SIZE STAT STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD XPWD XRMD\r\n"
+	              " ABOR ALLO APPE CDUP CWD DELE EPRT EPSV FEAT HASH HELP LIST MDTM MKD\r\n"
+	              " MLSD MLST MODE NLST NOOP OPTS PASS PASV PORT PWD QUIT RANG REST RETR\r\n"
+	              " RMD RNFR RNTO SITE SIZE STAT STOR STOU STRU SYST TYPE USER XCRC XCUP\r\n"
+	              " XCWD XMD5 XMKD XPWD XRMD XSHA1 XSHA256\r\n"
 	              "214 End\r\n");
 }
 
 void FtpSession::LIST (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// open the path in LIST mode
 	xferDir (args_, XferDirMode::LIST, true);
 }
@@ -2530,12 +4640,6 @@ void FtpSession::MDTM (char const *args_)
 
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	sendResponse ("502 Command not implemented\r\n");
 }
 
@@ -2543,12 +4647,6 @@ void FtpSession::MKD (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// build the path to create
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -2564,32 +4662,21 @@ void FtpSession::MKD (char const *args_)
 		return;
 	}
 
+	StatCache::instance ().invalidate (path);
+	ListingCache::instance ().invalidate (path);
+
 	FtpServer::updateFreeSpace ();
 	sendResponse ("250 OK\r\n");
 }
 
 void FtpSession::MLSD (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// open the path in MLSD mode
 	xferDir (args_, XferDirMode::MLSD, false);
 }
 
 void FtpSession::MLST (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// open the path in MLST mode
 	xferDir (args_, XferDirMode::MLST, false);
 }
@@ -2618,17 +4705,10 @@ void FtpSession::MODE (char const *args_)
 
 void FtpSession::NLST (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 #if FTPD_HAS_GLOB
 	if (std::strchr (args_, '*'))
 	{
-		if (::chdir (m_cwd.c_str ()) != 0 || !m_glob.glob (args_))
+		if (!m_glob.glob (m_cwd, args_))
 		{
 			sendResponse ("501 %s\r\n", std::strerror (errno));
 			setState (State::COMMAND, false, false);
@@ -2648,6 +4728,8 @@ void FtpSession::NLST (char const *args_)
 		setState (State::DATA_CONNECT, false, true);
 		m_send = true;
 
+		stats::global ().listings.add ();
+
 		// setup connection
 		if (m_port && !dataConnect ())
 		{
@@ -2659,7 +4741,7 @@ void FtpSession::NLST (char const *args_)
 	}
 #endif
 
-	xferDir (args_, XferDirMode::NLST, false);
+	xferDir (args_, XferDirMode::NLST, true);
 }
 
 void FtpSession::NOOP (char const *args_)
@@ -2681,6 +4763,25 @@ void FtpSession::OPTS (char const *args_)
 		return;
 	}
 
+	// check HASH options
+	if (compare (args_, "HASH") == 0)
+	{
+		sendResponse ("200 %s\r\n", checksum::name (m_hashAlgorithm));
+		return;
+	}
+
+	if (::strncasecmp (args_, "HASH ", 5) == 0)
+	{
+		if (!checksum::parse (args_ + 5, m_hashAlgorithm))
+		{
+			sendResponse ("501 Unknown algorithm\r\n");
+			return;
+		}
+
+		sendResponse ("200 %s\r\n", checksum::name (m_hashAlgorithm));
+		return;
+	}
+
 	// check MLST options
 	if (::strncasecmp (args_, "MLST ", 5) == 0)
 	{
@@ -2759,6 +4860,10 @@ void FtpSession::OPTS (char const *args_)
 				}
 
 				level = val[0] - '0';
+
+#ifndef __NDS__
+				auto const lock = m_config.lockGuard ();
+#endif
 				m_config.setDeflateLevel (level);
 			}
 			else
@@ -2787,16 +4892,8 @@ void FtpSession::PASS (char const *args_)
 
 	m_authorizedPass = false;
 
-	std::string user;
-	std::string pass;
-
-	{
-#ifndef __NDS__
-		auto const lock = m_config.lockGuard ();
-#endif
-		user = m_config.user ();
-		pass = m_config.pass ();
-	}
+	auto const &user = m_settings->user ();
+	auto const &pass = m_settings->pass ();
 
 	if (!user.empty () && !m_authorizedUser)
 	{
@@ -2818,63 +4915,30 @@ void FtpSession::PASV (char const *args_)
 {
 	(void)args_;
 
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// reset state
 	setState (State::COMMAND, true, true);
 	m_pasv = false;
 	m_port = false;
 
-	// create a socket to listen on
-	auto pasv = Socket::create (Socket::eStream);
-	LOCKED (m_pasvSocket = std::move (pasv));
-	if (!m_pasvSocket)
+	if (m_epsvAll)
 	{
-		sendResponse ("451 Failed to create listening socket\r\n");
+		sendResponse ("501 Only EPSV is allowed after EPSV ALL\r\n");
 		return;
 	}
 
-	// set the socket options
-	m_pasvSocket->setRecvBufferSize (SOCK_BUFFERSIZE);
-	m_pasvSocket->setSendBufferSize (SOCK_BUFFERSIZE);
-
-	// create an address to bind
-	sockaddr_in addr = m_commandSocket->sockName ();
-#if defined(__NDS__) || defined(__3DS__)
-	static std::uint16_t ephemeralPort = 5001;
-	if (ephemeralPort > 10000)
-		ephemeralPort = 5001;
-	addr.sin_port = htons (ephemeralPort++);
-#else
-	addr.sin_port = htons (0);
-#endif
-
-	// bind to the address
-	if (!m_pasvSocket->bind (addr))
+	// the reply can only carry an IPv4 address
+	if (m_commandSocket->sockName ().domain () != SockAddr::Domain::IPv4)
 	{
-		closePasv ();
-		sendResponse ("451 Failed to bind address\r\n");
+		sendResponse ("425 PASV requires IPv4, use EPSV\r\n");
 		return;
 	}
 
-	// listen on the socket
-	if (!m_pasvSocket->listen (1))
-	{
-		closePasv ();
-		sendResponse ("451 Failed to listen on socket\r\n");
+	if (!listenPassive ())
 		return;
-	}
 
-	// we are now listening on the socket
 	auto const &sockName = m_pasvSocket->sockName ();
 	std::string name     = sockName.name ();
 	auto const port      = sockName.port ();
-	info ("Listening on [%s]:%u\n", name.c_str (), port);
 
 	// send the address in the ftp format
 	for (auto &c : name)
@@ -2890,18 +4954,17 @@ void FtpSession::PASV (char const *args_)
 
 void FtpSession::PORT (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// reset state
 	setState (State::COMMAND, true, true);
 	m_pasv = false;
 	m_port = false;
 
+	if (m_epsvAll)
+	{
+		sendResponse ("501 Only EPSV is allowed after EPSV ALL\r\n");
+		return;
+	}
+
 	std::string addrString = args_;
 
 	// convert a,b,c,d,e,f with a.b.c.d\0e.f
@@ -2983,39 +5046,81 @@ void FtpSession::PWD (char const *args_)
 {
 	(void)args_;
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	auto const path = encodePath (m_cwd);
 
 	std::string response = "257 \"";
 	response += encodePath (m_cwd, true);
 	response += "\"\r\n";
 
-	sendResponse (response);
-}
+	sendResponse (response);
+}
+
+void FtpSession::QUIT (char const *args_)
+{
+	(void)args_;
+
+	sendResponse ("221 Disconnecting\r\n");
+	closeCommand ();
+}
+
+void FtpSession::RANG (char const *args_)
+{
+	setState (State::COMMAND, false, false);
+
+	// parse the inclusive range "<start> <end>"
+	std::uint64_t range[2] = {0, 0};
+	auto p                 = args_;
+	for (unsigned i = 0; i < 2; ++i)
+	{
+		auto const start = p;
+		for (; std::isdigit (*p); ++p)
+		{
+			if (UINT64_MAX / 10 < range[i] || UINT64_MAX - (*p - '0') < range[i] * 10)
+			{
+				sendResponse ("501 %s\r\n", std::strerror (ERANGE));
+				return;
+			}
+
+			range[i] = range[i] * 10 + (*p - '0');
+		}
+
+		// the values are separated by a space and nothing may follow
+		if (p == start || *p != (i == 0 ? ' ' : '\0'))
+		{
+			sendResponse ("501 Invalid range\r\n");
+			return;
+		}
+
+		++p;
+	}
 
-void FtpSession::QUIT (char const *args_)
-{
-	(void)args_;
+	// "RANG 1 0" resets the range
+	if (range[0] == 1 && range[1] == 0)
+	{
+		m_restartPosition = 0;
+		m_rangeEnd        = 0;
+		sendResponse ("350 Restarting at 0. End of range reset\r\n");
+		return;
+	}
 
-	sendResponse ("221 Disconnecting\r\n");
-	closeCommand ();
+	if (range[1] < range[0] || range[1] == UINT64_MAX)
+	{
+		sendResponse ("501 Invalid range\r\n");
+		return;
+	}
+
+	// the next RETR sends only this range
+	m_restartPosition = range[0];
+	m_rangeEnd        = range[1] + 1;
+	sendResponse ("350 Restarting at %" PRIu64 ". Ending at %" PRIu64 ".\r\n",
+	    range[0],
+	    range[1]);
 }
 
 void FtpSession::REST (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// parse the offset
 	std::uint64_t pos = 0;
 	for (auto p = args_; *p; ++p)
@@ -3037,20 +5142,14 @@ void FtpSession::REST (char const *args_)
 		pos += (*p - '0');
 	}
 
-	// set the restart offset
+	// set the restart offset; this replaces any RANG byte range
 	m_restartPosition = pos;
+	m_rangeEnd        = 0;
 	sendResponse ("350 OK\r\n");
 }
 
 void FtpSession::RETR (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// open the file to retrieve
 	xferFile (args_, XferFileMode::RETR);
 }
@@ -3059,12 +5158,6 @@ void FtpSession::RMD (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// build the path to remove
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -3080,6 +5173,9 @@ void FtpSession::RMD (char const *args_)
 		return;
 	}
 
+	StatCache::instance ().invalidate (path);
+	ListingCache::instance ().invalidate (path);
+
 	FtpServer::updateFreeSpace ();
 	sendResponse ("250 OK\r\n");
 }
@@ -3088,12 +5184,6 @@ void FtpSession::RNFR (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// build the path to rename from
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -3119,12 +5209,6 @@ void FtpSession::RNTO (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// make sure the previous command was RNFR
 	if (m_rename.empty ())
 	{
@@ -3149,6 +5233,18 @@ void FtpSession::RNTO (char const *args_)
 		return;
 	}
 
+	auto &cache = StatCache::instance ();
+	cache.invalidate (m_rename);
+	cache.invalidate (path);
+	ListingCache::instance ().invalidate (m_rename);
+	ListingCache::instance ().invalidate (path);
+#ifndef __NDS__
+	CachedFile::invalidate (m_rename);
+	CachedFile::invalidate (path);
+	StoreFile::invalidate (m_rename);
+	StoreFile::invalidate (path);
+#endif
+
 	// clear the rename state
 	m_rename.clear ();
 
@@ -3173,7 +5269,18 @@ void FtpSession::SITE (char const *args_)
 		              " Set username: SITE USER <NAME>\r\n"
 		              " Set password: SITE PASS <PASS>\r\n"
 		              " Set port: SITE PORT <PORT>\r\n"
-		              " Set deflate level: SITE DEFLATE <LEVEL>\r\n"
+		              " Set listen backlog: SITE BACKLOG <COUNT>\r\n"
+		              " Set deflate level: SITE DEFLATE <LEVEL|AUTO>\r\n"
+		              " Set stat cache TTL: SITE STATTTL <SECONDS>\r\n"
+		              " Set total rate limit: SITE RATE <KIB/S|0>\r\n"
+		              " Set session rate limit: SITE SESSIONRATE <KIB/S|0>\r\n"
+		              " Set socket buffer size: SITE SOCKBUF <DATA|CONTROL> <BYTES|0>\r\n"
+		              " Set control keepalive: SITE KEEPALIVE <SECONDS|0>\r\n"
+		              " Set passive ports: SITE PASVPORTS <MIN-MAX|0>\r\n"
+		              " Check passive peer: SITE PASVCHECK [0|1]\r\n"
+		              " Copy file from: SITE CPFR <PATH>\r\n"
+		              " Copy file to: SITE CPTO <PATH>\r\n"
+		              " Show statistics: SITE STATS [RESET]\r\n"
 #ifndef __NDS__
 		              " Set hostname: SITE HOST <HOSTNAME>\r\n"
 #endif
@@ -3185,13 +5292,58 @@ void FtpSession::SITE (char const *args_)
 		return;
 	}
 
+	// clear the copy source for all SITE commands except CPTO
+	auto const copyFrom = std::move (m_copyFrom);
+	m_copyFrom.clear ();
+
 	if (!authorized ())
 	{
 		sendResponse ("530 Not logged in\r\n");
 		return;
 	}
 
-	if (compare (command, "USER") == 0)
+	if (compare (command, "CPFR") == 0)
+	{
+		// build the path to copy from
+		auto const path = buildResolvedPath (m_cwd, std::string (arg).c_str ());
+		if (path.empty ())
+		{
+			sendResponse ("553 %s\r\n", std::strerror (errno));
+			return;
+		}
+
+		// only plain files can be copied
+		stat_t st;
+		if (tzStat (path.c_str (), &st) != 0)
+		{
+			sendResponse ("450 %s\r\n", std::strerror (errno));
+			return;
+		}
+
+		if (!S_ISREG (st.st_mode))
+		{
+			sendResponse ("550 Not a file\r\n");
+			return;
+		}
+
+		// we are ready for CPTO
+		m_copyFrom = path;
+		sendResponse ("350 OK\r\n");
+		return;
+	}
+	else if (compare (command, "CPTO") == 0)
+	{
+		// make sure the previous command was CPFR
+		if (copyFrom.empty ())
+		{
+			sendResponse ("503 Bad sequence of commands\r\n");
+			return;
+		}
+
+		xferCopy (copyFrom, std::string (arg).c_str ());
+		return;
+	}
+	else if (compare (command, "USER") == 0)
 	{
 		{
 #ifndef __NDS__
@@ -3235,14 +5387,186 @@ void FtpSession::SITE (char const *args_)
 		sendResponse ("200 OK\r\n");
 		return;
 	}
+	else if (compare (command, "BACKLOG") == 0)
+	{
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			if (!m_config.setBacklog (arg))
+			{
+				sendResponse ("550 %s\r\n", std::strerror (errno));
+				return;
+			}
+		}
+
+		sendResponse ("200 OK\r\n");
+		return;
+	}
 	else if (compare (command, "DEFLATE") == 0)
 	{
-		if (!m_config.setDeflateLevel (arg))
 		{
-			sendResponse ("550 %s\r\n", std::strerror (errno));
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			if (!m_config.setDeflateLevel (arg))
+			{
+				sendResponse ("550 %s\r\n", std::strerror (errno));
+				return;
+			}
+		}
+
+		sendResponse ("200 OK\r\n");
+		return;
+	}
+	else if (compare (command, "STATTTL") == 0)
+	{
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			if (!m_config.setStatCacheTTL (arg))
+			{
+				sendResponse ("550 %s\r\n", std::strerror (errno));
+				return;
+			}
+		}
+
+		StatCache::instance ().clear ();
+		ListingCache::instance ().clear ();
+		sendResponse ("200 OK\r\n");
+		return;
+	}
+	else if (compare (command, "RATE") == 0)
+	{
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			if (!m_config.setRateLimit (arg))
+			{
+				sendResponse ("550 %s\r\n", std::strerror (errno));
+				return;
+			}
+		}
+
+		sendResponse ("200 OK\r\n");
+		return;
+	}
+	else if (compare (command, "STATS") == 0)
+	{
+		if (compare (arg, "RESET") == 0)
+		{
+			stats::reset ();
+			sendResponse ("200 OK\r\n");
+			return;
+		}
+
+		if (!arg.empty ())
+		{
+			sendResponse ("501 Invalid argument\r\n");
+			return;
+		}
+
+		auto const session = io ();
+
+		sendResponse ("211-\r\n");
+		for (auto const &line : stats::describe (&session))
+			sendResponse (" %s\r\n", line.c_str ());
+		sendResponse ("211 End\r\n");
+		return;
+	}
+	else if (compare (command, "SESSIONRATE") == 0)
+	{
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			if (!m_config.setSessionRateLimit (arg))
+			{
+				sendResponse ("550 %s\r\n", std::strerror (errno));
+				return;
+			}
+		}
+
+		sendResponse ("200 OK\r\n");
+		return;
+	}
+	else if (compare (command, "SOCKBUF") == 0)
+	{
+		auto const sep   = arg.find_first_of (' ');
+		auto const which = arg.substr (0, sep);
+		auto const size  = sep == std::string::npos ? std::string_view () : arg.substr (sep + 1);
+
+		bool const data    = compare (which, "DATA") == 0;
+		bool const control = compare (which, "CONTROL") == 0;
+		if (!data && !control)
+		{
+			sendResponse ("501 Invalid argument\r\n");
+			return;
+		}
+
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			if (!(data ? m_config.setDataBufferSize (size) : m_config.setControlBufferSize (size)))
+			{
+				sendResponse ("550 %s\r\n", std::strerror (errno));
+				return;
+			}
+		}
+
+		sendResponse ("200 OK\r\n");
+		return;
+	}
+	else if (compare (command, "KEEPALIVE") == 0)
+	{
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			if (!m_config.setKeepAlive (arg))
+			{
+				sendResponse ("550 %s\r\n", std::strerror (errno));
+				return;
+			}
+		}
+
+		sendResponse ("200 OK\r\n");
+		return;
+	}
+	else if (compare (command, "PASVPORTS") == 0)
+	{
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			if (!m_config.setPasvPorts (arg))
+			{
+				sendResponse ("550 %s\r\n", std::strerror (errno));
+				return;
+			}
+		}
+
+		sendResponse ("200 OK\r\n");
+		return;
+	}
+	else if (compare (command, "PASVCHECK") == 0)
+	{
+		if (arg != "0" && arg != "1")
+		{
+			sendResponse ("550 %s\r\n", std::strerror (EINVAL));
 			return;
 		}
 
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			m_config.setPasvPeerCheck (arg == "1");
+		}
+
 		sendResponse ("200 OK\r\n");
 		return;
 	}
@@ -3266,6 +5590,8 @@ void FtpSession::SITE (char const *args_)
 			auto const lock = m_config.lockGuard ();
 #endif
 			m_config.setGetMTime (false);
+			StatCache::instance ().clear ();
+			ListingCache::instance ().clear ();
 		}
 		else if (arg == "1")
 		{
@@ -3273,6 +5599,8 @@ void FtpSession::SITE (char const *args_)
 			auto const lock = m_config.lockGuard ();
 #endif
 			m_config.setGetMTime (true);
+			StatCache::instance ().clear ();
+			ListingCache::instance ().clear ();
 		}
 		else
 		{
@@ -3309,12 +5637,6 @@ void FtpSession::SIZE (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// build the path to stat
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -3390,13 +5712,6 @@ void FtpSession::STAT (char const *args_)
 
 void FtpSession::STOR (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// open the file to store
 	xferFile (args_, XferFileMode::STOR);
 }
@@ -3447,16 +5762,8 @@ void FtpSession::USER (char const *args_)
 
 	m_authorizedUser = false;
 
-	std::string user;
-	std::string pass;
-
-	{
-#ifndef __NDS__
-		auto const lock = m_config.lockGuard ();
-#endif
-		user = m_config.user ();
-		pass = m_config.pass ();
-	}
+	auto const &user = m_settings->user ();
+	auto const &pass = m_settings->pass ();
 
 	if (user.empty () || user == args_)
 	{
@@ -3474,50 +5781,99 @@ void FtpSession::USER (char const *args_)
 	sendResponse ("430 Invalid user\r\n");
 }
 
-// clang-format off
-std::vector<std::pair<std::string_view, void (FtpSession::*) (char const *)>> const
-    FtpSession::handlers =
-{
-	{"ABOR", &FtpSession::ABOR}, 
-	{"ALLO", &FtpSession::ALLO}, 
-	{"APPE", &FtpSession::APPE}, 
-	{"CDUP", &FtpSession::CDUP}, 
-	{"CWD",  &FtpSession::CWD},
-	{"DELE", &FtpSession::DELE}, 
-	{"FEAT", &FtpSession::FEAT}, 
-	{"HELP", &FtpSession::HELP}, 
-	{"LIST", &FtpSession::LIST}, 
-	{"MDTM", &FtpSession::MDTM}, 
-	{"MKD",  &FtpSession::MKD},
-	{"MLSD", &FtpSession::MLSD}, 
-	{"MLST", &FtpSession::MLST}, 
-	{"MODE", &FtpSession::MODE}, 
-	{"NLST", &FtpSession::NLST}, 
-	{"NOOP", &FtpSession::NOOP}, 
-	{"OPTS", &FtpSession::OPTS}, 
-	{"PASS", &FtpSession::PASS}, 
-	{"PASV", &FtpSession::PASV}, 
-	{"PORT", &FtpSession::PORT}, 
-	{"PWD",  &FtpSession::PWD},
-	{"QUIT", &FtpSession::QUIT}, 
-	{"REST", &FtpSession::REST}, 
-	{"RETR", &FtpSession::RETR}, 
-	{"RMD",  &FtpSession::RMD},
-	{"RNFR", &FtpSession::RNFR}, 
-	{"RNTO", &FtpSession::RNTO}, 
-	{"SITE", &FtpSession::SITE}, 
-	{"SIZE", &FtpSession::SIZE}, 
-	{"STAT", &FtpSession::STAT}, 
-	{"STOR", &FtpSession::STOR}, 
-	{"STOU", &FtpSession::STOU}, 
-	{"STRU", &FtpSession::STRU}, 
-	{"SYST", &FtpSession::SYST}, 
-	{"TYPE", &FtpSession::TYPE}, 
-	{"USER", &FtpSession::USER}, 
-	{"XCUP", &FtpSession::CDUP},
-	{"XCWD", &FtpSession::CWD},
-	{"XMKD", &FtpSession::MKD},
-	{"XPWD", &FtpSession::PWD},
-	{"XRMD", &FtpSession::RMD},
+void FtpSession::XCRC (char const *args_)
+{
+	xferHash (args_, checksum::Algorithm::CRC32, false);
+}
+
+void FtpSession::XMD5 (char const *args_)
+{
+	xferHash (args_, checksum::Algorithm::MD5, false);
+}
+
+void FtpSession::XSHA1 (char const *args_)
+{
+	xferHash (args_, checksum::Algorithm::SHA1, false);
+}
+
+void FtpSession::XSHA256 (char const *args_)
+{
+	xferHash (args_, checksum::Algorithm::SHA256, false);
+}
+
+///////////////////////////////////////////////////////////////////////////
+struct FtpSession::CommandTable
+{
+	/// \brief Commands
+	/// \note SITE and STAT check the login themselves; some of their forms are allowed before it
+	// clang-format off
+	constexpr static Command commands[] = {
+		{"ABOR", &FtpSession::ABOR, PRE_AUTH | DURING_XFER},
+		{"ALLO", &FtpSession::ALLO, PRE_AUTH},
+		{"APPE", &FtpSession::APPE, 0},
+		{"CDUP", &FtpSession::CDUP, 0},
+		{"CWD",  &FtpSession::CWD,  0},
+		{"DELE", &FtpSession::DELE, 0},
+		{"EPRT", &FtpSession::EPRT, 0},
+		{"EPSV", &FtpSession::EPSV, 0},
+		{"FEAT", &FtpSession::FEAT, PRE_AUTH},
+		{"HASH", &FtpSession::HASH, 0},
+		{"HELP", &FtpSession::HELP, PRE_AUTH},
+		{"LIST", &FtpSession::LIST, 0},
+		{"MDTM", &FtpSession::MDTM, 0},
+		{"MKD",  &FtpSession::MKD,  0},
+		{"MLSD", &FtpSession::MLSD, 0},
+		{"MLST", &FtpSession::MLST, 0},
+		{"MODE", &FtpSession::MODE, PRE_AUTH},
+		{"NLST", &FtpSession::NLST, 0},
+		{"NOOP", &FtpSession::NOOP, PRE_AUTH | DURING_XFER},
+		{"OPTS", &FtpSession::OPTS, PRE_AUTH},
+		{"PASS", &FtpSession::PASS, PRE_AUTH},
+		{"PASV", &FtpSession::PASV, 0},
+		{"PORT", &FtpSession::PORT, 0},
+		{"PWD",  &FtpSession::PWD,  DURING_XFER},
+		{"QUIT", &FtpSession::QUIT, PRE_AUTH | DURING_XFER},
+		{"RANG", &FtpSession::RANG, 0},
+		{"REST", &FtpSession::REST, 0},
+		{"RETR", &FtpSession::RETR, 0},
+		{"RMD",  &FtpSession::RMD,  0},
+		{"RNFR", &FtpSession::RNFR, 0},
+		{"RNTO", &FtpSession::RNTO, KEEP_RENAME},
+		{"SITE", &FtpSession::SITE, PRE_AUTH},
+		{"SIZE", &FtpSession::SIZE, 0},
+		{"STAT", &FtpSession::STAT, PRE_AUTH | DURING_XFER},
+		{"STOR", &FtpSession::STOR, 0},
+		{"STOU", &FtpSession::STOU, PRE_AUTH},
+		{"STRU", &FtpSession::STRU, PRE_AUTH},
+		{"SYST", &FtpSession::SYST, PRE_AUTH},
+		{"TYPE", &FtpSession::TYPE, PRE_AUTH},
+		{"USER", &FtpSession::USER, PRE_AUTH},
+		{"XCRC", &FtpSession::XCRC, 0},
+		{"XCUP", &FtpSession::CDUP, 0},
+		{"XCWD", &FtpSession::CWD,  0},
+		{"XMD5", &FtpSession::XMD5, 0},
+		{"XMKD", &FtpSession::MKD,  0},
+		{"XPWD", &FtpSession::PWD,  DURING_XFER},
+		{"XRMD", &FtpSession::RMD,  0},
+		{"XSHA1", &FtpSession::XSHA1, 0},
+		{"XSHA256", &FtpSession::XSHA256, 0},
+	};
+	// clang-format on
+
+	/// \brief Perfect hash of commands
+	constexpr static auto hash = makeCommandHash (commands);
 };
-// clang-format on
+
+FtpSession::Command const *FtpSession::findCommand (std::string_view const verb_)
+{
+	auto const key = commandKey (verb_);
+	if (!key)
+		return nullptr;
+
+	auto const &hash = CommandTable::hash;
+	auto const slot  = commandHash (key, hash.mult);
+	if (hash.index[slot] == COMMAND_HASH_EMPTY || hash.keys[slot] != key)
+		return nullptr;
+
+	return &CommandTable::commands[hash.index[slot]];
+}
@@ -0,0 +1,197 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "hashJob.h"
+
+#include "statCache.h"
+
+#ifndef __NDS__
+#include "threadPool.h"
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+namespace
+{
+#ifdef __NDS__
+/// \brief Bytes hashed per step
+constexpr std::size_t CHUNK_SIZE = 8192;
+#else
+/// \brief Bytes hashed per read
+constexpr std::size_t CHUNK_SIZE = 256 * 1024;
+
+/// \brief Get hashing thread pool
+/// \note A single thread, so checksums never compete with transfers for the I/O threads
+ThreadPool &hashPool ()
+{
+	static ThreadPool pool (1);
+	return pool;
+}
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+HashJob::~HashJob () = default;
+
+HashJob::HashJob (std::string path_,
+    stat_t const &st_,
+    checksum::Algorithm const algorithm_,
+    std::uint64_t const offset_,
+    std::uint64_t const end_,
+    bool const cache_)
+    : m_path (std::move (path_)),
+      m_st (st_),
+      m_hasher (algorithm_),
+      m_algorithm (algorithm_),
+      m_offset (offset_),
+      m_end (std::max (offset_, end_)),
+      m_position (offset_),
+      m_cache (cache_)
+{
+}
+
+SharedHashJob HashJob::create (std::string path_,
+    stat_t const &st_,
+    checksum::Algorithm const algorithm_,
+    std::uint64_t const offset_,
+    std::uint64_t const end_,
+    bool const cache_)
+{
+	auto job =
+	    SharedHashJob (new HashJob (std::move (path_), st_, algorithm_, offset_, end_, cache_));
+
+#ifndef __NDS__
+	hashPool ().submit ([job] {
+		while (job->process ())
+			;
+	});
+#endif
+
+	return job;
+}
+
+#ifdef __NDS__
+void HashJob::step ()
+{
+	if (!done ())
+		process ();
+}
+#endif
+
+void HashJob::cancel ()
+{
+	m_cancel.store (true, std::memory_order_relaxed);
+}
+
+bool HashJob::done () const
+{
+	return m_done.load (std::memory_order_acquire);
+}
+
+std::uint64_t HashJob::position () const
+{
+	return m_position.load (std::memory_order_relaxed);
+}
+
+int HashJob::error () const
+{
+	return m_error;
+}
+
+std::string const &HashJob::digest () const
+{
+	return m_digest;
+}
+
+checksum::Algorithm HashJob::algorithm () const
+{
+	return m_algorithm;
+}
+
+std::uint64_t HashJob::offset () const
+{
+	return m_offset;
+}
+
+std::uint64_t HashJob::end () const
+{
+	return m_end;
+}
+
+bool HashJob::process ()
+{
+	if (m_cancel.load (std::memory_order_relaxed))
+	{
+		finish (ECANCELED);
+		return false;
+	}
+
+	if (!m_file)
+	{
+		// open lazily so the poll loop never waits on the filesystem
+		if (!m_file.open (m_path.c_str ()) ||
+		    (m_offset && m_file.seek (m_offset, SEEK_SET) != 0))
+		{
+			finish (errno);
+			return false;
+		}
+
+		m_buffer.resize (CHUNK_SIZE);
+	}
+
+	auto const position = m_position.load (std::memory_order_relaxed);
+	if (position == m_end)
+	{
+		m_digest = m_hasher.finish ();
+
+		// whole-file digests stay valid while the size and mtime match
+		if (m_cache && m_offset == 0 && m_end == static_cast<std::uint64_t> (m_st.st_size))
+			StatCache::instance ().insertDigest (m_path, m_algorithm, m_st, m_digest);
+
+		finish (0);
+		return false;
+	}
+
+	auto const size = std::min<std::uint64_t> (m_buffer.size (), m_end - position);
+	auto const rc   = m_file.read (m_buffer.data (), size);
+	if (rc <= 0)
+	{
+		// the file shrank underneath us
+		finish (rc == 0 ? EIO : errno);
+		return false;
+	}
+
+	m_hasher.update (m_buffer.data (), rc);
+	m_position.store (position + rc, std::memory_order_relaxed);
+	return true;
+}
+
+void HashJob::finish (int const error_)
+{
+	m_error = error_;
+	m_file.close ();
+	m_buffer = {};
+
+	m_done.store (true, std::memory_order_release);
+}
@@ -22,20 +22,134 @@
 
 #include "ioBuffer.h"
 
+#include "platform.h"
+
 #include <cassert>
 #include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace
+{
+#if defined(__NDS__)
+/// \brief Maximum bytes of idle storage kept in the pool
+constexpr std::size_t POOL_LIMIT = 128 * 1024;
+#elif defined(__3DS__)
+/// \brief Maximum bytes of idle storage kept in the pool
+constexpr std::size_t POOL_LIMIT = 1024 * 1024;
+#else
+/// \brief Maximum bytes of idle storage kept in the pool
+constexpr std::size_t POOL_LIMIT = 16 * 1024 * 1024;
+#endif
+
+/// \brief Idle buffer storage
+struct Pool
+{
+#ifndef __NDS__
+	/// \brief Mutex
+	platform::Mutex lock;
+#endif
+
+	/// \brief Idle storage and its size, most recently released last
+	std::vector<std::pair<std::unique_ptr<char[]>, std::size_t>> idle;
+
+	/// \brief Total size of idle storage
+	std::size_t bytes = 0;
+};
+
+/// \brief Get buffer pool
+Pool &pool ()
+{
+	// never destroyed, so buffers released during static destruction still have a home
+	static auto const pool = new Pool ();
+	return *pool;
+}
+
+/// \brief Check out storage
+/// \param size_ Storage size
+std::unique_ptr<char[]> allocate (std::size_t const size_)
+{
+	auto &pool = ::pool ();
+
+	{
+#ifndef __NDS__
+		auto const lock = std::scoped_lock (pool.lock);
+#endif
+
+		// the most recently released storage is most likely still in cache
+		for (auto it = std::rbegin (pool.idle); it != std::rend (pool.idle); ++it)
+		{
+			if (it->second != size_)
+				continue;
+
+			auto buffer = std::move (it->first);
+			pool.idle.erase (std::next (it).base ());
+			pool.bytes -= size_;
+			return buffer;
+		}
+	}
+
+	// every byte is written before it is read, so skip value-initialization
+	return std::unique_ptr<char[]> (new char[size_]);
+}
+
+/// \brief Return storage
+/// \param buffer_ Storage to return
+/// \param size_ Storage size
+void recycle (std::unique_ptr<char[]> buffer_, std::size_t const size_)
+{
+	auto &pool = ::pool ();
+
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (pool.lock);
+#endif
+
+	// anything past the limit goes back to the heap
+	if (pool.bytes + size_ > POOL_LIMIT)
+		return;
+
+	pool.idle.emplace_back (std::move (buffer_), size_);
+	pool.bytes += size_;
+}
+}
 
 ///////////////////////////////////////////////////////////////////////////
-IOBuffer::~IOBuffer () = default;
+IOBuffer::~IOBuffer ()
+{
+	release ();
+}
 
-IOBuffer::IOBuffer (std::size_t const size_)
-    : m_buffer (std::make_unique<char[]> (size_)), m_size (size_)
+IOBuffer::IOBuffer (std::size_t const size_, bool const acquire_) : m_size (size_)
 {
 	assert (size_ > 0);
+
+	if (acquire_)
+		acquire ();
+}
+
+bool IOBuffer::acquired () const
+{
+	return static_cast<bool> (m_buffer);
+}
+
+void IOBuffer::acquire ()
+{
+	if (!m_buffer)
+		m_buffer = allocate (m_size);
+}
+
+void IOBuffer::release ()
+{
+	clear ();
+
+	if (m_buffer)
+		recycle (std::move (m_buffer), m_size);
 }
 
 char *IOBuffer::freeArea () const
 {
+	assert (m_buffer);
 	assert (m_end < m_size);
 	return &m_buffer[m_end];
 }
@@ -62,6 +176,7 @@ void IOBuffer::markFree (std::size_t size_)
 
 char *IOBuffer::usedArea () const
 {
+	assert (m_buffer);
 	assert (m_start < m_size);
 	return &m_buffer[m_start];
 }
@@ -108,3 +223,12 @@ void IOBuffer::coalesce ()
 	m_end -= m_start;
 	m_start = 0;
 }
+
+void IOBuffer::swap (IOBuffer &that_)
+{
+	assert (m_size == that_.m_size);
+
+	std::swap (m_buffer, that_.m_buffer);
+	std::swap (m_start, that_.m_start);
+	std::swap (m_end, that_.m_end);
+}
@@ -0,0 +1,114 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "ioChain.h"
+
+#include <algorithm>
+#include <cassert>
+
+///////////////////////////////////////////////////////////////////////////
+IOChain::~IOChain () = default;
+
+IOChain::IOChain (std::size_t const segmentSize_, std::size_t const maxSegments_)
+    : m_segmentSize (segmentSize_), m_maxSegments (maxSegments_)
+{
+	assert (segmentSize_ > 0);
+	assert (maxSegments_ > 0);
+}
+
+IOBuffer *IOChain::tail ()
+{
+	if (!m_segments.empty () && m_segments.back ().freeSize ())
+		return &m_segments.back ();
+
+	return extend ();
+}
+
+IOBuffer *IOChain::extend ()
+{
+	if (!m_segments.empty () && m_segments.back ().empty ())
+	{
+		// a drained segment may have a consumed prefix
+		m_segments.back ().clear ();
+		return &m_segments.back ();
+	}
+
+	if (m_segments.size () == m_maxSegments)
+		return nullptr;
+
+	return &m_segments.emplace_back (m_segmentSize);
+}
+
+void IOChain::markUsed (std::size_t const size_)
+{
+	assert (!m_segments.empty ());
+	m_segments.back ().markUsed (size_);
+}
+
+void IOChain::markFree (std::size_t size_)
+{
+	while (size_)
+	{
+		assert (!m_segments.empty ());
+
+		auto &front     = m_segments.front ();
+		auto const size = std::min (size_, front.usedSize ());
+
+		front.markFree (size);
+		size_ -= size;
+
+		// the last segment stays around for the producer
+		if (front.empty () && m_segments.size () > 1)
+			m_segments.pop_front ();
+	}
+}
+
+std::size_t IOChain::usedSize () const
+{
+	std::size_t size = 0;
+	for (auto const &segment : m_segments)
+		size += segment.usedSize ();
+
+	return size;
+}
+
+bool IOChain::empty () const
+{
+	// only the last segment is kept once drained
+	return m_segments.empty () || m_segments.front ().empty ();
+}
+
+std::size_t IOChain::segments () const
+{
+	return m_segments.size ();
+}
+
+IOBuffer &IOChain::segment (std::size_t const index_)
+{
+	assert (index_ < m_segments.size ());
+	return m_segments[index_];
+}
+
+void IOChain::clear ()
+{
+	m_segments.clear ();
+}
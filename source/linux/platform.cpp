@@ -33,6 +33,7 @@
 
 #include <unistd.h>
 
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <memory>
@@ -224,6 +225,16 @@ std::string const &platform::hostname ()
 	return hostname;
 }
 
+std::size_t platform::freeMemory ()
+{
+	auto const pages    = sysconf (_SC_AVPHYS_PAGES);
+	auto const pageSize = sysconf (_SC_PAGESIZE);
+	if (pages < 0 || pageSize < 0)
+		return 0;
+
+	return static_cast<std::size_t> (pages) * pageSize;
+}
+
 bool platform::loop ()
 {
 	bool inactive;
@@ -351,3 +362,42 @@ void platform::Mutex::unlock ()
 {
 	m_d->mutex.unlock ();
 }
+
+///////////////////////////////////////////////////////////////////////////
+/// \brief Platform semaphore pimpl
+class platform::Semaphore::privateData_t
+{
+public:
+	/// \brief Mutex protecting count
+	std::mutex mutex;
+
+	/// \brief Condition variable signalled on post
+	std::condition_variable cv;
+
+	/// \brief Semaphore count
+	unsigned count = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////
+platform::Semaphore::~Semaphore () = default;
+
+platform::Semaphore::Semaphore () : m_d (new privateData_t ())
+{
+}
+
+void platform::Semaphore::post ()
+{
+	{
+		auto const lock = std::scoped_lock (m_d->mutex);
+		++m_d->count;
+	}
+
+	m_d->cv.notify_one ();
+}
+
+void platform::Semaphore::wait ()
+{
+	auto lock = std::unique_lock (m_d->mutex);
+	m_d->cv.wait (lock, [this] { return m_d->count != 0; });
+	--m_d->count;
+}
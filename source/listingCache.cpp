@@ -0,0 +1,184 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "listingCache.h"
+
+#include <chrono>
+#include <mutex>
+#include <utility>
+
+namespace
+{
+#if defined(__NDS__)
+/// \brief Maximum number of entries
+constexpr std::size_t MAX_ENTRIES = 4;
+
+/// \brief Maximum total size of cached listings
+constexpr std::size_t MAX_BYTES = 64 * 1024;
+#elif defined(__3DS__)
+/// \brief Maximum number of entries
+constexpr std::size_t MAX_ENTRIES = 16;
+
+/// \brief Maximum total size of cached listings
+constexpr std::size_t MAX_BYTES = 1024 * 1024;
+#else
+/// \brief Maximum number of entries
+constexpr std::size_t MAX_ENTRIES = 64;
+
+/// \brief Maximum total size of cached listings
+constexpr std::size_t MAX_BYTES = 16 * 1024 * 1024;
+#endif
+
+/// \brief Get listing size
+/// \param listing_ Listing
+std::size_t sizeOf (ListingCache::Listing const &listing_)
+{
+	return listing_.data.size () + listing_.deflated.size ();
+}
+
+/// \brief Whether path is or is below the directory
+/// \param path_ Path to check
+/// \param dir_ Directory
+bool within (std::string_view const path_, std::string_view const dir_)
+{
+	if (path_.size () < dir_.size () || path_.compare (0, dir_.size (), dir_) != 0)
+		return false;
+
+	return path_.size () == dir_.size () || path_[dir_.size ()] == '/' || dir_.back () == '/';
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+ListingCache::ListingCache () = default;
+
+std::size_t ListingCache::maxSize ()
+{
+	return MAX_BYTES / 4;
+}
+
+ListingCache &ListingCache::instance ()
+{
+	static ListingCache cache;
+	return cache;
+}
+
+ListingCache::SharedListing ListingCache::lookup (std::string_view const path_,
+    unsigned const variant_,
+    std::time_t const mtime_,
+    unsigned const ttl_)
+{
+	if (ttl_ == 0)
+		return nullptr;
+
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	for (auto it = std::begin (m_lru); it != std::end (m_lru); ++it)
+	{
+		auto const &listing = *it->listing;
+		if (listing.variant != variant_ || listing.path != path_)
+			continue;
+
+		if (listing.mtime != mtime_ ||
+		    platform::steady_clock::now () - it->time > std::chrono::seconds (ttl_))
+		{
+			erase (it);
+			return nullptr;
+		}
+
+		// move to front
+		m_lru.splice (std::begin (m_lru), m_lru, it);
+		return m_lru.front ().listing;
+	}
+
+	return nullptr;
+}
+
+void ListingCache::insert (SharedListing listing_)
+{
+	auto const size = sizeOf (*listing_);
+	if (size > maxSize ())
+		return;
+
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	for (auto it = std::begin (m_lru); it != std::end (m_lru); ++it)
+	{
+		if (it->listing->variant == listing_->variant && it->listing->path == listing_->path)
+		{
+			erase (it);
+			break;
+		}
+	}
+
+	evict (size);
+
+	m_size += size;
+	m_lru.emplace_front (Entry{platform::steady_clock::now (), std::move (listing_)});
+}
+
+void ListingCache::invalidate (std::string_view const path_)
+{
+	// the parent's listing shows the path
+	auto parent = std::string_view ();
+	if (auto const pos = path_.find_last_of ('/'); pos != std::string_view::npos)
+		parent = path_.substr (0, pos == 0 ? 1 : pos);
+
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	// a renamed or removed directory takes its children with it
+	for (auto it = std::begin (m_lru); it != std::end (m_lru);)
+	{
+		auto const &path = it->listing->path;
+		if (path == parent || within (path, path_))
+			it = erase (it);
+		else
+			++it;
+	}
+}
+
+void ListingCache::clear ()
+{
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	m_lru.clear ();
+	m_size = 0;
+}
+
+void ListingCache::evict (std::size_t const size_)
+{
+	while (!m_lru.empty () && (m_lru.size () >= MAX_ENTRIES || m_size + size_ > MAX_BYTES))
+		erase (std::prev (std::end (m_lru)));
+}
+
+std::list<ListingCache::Entry>::iterator ListingCache::erase (std::list<Entry>::iterator const it_)
+{
+	m_size -= sizeOf (*it_->listing);
+	return m_lru.erase (it_);
+}
@@ -23,27 +23,48 @@
 #include "log.h"
 
 #include "platform.h"
+#include "stats.h"
 
 #ifndef CLASSIC
 #include <imgui.h>
 #endif
 
-#include <mutex>
-#include <ranges>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <vector>
 
 namespace
 {
-#ifdef __3DS__
-/// \brief Maximum number of log messages to keep
-constexpr auto MAX_LOGS = 250;
+#ifdef CLASSIC
+/// \brief Maximum number of log lines to keep (more than fit on the console)
+constexpr std::size_t MAX_LOGS = 64;
+#elif defined(__3DS__)
+/// \brief Maximum number of log lines to keep
+constexpr std::size_t MAX_LOGS = 250;
 #else
-/// \brief Maximum number of log messages to keep
-constexpr auto MAX_LOGS = 10000;
+/// \brief Maximum number of log lines to keep
+constexpr std::size_t MAX_LOGS = 10000;
 #endif
 
-#ifdef CLASSIC
-bool s_logUpdated = true;
+#if defined(__NDS__)
+/// \brief Number of ring slots
+constexpr std::size_t RING_SIZE = 64;
+/// \brief Maximum message size
+constexpr std::size_t MESSAGE_SIZE = 256;
+#elif defined(__3DS__)
+/// \brief Number of ring slots
+constexpr std::size_t RING_SIZE = 256;
+/// \brief Maximum message size
+constexpr std::size_t MESSAGE_SIZE = 512;
+#else
+/// \brief Number of ring slots
+constexpr std::size_t RING_SIZE = 1024;
+/// \brief Maximum message size
+constexpr std::size_t MESSAGE_SIZE = 1024;
 #endif
 
 /// \brief Message prefix
@@ -55,60 +76,208 @@ static char const *const s_prefix[] = {
     [RESPONSE] = "[RESPONSE]",
 };
 
-/// \brief Log message
-struct Message
+/// \brief Bounded multi-producer single-consumer message ring
+/// \note Producers claim a slot with a CAS on the head and publish it through the slot sequence;
+/// nothing blocks. When the ring is full the message is dropped and counted instead.
+class LogRing
 {
-	/// \brief Parameterized constructor
+public:
+	LogRing ()
+	{
+		for (std::size_t i = 0; i < RING_SIZE; ++i)
+			m_slots[i].sequence.store (i, std::memory_order_relaxed);
+	}
+
+	/// \brief Add message
 	/// \param level_ Log level
-	/// \param message_ Log message
-	Message (LogLevel const level_, std::string message_)
-	    : level (level_), message (std::move (message_))
+	/// \param fill_ Writes the message into (buffer, size) and returns its length
+	template <typename F>
+	void push (LogLevel const level_, F &&fill_)
+	{
+		auto pos = m_head.load (std::memory_order_relaxed);
+		while (true)
+		{
+			auto &slot     = m_slots[pos % RING_SIZE];
+			auto const seq = slot.sequence.load (std::memory_order_acquire);
+			auto const diff =
+			    static_cast<std::intptr_t> (seq) - static_cast<std::intptr_t> (pos);
+
+			if (diff == 0)
+			{
+				if (!m_head.compare_exchange_weak (pos, pos + 1, std::memory_order_relaxed))
+				{
+					stats::global ().logRetries.add ();
+					continue;
+				}
+
+				slot.level = level_;
+				slot.size  = fill_ (slot.message, sizeof (slot.message));
+				slot.sequence.store (pos + 1, std::memory_order_release);
+				return;
+			}
+
+			if (diff < 0)
+			{
+				// full; the consumer is behind
+				m_dropped.fetch_add (1, std::memory_order_relaxed);
+				stats::global ().logDropped.add ();
+				return;
+			}
+
+			// another producer claimed this slot
+			stats::global ().logRetries.add ();
+			pos = m_head.load (std::memory_order_relaxed);
+		}
+	}
+
+	/// \brief Consume published messages
+	/// \param consume_ Called with (level, message) for each message in order
+	/// \note Must only be called from one thread
+	template <typename F>
+	void drain (F &&consume_)
+	{
+		while (true)
+		{
+			auto &slot = m_slots[m_tail % RING_SIZE];
+			if (slot.sequence.load (std::memory_order_acquire) != m_tail + 1)
+				break;
+
+			consume_ (slot.level, std::string_view (slot.message, slot.size));
+
+			// hand the slot back to the producers for the next lap
+			slot.sequence.store (m_tail + RING_SIZE, std::memory_order_release);
+			++m_tail;
+		}
+	}
+
+	/// \brief Get and clear number of dropped messages
+	std::size_t takeDropped ()
 	{
+		if (!m_dropped.load (std::memory_order_relaxed))
+			return 0;
+
+		return m_dropped.exchange (0, std::memory_order_relaxed);
 	}
 
+private:
+	/// \brief Message slot
+	struct Slot
+	{
+		/// \brief Slot sequence; index when free, index + 1 when published
+		std::atomic<std::size_t> sequence;
+		/// \brief Log level
+		LogLevel level;
+		/// \brief Message size
+		std::size_t size;
+		/// \brief Message
+		char message[MESSAGE_SIZE];
+	};
+
+	/// \brief Message slots
+	Slot m_slots[RING_SIZE];
+
+	/// \brief Next slot to claim
+	std::atomic<std::size_t> m_head = 0;
+
+	/// \brief Next slot to consume (consumer only)
+	std::size_t m_tail = 0;
+
+	/// \brief Number of dropped messages
+	std::atomic<std::size_t> m_dropped = 0;
+};
+
+/// \brief Log message ring
+LogRing s_ring;
+
+/// \brief Log line
+struct Line
+{
 	/// \brief Log level
 	LogLevel level;
-	/// \brief Log message
-	std::string message;
+	/// \brief Log line, including its newline
+	std::string text;
 };
 
-/// \brief Log messages
-std::vector<Message> s_messages;
+/// \brief Log lines (consumer only)
+/// \note Circular; lines are overwritten in place so their storage is reused
+std::vector<Line> s_lines;
+
+/// \brief Index of the oldest line
+std::size_t s_linesHead = 0;
 
-#ifndef __NDS__
-/// \brief Log lock
-platform::Mutex s_lock;
+#ifdef CLASSIC
+/// \brief Number of lines not yet printed
+std::size_t s_linesUnseen = 0;
 #endif
+
+/// \brief Get log line
+/// \param index_ Line index, oldest first
+Line const &line (std::size_t const index_)
+{
+	return s_lines[(s_linesHead + index_) % s_lines.size ()];
 }
 
-void drawLog ()
+/// \brief Append log line
+/// \param level_ Log level
+/// \param text_ Log line
+void appendLine (LogLevel const level_, std::string_view const text_)
 {
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
+#ifdef CLASSIC
+	++s_linesUnseen;
 #endif
 
-#ifdef CLASSIC
-	if (!s_logUpdated)
+	if (s_lines.size () < MAX_LOGS)
+	{
+		s_lines.emplace_back (Line{level_, std::string (text_)});
 		return;
+	}
 
-	s_logUpdated = false;
-#endif
-
-	auto const maxLogs =
-#ifdef CLASSIC
-	    g_logConsole.windowHeight;
-#else
-	    MAX_LOGS;
-#endif
+	// overwrite the oldest line
+	auto &oldest = s_lines[s_linesHead];
+	oldest.level = level_;
+	oldest.text.assign (text_);
+	s_linesHead = (s_linesHead + 1) % MAX_LOGS;
+}
 
-	if (s_messages.size () > static_cast<unsigned> (maxLogs))
+/// \brief Move published messages into the log lines
+void drainLog ()
+{
+	if (s_lines.capacity () < MAX_LOGS)
+		s_lines.reserve (MAX_LOGS);
+
+	s_ring.drain ([] (LogLevel const level_, std::string_view message_) {
+		// split into lines so each line renders at a fixed height
+		while (!message_.empty ())
+		{
+			auto const pos  = message_.find ('\n');
+			auto const size = pos == std::string_view::npos ? message_.size () : pos + 1;
+			appendLine (level_, message_.substr (0, size));
+			message_.remove_prefix (size);
+		}
+	});
+
+	if (auto const dropped = s_ring.takeDropped ())
 	{
-		auto const begin = std::begin (s_messages);
-		auto const end   = std::next (begin, s_messages.size () - maxLogs);
-		s_messages.erase (begin, end);
+		char buffer[64];
+		auto const rc =
+		    std::snprintf (buffer, sizeof (buffer), "%zu log messages dropped\n", dropped);
+		if (rc > 0)
+		{
+			auto const size = std::min<std::size_t> (rc, sizeof (buffer) - 1);
+			appendLine (ERROR, std::string_view (buffer, size));
+		}
 	}
+}
+}
+
+void drawLog ()
+{
+	drainLog ();
 
 #ifdef CLASSIC
+	if (!s_linesUnseen)
+		return;
+
 	char const *const s_colors[] = {
 	    [DEBUG]    = "\x1b[33;1m", // yellow
 	    [INFO]     = "\x1b[37;1m", // white
@@ -117,19 +286,19 @@ void drawLog ()
 	    [RESPONSE] = "\x1b[36;1m", // cyan
 	};
 
-	auto it = std::begin (s_messages);
-	if (s_messages.size () > static_cast<unsigned> (g_logConsole.windowHeight))
-		it = std::next (it, s_messages.size () - g_logConsole.windowHeight);
+	// only the newest lines fit on the console
+	auto const height = static_cast<std::size_t> (std::max (g_logConsole.windowHeight, 0));
+	auto const count  = std::min ({s_linesUnseen, height, s_lines.size ()});
 
 	consoleSelect (&g_logConsole);
-	while (it != std::end (s_messages))
+	for (auto i = s_lines.size () - count; i < s_lines.size (); ++i)
 	{
-		std::fputs (s_colors[it->level], stdout);
-		std::fputs (it->message.c_str (), stdout);
-		++it;
+		auto const &text = line (i);
+		std::fputs (s_colors[text.level], stdout);
+		std::fputs (text.text.c_str (), stdout);
 	}
 	std::fflush (stdout);
-	s_messages.clear ();
+	s_linesUnseen = 0;
 #else
 	ImVec4 const s_colors[] = {
 	    [DEBUG]    = ImVec4 (1.0f, 1.0f, 0.4f, 1.0f),          // yellow
@@ -139,13 +308,20 @@ void drawLog ()
 	    [RESPONSE] = ImVec4 (0.4f, 1.0f, 1.0f, 1.0f),          // cyan
 	};
 
-	for (auto const &message : s_messages)
+	// only submit the lines that are scrolled into view
+	ImGuiListClipper clipper;
+	clipper.Begin (static_cast<int> (s_lines.size ()));
+	while (clipper.Step ())
 	{
-		ImGui::PushStyleColor (ImGuiCol_Text, s_colors[message.level]);
-		ImGui::TextUnformatted (s_prefix[message.level]);
-		ImGui::SameLine ();
-		ImGui::TextUnformatted (message.message.c_str ());
-		ImGui::PopStyleColor ();
+		for (auto i = clipper.DisplayStart; i < clipper.DisplayEnd; ++i)
+		{
+			auto const &text = line (i);
+			ImGui::PushStyleColor (ImGuiCol_Text, s_colors[text.level]);
+			ImGui::TextUnformatted (s_prefix[text.level]);
+			ImGui::SameLine ();
+			ImGui::TextUnformatted (text.text.data (), text.text.data () + text.text.size ());
+			ImGui::PopStyleColor ();
+		}
 	}
 
 	// auto-scroll if scroll bar is at end
@@ -157,31 +333,29 @@ void drawLog ()
 #ifndef CLASSIC
 std::string getLog ()
 {
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
+	drainLog ();
 
-	if (s_messages.empty ())
+	if (s_lines.empty ())
 		return {};
 
-	std::vector<Message const *> stack;
-	stack.reserve (s_messages.size ());
-
-	std::size_t size = 0;
-	for (auto const &msg : s_messages | std::views::reverse)
+	// newest lines up to 1MiB
+	std::size_t size  = 0;
+	std::size_t first = s_lines.size ();
+	while (first > 0)
 	{
-		if (size + msg.message.size () > 1024 * 1024)
+		auto const &text = line (first - 1);
+		if (size + text.text.size () > 1024 * 1024)
 			break;
 
-		size += msg.message.size ();
-		stack.emplace_back (&msg);
+		size += text.text.size ();
+		--first;
 	}
 
 	std::string log;
 	log.reserve (size);
 
-	for (auto const &msg : stack | std::views::reverse)
-		log += msg->message;
+	for (auto i = first; i < s_lines.size (); ++i)
+		log += line (i).text;
 
 	return log;
 }
@@ -243,24 +417,14 @@ void addLog (LogLevel const level_, char const *const fmt_, va_list ap_)
 		return;
 #endif
 
-#ifndef __NDS__
-	thread_local
-#endif
-	    static char buffer[1024];
-
-	std::vsnprintf (buffer, sizeof (buffer), fmt_, ap_);
+	// format straight into the slot
+	s_ring.push (level_, [&] (char *const buffer_, std::size_t const size_) -> std::size_t {
+		auto const rc = std::vsnprintf (buffer_, size_, fmt_, ap_);
+		if (rc < 0)
+			return 0;
 
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
-#ifndef NDEBUG
-	// std::fprintf (stderr, "%s", s_prefix[level_]);
-	// std::fputs (buffer, stderr);
-#endif
-	s_messages.emplace_back (level_, buffer);
-#ifdef CLASSIC
-	s_logUpdated = true;
-#endif
+		return std::min<std::size_t> (rc, size_ - 1);
+	});
 }
 
 void addLog (LogLevel const level_, std::string_view const message_)
@@ -270,23 +434,12 @@ void addLog (LogLevel const level_, std::string_view const message_)
 		return;
 #endif
 
-	auto msg = std::string (message_);
-	for (auto &c : msg)
-	{
-		// replace nul-characters with ? to avoid truncation
-		if (c == '\0')
-			c = '?';
-	}
+	s_ring.push (level_, [&] (char *const buffer_, std::size_t const size_) {
+		auto const size = std::min (message_.size (), size_);
+		std::memcpy (buffer_, message_.data (), size);
 
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
-#ifndef NDEBUG
-	// std::fprintf (stderr, "%s", s_prefix[level_]);
-	// std::fwrite (msg.data (), 1, msg.size (), stderr);
-#endif
-	s_messages.emplace_back (level_, msg);
-#ifdef CLASSIC
-	s_logUpdated = true;
-#endif
+		// replace nul-characters with ? to avoid truncation
+		std::replace (buffer_, buffer_ + size, '\0', '?');
+		return size;
+	});
 }
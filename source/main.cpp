@@ -63,6 +63,12 @@ int main ()
 		server->draw ();
 
 		platform::render ();
+
+#ifndef CLASSIC
+		// give the transfer threads the time a full frame rate would take
+		if (auto const idle = server->frameIdle (); idle.count ())
+			platform::Thread::sleep (idle);
+#endif
 	}
 
 	// clean up resources before exiting switch/3ds services
@@ -174,6 +174,21 @@ void *encode (void *const buffer_, U &size_, T in_, bool hostToNetwork_ = true)
 	return static_cast<std::uint8_t *> (buffer_) + sizeof (T);
 }
 
+template <std::integral U>
+void *encode (void *const buffer_, U &size_, void const *const in_, std::size_t const length_)
+{
+	if (!buffer_)
+		return nullptr;
+
+	if (size_ < length_)
+		return nullptr;
+
+	std::memcpy (buffer_, in_, length_);
+
+	size_ -= length_;
+	return static_cast<std::uint8_t *> (buffer_) + length_;
+}
+
 template <std::integral T>
 void *encode (void *const buffer_, T &size_, std::string const &in_)
 {
@@ -360,14 +375,32 @@ void announce (Socket *const socket_,
 	out = encode<std::uint16_t> (out, available, 0);
 	out = encode<std::uint16_t> (out, available, 0);
 
+	// answer A or AAAA, whichever matches the address
+	std::uint16_t rtype;
+	void const *rdata;
+	std::uint16_t rlen;
+#ifndef NO_IPV6
+	if (addr_.domain () == SockAddr::Domain::IPv6)
+	{
+		rtype = 28;
+		rdata = &static_cast<sockaddr_in6 const &> (addr_).sin6_addr;
+		rlen  = sizeof (in6_addr);
+	}
+	else
+#endif
+	{
+		rtype = 1;
+		rdata = &static_cast<sockaddr_in const &> (addr_).sin_addr;
+		rlen  = sizeof (in_addr_t);
+	}
+
 	// answer section
 	out = encode (out, available, record_.qname);
-	out = encode<std::uint16_t> (out, available, record_.qtype);
+	out = encode<std::uint16_t> (out, available, rtype);
 	out = encode<std::uint16_t> (out, available, record_.qclass | (1 << 15)); // mark unique/flush
 	out = encode<std::uint32_t> (out, available, MDNS_TTL);
-	out = encode<std::uint16_t> (out, available, sizeof (in_addr_t));
-	out = encode<in_addr_t> (
-	    out, available, static_cast<sockaddr_in const &> (addr_).sin_addr.s_addr, false);
+	out = encode<std::uint16_t> (out, available, rlen);
+	out = encode (out, available, rdata, rlen);
 
 	if (!out)
 		return;
@@ -407,6 +440,33 @@ void mdns::setHostname (std::string hostname_)
 	s_lastProbe = platform::steady_clock::now ();
 }
 
+std::chrono::milliseconds mdns::timeout ()
+{
+	platform::steady_clock::time_point due;
+	switch (s_state)
+	{
+	case State::Probe1:
+	case State::Probe2:
+	case State::Probe3:
+		due = s_lastProbe + 250ms;
+		break;
+
+	case State::Announce1:
+	case State::Announce2:
+		due = s_lastAnnounce + 1s;
+		break;
+
+	default:
+		// only queries need an answer
+		return -1ms;
+	}
+
+	// handleSocket waits for strictly longer than the interval
+	auto const wait = std::chrono::ceil<std::chrono::milliseconds> (
+	    due - platform::steady_clock::now ());
+	return std::max (wait + 1ms, 0ms);
+}
+
 UniqueSocket mdns::createSocket ()
 {
 	auto socket = Socket::create (Socket::eDatagram);
@@ -430,15 +490,23 @@ UniqueSocket mdns::createSocket ()
 	return socket;
 }
 
-void mdns::handleSocket (Socket *socket_, SockAddr const &addr_)
+void mdns::handleSocket (Socket *socket_, SockAddr const &addr_, SockAddr const *addr6_)
 {
 	if (!socket_)
 		return;
 
-	// only support IPv4 for now
+	// queries arrive over IPv4 multicast; IPv6 is only advertised with AAAA records
 	if (addr_.domain () != SockAddr::Domain::IPv4)
 		return;
 
+#ifndef NO_IPV6
+	// a wildcard address can't be advertised
+	if (addr6_ && IN6_IS_ADDR_UNSPECIFIED (&static_cast<sockaddr_in6 const &> (*addr6_).sin6_addr))
+		addr6_ = nullptr;
+#else
+	addr6_ = nullptr;
+#endif
+
 	auto const now = platform::steady_clock::now ();
 
 	switch (s_state)
@@ -463,6 +531,15 @@ void mdns::handleSocket (Socket *socket_, SockAddr const &addr_)
 			    0,
 			    QueryRecord{.qname = s_hostname, .qtype = 1, .qclass = 1},
 			    addr_);
+			if (addr6_)
+			{
+				announce (socket_,
+				    nullptr,
+				    0,
+				    0,
+				    QueryRecord{.qname = s_hostname, .qtype = 28, .qclass = 1},
+				    *addr6_);
+			}
 			s_state = static_cast<State> (static_cast<int> (s_state) + 1);
 		}
 
@@ -542,7 +619,8 @@ void mdns::handleSocket (Socket *socket_, SockAddr const &addr_)
 
 	std::vector<ResourceRecord> answers;
 
-	bool announced = false;
+	bool announced  = false;
+	bool announced6 = false;
 	for (unsigned i = 0; i < qdCount; ++i)
 	{
 		QueryRecord record;
@@ -555,8 +633,8 @@ void mdns::handleSocket (Socket *socket_, SockAddr const &addr_)
 		if (qr)
 			continue;
 
-		// only accept A or ANY type
-		if (record.qtype != 1 && record.qtype != 255)
+		// only accept A, AAAA or ANY type
+		if (record.qtype != 1 && record.qtype != 28 && record.qtype != 255)
 			continue;
 
 		// only accept IN or ANY class
@@ -566,7 +644,13 @@ void mdns::handleSocket (Socket *socket_, SockAddr const &addr_)
 		if (record.qname != s_hostname && record.qname != s_hostnameLocal)
 			continue;
 
-		if (!announced)
+		if (record.qtype != 1 && addr6_ && !announced6)
+		{
+			announce (socket_, &srcAddr, id, flags, record, *addr6_);
+			announced6 = true;
+		}
+
+		if (record.qtype != 28 && !announced)
 		{
 			std::vector<std::uint8_t> data (sizeof (in_addr_t));
 			auto n = data.size ();
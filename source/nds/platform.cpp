@@ -27,6 +27,7 @@
 #include <dswifi9.h>
 #include <fat.h>
 
+#include <malloc.h>
 #include <netinet/in.h>
 
 #include <cstring>
@@ -83,6 +84,15 @@ bool platform::networkAddress (SockAddr &addr_)
 	return true;
 }
 
+std::size_t platform::freeMemory ()
+{
+	// free chunks inside the heap plus what sbrk can still hand out
+	auto const info  = mallinfo ();
+	auto const spare = getHeapLimit () - getHeapEnd ();
+
+	return info.fordblks + (spare > 0 ? spare : 0);
+}
+
 bool platform::init ()
 {
 	fatInitDefault ();
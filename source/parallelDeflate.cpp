@@ -0,0 +1,406 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "parallelDeflate.h"
+
+#if FTPD_HAS_PARALLEL_DEFLATE
+#include "log.h"
+#include "stats.h"
+#include "threadPool.h"
+
+#include <gsl/util>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <utility>
+
+namespace
+{
+/// \brief Get compression thread pool
+ThreadPool &deflatePool ()
+{
+#ifdef __SWITCH__
+	// leave a core for the UI thread
+	static ThreadPool pool (3);
+#else
+	static ThreadPool pool (std::max (std::thread::hardware_concurrency (), 1u));
+#endif
+	return pool;
+}
+
+/// \brief Block state
+enum BlockState
+{
+	BLOCK_PENDING,
+	BLOCK_DONE,
+	BLOCK_ERROR,
+};
+}
+
+///////////////////////////////////////////////////////////////////////////
+struct ParallelDeflate::Block
+{
+	/// \brief Compress block (called on a compression thread)
+	void compress ()
+	{
+		auto const start = platform::steady_clock::now ();
+
+		// incompressible data would grow; stored blocks cost five bytes per 64KiB
+		auto ok = false;
+#if FTPD_HAS_LIBDEFLATE
+		// a lone final block needs neither a dictionary nor an open end
+		if (last && dict.empty ())
+			ok = wholeDeflateBlock ();
+		else
+#endif
+		{
+			ok = deflateBlock (level);
+			if (ok && level != Z_NO_COMPRESSION && output.size () >= input.size ())
+				ok = deflateBlock (Z_NO_COMPRESSION);
+		}
+
+		if (!ok)
+		{
+			state.store (BLOCK_ERROR, std::memory_order_release);
+			return;
+		}
+
+		adler    = codec::adler32 (codec::ADLER32_INIT, input.data (), input.size ());
+		duration = platform::steady_clock::now () - start;
+
+		stats::global ().deflateTime.add (
+		    std::chrono::duration_cast<std::chrono::nanoseconds> (duration).count ());
+
+		state.store (BLOCK_DONE, std::memory_order_release);
+	}
+
+	/// \brief Deflate input into output
+	/// \param level_ Compression level
+	bool deflateBlock (int const level_)
+	{
+		codec::Stream zStream{};
+
+		if (codec::initRawDeflate (&zStream, level_) != Z_OK)
+		{
+			error ("deflateInit2: %s\n", zStream.msg ? zStream.msg : "zlib error");
+			return false;
+		}
+
+		auto const finish = gsl::finally ([&zStream] { codec::deflateEnd (&zStream); });
+
+		if (!dict.empty () &&
+		    codec::deflateSetDictionary (&zStream, dict.data (), dict.size ()) != Z_OK)
+		{
+			error ("deflateSetDictionary: %s\n", zStream.msg ? zStream.msg : "zlib error");
+			return false;
+		}
+
+		// room for the sync flush marker as well
+		output.resize (codec::deflateBound (&zStream, input.size ()) + 16);
+
+		zStream.next_in   = input.data ();
+		zStream.avail_in  = input.size ();
+		zStream.next_out  = output.data ();
+		zStream.avail_out = output.size ();
+
+		// a sync flush ends the block on a byte boundary so blocks can be concatenated
+		auto const flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+		while (true)
+		{
+			auto const rc = codec::deflate (&zStream, flush);
+			if (rc == Z_STREAM_END || (rc == Z_OK && flush == Z_SYNC_FLUSH && zStream.avail_out))
+				break;
+
+			if (rc != Z_OK && rc != Z_BUF_ERROR)
+			{
+				error ("deflate: %s\n", zStream.msg ? zStream.msg : "zlib error");
+				return false;
+			}
+
+			// out of space; grow and continue
+			auto const used = output.size () - zStream.avail_out;
+			output.resize (output.size () * 2);
+			zStream.next_out  = output.data () + used;
+			zStream.avail_out = output.size () - used;
+		}
+
+		output.resize (output.size () - zStream.avail_out);
+		return true;
+	}
+
+#if FTPD_HAS_LIBDEFLATE
+	/// \brief Deflate input into output as a complete raw deflate stream
+	bool wholeDeflateBlock ()
+	{
+		output.resize (codec::wholeDeflateBound (input.size ()));
+
+		auto const size =
+		    codec::wholeDeflate (level, input.data (), input.size (), output.data (), output.size ());
+		if (!size)
+		{
+			error ("libdeflate_deflate_compress: failed\n");
+			return false;
+		}
+
+		output.resize (size);
+		return true;
+	}
+#endif
+
+	/// \brief Uncompressed data
+	std::vector<unsigned char> input;
+
+	/// \brief Preset dictionary (tail of the previous block's input)
+	std::vector<unsigned char> dict;
+
+	/// \brief Compressed data
+	std::vector<unsigned char> output;
+
+	/// \brief adler32 of input
+	std::uint32_t adler = 0;
+
+	/// \brief Compressor time spent
+	platform::steady_clock::duration duration{};
+
+	/// \brief Compression level
+	int level = Z_DEFAULT_COMPRESSION;
+
+	/// \brief Whether this is the final block
+	bool last = false;
+
+	/// \brief Block state
+	std::atomic<int> state = BLOCK_PENDING;
+};
+
+///////////////////////////////////////////////////////////////////////////
+ParallelDeflate::~ParallelDeflate () = default;
+
+ParallelDeflate::ParallelDeflate (int const level_)
+    : m_level (level_),
+      m_maxBlocks (2 * deflatePool ().size ()),
+      m_adler (codec::ADLER32_INIT),
+      m_finished (false),
+      m_trailer (false)
+{
+	// zlib header, as deflateInit would emit at this level
+	unsigned levelFlags = 3;
+	if (level_ == Z_DEFAULT_COMPRESSION || level_ == 6)
+		levelFlags = 2;
+	else if (level_ < 2)
+		levelFlags = 0;
+	else if (level_ < 6)
+		levelFlags = 1;
+
+	unsigned header = ((Z_DEFLATED + ((MAX_WBITS - 8) << 4)) << 8) | (levelFlags << 6);
+	header += 31 - (header % 31);
+
+	m_extra.emplace_back (header >> 8);
+	m_extra.emplace_back (header & 0xFF);
+
+	m_fill        = std::make_shared<Block> ();
+	m_fill->level = level_;
+	m_fill->input.reserve (m_blockSize);
+}
+
+UniqueParallelDeflate ParallelDeflate::create (int const level_)
+{
+	return UniqueParallelDeflate (new ParallelDeflate (level_));
+}
+
+std::make_signed_t<std::size_t> ParallelDeflate::write (IOBuffer &buffer_)
+{
+	assert (!m_finished);
+
+	if (!writable ())
+	{
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+
+	auto const size = std::min (buffer_.usedSize (), m_blockSize - m_fill->input.size ());
+	auto const data = reinterpret_cast<unsigned char const *> (buffer_.usedArea ());
+
+	m_fill->input.insert (std::end (m_fill->input), data, data + size);
+	buffer_.markFree (size);
+
+	if (m_fill->input.size () == m_blockSize)
+		submit (false);
+
+	return size;
+}
+
+void ParallelDeflate::finish ()
+{
+	if (m_finished)
+		return;
+
+	// the final block may be empty; it still carries the end-of-stream marker
+	m_finished = true;
+	submit (true);
+}
+
+std::make_signed_t<std::size_t> ParallelDeflate::read (IOBuffer &buffer_)
+{
+	std::size_t total = 0;
+
+	while (buffer_.freeSize ())
+	{
+		// drain header/trailer bytes first
+		if (m_extraPos < m_extra.size ())
+		{
+			auto const size = std::min (buffer_.freeSize (), m_extra.size () - m_extraPos);
+			std::memcpy (buffer_.freeArea (), &m_extra[m_extraPos], size);
+			buffer_.markUsed (size);
+			m_extraPos += size;
+			total += size;
+			continue;
+		}
+
+		if (m_blocks.empty ())
+		{
+			if (m_finished && !m_trailer)
+			{
+				// adler32 trailer in network byte order
+				m_trailer = true;
+				m_extra.clear ();
+				m_extraPos = 0;
+				for (unsigned i = 0; i < 4; ++i)
+					m_extra.emplace_back ((m_adler >> (24 - 8 * i)) & 0xFF);
+				continue;
+			}
+
+			break;
+		}
+
+		auto &block      = *m_blocks.front ();
+		auto const state = block.state.load (std::memory_order_acquire);
+		if (state == BLOCK_PENDING)
+			break;
+
+		if (state == BLOCK_ERROR)
+		{
+			errno = EIO;
+			return -1;
+		}
+
+		auto const size = std::min (buffer_.freeSize (), block.output.size () - m_outPos);
+		std::memcpy (buffer_.freeArea (), &block.output[m_outPos], size);
+		buffer_.markUsed (size);
+		m_outPos += size;
+		total += size;
+
+		if (m_outPos == block.output.size ())
+		{
+			m_adler = codec::adler32Combine (m_adler, block.adler, block.input.size ());
+
+			m_stats.in += block.input.size ();
+			m_stats.out += block.output.size ();
+			m_stats.duration += block.duration;
+
+			m_blocks.pop_front ();
+			m_outPos = 0;
+		}
+	}
+
+	if (total)
+		return total;
+
+	if (m_trailer && m_extraPos == m_extra.size ())
+		return 0;
+
+	errno = EWOULDBLOCK;
+	return -1;
+}
+
+bool ParallelDeflate::ready () const
+{
+	if (m_extraPos < m_extra.size ())
+		return true;
+
+	if (m_blocks.empty ())
+		return m_finished;
+
+	return m_blocks.front ()->state.load (std::memory_order_acquire) != BLOCK_PENDING;
+}
+
+bool ParallelDeflate::writable () const
+{
+	return m_blocks.size () < m_maxBlocks;
+}
+
+void ParallelDeflate::setLevel (int const level_)
+{
+	m_level = level_;
+	if (m_fill)
+		m_fill->level = level_;
+}
+
+void ParallelDeflate::sizeHint (std::uint64_t const size_)
+{
+#if FTPD_HAS_LIBDEFLATE
+	assert (m_blocks.empty () && m_fill->input.empty ());
+
+	// one spare byte so the block is only submitted by finish (), as the final block
+	if (size_ < WHOLE_SIZE)
+	{
+		m_blockSize = std::max<std::size_t> (size_ + 1, BLOCK_SIZE);
+		m_fill->input.reserve (m_blockSize);
+	}
+#else
+	(void)size_;
+#endif
+}
+
+ParallelDeflate::Stats ParallelDeflate::takeStats ()
+{
+	return std::exchange (m_stats, Stats{});
+}
+
+unsigned ParallelDeflate::threads ()
+{
+	return deflatePool ().size ();
+}
+
+void ParallelDeflate::submit (bool const last_)
+{
+	auto block  = std::move (m_fill);
+	block->last = last_;
+
+	if (!last_)
+	{
+		// prime the next block with the tail of this one
+		m_fill        = std::make_shared<Block> ();
+		m_fill->level = m_level;
+		m_fill->input.reserve (m_blockSize);
+
+		auto const dictSize = std::min (DICT_SIZE, block->input.size ());
+		m_fill->dict.assign (std::end (block->input) - dictSize, std::end (block->input));
+	}
+
+	m_blocks.emplace_back (block);
+	deflatePool ().submit ([block] { block->compress (); });
+}
+#endif
@@ -0,0 +1,213 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "pasvPool.h"
+
+#include <poll.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <iterator>
+#include <mutex>
+using namespace std::chrono_literals;
+
+namespace
+{
+#if defined(__NDS__)
+/// \brief Maximum number of idle listeners
+constexpr std::size_t POOL_SIZE = 1;
+#elif defined(__3DS__)
+/// \brief Maximum number of idle listeners
+/// \note The 3DS only supports a handful of sockets
+constexpr std::size_t POOL_SIZE = 2;
+#else
+/// \brief Maximum number of idle listeners
+constexpr std::size_t POOL_SIZE = 16;
+#endif
+
+/// \brief Ports tried in the configured range before giving up
+constexpr unsigned BIND_ATTEMPTS = 16;
+}
+
+///////////////////////////////////////////////////////////////////////////
+PasvPool::~PasvPool () = default;
+
+PasvPool::PasvPool () = default;
+
+UniquePasvPool PasvPool::create ()
+{
+	return UniquePasvPool (new PasvPool ());
+}
+
+UniqueSocket PasvPool::lease (SockAddr const &addr_,
+    unsigned const bufferSize_,
+    std::uint16_t const minPort_,
+    std::uint16_t const maxPort_)
+{
+	while (true)
+	{
+		UniqueSocket socket;
+
+		{
+#ifndef __NDS__
+			auto const lock = std::scoped_lock (m_lock);
+#endif
+
+			// listeners set up under different settings are stale
+			if (bufferSize_ != m_bufferSize || minPort_ != m_minPort || maxPort_ != m_maxPort)
+			{
+				m_idle.clear ();
+				m_bufferSize = bufferSize_;
+				m_minPort    = minPort_;
+				m_maxPort    = maxPort_;
+			}
+
+			// the most recently returned listener is the least likely to have a straggler
+			for (auto it = std::rbegin (m_idle); it != std::rend (m_idle); ++it)
+			{
+				// only the port may differ from the command connection's address
+				auto name = (*it)->sockName ();
+				name.setPort (addr_.port ());
+				if (!(name == addr_))
+					continue;
+
+				socket = std::move (*it);
+				m_idle.erase (std::next (it).base ());
+				break;
+			}
+		}
+
+		if (!socket)
+			break;
+
+		// connections which arrived while the listener sat idle must not reach this session
+		if (drain (*socket))
+			return socket;
+	}
+
+	return bind (addr_, bufferSize_, minPort_, maxPort_);
+}
+
+void PasvPool::release (UniqueSocket socket_)
+{
+	if (!socket_)
+		return;
+
+	// the next lease may be on another worker
+	socket_->detach ();
+
+	// drop connections nobody is waiting for
+	if (!drain (*socket_))
+		return;
+
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	if (m_idle.size () >= POOL_SIZE)
+		m_idle.erase (std::begin (m_idle));
+
+	m_idle.emplace_back (std::move (socket_));
+}
+
+void PasvPool::clear ()
+{
+	std::vector<UniqueSocket> idle;
+
+	{
+#ifndef __NDS__
+		auto const lock = std::scoped_lock (m_lock);
+#endif
+		idle = std::move (m_idle);
+		m_idle.clear ();
+	}
+}
+
+bool PasvPool::drain (Socket &socket_)
+{
+	while (true)
+	{
+		Socket::PollInfo info{socket_, POLLIN, 0};
+		if (Socket::poll (&info, 1, 0ms) <= 0)
+			return true;
+
+		if (info.revents & (POLLERR | POLLHUP | POLLNVAL))
+			return false;
+
+		if (!(info.revents & POLLIN) || !socket_.accept ())
+			return true;
+	}
+}
+
+UniqueSocket PasvPool::bind (SockAddr addr_,
+    unsigned const bufferSize_,
+    std::uint16_t const minPort_,
+    std::uint16_t const maxPort_)
+{
+	auto const attempts = minPort_ ? std::min (maxPort_ - minPort_ + 1u, BIND_ATTEMPTS) : 1u;
+	for (unsigned i = 0; i < attempts; ++i)
+	{
+		if (minPort_)
+		{
+			// walk the range from where the last bind left off
+#ifndef __NDS__
+			auto const lock = std::scoped_lock (m_lock);
+#endif
+			if (m_nextPort < minPort_ || m_nextPort > maxPort_)
+				m_nextPort = minPort_;
+
+			addr_.setPort (m_nextPort);
+			m_nextPort = m_nextPort == maxPort_ ? minPort_ : m_nextPort + 1;
+		}
+		else
+			addr_.setPort (0);
+
+		// a fresh socket each time; not every stack allows binding again after a failure
+		auto socket = Socket::create (Socket::eStream, addr_.domain ());
+		if (!socket)
+			return nullptr;
+
+		if (bufferSize_)
+		{
+			socket->setRecvBufferSize (bufferSize_);
+			socket->setSendBufferSize (bufferSize_);
+		}
+
+		if (!socket->bind (addr_))
+		{
+			// skip ports which are still in use
+			if (errno == EADDRINUSE)
+				continue;
+
+			return nullptr;
+		}
+
+		if (!socket->listen (1))
+			return nullptr;
+
+		return socket;
+	}
+
+	errno = EADDRINUSE;
+	return nullptr;
+}
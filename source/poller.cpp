@@ -0,0 +1,428 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "poller.h"
+
+#include "log.h"
+#include "stats.h"
+
+#if !FTPD_HAS_EPOLL && !FTPD_HAS_KQUEUE && FTPD_HAS_POLLER_WAKE
+#include <fcntl.h>
+#endif
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#if FTPD_HAS_EPOLL
+static_assert (EPOLLIN == POLLIN);
+static_assert (EPOLLPRI == POLLPRI);
+static_assert (EPOLLOUT == POLLOUT);
+static_assert (EPOLLERR == POLLERR);
+static_assert (EPOLLHUP == POLLHUP);
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+Poller::~Poller ()
+{
+#if FTPD_HAS_EPOLL || FTPD_HAS_KQUEUE
+	if (m_fd >= 0 && ::close (m_fd) != 0)
+		error ("close: %s\n", std::strerror (errno));
+#if FTPD_HAS_EPOLL
+	if (m_wakeFd >= 0 && ::close (m_wakeFd) != 0)
+		error ("close: %s\n", std::strerror (errno));
+#endif
+#elif FTPD_HAS_POLLER_WAKE
+	if (m_wakeFd >= 0 && ::close (m_wakeFd) != 0)
+		error ("close: %s\n", std::strerror (errno));
+#endif
+
+	for (auto const &socket : m_sockets)
+	{
+		socket->m_poller     = nullptr;
+		socket->m_pollOwner  = nullptr;
+		socket->m_pollEvents = 0;
+		socket->m_pollIndex  = 0;
+	}
+}
+
+Poller::Poller () = default;
+
+UniquePoller Poller::create ()
+{
+	auto poller = UniquePoller (new Poller ());
+
+#if FTPD_HAS_EPOLL
+	poller->m_fd = ::epoll_create1 (EPOLL_CLOEXEC);
+	if (poller->m_fd < 0)
+	{
+		error ("epoll_create1: %s\n", std::strerror (errno));
+		return nullptr;
+	}
+
+	poller->m_wakeFd = ::eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (poller->m_wakeFd < 0)
+	{
+		error ("eventfd: %s\n", std::strerror (errno));
+		return nullptr;
+	}
+
+	// a null data pointer tells the wakeup apart from sockets
+	epoll_event event{};
+	event.events   = EPOLLIN;
+	event.data.ptr = nullptr;
+	if (::epoll_ctl (poller->m_fd, EPOLL_CTL_ADD, poller->m_wakeFd, &event) != 0)
+	{
+		error ("epoll_ctl: %s\n", std::strerror (errno));
+		return nullptr;
+	}
+#elif FTPD_HAS_KQUEUE
+	poller->m_fd = ::kqueue ();
+	if (poller->m_fd < 0)
+	{
+		error ("kqueue: %s\n", std::strerror (errno));
+		return nullptr;
+	}
+
+	struct kevent change;
+	EV_SET (&change, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+	if (::kevent (poller->m_fd, &change, 1, nullptr, 0, nullptr) != 0)
+	{
+		error ("kevent: %s\n", std::strerror (errno));
+		return nullptr;
+	}
+#elif FTPD_HAS_POLLER_WAKE
+	// poll only takes sockets; a datagram to a socket connected to itself interrupts the wait
+	poller->m_wakeFd = ::socket (AF_INET, SOCK_DGRAM, 0);
+	if (poller->m_wakeFd < 0)
+	{
+		error ("socket: %s\n", std::strerror (errno));
+		return nullptr;
+	}
+
+	auto addr         = SockAddr (htonl (INADDR_LOOPBACK));
+	socklen_t addrLen = sizeof (sockaddr_storage);
+	if (::bind (poller->m_wakeFd, addr, addr.size ()) != 0 ||
+	    ::getsockname (poller->m_wakeFd, addr, &addrLen) != 0 ||
+	    ::connect (poller->m_wakeFd, addr, addr.size ()) != 0)
+	{
+		error ("wake socket: %s\n", std::strerror (errno));
+		return nullptr;
+	}
+
+	auto const flags = ::fcntl (poller->m_wakeFd, F_GETFL, 0);
+	if (flags == -1 || ::fcntl (poller->m_wakeFd, F_SETFL, flags | O_NONBLOCK) != 0)
+	{
+		error ("fcntl: %s\n", std::strerror (errno));
+		return nullptr;
+	}
+#endif
+
+	return poller;
+}
+
+bool Poller::update (Socket &socket_, int const events_, void *const owner_)
+{
+	if (!events_)
+	{
+		remove (socket_);
+		return true;
+	}
+
+	assert (!socket_.m_poller || socket_.m_poller == this);
+
+	auto const registered = socket_.m_poller != nullptr;
+	if (registered && socket_.m_pollEvents == events_ && socket_.m_pollOwner == owner_)
+		return true;
+
+#if FTPD_HAS_EPOLL
+	epoll_event event{};
+	event.events   = events_;
+	event.data.ptr = &socket_;
+
+	if (::epoll_ctl (m_fd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, socket_.m_fd, &event) != 0)
+	{
+		error ("epoll_ctl: %s\n", std::strerror (errno));
+		return false;
+	}
+#elif FTPD_HAS_KQUEUE
+	auto const oldRead  = (socket_.m_pollEvents & (POLLIN | POLLPRI)) != 0;
+	auto const oldWrite = (socket_.m_pollEvents & POLLOUT) != 0;
+	auto const newRead  = (events_ & (POLLIN | POLLPRI)) != 0;
+	auto const newWrite = (events_ & POLLOUT) != 0;
+
+	struct kevent changes[2];
+	int count = 0;
+
+	if (newRead || oldRead)
+	{
+		EV_SET (&changes[count++],
+		    socket_.m_fd,
+		    EVFILT_READ,
+		    newRead ? EV_ADD : EV_DELETE,
+		    0,
+		    0,
+		    &socket_);
+	}
+
+	if (newWrite || oldWrite)
+	{
+		EV_SET (&changes[count++],
+		    socket_.m_fd,
+		    EVFILT_WRITE,
+		    newWrite ? EV_ADD : EV_DELETE,
+		    0,
+		    0,
+		    &socket_);
+	}
+
+	if (::kevent (m_fd, changes, count, nullptr, 0, nullptr) != 0)
+	{
+		error ("kevent: %s\n", std::strerror (errno));
+		return false;
+	}
+#else
+	if (registered)
+		m_pollFds[socket_.m_pollIndex].events = static_cast<short> (events_);
+	else
+		m_pollFds.emplace_back (pollfd{socket_.m_fd, static_cast<short> (events_), 0});
+#endif
+
+	if (!registered)
+	{
+		socket_.m_pollIndex = m_sockets.size ();
+		m_sockets.emplace_back (&socket_);
+		++m_count;
+	}
+
+	socket_.m_poller     = this;
+	socket_.m_pollOwner  = owner_;
+	socket_.m_pollEvents = events_;
+
+	return true;
+}
+
+void Poller::remove (Socket &socket_)
+{
+	if (!socket_.m_poller)
+		return;
+
+	assert (socket_.m_poller == this);
+	assert (m_count > 0);
+
+#if FTPD_HAS_EPOLL
+	if (::epoll_ctl (m_fd, EPOLL_CTL_DEL, socket_.m_fd, nullptr) != 0)
+		error ("epoll_ctl: %s\n", std::strerror (errno));
+#elif FTPD_HAS_KQUEUE
+	struct kevent changes[2];
+	int count = 0;
+
+	if (socket_.m_pollEvents & (POLLIN | POLLPRI))
+		EV_SET (&changes[count++], socket_.m_fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+
+	if (socket_.m_pollEvents & POLLOUT)
+		EV_SET (&changes[count++], socket_.m_fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+
+	if (::kevent (m_fd, changes, count, nullptr, 0, nullptr) != 0)
+		error ("kevent: %s\n", std::strerror (errno));
+#endif
+
+	// swap with the last entry so removal is O(1)
+	auto const index = socket_.m_pollIndex;
+	assert (index < m_sockets.size () && m_sockets[index] == &socket_);
+
+	if (index != m_sockets.size () - 1)
+	{
+#if !FTPD_HAS_EPOLL && !FTPD_HAS_KQUEUE
+		m_pollFds[index] = m_pollFds.back ();
+#endif
+		m_sockets[index]              = m_sockets.back ();
+		m_sockets[index]->m_pollIndex = index;
+	}
+
+#if !FTPD_HAS_EPOLL && !FTPD_HAS_KQUEUE
+	m_pollFds.pop_back ();
+#endif
+	m_sockets.pop_back ();
+
+	--m_count;
+
+	socket_.m_poller     = nullptr;
+	socket_.m_pollOwner  = nullptr;
+	socket_.m_pollEvents = 0;
+	socket_.m_pollIndex  = 0;
+}
+
+int Poller::wait (std::chrono::milliseconds const timeout_)
+{
+	m_events.clear ();
+
+#if FTPD_HAS_EPOLL
+	// one more for the wakeup
+	if (m_epollEvents.size () < m_count + 1)
+		m_epollEvents.resize (m_count + 1);
+
+	auto const rc = ::epoll_wait (m_fd,
+	    m_epollEvents.data (),
+	    static_cast<int> (m_epollEvents.size ()),
+	    timeout_.count ());
+	if (rc < 0)
+	{
+		if (errno == EINTR)
+			return 0;
+
+		error ("epoll_wait: %s\n", std::strerror (errno));
+		return rc;
+	}
+
+	// capture the owners now; dispatching an event may close another ready socket
+	for (int i = 0; i < rc; ++i)
+	{
+		auto const socket = static_cast<Socket *> (m_epollEvents[i].data.ptr);
+		if (!socket)
+		{
+			std::uint64_t count;
+			if (::read (m_wakeFd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+				error ("read: %s\n", std::strerror (errno));
+			continue;
+		}
+
+		m_events.emplace_back (
+		    Event{socket, socket->m_pollOwner, static_cast<int> (m_epollEvents[i].events)});
+	}
+#elif FTPD_HAS_KQUEUE
+	// each socket may have a read and a write filter, plus the wakeup
+	if (m_kevents.size () < 2 * m_count + 1)
+		m_kevents.resize (2 * m_count + 1);
+
+	timespec ts;
+	ts.tv_sec  = timeout_.count () / 1000;
+	ts.tv_nsec = (timeout_.count () % 1000) * 1000000;
+
+	auto const rc = ::kevent (m_fd,
+	    nullptr,
+	    0,
+	    m_kevents.data (),
+	    static_cast<int> (m_kevents.size ()),
+	    timeout_.count () < 0 ? nullptr : &ts);
+	if (rc < 0)
+	{
+		if (errno == EINTR)
+			return 0;
+
+		error ("kevent: %s\n", std::strerror (errno));
+		return rc;
+	}
+
+	// capture the owners now; dispatching an event may close another ready socket
+	for (int i = 0; i < rc; ++i)
+	{
+		auto const &kev = m_kevents[i];
+		if (kev.filter == EVFILT_USER)
+			continue;
+
+		auto const socket = static_cast<Socket *> (kev.udata);
+
+		int revents = kev.filter == EVFILT_READ ? POLLIN : POLLOUT;
+		if (kev.flags & EV_ERROR)
+			revents |= POLLERR;
+		// EOF on the read side still has data to drain; let read() report it
+		else if ((kev.flags & EV_EOF) && kev.filter == EVFILT_WRITE)
+			revents |= POLLHUP;
+
+		m_events.emplace_back (Event{socket, socket->m_pollOwner, revents});
+	}
+#else
+#if FTPD_HAS_POLLER_WAKE
+	// the wakeup goes last so the socket indices stay put
+	m_pollFds.emplace_back (pollfd{m_wakeFd, POLLIN, 0});
+	auto const rc   = ::poll (m_pollFds.data (), m_pollFds.size (), timeout_.count ());
+	auto const wake = m_pollFds.back ().revents != 0;
+	m_pollFds.pop_back ();
+#else
+	auto const rc   = ::poll (m_pollFds.data (), m_pollFds.size (), timeout_.count ());
+	auto const wake = false;
+#endif
+	if (rc < 0)
+	{
+		if (errno == EINTR)
+			return 0;
+
+		error ("poll: %s\n", std::strerror (errno));
+		return rc;
+	}
+
+#if FTPD_HAS_POLLER_WAKE
+	if (wake)
+	{
+		// several wakeups may have queued up
+		char buffer[16];
+		while (::recv (m_wakeFd, buffer, sizeof (buffer), 0) > 0)
+			;
+	}
+#endif
+
+	// capture the owners now; dispatching an event may close another ready socket
+	auto const ready = static_cast<unsigned> (rc) - wake;
+	for (std::size_t i = 0; i < m_pollFds.size () && m_events.size () < ready; ++i)
+	{
+		if (!m_pollFds[i].revents)
+			continue;
+
+		m_events.emplace_back (
+		    Event{m_sockets[i], m_sockets[i]->m_pollOwner, m_pollFds[i].revents});
+	}
+#endif
+
+	stats::global ().polls.add ();
+	stats::global ().pollEvents.add (m_events.size ());
+
+	return m_events.size ();
+}
+
+std::vector<Poller::Event> const &Poller::events () const
+{
+	return m_events;
+}
+
+#if FTPD_HAS_POLLER_WAKE
+void Poller::wake ()
+{
+#if FTPD_HAS_EPOLL
+	std::uint64_t const count = 1;
+	if (::write (m_wakeFd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+		error ("write: %s\n", std::strerror (errno));
+#elif FTPD_HAS_KQUEUE
+	struct kevent change;
+	EV_SET (&change, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+	if (::kevent (m_fd, &change, 1, nullptr, 0, nullptr) != 0)
+		error ("kevent: %s\n", std::strerror (errno));
+#else
+	// a full socket buffer already holds a pending wakeup
+	char const byte = 0;
+	if (::send (m_wakeFd, &byte, sizeof (byte), 0) < 0 && errno != EWOULDBLOCK)
+		error ("send: %s\n", std::strerror (errno));
+#endif
+}
+#endif
@@ -23,10 +23,17 @@
 #include "socket.h"
 
 #include "log.h"
+#include "poller.h"
 
 #include <fcntl.h>
+#ifndef __NDS__
+#include <netinet/tcp.h>
+#endif
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#if FTPD_HAS_SENDMSG
+#include <sys/uio.h>
+#endif
 #include <unistd.h>
 
 #include <cassert>
@@ -34,6 +41,14 @@
 #include <cstdio>
 #include <cstring>
 
+#if FTPD_HAS_SENDMSG
+namespace
+{
+/// \brief Maximum number of chain segments sent at once
+constexpr std::size_t IOV_SEGMENTS = 8;
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////
 Socket::~Socket ()
 {
@@ -43,6 +58,9 @@ Socket::~Socket ()
 	if (m_connected)
 		info ("Closing connection to [%s]:%u\n", m_peerName.name (), m_peerName.port ());
 
+	if (m_poller)
+		m_poller->remove (*this);
+
 #ifdef __NDS__
 	if (::closesocket (m_fd) != 0)
 		error ("closesocket: %s\n", std::strerror (errno));
@@ -73,7 +91,13 @@ UniqueSocket Socket::accept ()
 	auto const fd = ::accept (m_fd, addr, &addrLen);
 	if (fd < 0)
 	{
-		error ("accept: %s\n", std::strerror (errno));
+		// a non-blocking listener has run out of connections
+		auto const err = errno;
+		if (err != EWOULDBLOCK)
+			error ("accept: %s\n", std::strerror (err));
+
+		// the caller decides from errno whether the listener is still usable
+		errno = err;
 		return nullptr;
 	}
 
@@ -150,6 +174,12 @@ bool Socket::listen (int const backlog_)
 	return true;
 }
 
+void Socket::detach ()
+{
+	if (m_poller)
+		m_poller->remove (*this);
+}
+
 bool Socket::shutdown (int const how_)
 {
 	if (::shutdown (m_fd, how_) != 0)
@@ -233,6 +263,20 @@ bool Socket::setReuseAddress (bool const reuse_)
 	return true;
 }
 
+#ifndef NO_IPV6
+bool Socket::setV6Only (bool const v6Only_)
+{
+	int const v6Only = v6Only_;
+	if (::setsockopt (m_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof (v6Only)) != 0)
+	{
+		error ("setsockopt(IPV6_V6ONLY, %s): %s\n", v6Only_ ? "yes" : "no", std::strerror (errno));
+		return false;
+	}
+
+	return true;
+}
+#endif
+
 bool Socket::setRecvBufferSize (std::size_t const size_)
 {
 	int const size = size_;
@@ -257,6 +301,116 @@ bool Socket::setSendBufferSize (std::size_t const size_)
 	return true;
 }
 
+bool Socket::setRecvLowWatermark (std::size_t const size_)
+{
+#if defined(__NDS__) || !defined(SO_RCVLOWAT)
+	(void)size_;
+	errno = ENOSYS;
+	return false;
+#else
+	int const size = size_;
+	if (::setsockopt (m_fd, SOL_SOCKET, SO_RCVLOWAT, &size, sizeof (size)) != 0)
+	{
+		error ("setsockopt(SO_RCVLOWAT, %zu): %s\n", size_, std::strerror (errno));
+		return false;
+	}
+
+	return true;
+#endif
+}
+
+bool Socket::setNoDelay (bool const noDelay_)
+{
+#if defined(__NDS__) || !defined(TCP_NODELAY)
+	(void)noDelay_;
+	errno = ENOSYS;
+	return false;
+#else
+	int const noDelay = noDelay_;
+	if (::setsockopt (m_fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof (noDelay)) != 0)
+	{
+		error ("setsockopt(TCP_NODELAY, %s): %s\n", noDelay_ ? "yes" : "no", std::strerror (errno));
+		return false;
+	}
+
+	return true;
+#endif
+}
+
+bool Socket::setCork (bool const cork_)
+{
+#if defined(__NDS__) || !(defined(TCP_CORK) || defined(TCP_NOPUSH))
+	(void)cork_;
+	errno = ENOSYS;
+	return false;
+#else
+#ifdef TCP_CORK
+	constexpr auto option = TCP_CORK;
+#else
+	constexpr auto option = TCP_NOPUSH;
+#endif
+
+	int const cork = cork_;
+	if (::setsockopt (m_fd, IPPROTO_TCP, option, &cork, sizeof (cork)) != 0)
+	{
+		error ("setsockopt(TCP_CORK, %s): %s\n", cork_ ? "yes" : "no", std::strerror (errno));
+		return false;
+	}
+
+	return true;
+#endif
+}
+
+bool Socket::setKeepAlive (bool const enable_, std::chrono::seconds const idle_)
+{
+#if defined(__NDS__) || !defined(SO_KEEPALIVE)
+	(void)enable_;
+	(void)idle_;
+	errno = ENOSYS;
+	return false;
+#else
+	int const enable = enable_;
+	if (::setsockopt (m_fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof (enable)) != 0)
+	{
+		error ("setsockopt(SO_KEEPALIVE, %s): %s\n", enable_ ? "yes" : "no", std::strerror (errno));
+		return false;
+	}
+
+	if (!enable_ || idle_.count () <= 0)
+		return true;
+
+#if defined(TCP_KEEPIDLE) || defined(TCP_KEEPALIVE)
+#ifdef TCP_KEEPIDLE
+	constexpr auto option = TCP_KEEPIDLE;
+#else
+	constexpr auto option = TCP_KEEPALIVE;
+#endif
+
+	// probe at the same interval once idle
+	int const idle = idle_.count ();
+	if (::setsockopt (m_fd, IPPROTO_TCP, option, &idle, sizeof (idle)) != 0)
+	{
+		error ("setsockopt(TCP_KEEPIDLE, %lus): %s\n",
+		    static_cast<unsigned long> (idle_.count ()),
+		    std::strerror (errno));
+		return false;
+	}
+
+#ifdef TCP_KEEPINTVL
+	if (::setsockopt (m_fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof (idle)) != 0)
+	{
+		error ("setsockopt(TCP_KEEPINTVL, %lus): %s\n",
+		    static_cast<unsigned long> (idle_.count ()),
+		    std::strerror (errno));
+		return false;
+	}
+#endif
+#endif
+
+	return true;
+#endif
+}
+
 #ifndef __NDS__
 bool Socket::joinMulticastGroup (SockAddr const &addr_, SockAddr const &iface_)
 {
@@ -296,6 +450,7 @@ std::make_signed_t<std::size_t>
 	assert (size_);
 
 	auto const rc = ::recv (m_fd, buffer_, size_, oob_ ? MSG_OOB : 0);
+	stats::account (m_io, rc, size_, false);
 	if (rc < 0 && errno != EWOULDBLOCK)
 		error ("recv: %s\n", std::strerror (errno));
 
@@ -322,35 +477,93 @@ std::make_signed_t<std::size_t>
 	socklen_t addrLen = sizeof (sockaddr_storage);
 
 	auto const rc = ::recvfrom (m_fd, buffer_, size_, 0, addr_, &addrLen);
+	stats::account (m_io, rc, size_, false);
 	if (rc < 0 && errno != EWOULDBLOCK)
 		error ("recvfrom: %s\n", std::strerror (errno));
 
 	return rc;
 }
 
-std::make_signed_t<std::size_t> Socket::write (void const *const buffer_, std::size_t const size_)
+std::make_signed_t<std::size_t>
+    Socket::write (void const *const buffer_, std::size_t const size_, bool const more_)
 {
 	assert (buffer_);
 	assert (size_ > 0);
 
-	auto const rc = ::send (m_fd, buffer_, size_, 0);
+#ifdef MSG_MORE
+	auto const flags = more_ ? MSG_MORE : 0;
+#else
+	(void)more_;
+	auto const flags = 0;
+#endif
+
+	auto const rc = ::send (m_fd, buffer_, size_, flags);
+	stats::account (m_io, rc, size_, true);
 	if (rc < 0 && errno != EWOULDBLOCK)
 		error ("send: %s\n", std::strerror (errno));
 
 	return rc;
 }
 
-std::make_signed_t<std::size_t> Socket::write (IOBuffer &buffer_)
+std::make_signed_t<std::size_t> Socket::write (IOBuffer &buffer_, bool const more_)
 {
 	assert (buffer_.usedSize () > 0);
 
-	auto const rc = write (buffer_.usedArea (), buffer_.usedSize ());
+	auto const rc = write (buffer_.usedArea (), buffer_.usedSize (), more_);
 	if (rc > 0)
 		buffer_.markFree (rc);
 
 	return rc;
 }
 
+std::make_signed_t<std::size_t> Socket::write (IOChain &chain_, bool const more_)
+{
+	assert (!chain_.empty ());
+
+#if FTPD_HAS_SENDMSG
+	iovec iov[IOV_SEGMENTS];
+
+	std::size_t size  = 0;
+	std::size_t count = 0;
+	for (std::size_t i = 0; i < chain_.segments () && count < IOV_SEGMENTS; ++i)
+	{
+		auto &segment = chain_.segment (i);
+		if (segment.empty ())
+			continue;
+
+		iov[count].iov_base = segment.usedArea ();
+		iov[count].iov_len  = segment.usedSize ();
+		size += segment.usedSize ();
+		++count;
+	}
+
+	msghdr msg{};
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = count;
+
+#ifdef MSG_MORE
+	auto const flags = more_ ? MSG_MORE : 0;
+#else
+	(void)more_;
+	auto const flags = 0;
+#endif
+
+	auto const rc = ::sendmsg (m_fd, &msg, flags);
+	stats::account (m_io, rc, size, true);
+	if (rc < 0 && errno != EWOULDBLOCK)
+		error ("sendmsg: %s\n", std::strerror (errno));
+#else
+	// no gather support; send the first segment
+	auto &segment = chain_.segment (0);
+	auto const rc = write (segment.usedArea (), segment.usedSize (), more_);
+#endif
+
+	if (rc > 0)
+		chain_.markFree (rc);
+
+	return rc;
+}
+
 std::make_signed_t<std::size_t>
     Socket::writeTo (void const *buffer_, std::size_t size_, SockAddr const &addr_)
 {
@@ -358,12 +571,39 @@ std::make_signed_t<std::size_t>
 	assert (size_ > 0);
 
 	auto const rc = ::sendto (m_fd, buffer_, size_, 0, addr_, addr_.size ());
+	stats::account (m_io, rc, size_, true);
 	if (rc < 0 && errno != EWOULDBLOCK)
 		error ("sendto: %s\n", std::strerror (errno));
 
 	return rc;
 }
 
+#if FTPD_HAS_SENDFILE
+std::make_signed_t<std::size_t>
+    Socket::sendFile (int const fd_, off_t &offset_, std::size_t const size_)
+{
+	assert (size_ > 0);
+
+	auto const rc = ::sendfile (m_fd, fd_, &offset_, size_);
+	stats::account (m_io, rc, size_, true);
+	// EINVAL/ENOSYS mean the file can't be sent this way; the caller falls back
+	if (rc < 0 && errno != EWOULDBLOCK && errno != EINVAL && errno != ENOSYS)
+		error ("sendfile: %s\n", std::strerror (errno));
+
+	return rc;
+}
+#endif
+
+std::uint64_t Socket::bytes () const
+{
+	return m_io.bytesIn + m_io.bytesOut;
+}
+
+stats::IO const &Socket::io () const
+{
+	return m_io;
+}
+
 SockAddr const &Socket::sockName () const
 {
 	return m_sockName;
@@ -374,9 +614,9 @@ SockAddr const &Socket::peerName () const
 	return m_peerName;
 }
 
-UniqueSocket Socket::create (Type const type_)
+UniqueSocket Socket::create (Type const type_, SockAddr::Domain const domain_)
 {
-	auto const fd = ::socket (AF_INET, static_cast<int> (type_), 0);
+	auto const fd = ::socket (static_cast<int> (domain_), static_cast<int> (type_), 0);
 	if (fd < 0)
 	{
 		error ("socket: %s\n", std::strerror (errno));
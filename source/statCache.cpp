@@ -0,0 +1,245 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "statCache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+namespace
+{
+#if defined(__NDS__)
+/// \brief Maximum number of entries
+constexpr std::size_t MAX_ENTRIES = 256;
+#elif defined(__3DS__)
+/// \brief Maximum number of entries
+constexpr std::size_t MAX_ENTRIES = 1024;
+#else
+/// \brief Maximum number of entries
+constexpr std::size_t MAX_ENTRIES = 8192;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+StatCache::StatCache () = default;
+
+StatCache &StatCache::instance ()
+{
+	static StatCache cache;
+	return cache;
+}
+
+bool StatCache::lookup (std::string_view const path_,
+    bool const follow_,
+    unsigned const ttl_,
+    stat_t &st_)
+{
+	if (ttl_ == 0)
+		return false;
+
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	auto const it = m_entries.find (path_);
+	if (it == std::end (m_entries))
+		return false;
+
+	auto const entry = it->second;
+	if (platform::steady_clock::now () - entry->time > std::chrono::seconds (ttl_))
+	{
+		// digests don't expire; they are checked against the size and mtime
+		if (entry->digests.empty ())
+			erase (path_);
+		else
+		{
+			entry->hasStat  = false;
+			entry->hasLStat = false;
+		}
+
+		return false;
+	}
+
+	if (follow_ ? !entry->hasStat : !entry->hasLStat)
+		return false;
+
+	st_ = follow_ ? entry->stat : entry->lstat;
+
+	// move to front
+	m_lru.splice (std::begin (m_lru), m_lru, entry);
+	return true;
+}
+
+void StatCache::insert (std::string_view const path_, bool const follow_, stat_t const &st_)
+{
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	// the other variant would be older than the new timestamp
+	auto &entry    = touch (path_);
+	entry.time     = platform::steady_clock::now ();
+	entry.hasStat  = false;
+	entry.hasLStat = false;
+
+	// without symlinks both variants agree
+	if (follow_ || !S_ISLNK (st_.st_mode))
+	{
+		entry.stat    = st_;
+		entry.hasStat = true;
+	}
+
+	if (!follow_ || !S_ISLNK (st_.st_mode))
+	{
+		entry.lstat    = st_;
+		entry.hasLStat = true;
+	}
+}
+
+bool StatCache::lookupDigest (std::string_view const path_,
+    checksum::Algorithm const algorithm_,
+    stat_t const &st_,
+    std::string &digest_)
+{
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	auto const it = m_entries.find (path_);
+	if (it == std::end (m_entries))
+		return false;
+
+	for (auto const &digest : it->second->digests)
+	{
+		if (digest.algorithm != algorithm_)
+			continue;
+
+		if (digest.size != st_.st_size || digest.mtime != st_.st_mtime)
+			return false;
+
+		digest_ = digest.value;
+
+		// move to front
+		m_lru.splice (std::begin (m_lru), m_lru, it->second);
+		return true;
+	}
+
+	return false;
+}
+
+void StatCache::insertDigest (std::string_view const path_,
+    checksum::Algorithm const algorithm_,
+    stat_t const &st_,
+    std::string digest_)
+{
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	auto &digests = touch (path_).digests;
+
+	auto const it = std::find_if (std::begin (digests),
+	    std::end (digests),
+	    [algorithm_] (auto const &digest_) { return digest_.algorithm == algorithm_; });
+
+	auto &digest     = it == std::end (digests) ? digests.emplace_back () : *it;
+	digest.algorithm = algorithm_;
+	digest.size      = st_.st_size;
+	digest.mtime     = st_.st_mtime;
+	digest.value     = std::move (digest_);
+}
+
+void StatCache::invalidate (std::string_view const path_)
+{
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	// the parent's mtime changes along with its contents
+	auto const pos = path_.find_last_of ('/');
+	if (pos != std::string_view::npos)
+	{
+		auto const parent = path_.substr (0, pos == 0 ? 1 : pos);
+		if (auto const it = m_entries.find (parent); it != std::end (m_entries))
+			erase (it->second->path);
+	}
+
+	if (auto const it = m_entries.find (path_); it != std::end (m_entries))
+		erase (it->second->path);
+
+	// a renamed or removed directory takes its children with it
+	for (auto it = std::begin (m_lru); it != std::end (m_lru);)
+	{
+		auto const &path = it->path;
+		if (path.size () > path_.size () && path.compare (0, path_.size (), path_) == 0 &&
+		    (path[path_.size ()] == '/' || path_.back () == '/'))
+		{
+			m_entries.erase (path);
+			it = m_lru.erase (it);
+		}
+		else
+			++it;
+	}
+}
+
+void StatCache::clear ()
+{
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (m_lock);
+#endif
+
+	m_entries.clear ();
+	m_lru.clear ();
+}
+
+StatCache::Entry &StatCache::touch (std::string_view const path_)
+{
+	auto it = m_entries.find (path_);
+	if (it == std::end (m_entries))
+	{
+		if (m_lru.size () >= MAX_ENTRIES)
+			erase (m_lru.back ().path);
+
+		m_lru.emplace_front ();
+		m_lru.front ().path     = path_;
+		m_lru.front ().hasStat  = false;
+		m_lru.front ().hasLStat = false;
+
+		it = m_entries.emplace (m_lru.front ().path, std::begin (m_lru)).first;
+	}
+	else
+		m_lru.splice (std::begin (m_lru), m_lru, it->second);
+
+	return *it->second;
+}
+
+void StatCache::erase (std::string_view const path_)
+{
+	auto const it = m_entries.find (path_);
+	if (it == std::end (m_entries))
+		return;
+
+	auto const entry = it->second;
+	m_entries.erase (it);
+	m_lru.erase (entry);
+}
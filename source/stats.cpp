@@ -0,0 +1,201 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "stats.h"
+
+#include "codec.h"
+#include "fs.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+
+namespace
+{
+/// \brief Server-wide counters
+stats::Global s_global;
+
+/// \brief Append formatted line
+/// \param lines_ Lines to append to
+/// \param fmt_ Format string
+[[gnu::format (printf, 2, 3)]] void
+    addLine (std::vector<std::string> &lines_, char const *const fmt_, ...)
+{
+	char buffer[128];
+
+	va_list ap;
+	va_start (ap, fmt_);
+	std::vsnprintf (buffer, sizeof (buffer), fmt_, ap);
+	va_end (ap);
+
+	lines_.emplace_back (buffer);
+}
+
+/// \brief Safe ratio
+/// \param num_ Numerator
+/// \param den_ Denominator
+double ratio (std::uint64_t const num_, std::uint64_t const den_)
+{
+	return den_ ? static_cast<double> (num_) / den_ : 0.0;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+stats::IO &stats::IO::operator+= (IO const &that_)
+{
+	bytesIn += that_.bytesIn;
+	bytesOut += that_.bytesOut;
+	syscalls += that_.syscalls;
+	shortWrites += that_.shortWrites;
+	wouldBlock += that_.wouldBlock;
+
+	return *this;
+}
+
+stats::Global &stats::global ()
+{
+	return s_global;
+}
+
+void stats::reset ()
+{
+	for (auto counter : {&s_global.bytesIn,
+	         &s_global.bytesOut,
+	         &s_global.syscalls,
+	         &s_global.shortWrites,
+	         &s_global.wouldBlock,
+	         &s_global.polls,
+	         &s_global.pollEvents,
+	         &s_global.transfers,
+	         &s_global.deflateTime,
+	         &s_global.inflateTime,
+	         &s_global.listings,
+	         &s_global.statCalls,
+	         &s_global.listingHits,
+	         &s_global.hashes,
+	         &s_global.hashHits,
+	         &s_global.logRetries,
+	         &s_global.logDropped})
+		counter->reset ();
+}
+
+void stats::account (IO &io_,
+    std::make_signed_t<std::size_t> const rc_,
+    std::size_t const size_,
+    bool const write_)
+{
+	++io_.syscalls;
+	s_global.syscalls.add ();
+
+	if (rc_ < 0)
+	{
+		if (errno == EWOULDBLOCK)
+		{
+			++io_.wouldBlock;
+			s_global.wouldBlock.add ();
+		}
+
+		return;
+	}
+
+	if (!write_)
+	{
+		io_.bytesIn += rc_;
+		s_global.bytesIn.add (rc_);
+		return;
+	}
+
+	io_.bytesOut += rc_;
+	s_global.bytesOut.add (rc_);
+
+	if (static_cast<std::size_t> (rc_) < size_)
+	{
+		++io_.shortWrites;
+		s_global.shortWrites.add ();
+	}
+}
+
+std::vector<std::string> stats::describe (IO const *const session_)
+{
+	std::vector<std::string> lines;
+
+	auto const &g         = s_global;
+	auto const syscalls   = g.syscalls.load ();
+	auto const transfers  = g.transfers.load ();
+	auto const polls      = g.polls.load ();
+	auto const listings   = g.listings.load ();
+	auto const wouldBlock = g.wouldBlock.load ();
+
+	addLine (lines,
+	    "Bytes in/out: %s / %s",
+	    fs::printSize (g.bytesIn.load ()).c_str (),
+	    fs::printSize (g.bytesOut.load ()).c_str ());
+	addLine (lines, "Transfers: %" PRIu64, transfers);
+	addLine (lines,
+	    "Syscalls: %" PRIu64 " (%.1f per transfer)",
+	    syscalls,
+	    ratio (syscalls, transfers));
+	addLine (lines, "Short writes: %" PRIu64, g.shortWrites.load ());
+	addLine (lines,
+	    "EWOULDBLOCK: %" PRIu64 " (%.1f%% of syscalls)",
+	    wouldBlock,
+	    100.0 * ratio (wouldBlock, syscalls));
+	addLine (lines,
+	    "Poll batch: %.2f events (%" PRIu64 " polls)",
+	    ratio (g.pollEvents.load (), polls),
+	    polls);
+	addLine (lines, "Compression: %s", codec::name ());
+	addLine (lines, "Deflate time: %.3fs", g.deflateTime.load () / 1e9);
+	addLine (lines, "Inflate time: %.3fs", g.inflateTime.load () / 1e9);
+	addLine (lines,
+	    "Stat calls: %" PRIu64 " (%.1f per listing)",
+	    g.statCalls.load (),
+	    ratio (g.statCalls.load (), listings));
+	addLine (lines,
+	    "Listing cache hits: %" PRIu64 " (%.1f%% of listings)",
+	    g.listingHits.load (),
+	    100.0 * ratio (g.listingHits.load (), listings));
+	addLine (lines,
+	    "Checksum cache hits: %" PRIu64 " (%.1f%% of checksums)",
+	    g.hashHits.load (),
+	    100.0 * ratio (g.hashHits.load (), g.hashes.load ()));
+	addLine (lines,
+	    "Log contention: %" PRIu64 " retries, %" PRIu64 " dropped",
+	    g.logRetries.load (),
+	    g.logDropped.load ());
+
+	if (session_)
+	{
+		addLine (lines,
+		    "Session bytes in/out: %s / %s",
+		    fs::printSize (session_->bytesIn).c_str (),
+		    fs::printSize (session_->bytesOut).c_str ());
+		addLine (lines,
+		    "Session syscalls: %" PRIu64 " (%" PRIu64 " short writes, %.1f%% EWOULDBLOCK)",
+		    session_->syscalls,
+		    session_->shortWrites,
+		    100.0 * ratio (session_->wouldBlock, session_->syscalls));
+	}
+
+	return lines;
+}
@@ -0,0 +1,215 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "storeFile.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+namespace
+{
+/// \brief Files being uploaded keyed by resolved path
+struct Registry
+{
+	/// \brief Mutex
+	platform::Mutex lock;
+
+	/// \brief Files being uploaded
+	std::unordered_map<std::string, std::weak_ptr<StoreFile>> files;
+};
+
+/// \brief Get upload registry
+Registry &registry ()
+{
+	static Registry registry;
+	return registry;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+StoreFile::~StoreFile () = default;
+
+StoreFile::StoreFile (fs::File file_, std::uint64_t const size_)
+    : m_file (std::move (file_)), m_openSize (size_)
+{
+}
+
+SharedStoreFile StoreFile::open (std::string const &path_)
+{
+	auto &registry  = ::registry ();
+	auto const lock = std::scoped_lock (registry.lock);
+
+	// forget files nobody is uploading anymore
+	for (auto it = std::begin (registry.files); it != std::end (registry.files);)
+	{
+		if (it->second.expired ())
+			it = registry.files.erase (it);
+		else
+			++it;
+	}
+
+	SharedStoreFile store;
+
+	auto const it = registry.files.find (path_);
+	if (it != std::end (registry.files))
+		store = it->second.lock ();
+
+	if (!store)
+	{
+		// the other ranges may already be in place, so an existing file is never truncated
+		fs::File file;
+		if (!file.open (path_.c_str (), "r+b") &&
+		    (errno != ENOENT || !file.open (path_.c_str (), "wb")))
+			return nullptr;
+
+		// trimming never cuts into data which was there before the upload
+		if (file.seek (0, SEEK_END) != 0)
+			return nullptr;
+
+		auto const size = file.tell ();
+		if (size < 0)
+			return nullptr;
+
+		store                 = SharedStoreFile (new StoreFile (std::move (file), size));
+		registry.files[path_] = store;
+	}
+
+	auto const storeLock = std::scoped_lock (store->m_lock);
+	++store->m_writers;
+
+	return store;
+}
+
+void StoreFile::invalidate (std::string_view const path_)
+{
+	auto &registry  = ::registry ();
+	auto const lock = std::scoped_lock (registry.lock);
+
+	auto const it = registry.files.find (std::string (path_));
+	if (it != std::end (registry.files))
+		registry.files.erase (it);
+}
+
+std::make_signed_t<std::size_t> StoreFile::write (IOBuffer &buffer_, std::uint64_t const offset_)
+{
+	assert (buffer_.usedSize () > 0);
+
+#if FTPD_HAS_PREAD
+	// positional writes don't touch the shared file position
+	auto const rc = m_file.writeAt (buffer_.usedArea (), buffer_.usedSize (), offset_);
+#else
+	auto const lock = std::scoped_lock (m_lock);
+
+	if (m_file.seek (offset_, SEEK_SET) != 0)
+		return -1;
+
+	auto const rc = m_file.writeDirect (buffer_);
+#endif
+	if (rc > 0)
+		buffer_.markFree (rc);
+
+	return rc;
+}
+
+bool StoreFile::preallocate (std::uint64_t const size_)
+{
+	// growing the file must not race another upload's reservation
+	auto const lock = std::scoped_lock (m_lock);
+	if (!m_file.preallocate (size_))
+		return false;
+
+	m_reserved = std::max (m_reserved, size_);
+	return true;
+}
+
+void StoreFile::announce (std::uint64_t const size_)
+{
+	auto const lock = std::scoped_lock (m_lock);
+	m_size          = size_;
+}
+
+bool StoreFile::finish (std::uint64_t const start_, std::uint64_t const end_)
+{
+	auto const lock = std::scoped_lock (m_lock);
+
+	release (end_);
+
+	if (start_ < end_)
+	{
+		auto const before = [] (auto const &range_, std::uint64_t const offset_) {
+			return range_.second < offset_;
+		};
+
+		// merge the range with any it touches
+		auto it = std::lower_bound (std::begin (m_ranges), std::end (m_ranges), start_, before);
+
+		auto range = std::make_pair (start_, end_);
+		while (it != std::end (m_ranges) && it->first <= range.second)
+		{
+			range.first  = std::min (range.first, it->first);
+			range.second = std::max (range.second, it->second);
+			it           = m_ranges.erase (it);
+		}
+
+		m_ranges.insert (it, range);
+	}
+
+	// only the announced size says the file is whole; the ranges only cover this handle's uploads
+	if (m_complete || !m_size || m_ranges.empty () || m_ranges.front ().first != 0 ||
+	    m_ranges.front ().second < m_size)
+		return false;
+
+	m_complete = true;
+	return true;
+}
+
+void StoreFile::abandon (std::uint64_t const end_)
+{
+	auto const lock = std::scoped_lock (m_lock);
+	release (end_);
+}
+
+void StoreFile::release (std::uint64_t const end_)
+{
+	assert (m_writers > 0);
+	--m_writers;
+
+	m_written = std::max (m_written, end_);
+	if (m_writers != 0)
+		return;
+
+	// drop preallocated space nothing was written to
+	auto const size = std::max (m_openSize, m_written);
+	if (m_reserved <= size)
+		return;
+
+	if (!m_file.truncate (size))
+		error ("truncate: %s\n", std::strerror (errno));
+
+	m_reserved = size;
+}
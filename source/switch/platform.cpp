@@ -36,7 +36,9 @@
 #endif
 
 #include <arpa/inet.h>
+#include <malloc.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <cerrno>
 #include <cstdio>
@@ -46,6 +48,9 @@
 #include <numeric>
 #include <thread>
 
+/// \brief End of the heap sbrk hands out from (set up by libnx)
+extern "C" char *fake_heap_end;
+
 #ifdef CLASSIC
 PrintConsole g_statusConsole;
 PrintConsole g_logConsole;
@@ -579,6 +584,42 @@ void drawStatus ()
 	}
 #endif
 }
+
+/// \brief Number of directory entries read at once
+constexpr auto DIR_BATCH = 64;
+
+/// \brief Translate FS service result to errno
+/// \param rc_ Result
+int fsErrno (Result const rc_)
+{
+	// results from the FS module (2); anything else is reported as an I/O error
+	if (R_MODULE (rc_) != 2)
+		return EIO;
+
+	auto const description = R_DESCRIPTION (rc_);
+	if (description == 1)
+		return ENOENT; // PathNotFound
+	if (description == 2)
+		return EEXIST; // PathAlreadyExists
+	if (description == 7)
+		return EBUSY; // TargetLocked
+	if (description >= 30 && description <= 45)
+		return ENOSPC; // NotEnoughFreeSpace
+	return EIO;
+}
+
+/// \brief Translate path to an fsdev device
+/// \param path_ Path to translate
+/// \param[out] out_ Path on the device
+/// \returns nullptr if the path isn't on an fsdev device
+FsFileSystem *fsdevPath (char const *const path_, char (&out_)[FS_MAX_PATH])
+{
+	FsFileSystem *fs = nullptr;
+	if (::fsdevTranslatePath (path_, &fs, out_) < 0)
+		return nullptr;
+
+	return fs;
+}
 }
 
 bool platform::init ()
@@ -801,6 +842,16 @@ std::string const &platform::hostname ()
 	return hostname;
 }
 
+std::size_t platform::freeMemory ()
+{
+	// free chunks inside the heap plus what sbrk can still hand out
+	auto const info  = mallinfo ();
+	auto const brk   = static_cast<char *> (sbrk (0));
+	auto const spare = brk < fake_heap_end ? fake_heap_end - brk : 0;
+
+	return info.fordblks + spare;
+}
+
 bool platform::loop ()
 {
 	if (!appletMainLoop ())
@@ -1015,3 +1066,269 @@ void platform::Mutex::unlock ()
 	mutexUnlock (&m_d->mutex);
 #endif
 }
+
+///////////////////////////////////////////////////////////////////////////
+/// \brief Platform semaphore pimpl
+class platform::Semaphore::privateData_t
+{
+public:
+	/// \brief Underlying semaphore
+	::Semaphore semaphore;
+};
+
+///////////////////////////////////////////////////////////////////////////
+platform::Semaphore::~Semaphore () = default;
+
+platform::Semaphore::Semaphore () : m_d (new privateData_t ())
+{
+	semaphoreInit (&m_d->semaphore, 0);
+}
+
+void platform::Semaphore::post ()
+{
+	semaphoreSignal (&m_d->semaphore);
+}
+
+void platform::Semaphore::wait ()
+{
+	semaphoreWait (&m_d->semaphore);
+}
+
+///////////////////////////////////////////////////////////////////////////
+platform::NxFile::~NxFile ()
+{
+	fsFileClose (&m_file);
+}
+
+platform::NxFile::NxFile (FsFile const file_, std::uint64_t const offset_)
+    : m_file (file_), m_offset (offset_)
+{
+}
+
+std::unique_ptr<platform::NxFile> platform::NxFile::open (char const *const path_,
+    char const *const mode_)
+{
+	// text files keep using stdio
+	if (!std::strchr (mode_, 'b'))
+	{
+		errno = ENOTSUP;
+		return nullptr;
+	}
+
+	char path[FS_MAX_PATH];
+	auto const fs = fsdevPath (path_, path);
+	if (!fs)
+		return nullptr;
+
+	auto const update = std::strchr (mode_, '+') != nullptr;
+	auto const create = mode_[0] == 'w' || mode_[0] == 'a';
+
+	// writing past the end needs AllowAppend; it doesn't move writes to the end like O_APPEND
+	u32 mode = 0;
+	if (mode_[0] == 'r' || update)
+		mode |= FsOpenMode_Read;
+	if (mode_[0] != 'r' || update)
+		mode |= FsOpenMode_Write | FsOpenMode_Append;
+
+	if (create)
+	{
+		auto const rc = fsFsCreateFile (fs, path, 0, 0);
+		if (R_FAILED (rc) && fsErrno (rc) != EEXIST)
+		{
+			errno = fsErrno (rc);
+			return nullptr;
+		}
+	}
+
+	FsFile file;
+	auto const rc = fsFsOpenFile (fs, path, mode, &file);
+	if (R_FAILED (rc))
+	{
+		errno = fsErrno (rc);
+		return nullptr;
+	}
+
+	auto nxFile = std::unique_ptr<NxFile> (new NxFile (file, 0));
+	if (mode_[0] == 'w' && !nxFile->setSize (0))
+		return nullptr;
+
+	if (mode_[0] == 'a' && !nxFile->seek (0, SEEK_END))
+		return nullptr;
+
+	return nxFile;
+}
+
+std::make_signed_t<std::size_t> platform::NxFile::read (void *const buffer_,
+    std::size_t const size_)
+{
+	auto const rc = readAt (buffer_, size_, m_offset);
+	if (rc > 0)
+		m_offset += rc;
+
+	return rc;
+}
+
+std::make_signed_t<std::size_t> platform::NxFile::readAt (void *const buffer_,
+    std::size_t const size_,
+    std::uint64_t const offset_)
+{
+	u64 bytes = 0;
+	auto const rc = fsFileRead (&m_file, offset_, buffer_, size_, FsReadOption_None, &bytes);
+	if (R_FAILED (rc))
+	{
+		errno = fsErrno (rc);
+		return -1;
+	}
+
+	return bytes;
+}
+
+std::make_signed_t<std::size_t> platform::NxFile::write (void const *const buffer_,
+    std::size_t const size_)
+{
+	auto const rc = writeAt (buffer_, size_, m_offset);
+	if (rc > 0)
+		m_offset += rc;
+
+	return rc;
+}
+
+std::make_signed_t<std::size_t> platform::NxFile::writeAt (void const *const buffer_,
+    std::size_t const size_,
+    std::uint64_t const offset_)
+{
+	auto const rc = fsFileWrite (&m_file, offset_, buffer_, size_, FsWriteOption_None);
+	if (R_FAILED (rc))
+	{
+		errno = fsErrno (rc);
+		return -1;
+	}
+
+	// the FS service doesn't do partial writes
+	return size_;
+}
+
+bool platform::NxFile::seek (std::int64_t const pos_, int const origin_)
+{
+	std::int64_t base = 0;
+	if (origin_ == SEEK_CUR)
+		base = m_offset;
+	else if (origin_ == SEEK_END)
+	{
+		std::uint64_t size;
+		if (!this->size (size))
+			return false;
+
+		base = size;
+	}
+
+	if (base + pos_ < 0)
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	m_offset = base + pos_;
+	return true;
+}
+
+std::uint64_t platform::NxFile::tell () const
+{
+	return m_offset;
+}
+
+bool platform::NxFile::flush ()
+{
+	auto const rc = fsFileFlush (&m_file);
+	if (R_FAILED (rc))
+	{
+		errno = fsErrno (rc);
+		return false;
+	}
+
+	return true;
+}
+
+bool platform::NxFile::size (std::uint64_t &size_)
+{
+	s64 size = 0;
+	auto const rc = fsFileGetSize (&m_file, &size);
+	if (R_FAILED (rc))
+	{
+		errno = fsErrno (rc);
+		return false;
+	}
+
+	size_ = size;
+	return true;
+}
+
+bool platform::NxFile::setSize (std::uint64_t const size_)
+{
+	auto const rc = fsFileSetSize (&m_file, size_);
+	if (R_FAILED (rc))
+	{
+		errno = fsErrno (rc);
+		return false;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+platform::NxDir::~NxDir ()
+{
+	fsDirClose (&m_dir);
+}
+
+platform::NxDir::NxDir (FsDir const dir_)
+    : m_dir (dir_), m_entries (std::make_unique<FsDirectoryEntry[]> (DIR_BATCH))
+{
+}
+
+std::unique_ptr<platform::NxDir> platform::NxDir::open (char const *const path_)
+{
+	char path[FS_MAX_PATH];
+	auto const fs = fsdevPath (path_, path);
+	if (!fs)
+		return nullptr;
+
+	// sizes come from stat along with the rest of the entry's info
+	FsDir dir;
+	auto const rc = fsFsOpenDirectory (fs,
+	    path,
+	    FsDirOpenMode_ReadDirs | FsDirOpenMode_ReadFiles | FsDirOpenMode_NoFileSize,
+	    &dir);
+	if (R_FAILED (rc))
+	{
+		errno = fsErrno (rc);
+		return nullptr;
+	}
+
+	return std::unique_ptr<NxDir> (new NxDir (dir));
+}
+
+FsDirectoryEntry const *platform::NxDir::read ()
+{
+	if (m_index == m_count)
+	{
+		s64 count = 0;
+		auto const rc = fsDirRead (&m_dir, &count, DIR_BATCH, m_entries.get ());
+		if (R_FAILED (rc))
+		{
+			errno = fsErrno (rc);
+			return nullptr;
+		}
+
+		m_count = count;
+		m_index = 0;
+
+		if (!m_count)
+		{
+			errno = 0;
+			return nullptr;
+		}
+	}
+
+	return &m_entries[m_index++];
+}
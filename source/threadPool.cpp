@@ -0,0 +1,90 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "threadPool.h"
+
+#include <cassert>
+#include <mutex>
+#include <utility>
+
+///////////////////////////////////////////////////////////////////////////
+ThreadPool::~ThreadPool ()
+{
+	{
+		auto const lock = std::scoped_lock (m_lock);
+		m_quit          = true;
+	}
+
+	for (unsigned i = 0; i < m_threads.size (); ++i)
+		m_semaphore.post ();
+
+	for (auto &thread : m_threads)
+		thread.join ();
+}
+
+ThreadPool::ThreadPool (unsigned const threads_)
+{
+	assert (threads_ > 0);
+
+	for (unsigned i = 0; i < threads_; ++i)
+		m_threads.emplace_back (std::bind (&ThreadPool::threadFunc, this));
+}
+
+void ThreadPool::submit (std::function<void ()> work_)
+{
+	{
+		auto const lock = std::scoped_lock (m_lock);
+		m_queue.emplace_back (std::move (work_));
+	}
+
+	m_semaphore.post ();
+}
+
+unsigned ThreadPool::size () const
+{
+	return m_threads.size ();
+}
+
+void ThreadPool::threadFunc ()
+{
+	while (true)
+	{
+		m_semaphore.wait ();
+
+		std::function<void ()> work;
+		{
+			auto const lock = std::scoped_lock (m_lock);
+			if (m_queue.empty ())
+			{
+				if (m_quit)
+					return;
+
+				continue;
+			}
+
+			work = std::move (m_queue.front ());
+			m_queue.pop_front ();
+		}
+
+		work ();
+	}
+}
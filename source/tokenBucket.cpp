@@ -0,0 +1,120 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "tokenBucket.h"
+
+#include <algorithm>
+using namespace std::chrono_literals;
+
+namespace
+{
+/// \brief Minimum burst size
+constexpr std::int64_t MIN_BURST = 16 * 1024;
+
+/// \brief Fraction of a second's worth of tokens which may accumulate
+constexpr std::int64_t BURST_DIVISOR = 8;
+}
+
+///////////////////////////////////////////////////////////////////////////
+void TokenBucket::setRate (std::uint64_t const rate_)
+{
+	if (rate_ == m_rate)
+		return;
+
+	// start full so a new limit doesn't stall transfers in flight
+	m_rate   = rate_;
+	m_tokens = burst ();
+	m_refill = platform::steady_clock::now ();
+}
+
+std::uint64_t TokenBucket::rate () const
+{
+	return m_rate;
+}
+
+bool TokenBucket::available (platform::steady_clock::time_point const now_)
+{
+	if (!m_rate)
+		return true;
+
+	refill (now_);
+	return m_tokens > 0;
+}
+
+void TokenBucket::consume (std::uint64_t const bytes_)
+{
+	if (!m_rate)
+		return;
+
+	m_tokens -= static_cast<std::int64_t> (bytes_);
+}
+
+std::chrono::milliseconds TokenBucket::wait (platform::steady_clock::time_point const now_)
+{
+	if (!m_rate)
+		return 0ms;
+
+	refill (now_);
+	if (m_tokens > 0)
+		return 0ms;
+
+	// round up so the caller doesn't wake just short of the refill
+	auto const deficit = static_cast<std::uint64_t> (1 - m_tokens);
+	return std::chrono::milliseconds ((deficit * 1000 + m_rate - 1) / m_rate);
+}
+
+void TokenBucket::refill (platform::steady_clock::time_point const now_)
+{
+	if (now_ <= m_refill)
+		return;
+
+	auto const elapsed =
+	    std::chrono::duration_cast<std::chrono::microseconds> (now_ - m_refill).count ();
+	if (elapsed >= 1000000)
+	{
+		// idle for a while; the bucket is full
+		m_tokens = burst ();
+		m_refill = now_;
+		return;
+	}
+
+	auto const tokens = static_cast<std::int64_t> (m_rate * elapsed / 1000000);
+	if (!tokens)
+		return;
+
+	m_tokens += tokens;
+	if (m_tokens >= burst ())
+	{
+		m_tokens = burst ();
+		m_refill = now_;
+		return;
+	}
+
+	// only advance by the time that produced whole tokens so fractions aren't lost
+	m_refill += std::chrono::duration_cast<platform::steady_clock::duration> (
+	    std::chrono::microseconds (tokens * 1000000 / static_cast<std::int64_t> (m_rate)));
+}
+
+std::int64_t TokenBucket::burst () const
+{
+	return std::max (static_cast<std::int64_t> (m_rate) / BURST_DIVISOR, MIN_BURST);
+}
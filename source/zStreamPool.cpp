@@ -0,0 +1,218 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "zStreamPool.h"
+
+#include "log.h"
+#include "platform.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+#if defined(__NDS__)
+/// \brief Maximum idle streams of each kind
+constexpr std::size_t MAX_IDLE = 1;
+#elif defined(__3DS__)
+/// \brief Maximum idle streams of each kind
+constexpr std::size_t MAX_IDLE = 2;
+#else
+/// \brief Maximum idle streams of each kind
+constexpr std::size_t MAX_IDLE = 8;
+#endif
+
+/// \brief zlib state held by a deflate stream (window, hash chains and pending buffer)
+constexpr std::size_t DEFLATE_COST = (1u << (MAX_WBITS + 2)) + (1u << (8 + 9)) + 8 * 1024;
+
+/// \brief zlib state held by an inflate stream (window and inflate state)
+constexpr std::size_t INFLATE_COST = (1u << MAX_WBITS) + 8 * 1024;
+
+/// \brief Tears down streams which aren't kept
+struct Destroy
+{
+	void operator() (codec::Stream *const stream_) const
+	{
+		if (inflate)
+			codec::inflateEnd (stream_);
+		else
+			codec::deflateEnd (stream_);
+
+		delete stream_;
+	}
+
+	/// \brief Whether the stream inflates (otherwise deflates)
+	bool inflate = false;
+};
+
+/// \brief Owned z-stream
+using OwnedZStream = std::unique_ptr<codec::Stream, Destroy>;
+
+/// \brief Idle streams
+struct Pool
+{
+#ifndef __NDS__
+	/// \brief Mutex
+	platform::Mutex lock;
+#endif
+
+	/// \brief Idle deflate streams, most recently used last
+	std::vector<OwnedZStream> deflate;
+
+	/// \brief Idle inflate streams, most recently used last
+	std::vector<OwnedZStream> inflate;
+};
+
+/// \brief Get stream pool
+Pool &pool ()
+{
+	// never destroyed, so streams recycled during static destruction still have a home
+	static auto const pool = new Pool ();
+	return *pool;
+}
+
+/// \brief Take most recently used idle stream
+/// \param inflate_ Whether to take an inflate stream (otherwise deflate)
+OwnedZStream take (bool const inflate_)
+{
+	auto &pool = ::pool ();
+
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (pool.lock);
+#endif
+
+	auto &idle = inflate_ ? pool.inflate : pool.deflate;
+	if (idle.empty ())
+		return OwnedZStream (nullptr, Destroy{inflate_});
+
+	auto stream = std::move (idle.back ());
+	idle.pop_back ();
+	return stream;
+}
+
+/// \brief Allocate uninitialized stream
+/// \param inflate_ Whether this will be an inflate stream (otherwise deflate)
+OwnedZStream allocate (bool const inflate_)
+{
+	auto stream = std::make_unique<codec::Stream> ();
+
+	stream->zalloc    = Z_NULL;
+	stream->zfree     = Z_NULL;
+	stream->opaque    = Z_NULL;
+	stream->next_in   = Z_NULL;
+	stream->avail_in  = 0;
+	stream->next_out  = Z_NULL;
+	stream->avail_out = 0;
+
+	return OwnedZStream (stream.release (), Destroy{inflate_});
+}
+
+/// \brief Hand stream to caller
+/// \param stream_ Stream to hand over
+zStreamPool::UniqueZStream checkout (OwnedZStream stream_)
+{
+	auto const inflate = stream_.get_deleter ().inflate;
+	return zStreamPool::UniqueZStream (stream_.release (), zStreamPool::Recycle{inflate});
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+void zStreamPool::Recycle::operator() (codec::Stream *const stream_) const
+{
+	auto stream = OwnedZStream (stream_, Destroy{inflate});
+
+	auto const rc =
+	    inflate ? codec::inflateReset (stream.get ()) : codec::deflateReset (stream.get ());
+	if (rc != Z_OK)
+		return;
+
+	stream->next_in   = Z_NULL;
+	stream->avail_in  = 0;
+	stream->next_out  = Z_NULL;
+	stream->avail_out = 0;
+
+	// only keep what the heap can comfortably spare
+	auto const cost = inflate ? INFLATE_COST : DEFLATE_COST;
+	if (platform::freeMemory () / 4 < cost)
+		return;
+
+	auto &pool = ::pool ();
+
+	{
+#ifndef __NDS__
+		auto const lock = std::scoped_lock (pool.lock);
+#endif
+
+		auto &idle = inflate ? pool.inflate : pool.deflate;
+		if (idle.size () < MAX_IDLE)
+		{
+			idle.emplace_back (std::move (stream));
+			return;
+		}
+	}
+
+	// the pool is full; stream is torn down outside the lock
+}
+
+zStreamPool::UniqueZStream zStreamPool::acquireDeflate (int const level_)
+{
+	// reset streams keep their level; the level may also have been tuned mid-transfer
+	if (auto stream = take (false))
+	{
+		if (codec::deflateParams (stream.get (), level_) == Z_OK)
+			return checkout (std::move (stream));
+	}
+
+	auto stream = allocate (false);
+	if (auto const rc = codec::initDeflate (stream.get (), level_); rc != Z_OK)
+	{
+		error ("deflateInit: %s\n", stream->msg ? stream->msg : "zlib error");
+
+		// never initialized, so don't let deflateEnd see it
+		delete stream.release ();
+		errno = rc == Z_MEM_ERROR ? ENOMEM : EINVAL;
+		return nullptr;
+	}
+
+	return checkout (std::move (stream));
+}
+
+zStreamPool::UniqueZStream zStreamPool::acquireInflate ()
+{
+	if (auto stream = take (true))
+		return checkout (std::move (stream));
+
+	auto stream = allocate (true);
+	if (auto const rc = codec::initInflate (stream.get ()); rc != Z_OK)
+	{
+		error ("inflateInit: %s\n", stream->msg ? stream->msg : "zlib error");
+
+		// never initialized, so don't let inflateEnd see it
+		delete stream.release ();
+		errno = rc == Z_MEM_ERROR ? ENOMEM : EINVAL;
+		return nullptr;
+	}
+
+	return checkout (std::move (stream));
+}